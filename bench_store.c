@@ -0,0 +1,145 @@
+/*
+ * This measures how many reservations per second the private key store can
+ * do, compared to how long an fsync takes on this filesystem.  A single
+ * thread can't do better than one reservation per fsync; with several
+ * threads reserving at once (each with its own slot), group commit lets them
+ * share fsyncs.
+ *
+ * Usage: bench_store [filename [reservations per thread]]
+ * The store (filename, and filename.log) is created, and removed afterwards;
+ * put it on the filesystem you care about
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "hss.h"
+#include "hss_store.h"
+
+#define MAX_THREADS 16
+#define FSYNC_REPS 50
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* How long does appending a few bytes and syncing them take? */
+static double fsync_latency(const char *filename) {
+    int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600 );
+    if (fd < 0) return 0;
+    double start = now();
+    int i;
+    for (i=0; i<FSYNC_REPS; i++) {
+        if (16 != write( fd, "0123456789abcdef", 16 ) || 0 != fsync( fd )) {
+            break;
+        }
+    }
+    double elapsed = now() - start;
+    close( fd );
+    unlink( filename );
+    return i ? elapsed / i : 0;
+}
+
+struct thread_detail {
+    void *slot;
+    unsigned reps;
+    bool success;
+};
+
+/* This advances the slot's count, one reservation at a time */
+static void *reserve_thread(void *arg) {
+    struct thread_detail *d = arg;
+    unsigned char count[8];
+    unsigned i;
+    for (i=1; i<=d->reps; i++) {
+        memset( count, 0, sizeof count );
+        count[4] = i >> 24; count[5] = i >> 16;
+        count[6] = i >> 8;  count[7] = i;
+        if (!hss_store_update_private_key( count, sizeof count, d->slot )) {
+            d->success = false;
+            return 0;
+        }
+    }
+    d->success = true;
+    return 0;
+}
+
+/* Reserve from num_threads threads at once; returns reservations/second */
+static double run(const char *filename, unsigned num_threads,
+                  unsigned reps, unsigned long *syncs) {
+    char log_name[ 1000 ];
+    sprintf( log_name, "%s.log", filename );
+    unlink( filename );
+    unlink( log_name );
+
+    struct hss_store *store = hss_store_open( filename, num_threads, 0 );
+    if (!store) return 0;
+
+    /* Put a placeholder key in each slot (the store doesn't care what's */
+    /* in it, apart from the count at the front) */
+    unsigned char key[ HSS_MAX_PRIVATE_KEY_LEN ];
+    memset( key, 0, sizeof key );
+    struct thread_detail detail[ MAX_THREADS ];
+    pthread_t thread[ MAX_THREADS ];
+    unsigned i;
+    for (i=0; i<num_threads; i++) {
+        detail[i].slot = hss_store_slot( store, i );
+        detail[i].reps = reps;
+        if (!hss_store_update_private_key( key, sizeof key, detail[i].slot )) {
+            hss_store_close( store );
+            return 0;
+        }
+    }
+
+    unsigned long syncs_before = hss_store_sync_count( store );
+    double start = now();
+    for (i=0; i<num_threads; i++) {
+        if (0 != pthread_create( &thread[i], 0, reserve_thread, &detail[i] )) {
+            num_threads = i;
+            break;
+        }
+    }
+    bool success = (num_threads > 0);
+    for (i=0; i<num_threads; i++) {
+        pthread_join( thread[i], 0 );
+        if (!detail[i].success) success = false;
+    }
+    double elapsed = now() - start;
+    *syncs = hss_store_sync_count( store ) - syncs_before;
+
+    hss_store_close( store );
+    unlink( filename );
+    unlink( log_name );
+    return success ? num_threads * reps / elapsed : 0;
+}
+
+int main(int argc, char **argv) {
+    const char *filename = argc > 1 ? argv[1] : "bench_store.dat";
+    unsigned reps = argc > 2 ? atoi( argv[2] ) : 200;
+    if (strlen( filename ) > 900 || reps == 0) {
+        printf( "Usage: %s [filename [reservations per thread]]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    double latency = fsync_latency( filename );
+    printf( "fsync latency: %.1f usec (so at most %.0f syncs/sec)\n",
+            latency * 1e6, latency > 0 ? 1 / latency : 0 );
+    printf( "threads  reservations/sec  syncs  reservations/sync\n" );
+    unsigned threads;
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        unsigned long syncs = 0;
+        double rate = run( filename, threads, reps, &syncs );
+        if (rate == 0) {
+            printf( "Error: store failed\n" );
+            return EXIT_FAILURE;
+        }
+        printf( "%7u  %16.0f  %5lu  %17.2f\n", threads, rate, syncs,
+                syncs ? (double)threads * reps / syncs : 0 );
+    }
+    return EXIT_SUCCESS;
+}
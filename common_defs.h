@@ -10,6 +10,7 @@
 #include <stdbool.h>
 
 #define MAX_HASH   32 /* Length of the largest hash we support */
+#define MAX_P     265 /* Number of chains in the largest OTS we support */
 
 /* The I (Merkle tree identifier) value is 16 bytes long */
 #define I_LEN               16
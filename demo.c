@@ -32,6 +32,20 @@
  *       This takes the private key keyname.prf, and advances it [integer]
  *       places; that is, makes it assume it has generated [integer]
  *       signatures (without doing the work)
+ *   demo shardkey keyname [parameter set]
+ *       This creates just the private key keyname.prv; the public key is
+ *       then computed in pieces (shards) by the below, which can be run as
+ *       separate processes (or on separate machines, given a copy of the
+ *       private key)
+ *   demo shard keyname i/n [aux size]
+ *       This computes shard i (of n) of the top level tree of the key
+ *       keyname.prv, and places it into keyname.shard.i.  The aux size
+ *       (which defaults to the same as genkey, and needs to be the same for
+ *       all the shards and the merge) is the maximum amount of aux data
+ *   demo merge keyname n [aux size]
+ *       This combines keyname.shard.0 through keyname.shard.n-1 into the
+ *       public key keyname.pub and the aux data keyname.aux (computing any
+ *       shard that's missing)
  */
 
 #include <stdio.h>
@@ -232,6 +246,24 @@ void *read_file( const char *filename, size_t *len ) {
     return p;
 }
 
+/*
+ * This writes out a file
+ */
+static int write_file( const char *filename, const void *data, size_t len ) {
+    FILE *f = fopen( filename, "w" );
+    if (!f) return 0;
+    if (len > 0 && 1 != fwrite( data, len, 1, f )) {
+        /* Write failed */
+        fclose(f);
+        return 0;
+    }
+    if (0 != fclose(f)) {
+        /* Close failed (possibly because pending write failed) */
+        return 0;
+    }
+    return 1;
+}
+
 static int fromhex(char c) {
     if (isdigit(c)) return c - '0';
     switch (c) {
@@ -747,6 +779,188 @@ static int advance(const char *keyname, const char *text_advance) {
     return success;
 }
 
+/*
+ * This function implements the 'shardkey' command; it creates the private
+ * key, leaving the public key to be computed by 'shard' and 'merge'
+ */
+static int shardkey(const char *keyname, const char *parm_set) {
+    int levels;
+    param_set_t lm_array[ MAX_HSS_LEVELS ];
+    param_set_t ots_array[ MAX_HSS_LEVELS ];
+    size_t aux_size;
+    if (!parm_set) parm_set = default_parm_set;
+    if (!parse_parm_set( &levels, lm_array, ots_array, &aux_size, parm_set)) {
+        return 0;
+    }
+    list_parameter_set( levels, lm_array, ots_array, aux_size );
+
+    size_t private_key_filename_len = strlen(keyname) + sizeof (".prv" ) + 1;
+    char *private_key_filename = malloc(private_key_filename_len);
+    if (!private_key_filename) return 0;
+    sprintf( private_key_filename, "%s.prv", keyname );
+
+    printf( "Generating private key %s\n", private_key_filename );
+    bool success = hss_generate_private_key_for_shards( do_rand,
+             levels, lm_array, ots_array,
+             update_private_key, private_key_filename, 0 );
+    free(private_key_filename);
+    if (!success) return 0;
+
+    printf( "Success!\nNow run 'shard %s i/n %lu' for each shard i, and "
+            "then 'merge %s n %lu'\n",
+            keyname, (unsigned long)aux_size,
+            keyname, (unsigned long)aux_size );
+    return 1;
+}
+
+/*
+ * This function implements the 'shard' command; it computes one shard of
+ * the top level tree, and writes it to keyname.shard.i
+ */
+static int shard(const char *keyname, const char *text_shard,
+                 const char *text_aux) {
+    unsigned i, n;
+    char extra;
+    if (2 != sscanf( text_shard, "%u/%u%c", &i, &n, &extra ) ||
+                              n == 0 || i >= n) {
+        printf( "Illegal shard %s\n", text_shard );
+        return 0;
+    }
+    size_t aux_size = text_aux ? atol( text_aux ) : DEFAULT_AUX_DATA;
+
+    size_t private_key_filename_len = strlen(keyname) + sizeof (".prv" ) + 1;
+    char *private_key_filename = malloc(private_key_filename_len);
+    if (!private_key_filename) return 0;
+    sprintf( private_key_filename, "%s.prv", keyname );
+
+    unsigned levels;
+    param_set_t lm_array[ MAX_HSS_LEVELS ];
+    param_set_t ots_array[ MAX_HSS_LEVELS ];
+    if (!hss_get_parameter_set( &levels, lm_array, ots_array,
+                                read_private_key, private_key_filename)) {
+        printf( "Error reading private key %s\n", private_key_filename );
+        free(private_key_filename);
+        return 0;
+    }
+    size_t len_shard = hss_get_keygen_shard_len( levels, lm_array, ots_array,
+                                                 aux_size, i, n );
+    unsigned char *output = len_shard ? malloc( len_shard ) : 0;
+    size_t shard_filename_len = strlen(keyname) + sizeof (".shard." ) + 12;
+    char *shard_filename = malloc(shard_filename_len);
+    if (!output || !shard_filename) {
+        printf( "Error: too many shards, or malloc failure\n" );
+        free(output);
+        free(shard_filename);
+        free(private_key_filename);
+        return 0;
+    }
+    sprintf( shard_filename, "%s.shard.%u", keyname, i );
+
+    printf( "Computing shard %u of %u (will take a while)\n", i, n );
+    fflush(stdout);
+    bool success = hss_generate_keygen_shard( read_private_key,
+             private_key_filename, aux_size, i, n,
+             output, len_shard, 0 );
+    free(private_key_filename);
+    if (success) {
+        printf( "Writing %s\n", shard_filename );
+        success = write_file( shard_filename, output, len_shard );
+    }
+    free(shard_filename);
+    free(output);
+    return success;
+}
+
+/*
+ * This function implements the 'merge' command; it reads in the shards, and
+ * computes the public key and aux data from them
+ */
+static int merge(const char *keyname, const char *text_num_shards,
+                 const char *text_aux) {
+    int n = atoi( text_num_shards );
+    if (n <= 0) {
+        printf( "Illegal number of shards %s\n", text_num_shards );
+        return 0;
+    }
+    size_t aux_size = text_aux ? atol( text_aux ) : DEFAULT_AUX_DATA;
+
+    size_t filename_len = strlen(keyname) + sizeof (".shard." ) + 12;
+    char *private_key_filename = malloc(filename_len);
+    char *filename = malloc(filename_len);
+    const unsigned char **shards = calloc( n, sizeof *shards );
+    size_t *len_shards = calloc( n, sizeof *len_shards );
+    unsigned char *aux = aux_size > 0 ? malloc( aux_size ) : 0;
+    int success = 0;
+    int i;
+    if (!private_key_filename || !filename || !shards || !len_shards ||
+                                                 (aux_size > 0 && !aux)) {
+        printf( "Malloc failure\n" );
+        goto failed;
+    }
+    sprintf( private_key_filename, "%s.prv", keyname );
+
+    for (i=0; i<n; i++) {
+        sprintf( filename, "%s.shard.%d", keyname, i );
+        shards[i] = read_file( filename, &len_shards[i] );
+        if (!shards[i]) {
+            printf( "Unable to read %s; will compute it here\n", filename );
+        }
+    }
+
+    unsigned levels;
+    param_set_t lm_array[ MAX_HSS_LEVELS ];
+    param_set_t ots_array[ MAX_HSS_LEVELS ];
+    if (!hss_get_parameter_set( &levels, lm_array, ots_array,
+                                read_private_key, private_key_filename)) {
+        printf( "Error reading private key %s\n", private_key_filename );
+        goto failed;
+    }
+    unsigned len_public_key = hss_get_public_key_len(levels,
+                                                lm_array, ots_array);
+    unsigned char public_key[HSS_MAX_PUBLIC_KEY_LEN];
+
+    printf( "Merging %d shards\n", n );
+    fflush(stdout);
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    if (!hss_merge_keygen_shards( read_private_key, private_key_filename,
+             public_key, len_public_key,
+             aux, aux_size,
+             n, shards, len_shards, &info )) {
+        if (hss_extra_info_test_error_code(&info) == hss_error_bad_shard) {
+            printf( "Error: the shards don't match (wrong number of shards "
+                    "or aux size?)\n" );
+        }
+        goto failed;
+    }
+
+    sprintf( filename, "%s.pub", keyname );
+    printf( "Success!\nWriting public key %s\n", filename );
+    if (!write_file( filename, public_key, len_public_key )) {
+        fprintf( stderr, "Error: unable to write public key\n" );
+        goto failed;
+    }
+    if (aux_size > 0) {
+        sprintf( filename, "%s.aux", keyname );
+        printf( "Writing aux data %s\n", filename );
+        if (!write_file( filename, aux, hss_get_aux_data_len( aux_size,
+                                     levels, lm_array, ots_array ))) {
+            fprintf( stderr, "Warning: unable to write aux file\n" );
+        }
+    }
+    success = 1;
+failed:
+    if (shards) {
+        for (i=0; i<n; i++) free( (void *)shards[i] );
+    }
+    free(shards);
+    free(len_shards);
+    free(aux);
+    free(filename);
+    free(private_key_filename);
+    return success;
+}
+
 static void usage(char *program) {
     printf( "Usage:\n" );
     printf( " %s genkey [keyname]\n", program );
@@ -754,6 +968,9 @@ static void usage(char *program) {
     printf( " %s sign [keyname] [files to sign]\n", program );
     printf( " %s verify [keyname] [files to verify]\n", program );
     printf( " %s advance [keyname] [amount of advance]\n", program );
+    printf( " %s shardkey [keyname] [parameter set]\n", program );
+    printf( " %s shard [keyname] [shard]/[number of shards] [aux size]\n", program );
+    printf( " %s merge [keyname] [number of shards] [aux size]\n", program );
 }
 
 static int get_integer(const char **p) {
@@ -958,6 +1175,39 @@ int main(int argc, char **argv) {
         }
         return 0;
     }
+    if (0 == strcmp( argv[1], "shardkey" )) {
+        if (argc < 3 || argc > 4) {
+            printf( "Error: missing keyname argument\n" );
+            usage(argv[0]);
+            return 0;
+        }
+        if (!shardkey( argv[2], argc > 3 ? argv[3] : 0 )) {
+            printf( "Error creating private key\n" );
+        }
+        return 0;
+    }
+    if (0 == strcmp( argv[1], "shard" )) {
+        if (argc < 4 || argc > 5) {
+            printf( "Error: missing keyname and shard argument\n" );
+            usage(argv[0]);
+            return 0;
+        }
+        if (!shard( argv[2], argv[3], argc > 4 ? argv[4] : 0 )) {
+            printf( "Error computing shard\n" );
+        }
+        return 0;
+    }
+    if (0 == strcmp( argv[1], "merge" )) {
+        if (argc < 4 || argc > 5) {
+            printf( "Error: missing keyname and number of shards\n" );
+            usage(argv[0]);
+            return 0;
+        }
+        if (!merge( argv[2], argv[3], argc > 4 ? argv[4] : 0 )) {
+            printf( "Error merging shards\n" );
+        }
+        return 0;
+    }
 
     usage(argv[0]);
     return 0;
@@ -60,6 +60,363 @@ void hss_hash(void *result, int hash_type,
     hss_zeroize(&ctx, sizeof ctx);
 }
 
+/*
+ * This hashes count messages, all of length message_len.  On the lower
+ * level, this is done several at a time (using SIMD instructions)
+ */
+void hss_hash_multi(unsigned char *const *result, int hash_type,
+          const unsigned char *const *message, size_t message_len,
+          unsigned count) {
+    switch (hash_type) {
+    case HASH_SHA256:
+        sha256_multi( result, message, message_len, count );
+#if ALLOW_VERBOSE
+        if (hss_verbose) {
+            unsigned j;
+            for (j=0; j<count; j++) {
+                int i; for (i=0; i< message_len; i++) printf( " %02x%s", message[j][i], (i%16 == 15) ? "\n" : "" );
+                printf( " ->" );
+                for (i=0; i<32; i++) printf( " %02x", result[j][i] ); printf( "\n" );
+            }
+        }
+#endif
+        break;
+    }
+}
+
+unsigned hss_hash_lanes(int hash_type) {
+    switch (hash_type) {
+    case HASH_SHA256: return sha256_lanes();
+    }
+    return 1;
+}
+
+/*
+ * These are the single block hashing routines
+ */
+bool hss_hash_block_init( struct hash_block *block, int hash_type,
+                          size_t message_len ) {
+    memset( block, 0, sizeof *block );
+    switch (hash_type) {
+    case HASH_SHA256:
+        /* SHA-256 needs room for the 0x80 byte and the 8 byte length */
+        if (message_len > 64 - 1 - 8) return false;
+        hss_hash_block_set_byte( block, message_len, 0x80 );
+        block->w[15] = 8 * (uint32_t)message_len;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The block words are bigendian; byte offset 0 is the most significant byte
+ * of word 0
+ */
+void hss_hash_block_set_byte( struct hash_block *block, size_t offset,
+                         unsigned char data ) {
+    unsigned shift = 24 - 8*(offset % 4);
+    uint32_t *p = &block->w[ offset / 4 ];
+    *p = (*p & ~((uint32_t)0xff << shift)) | ((uint32_t)data << shift);
+}
+
+void hss_hash_block_set( struct hash_block *block, size_t offset,
+                         const void *data, size_t len ) {
+    const unsigned char *p = data;
+    /* Do the leading bytes that aren't word aligned */
+    while (len > 0 && offset % 4 != 0) {
+        hss_hash_block_set_byte( block, offset++, *p++ );
+        len--;
+    }
+    /* Do the aligned bytes a word at a time */
+    while (len >= 4) {
+        block->w[ offset / 4 ] = ((uint32_t)p[0] << 24) |
+                                 ((uint32_t)p[1] << 16) |
+                                 ((uint32_t)p[2] <<  8) |
+                                  (uint32_t)p[3];
+        offset += 4; p += 4; len -= 4;
+    }
+    /* And the trailing bytes */
+    while (len > 0) {
+        hss_hash_block_set_byte( block, offset++, *p++ );
+        len--;
+    }
+}
+
+void hss_hash_block_get( void *data, const struct hash_block *block,
+                         size_t offset, size_t len ) {
+    unsigned char *p = data;
+    while (len--) {
+        *p++ = block->w[ offset / 4 ] >> (24 - 8*(offset % 4));
+        offset++;
+    }
+}
+
+/*
+ * This writes the hash (num_words native words) into the block at the
+ * given byte offset.  If the offset isn't word aligned (and for the ITER
+ * hashes, it isn't), each word of the block is made up of the tail of one
+ * hash word and the head of the next
+ */
+static void put_hash_words( struct hash_block *block, size_t offset,
+                            const uint32_t *hash, unsigned num_words ) {
+    uint32_t *p = &block->w[ offset / 4 ];
+    unsigned shift = 8 * (offset % 4);
+    unsigned i;
+    if (shift == 0) {
+        for (i=0; i<num_words; i++) {
+            p[i] = hash[i];
+        }
+        return;
+    }
+    uint32_t mask = 0xffffffff >> shift;  /* The part of the first word */
+                                          /* that's the hash */
+    p[0] = (p[0] & ~mask) | (hash[0] >> shift);
+    for (i=1; i<num_words; i++) {
+        p[i] = (hash[i-1] << (32-shift)) | (hash[i] >> shift);
+    }
+    p[num_words] = (hash[num_words-1] << (32-shift)) | (p[num_words] & mask);
+}
+
+void hss_hash_block( void *result, int hash_type,
+                     const struct hash_block *block ) {
+    switch (hash_type) {
+    case HASH_SHA256: {
+        uint32_t digest[8];
+        unsigned char *p = result;
+        int i;
+        sha256_block( digest, block->w );
+        for (i=0; i<8; i++) {
+            p[4*i + 0] = digest[i] >> 24;
+            p[4*i + 1] = digest[i] >> 16;
+            p[4*i + 2] = digest[i] >>  8;
+            p[4*i + 3] = digest[i];
+        }
+        hss_zeroize( digest, sizeof digest );
+        break;
+    }
+    }
+}
+
+void hss_hash_block_to_block( struct hash_block *dest, size_t offset,
+                     int hash_type, const struct hash_block *src ) {
+    switch (hash_type) {
+    case HASH_SHA256: {
+        uint32_t digest[8];
+        sha256_block( digest, src->w );
+        put_hash_words( dest, offset, digest, 8 );
+        /* We don't zeroize digest here; this is the inner loop of the */
+        /* Winternitz chains, and the value we'd be clearing is sitting */
+        /* in dest anyways; the caller clears that when it's done */
+        break;
+    }
+    }
+}
+
+/*
+ * These are the multiple lane versions
+ */
+void hss_hash_block_lanes_broadcast( struct hash_block_lanes *lanes,
+                                     const struct hash_block *block ) {
+    unsigned i, lane;
+    for (i=0; i<HASH_BLOCK_WORDS; i++) {
+        for (lane=0; lane<MAX_HASH_LANES; lane++) {
+            lanes->w[i][lane] = block->w[i];
+        }
+    }
+}
+
+void hss_hash_block_lanes_set_byte( struct hash_block_lanes *block,
+                    unsigned lane, size_t offset, unsigned char data ) {
+    unsigned shift = 24 - 8*(offset % 4);
+    uint32_t *p = &block->w[ offset / 4 ][ lane ];
+    *p = (*p & ~((uint32_t)0xff << shift)) | ((uint32_t)data << shift);
+}
+
+void hss_hash_block_lanes_set( struct hash_block_lanes *block, unsigned lane,
+                               size_t offset, const void *data, size_t len ) {
+    const unsigned char *p = data;
+    while (len--) {
+        hss_hash_block_lanes_set_byte( block, lane, offset++, *p++ );
+    }
+}
+
+void hss_hash_block_lanes_get( void *data,
+                               const struct hash_block_lanes *block,
+                               unsigned lane, size_t offset, size_t len ) {
+    unsigned char *p = data;
+    /* We typically read a hash at an unaligned offset; do it a word at */
+    /* a time, assembling each from two adjacent words in the block */
+    unsigned shift = 8 * (offset % 4);
+    const uint32_t (*w)[MAX_HASH_LANES] = &block->w[ offset / 4 ];
+    for (; len >= 4; len -= 4, offset += 4, w++, p += 4) {
+        uint32_t x = w[0][lane] << shift;
+        if (shift) x |= w[1][lane] >> (32 - shift);
+        p[0] = x >> 24;
+        p[1] = x >> 16;
+        p[2] = x >>  8;
+        p[3] = x;
+    }
+    /* And any trailing bytes */
+    while (len--) {
+        *p++ = block->w[ offset / 4 ][ lane ] >> (24 - 8*(offset % 4));
+        offset++;
+    }
+}
+
+void hss_hash_block_lanes_set_byte_all( struct hash_block_lanes *block,
+                               size_t offset, unsigned char data ) {
+    unsigned shift = 24 - 8*(offset % 4);
+    uint32_t mask = ~((uint32_t)0xff << shift);
+    uint32_t value = (uint32_t)data << shift;
+    uint32_t *p = block->w[ offset / 4 ];
+    unsigned lane;
+    for (lane=0; lane<MAX_HASH_LANES; lane++) {
+        p[lane] = (p[lane] & mask) | value;
+    }
+}
+
+/*
+ * This is put_hash_words, done for all the lanes at once.  We process
+ * every lane (not just the ones in use); that way, the compiler can
+ * vectorize the inner loops
+ */
+static void put_hash_words_lanes( struct hash_block_lanes *block,
+                            size_t offset,
+                            uint32_t hash[][MAX_HASH_LANES],
+                            unsigned num_words ) {
+    uint32_t (*p)[MAX_HASH_LANES] = &block->w[ offset / 4 ];
+    unsigned shift = 8 * (offset % 4);
+    unsigned i, lane;
+    if (shift == 0) {
+        for (i=0; i<num_words; i++) {
+            for (lane=0; lane<MAX_HASH_LANES; lane++) {
+                p[i][lane] = hash[i][lane];
+            }
+        }
+        return;
+    }
+    uint32_t mask = 0xffffffff >> shift;
+    for (lane=0; lane<MAX_HASH_LANES; lane++) {
+        p[0][lane] = (p[0][lane] & ~mask) | (hash[0][lane] >> shift);
+    }
+    for (i=1; i<num_words; i++) {
+        for (lane=0; lane<MAX_HASH_LANES; lane++) {
+            p[i][lane] = (hash[i-1][lane] << (32-shift)) |
+                         (hash[i][lane] >> shift);
+        }
+    }
+    for (lane=0; lane<MAX_HASH_LANES; lane++) {
+        p[num_words][lane] = (hash[num_words-1][lane] << (32-shift)) |
+                             (p[num_words][lane] & mask);
+    }
+}
+
+void hss_hash_block_lanes_to_block( struct hash_block_lanes *dest,
+                    size_t offset, int hash_type,
+                    const struct hash_block_lanes *src, unsigned lanes ) {
+    switch (hash_type) {
+    case HASH_SHA256: {
+        uint32_t digest[8][MAX_HASH_LANES];
+        sha256_block_lanes( digest, src->w, lanes );
+        put_hash_words_lanes( dest, offset, digest, 8 );
+        /* As with hss_hash_block_to_block, we leave it to the caller to */
+        /* clean up */
+        break;
+    }
+    }
+}
+
+/*
+ * This is the multiple lane incremental hash
+ */
+void hss_init_hash_lanes_context( int h, struct hash_lanes_context *ctx ) {
+    switch (h) {
+    case HASH_SHA256:
+        sha256_init_lanes( ctx->state );
+        ctx->len = 0;
+        break;
+    }
+}
+
+/* This compresses the (full) partial blocks in all the lanes */
+static void compress_data_lanes( struct hash_lanes_context *ctx,
+                                 unsigned lanes ) {
+    uint32_t block[HASH_BLOCK_WORDS][MAX_HASH_LANES];
+    unsigned i, lane;
+    for (lane=0; lane<lanes; lane++) {
+        const unsigned char *p = ctx->data[lane];
+        for (i=0; i<HASH_BLOCK_WORDS; i++, p += 4) {
+            block[i][lane] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                             ((uint32_t)p[2] <<  8) |  (uint32_t)p[3];
+        }
+    }
+    /* The SIMD code may process the lanes we're not using; give it */
+    /* something defined */
+    for (; lane<MAX_HASH_LANES; lane++) {
+        for (i=0; i<HASH_BLOCK_WORDS; i++) block[i][lane] = 0;
+    }
+    sha256_compress_lanes( ctx->state, block, lanes );
+    hss_zeroize( block, sizeof block );
+}
+
+void hss_update_hash_lanes_context( int h, struct hash_lanes_context *ctx,
+                          const unsigned char *const *msg, size_t len_msg,
+                          unsigned lanes ) {
+    size_t done = 0;
+    unsigned lane;
+    switch (h) {
+    case HASH_SHA256:
+        while (done < len_msg) {
+            unsigned offset = ctx->len % 64;
+            size_t this_step = 64 - offset;
+            if (this_step > len_msg - done) this_step = len_msg - done;
+            for (lane=0; lane<lanes; lane++) {
+                memcpy( &ctx->data[lane][offset], msg[lane] + done,
+                        this_step );
+            }
+            done += this_step;
+            ctx->len += this_step;
+            if (ctx->len % 64 == 0) {
+                compress_data_lanes( ctx, lanes );
+            }
+        }
+        break;
+    }
+}
+
+void hss_finalize_hash_lanes_context( int h, struct hash_lanes_context *ctx,
+                          unsigned char *const *buffer, unsigned lanes ) {
+    unsigned lane, i;
+    switch (h) {
+    case HASH_SHA256: {
+        /* Add the padding; this is the same for every lane */
+        unsigned char pad[64 + 8];
+        const unsigned char *pad_ptr[MAX_HASH_LANES];
+        uint64_t bit_len = 8 * (uint64_t)ctx->len;
+        size_t pad_len = 64 - (ctx->len + 8) % 64;  /* 0x80, then zeros */
+        memset( pad, 0, sizeof pad );
+        pad[0] = 0x80;
+        for (i=0; i<8; i++) {
+            pad[pad_len + i] = bit_len >> (56 - 8*i);
+        }
+        /* We fill in every entry (not just the first lanes); the */
+        /* compiler can't see that lanes <= MAX_HASH_LANES */
+        for (lane=0; lane<MAX_HASH_LANES; lane++) pad_ptr[lane] = pad;
+        hss_update_hash_lanes_context( h, ctx, pad_ptr, pad_len + 8, lanes );
+
+        for (lane=0; lane<lanes; lane++) {
+            for (i=0; i<8; i++) {
+                uint32_t x = ctx->state[i][lane];
+                buffer[lane][4*i + 0] = x >> 24;
+                buffer[lane][4*i + 1] = x >> 16;
+                buffer[lane][4*i + 2] = x >>  8;
+                buffer[lane][4*i + 3] = x;
+            }
+        }
+        break;
+    }
+    }
+}
 
 /*
  * This provides an API to do incremental hashing.  We use it when hashing the
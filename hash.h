@@ -32,6 +32,123 @@ void hss_hash(void *result, int hash_type,
 void hss_hash_ctx(void *result, int hash_type, union hash_context *ctx,
           const void *message, size_t message_len);
 
+/*
+ * Hash count independent messages (all of the same length) at once; the
+ * hash of message[i] goes into result[i].  This gives the same results as
+ * calling hss_hash on each one; it's just faster on CPUs that can do several
+ * hashes in parallel
+ */
+void hss_hash_multi(unsigned char *const *result, int hash_type,
+          const unsigned char *const *message, size_t message_len,
+          unsigned count);
+
+/*
+ * This is the number of messages hss_hash_multi can actually process in
+ * parallel on this CPU; callers use it to decide how many messages to batch
+ * up (there's no point in batching up more than this, and if this is 1,
+ * there's no point in batching at all)
+ */
+unsigned hss_hash_lanes(int hash_type);
+#define MAX_HASH_LANES SHA256_LANES  /* The largest value hss_hash_lanes */
+                                     /* will return */
+
+/*
+ * Single block hashing.  Almost all the hashes we compute (the Winternitz
+ * chain ITER hashes, the PRG seed derivations, the Merkle leaf hashes) are
+ * of short fixed length messages that fit (with the padding) within a
+ * single hash block.  This interface lets the caller set up that block
+ * (including the padding and length) once, and then update only the parts
+ * that change between hashes; each hash is then a single call to the
+ * compression function, with none of the buffering or length tracking of
+ * the general API.  The block is held as native words (which is what the
+ * compression function works on), and so the parts that stay the same
+ * (e.g. the I||q prefix of the ITER hashes) are converted only once
+ */
+#define HASH_BLOCK_WORDS 16  /* Number of 32 bit words in a hash block */
+struct hash_block {
+    uint32_t w[HASH_BLOCK_WORDS];
+};
+
+/* This sets up the padding for a message of length message_len.  It */
+/* returns false if that message won't fit into a single block */
+bool hss_hash_block_init( struct hash_block *block, int hash_type,
+                          size_t message_len );
+
+/* This writes len bytes of the message, starting at offset */
+void hss_hash_block_set( struct hash_block *block, size_t offset,
+                         const void *data, size_t len );
+void hss_hash_block_set_byte( struct hash_block *block, size_t offset,
+                         unsigned char data );
+
+/* This reads len bytes of the message, starting at offset */
+void hss_hash_block_get( void *data, const struct hash_block *block,
+                         size_t offset, size_t len );
+
+/* Hash the message in the block, placing the hash into result */
+void hss_hash_block( void *result, int hash_type,
+                     const struct hash_block *block );
+
+/* Hash the message in src, and write the hash into the message in dest */
+/* (starting at offset).  src and dest may be the same block; that's */
+/* precisely the step of a Winternitz chain */
+void hss_hash_block_to_block( struct hash_block *dest, size_t offset,
+                     int hash_type, const struct hash_block *src );
+
+/*
+ * This is the multiple lane version of the single block hashing; this holds
+ * several independent blocks (lanes), which are hashed all at once (using
+ * the multi-buffer SHA-256).  The blocks are interleaved by word (so that
+ * w[i][lane] is word i of the block in that lane); that's the format the
+ * SIMD code wants
+ */
+struct hash_block_lanes {
+    uint32_t w[HASH_BLOCK_WORDS][MAX_HASH_LANES];
+};
+
+/* This copies the single block into all the lanes */
+void hss_hash_block_lanes_broadcast( struct hash_block_lanes *lanes,
+                                     const struct hash_block *block );
+
+/* These read and write bytes of the message in a single lane */
+void hss_hash_block_lanes_set( struct hash_block_lanes *block, unsigned lane,
+                               size_t offset, const void *data, size_t len );
+void hss_hash_block_lanes_set_byte( struct hash_block_lanes *block,
+                    unsigned lane, size_t offset, unsigned char data );
+void hss_hash_block_lanes_get( void *data,
+                               const struct hash_block_lanes *block,
+                               unsigned lane, size_t offset, size_t len );
+
+/* This writes a byte into the message of every lane */
+void hss_hash_block_lanes_set_byte_all( struct hash_block_lanes *block,
+                               size_t offset, unsigned char data );
+
+/* Hash the messages in the first 'lanes' lanes of src, and write each hash */
+/* into the message in the same lane of dest (starting at offset).  The */
+/* remaining lanes of dest may be overwritten with garbage */
+void hss_hash_block_lanes_to_block( struct hash_block_lanes *dest,
+                    size_t offset, int hash_type,
+                    const struct hash_block_lanes *src, unsigned lanes );
+
+/*
+ * This is an incremental hash over multiple lanes; each lane hashes an
+ * independent message; however the messages in all the lanes must be
+ * presented in pieces of the same length (and so the messages will all be
+ * the same length).  We use this to compute several OTS public keys at once
+ */
+struct hash_lanes_context {
+    uint32_t state[8][MAX_HASH_LANES];
+    unsigned char data[MAX_HASH_LANES][64]; /* The partial block for each */
+                                            /* lane */
+    size_t len;                             /* The number of bytes hashed */
+                                            /* (in each lane) so far */
+};
+void hss_init_hash_lanes_context( int h, struct hash_lanes_context *ctx );
+void hss_update_hash_lanes_context( int h, struct hash_lanes_context *ctx,
+                          const unsigned char *const *msg, size_t len_msg,
+                          unsigned lanes );
+void hss_finalize_hash_lanes_context( int h, struct hash_lanes_context *ctx,
+                          unsigned char *const *buffer, unsigned lanes );
+
 /*
  * This is a debugging flag; turning this on will cause the system to dump
  * the inputs and the outputs of all hash functions.  It only works if
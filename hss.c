@@ -158,11 +158,26 @@ void hss_extra_info_set_threads( struct hss_extra_info *p, int num_threads ) {
     if (p) p->num_threads = num_threads;
 }
 
+void hss_extra_info_set_thread_pool( struct hss_extra_info *p,
+                                     struct hss_thread_pool *pool ) {
+    if (p) p->thread_pool = pool;
+}
+
+void hss_extra_info_set_background_load( struct hss_extra_info *p,
+                                         bool background ) {
+    if (p) p->background_load = background;
+}
+
 bool hss_extra_info_test_last_signature( struct hss_extra_info *p ) {
     if (!p) return false;
     return p->last_signature;
 }
 
+bool hss_extra_info_test_used_checkpoint( struct hss_extra_info *p ) {
+    if (!p) return false;
+    return p->used_checkpoint;
+}
+
 enum hss_error_code hss_extra_info_test_error_code( struct hss_extra_info *p ) {
     if (!p) return hss_error_got_null;
     return p->error_code;
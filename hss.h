@@ -122,6 +122,120 @@ bool hss_generate_private_key(
     unsigned char *aux_data, size_t len_aux_data,
     struct hss_extra_info *info);
 
+/*
+ * Resumable key generation.  For tall top level trees (e.g. H25), computing
+ * the public key can take hours; these allow the computation to be picked
+ * up where it left off if it is interrupted.
+ *
+ * hss_generate_private_key_checkpointed is the same as
+ * hss_generate_private_key, except that as it computes the nodes within the
+ * top level tree, it records them (a range at a time) in the checkpoint
+ * buffer (which must be at least hss_get_keygen_checkpoint_len bytes long);
+ * after each batch of ranges, it calls checkpoint_written with the part of
+ * the checkpoint that was updated, so the application can write it out.
+ * The checkpoint contains only public data (plus an HMAC on each range), and
+ * so can be kept on ordinary storage, just like the aux data.
+ *
+ * If that is interrupted (after the private key was written), the
+ * application can call hss_resume_private_key with the private key (via
+ * read_private_key/context, as with hss_load_private_key), and with the
+ * checkpoint as it was saved; this computes the public key (and the aux data,
+ * which needs to be the same length as before), skipping over the ranges
+ * that the checkpoint says were done (and redoing any that were damaged).
+ * If the private key has already been used to sign, this fails with
+ * hss_error_key_already_used.
+ *
+ * The checkpoint holds the nodes at the highest aux data level that is no
+ * higher than level 12; if there's no such aux level, it holds the nodes at
+ * level 12 (or just below the root, if the tree is smaller).  Hence it's
+ * never more than a few hundred kbytes.  The aux data also stops at that
+ * level (as we don't compute the nodes below it separately); hence, an aux
+ * buffer larger than what the levels down to 12 need isn't used in full
+ * (and so the aux data differs from what hss_generate_private_key writes)
+ */
+bool hss_generate_private_key_checkpointed(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type, const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned char *checkpoint, size_t len_checkpoint,
+    bool (*checkpoint_written)(const unsigned char *checkpoint,
+                               size_t offset, size_t len, void *context),
+        void *checkpoint_context,
+    struct hss_extra_info *info);
+bool hss_resume_private_key(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned char *checkpoint, size_t len_checkpoint,
+    bool (*checkpoint_written)(const unsigned char *checkpoint,
+                               size_t offset, size_t len, void *context),
+        void *checkpoint_context,
+    struct hss_extra_info *info);
+size_t hss_get_keygen_checkpoint_len(unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type,
+                   size_t len_aux_data);
+
+/*
+ * Sharded key generation.  This allows the top level tree to be computed
+ * by several processes (possibly on different machines), each of which
+ * does its own part (shard) of the ranges that the checkpoint would hold.
+ *
+ * hss_generate_private_key_for_shards creates the private key (just as
+ * hss_generate_private_key would), but doesn't compute the public key.
+ * Then, for each shard (0 through num_shards-1), the application calls
+ * hss_generate_keygen_shard with the private key (via read_private_key/
+ * context, as with hss_load_private_key); this writes the shard output
+ * (which is hss_get_keygen_shard_len bytes long) into output.  The shard
+ * output is public data (with an HMAC on each range), just like the
+ * checkpoint.  len_aux_data needs to be the same as what's passed to the
+ * merge (as it determines the level we compute).
+ *
+ * Once they're all done, hss_merge_keygen_shards takes the shard outputs
+ * (shards[i] is the output from shard i, and len_shards[i] is its length)
+ * and computes the public key and aux data.  A shard may be NULL (or
+ * have a damaged range); we compute what's missing ourselves.  A shard that
+ * was generated for a different private key, shard index, number of shards
+ * or aux data length is rejected with hss_error_bad_shard
+ */
+bool hss_generate_private_key_for_shards(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type, const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    struct hss_extra_info *info);
+bool hss_generate_keygen_shard(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    size_t len_aux_data,
+    unsigned shard, unsigned num_shards,
+    unsigned char *output, size_t len_output,
+    struct hss_extra_info *info);
+bool hss_merge_keygen_shards(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned num_shards,
+    const unsigned char *const *shards, const size_t *len_shards,
+    struct hss_extra_info *info);
+size_t hss_get_keygen_shard_len(unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type,
+                   size_t len_aux_data,
+                   unsigned shard, unsigned num_shards);
+
 /*
  * This is the routine to load a private key into memory, and
  * initialize the working data structures; these data structures
@@ -189,6 +303,19 @@ void hss_free_working_key( struct hss_working_key * );
  * the length of the buffer.  See the hss_get_signature_len function for the
  * expected signature length for this parameter set; if signature_len is too
  * short for the signature to fit, this will fail.
+ *
+ * If we have threads, this returns as soon as the signature is written; the
+ * updates to the working key for the next signature continue in the
+ * background (and the next call on this working key picks up where they
+ * left off).  Hence, the thread pool (if one was given) must stay around
+ * until the next call; hss_finish_working_key or hss_free_working_key waits
+ * for them
+ *
+ * Several application threads may sign with the same working key at once
+ * (with this, hss_sign_init or hss_generate_signatures_batch); each gets a
+ * different leaf, and they compute their OTS signatures in parallel.  This
+ * needs the threaded library (hss_lib_thread.a); hss_load_private_key and
+ * hss_free_working_key must not overlap with any of them
  */
 bool hss_generate_signature(
     struct hss_working_key *working_key,
@@ -199,6 +326,29 @@ bool hss_generate_signature(
     unsigned char *signature, size_t signature_len,
     struct hss_extra_info *info);
 
+/*
+ * This generates signatures for num_messages messages at once; message i is
+ * messages[i] (of length message_lens[i]), and its signature is written to
+ * signatures[i] (each of which is signature_len bytes long).  The
+ * signatures are exactly what num_messages calls to hss_generate_signature
+ * would give, however the private key is updated (at most) once for the
+ * entire batch, and the signatures within a bottom subtree are generated in
+ * parallel (if we have threads).
+ *
+ * If there aren't num_messages signatures left in the key, this fails
+ * without generating any (hss_error_not_that_many_sigs_left).  On any
+ * failure, all the signature buffers are zeroed
+ */
+bool hss_generate_signatures_batch(
+    struct hss_working_key *working_key,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    const void *const *messages, const size_t *message_lens,
+    size_t num_messages,
+    unsigned char *const *signatures, size_t signature_len,
+    struct hss_extra_info *info);
+
 /*
  * See hss_verify.h for the signature verfication routine; it's in a
  * separate file for those programs that only need to verify a signature
@@ -248,6 +398,17 @@ struct hss_working_key *allocate_working_key(
  * data (which is fine; it just means this will take longer)
  *
  * working_key is a pointer to the allocated working key
+ *
+ * If info has background_load set (hss_extra_info_set_background_load),
+ * this (and hss_load_private_key) returns as soon as the working key can
+ * generate the next signature; the subtrees we'll need later are built by
+ * the threads in the background (at a lower priority than any other work
+ * on the same thread pool).  Signatures generated in the meantime are the
+ * same as they would be otherwise; hss_generate_signature waits for the
+ * background work only when it gets to where it needs those subtrees.  The
+ * thread pool (if one was given) must stay around until that's done;
+ * hss_finish_working_key waits for it.  If we don't have threads, this
+ * acts as if background_load were clear
  */
 bool hss_generate_working_key(
     bool (*read_private_key)(unsigned char *private_key,
@@ -257,6 +418,66 @@ bool hss_generate_working_key(
     struct hss_working_key *working_key,
     struct hss_extra_info *info);
 
+/*
+ * Step-wise loading.  hss_generate_working_key does the entire load before it
+ * returns; if that's a problem (for example, if it'd be called from an event
+ * loop that can't block for that long), you can do the same work a slice at
+ * a time:
+ *
+ *    if (!hss_generate_working_key_init( read_private_key, context,
+ *                        aux_data, len_aux_data, working_key, info )) ...
+ *    for (;;) {
+ *        bool done;
+ *        if (!hss_generate_working_key_step( working_key, 100000,
+ *                                            &done, info )) ...
+ *        if (done) break;
+ *        ... do other things ...
+ *    }
+ *
+ * hss_generate_working_key_init reads the private key and lists the work to
+ * be done (which is a tiny part of the total).  Each call to
+ * hss_generate_working_key_step then does about max_hashes hash compression
+ * operations worth of that work (always at least one piece of it; a piece
+ * is a few thousand hashes at most, except for some W=8 parameter sets,
+ * where it's a single OTS public key), in the calling thread.  When the
+ * last of the work is done, it sets *done; after that, the working key can
+ * be used to sign, just as if hss_generate_working_key had loaded it.
+ *
+ * hss_generate_working_key_progress gives how many hashes we've done, and
+ * how many we'll have done at the end (returning false if there isn't a
+ * step-wise load in progress).  hss_generate_working_key_cancel abandons the
+ * load (leaving the working key unloaded); freeing the working key, or
+ * loading it again, also does that
+ */
+bool hss_generate_working_key_init(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    const unsigned char *aux_data, size_t len_aux_data,  /* Optional */
+    struct hss_working_key *working_key,
+    struct hss_extra_info *info);
+bool hss_generate_working_key_step(
+    struct hss_working_key *working_key,
+    unsigned long max_hashes,
+    bool *done,
+    struct hss_extra_info *info);
+bool hss_generate_working_key_progress(
+    const struct hss_working_key *working_key,
+    unsigned long long *hashes_done,
+    unsigned long long *hashes_total);
+void hss_generate_working_key_cancel(
+    struct hss_working_key *working_key);
+
+/*
+ * If the working key was loaded in the background, this waits until that's
+ * complete (and catches up on the updates that the signatures generated in
+ * the meantime skipped).  Afterwards, signing never waits.  This also
+ * finishes any updates the last signature left running in the background
+ */
+bool hss_finish_working_key(
+    struct hss_working_key *working_key,
+    struct hss_extra_info *info);
+
 /*
  * This will make sure that (at least) N signatures are reserved; that is, we
  * won't need to actually call the update function for the next N signatures
@@ -289,6 +510,83 @@ bool hss_set_autoreserve(
     unsigned sigs_to_autoreserve,
     struct hss_extra_info *info);
 
+/*
+ * This makes the autoreserve adapt to how fast we're signing; rather than
+ * reserving a fixed number of signatures, each time we run out, we reserve
+ * enough that (at the signing rate we've seen recently, and allowing for
+ * how long update_private_key has been taking) the next write won't be
+ * needed for write_interval milliseconds.  We never reserve more than
+ * max_lost_sigs (which is what a crash can cost you), nor less than the
+ * hss_set_autoreserve count.  write_interval = 0 turns this off.
+ *
+ * This applies to the normal (synchronous) reservations; the asynchronous
+ * mode (hss_set_async_reserve) reserves its fixed window
+ */
+bool hss_set_adaptive_reserve(
+    struct hss_working_key *w,
+    unsigned write_interval,
+    unsigned max_lost_sigs,
+    struct hss_extra_info *info);
+
+/*
+ * This switches the working key to asynchronous reservations, so that
+ * signing doesn't wait for the private key to be written.  We reserve window
+ * signatures at a time; once half of the current window has been used, we
+ * call async_write to start writing the next reservation (the private_key
+ * buffer it's passed stays valid until the write is complete).  async_write
+ * returns false if it couldn't start the write; otherwise, once the write is
+ * complete (and durable), the application calls hss_async_reserve_done
+ * (from any thread, even from within async_write); a call made when no write
+ * is in flight (including one for a write that async_write reported it
+ * couldn't start) is ignored.  Meanwhile, we keep
+ * signing out of the current window; we wait for the write only if we use
+ * that up first.  The update_private_key function passed to the signing
+ * routines is then used only to retire the private key after its last
+ * signature.
+ *
+ * Passing async_write = NULL switches back to the normal reservations.  This
+ * needs the threaded library (hss_lib_thread.a); otherwise, it fails with
+ * hss_error_no_threads.  Explicit reservations (hss_reserve_signature) still
+ * work; they wait for any write in flight
+ */
+bool hss_set_async_reserve(
+    struct hss_working_key *w,
+    bool (*async_write)(const unsigned char *private_key,
+                        size_t len_private_key, void *context),
+    void *context,
+    unsigned window,
+    struct hss_extra_info *info);
+void hss_async_reserve_done(
+    struct hss_working_key *w,
+    bool success);
+
+/*
+ * This splits what's left of a key into num_subkeys sub-keys; each one is a
+ * private key that may sign with only its own (contiguous, disjoint) range
+ * of sequence numbers.  Hence they can be handed to separate signers (even
+ * on separate hosts), which then sign without any coordination; each loads
+ * its sub-key with hss_load_private_key (and keeps it up to date with its
+ * own update_private_key), just as with a full private key.
+ *
+ * subkeys[i] is where sub-key i is written; each is len_subkey bytes long
+ * (which must be at least hss_get_private_subkey_len, and must not overlap
+ * the private key).  When there are enough signatures left, the ranges are
+ * whole bottom level trees.
+ *
+ * Because the sub-keys now own all the signatures left, the working key
+ * (and its private key, which is updated through update_private_key/context)
+ * is retired; it can't sign any more.  On failure, the subkey buffers are
+ * zeroed, and the working key is left alone.  A sub-key may itself be split
+ */
+bool hss_split_working_key(
+    struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    unsigned num_subkeys,
+    unsigned char *const *subkeys, size_t len_subkey,
+    struct hss_extra_info *info);
+
 /*
  * This returns the required lengths for the various objects we export
  *
@@ -299,6 +597,16 @@ size_t hss_get_private_key_len(unsigned levels,
                    const param_set_t *lm_ots_type);
 #define HSS_MAX_PRIVATE_KEY_LEN (8 + 8 + SEED_LEN + 16)
 
+/*
+ * This is the length of a sub-key (see hss_split_working_key); it returns 0
+ * if the parameter set can't have sub-keys (which is when it uses the
+ * maximum number of levels)
+ */
+size_t hss_get_private_subkey_len(unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type);
+#define HSS_MAX_PRIVATE_SUBKEY_LEN (HSS_MAX_PRIVATE_KEY_LEN + 8)
+
 /*
  * This include file has the functions that contains the lengths of the other
  * public objects
@@ -379,6 +687,11 @@ enum hss_error_code {
                              /* properly */
     hss_error_ctx_already_used, /* The ctx has already been used */
     hss_error_bad_public_key, /* Somehow, we got an invalid public key */
+    hss_error_bad_shard,     /* A key generation shard didn't belong */
+                             /* with the others */
+    hss_error_no_threads,    /* The request needs the threaded library */
+    hss_error_key_already_used, /* Key generation can't be resumed with a */
+                             /* private key that has signed (or a sub-key) */
 
     hss_range_processing_error, /* These errors are cause by an */
                              /* error while processing */
@@ -388,6 +701,9 @@ enum hss_error_code {
     hss_error_private_key_read_failed, /* The read of the private key */
                              /* from NVRAM failed */
     hss_error_out_of_memory, /* A malloc failure caused us to fail */
+    hss_error_checkpoint_write_failed, /* The application couldn't save */
+                             /* the key generation checkpoint */
+    hss_error_store_in_use,  /* The private key store is already open */
 
     hss_range_my_problem,    /* These are caused by internal errors */
                              /* within the HSS implementation */
@@ -400,10 +716,18 @@ enum hss_error_code {
  * to and from the above routines (without requiring us to add each
  * one as an additional parameter
  */
+struct hss_thread_pool;
 struct hss_extra_info {
     int num_threads;     /* Number of threads we're allowed to ues */
+    struct hss_thread_pool *thread_pool; /* If non-NULL, the (long lived) */
+                         /* threads we use; num_threads is ignored */
     bool last_signature; /* Set if we just signed the last signature */
                          /* allowed by this private key */
+    bool background_load; /* If set, loading a key returns once it can */
+                         /* sign; the rest is done in the background */
+    bool used_checkpoint; /* Set if the signature we just generated took */
+                         /* the bottom OTS signature's Winternitz */
+                         /* checkpoints from the working key's cache */
     enum hss_error_code error_code; /* The more recent error detected */
 };
 
@@ -412,6 +736,27 @@ struct hss_extra_info {
 void hss_init_extra_info( struct hss_extra_info * );
 void hss_extra_info_set_threads( struct hss_extra_info *, int );
 bool hss_extra_info_test_last_signature( struct hss_extra_info * );
+bool hss_extra_info_test_used_checkpoint( struct hss_extra_info * );
 enum hss_error_code hss_extra_info_test_error_code( struct hss_extra_info * );
+void hss_extra_info_set_thread_pool( struct hss_extra_info *,
+                                     struct hss_thread_pool * );
+void hss_extra_info_set_background_load( struct hss_extra_info *, bool );
+
+/*
+ * Persistent thread pool.  By default, each call that uses threads spawns
+ * its own worker threads, and waits for them to exit before returning; if
+ * you're doing a lot of operations (e.g. signing thousands of messages per
+ * second), that overhead adds up.  Instead, you can create a pool once, and
+ * pass it to the calls (via hss_extra_info_set_thread_pool); the pool's
+ * threads stay parked between calls.  A pool may be shared by several
+ * application threads at once.
+ *
+ * hss_thread_pool_create returns NULL if it can't create the threads (or
+ * if we're not built with thread support, or num_threads <= 1); that's not
+ * an error, passing a NULL pool just means we act as before.
+ * hss_thread_pool_free must not be called while a call is using the pool
+ */
+struct hss_thread_pool *hss_thread_pool_create( int num_threads );
+void hss_thread_pool_free( struct hss_thread_pool * );
 
 #endif /* HSS_H_ */
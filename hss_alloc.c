@@ -8,6 +8,9 @@
 #include "hss.h"
 #include "hss_internal.h"
 #include "lm_common.h"
+#include "lm_ots.h"
+#include "hss_thread.h"
+#include "hss_reserve.h"
 
 #define MALLOC_OVERHEAD  8   /* Our simplistic model about the overhead */
                              /* that malloc takes up is that it adds 8 */
@@ -181,6 +184,23 @@ signed long initial_mem_target = mem_target; /* DEBUG HACK */
     w->status = hss_error_key_uninitialized; /* Not usable until we see a */
                                              /* private key */
     w->autoreserve = 0;
+    w->adaptive_interval = 0;
+    w->async_write = NULL;
+    w->async_target = 0;
+    atomic_init( &w->async_pending, false );
+    w->async_done = NULL;
+    w->pending_load = NULL;
+    w->deferred_updates = 0;
+    w->stepwise_load = NULL;
+    w->maintenance = NULL;
+    w->maintenance_error = hss_error_none;
+    w->pending_advance = false;
+    if (!hss_mutex_create( &w->lock )) {
+        /* Without the lock, two threads could sign with the same leaf */
+        free( w );
+        info->error_code = hss_error_out_of_memory;
+        return NULL;
+    }
 
     /* Initialize all the allocated data structures to NULL */
     /* We do this up front so that if we hit an error in the middle, we can */
@@ -188,6 +208,10 @@ signed long initial_mem_target = mem_target; /* DEBUG HACK */
     for (i=0; i<MAX_HSS_LEVELS-1; i++) {
         w->signed_pk[i] = NULL;
     }
+    for (i=0; i<MAX_HSS_LEVELS; i++) {
+        w->next_signed_pk[i] = NULL;
+        w->next_signed_pk_q[i] = NO_SIGNED_PK;
+    }
     for (i=0; i<MAX_HSS_LEVELS; i++) {
         w->tree[i] = NULL;
     }
@@ -217,6 +241,15 @@ signed long initial_mem_target = mem_target; /* DEBUG HACK */
             info->error_code = hss_error_out_of_memory;
             return 0;
         }
+        mem_target -= w->signed_pk_len[i] + MALLOC_OVERHEAD;
+
+            /* And the one for the next tree (which we sign ahead of time) */
+        w->next_signed_pk[i] = malloc( w->signed_pk_len[i] );
+        if (!w->next_signed_pk[i]) {
+            hss_free_working_key(w);
+            info->error_code = hss_error_out_of_memory;
+            return 0;
+        }
         mem_target -= w->signed_pk_len[i] + MALLOC_OVERHEAD;
     }
     w->signature_len = signature_len;
@@ -453,6 +486,10 @@ printf( "Allocation = %ld\n", initial_mem_target - mem_target + best_mem ); /* D
         tree->hash_size = hash_size[i];
         tree->lm_type = lm_type[i];
         tree->lm_ots_type = lm_ots_type[i];
+        tree->ots = lm_ots_look_up_kernel( lm_ots_type[i] );
+        tree->checkpoint_leaves = 0;
+        tree->checkpoint_q = NULL;
+        tree->checkpoint = NULL;
         /* We'll initialize current_index from the private key */
         tree->max_index = (1L << tree->level) - 1;
         tree->sublevels = subtree_levels[i];
@@ -515,6 +552,36 @@ printf( "Allocation = %ld\n", initial_mem_target - mem_target + best_mem ); /* D
     }
 /* SANITY CHECK */
 
+    /*
+     * If we have memory left over after that, use it for the Winternitz
+     * checkpoint cache for the bottom tree.  This only helps if the bottom
+     * tree has BUILDING subtrees (that is, more than one sublevel), as
+     * that's where we generate the checkpoints
+     */
+    i = levels - 1;
+    mem_target -= best_mem;
+    if (subtree_levels[i] > 1) {
+        struct merkle_level *tree = w->tree[i];
+        size_t leaf_len = tree->ots->checkpoint_len + sizeof(merkle_index_t);
+        signed long leaves = (mem_target - 2*MALLOC_OVERHEAD) /
+                                             (signed long)(2 * leaf_len);
+        signed long max_leaves = (signed long)1 << tree->subtree_size;
+        if (leaves > max_leaves) leaves = max_leaves;
+        if (leaves > 0) {
+            tree->checkpoint_q = malloc( 2 * leaves * sizeof(merkle_index_t) );
+            tree->checkpoint = malloc( 2 * leaves *
+                                       tree->ots->checkpoint_len );
+            if (!tree->checkpoint_q || !tree->checkpoint) {
+                /* We don't actually need this; just do without */
+                free( tree->checkpoint_q ); tree->checkpoint_q = NULL;
+                free( tree->checkpoint ); tree->checkpoint = NULL;
+            } else {
+                tree->checkpoint_leaves = leaves;
+                hss_reset_checkpoints( tree );
+            }
+        }
+    }
+
     /* Compute the max number of signatures we can generate */
     if (total_height > 64) total_height = 64; /* (bounded by 2**64) */
     w->max_count = ((sequence_t)2 << (total_height-1)) - 1; /* height-1 so */
@@ -525,6 +592,7 @@ printf( "Allocation = %ld\n", initial_mem_target - mem_target + best_mem ); /* D
         /* parameter sets that can literally generate 2**64 signatures (by */
         /* letting them generate only 2**64-1) */
     if (total_height == 64) w->max_count--;
+    w->tree_max_count = w->max_count;
 
     return w;
 }
@@ -532,6 +600,12 @@ printf( "Allocation = %ld\n", initial_mem_target - mem_target + best_mem ); /* D
 void hss_free_working_key(struct hss_working_key *w) {
     int i;
     if (!w) return;
+    /* If the subtrees are still being built, wait for that to stop */
+    hss_wait_pending_updates( w );
+    (void)hss_wait_background_load( w, true );
+    hss_generate_working_key_cancel( w );
+    /* The application may still be writing out of our buffer */
+    hss_wait_async_reserve( w );
     for (i=0; i<MAX_HSS_LEVELS; i++) {
         struct merkle_level *tree = w->tree[i];
         if (tree) {
@@ -539,6 +613,9 @@ void hss_free_working_key(struct hss_working_key *w) {
             for (j=0; j<MAX_SUBLEVELS; j++)
                 for (k=0; k<3; k++)
                     free(tree->subtree[j][k]);
+            hss_reset_checkpoints( tree ); /* The checkpoints are secret */
+            free(tree->checkpoint_q);
+            free(tree->checkpoint);
             hss_zeroize( tree, sizeof *tree ); /* We have seeds here */
         }
         free(tree);
@@ -546,7 +623,25 @@ void hss_free_working_key(struct hss_working_key *w) {
     for (i=0; i<MAX_HSS_LEVELS-1; i++) {
         free(w->signed_pk[i]);
     }
+    for (i=0; i<MAX_HSS_LEVELS; i++) {
+        free(w->next_signed_pk[i]);
+    }
     free(w->stack);
+    hss_mutex_free(w->lock);
+    hss_event_free(w->async_done);
     hss_zeroize( w, sizeof *w ); /* We have secret information here */
     free(w);
 }
+
+/*
+ * This empties the Winternitz checkpoint cache of a tree (and zeroizes it;
+ * the checkpoints are secret)
+ */
+void hss_reset_checkpoints(struct merkle_level *tree) {
+    unsigned i, entries = 2 * tree->checkpoint_leaves;
+    if (entries == 0) return;
+    for (i=0; i<entries; i++) {
+        tree->checkpoint_q[i] = NO_CHECKPOINT;
+    }
+    hss_zeroize( tree->checkpoint, entries * tree->ots->checkpoint_len );
+}
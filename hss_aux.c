@@ -39,6 +39,7 @@ static void compute_hmac( unsigned char *dest,
                           unsigned hash, unsigned size_hash,
                           union hash_context *ctx,
                           unsigned char *key,
+                          const unsigned char *prefix, size_t len_prefix,
                           const unsigned char *data, size_t len_data);
 
 /*
@@ -164,7 +165,7 @@ struct expanded_aux_data *hss_expand_aux_data( const unsigned char *aux_data,
         compute_seed_derive( key, w->tree[0]->h, w->working_key_seed, &ctx );
         unsigned char expected_mac[ MAX_HASH ];
         compute_hmac( expected_mac, w->tree[0]->h, size_hash, &ctx, key,
-                          orig_aux_data, aux_data - orig_aux_data );
+                          0, 0, orig_aux_data, aux_data - orig_aux_data );
         hss_zeroize( key, size_hash );
         hss_zeroize( &ctx, sizeof ctx );
         if (0 != memcmp_consttime( expected_mac, aux_data, size_hash)) {
@@ -257,6 +258,7 @@ static void xor_key( unsigned char *key, unsigned xor_val, unsigned len_key) {
  * This computes the hmac; it assumes that the key is size_hash bytes
  * long (and while it does modify it during processing, it restores
  * it at the end)
+ * The data being MAC'ed is prefix followed by data (the prefix may be empty)
  * This can obviously be optimized; however, this is not performance critical,
  * so we keep it simple
  */
@@ -264,6 +266,7 @@ static void compute_hmac( unsigned char *dest,
                           unsigned hash, unsigned size_hash,
                           union hash_context *ctx,
                           unsigned char *key,
+                          const unsigned char *prefix, size_t len_prefix,
                           const unsigned char *data, size_t len_data) {
     unsigned block_size = hss_hash_blocksize(hash);
 
@@ -276,6 +279,7 @@ static void compute_hmac( unsigned char *dest,
          const unsigned char ipad = IPAD;
          hss_update_hash_context( hash, ctx, &ipad, 1 );
     }
+    if (len_prefix) hss_update_hash_context( hash, ctx, prefix, len_prefix );
     hss_update_hash_context( hash, ctx, data, len_data );
 
     hss_finalize_hash_context( hash, ctx, dest );  /* We place the */
@@ -325,7 +329,7 @@ void hss_finalize_aux_data( struct expanded_aux_data *data,
     }
     if (aux) {
         compute_hmac( aux+total_length, hash, size_hash, &ctx, aux_seed,
-                      aux, total_length );
+                      0, 0, aux, total_length );
     }
 
     hss_zeroize( &ctx, sizeof ctx );
@@ -353,3 +357,45 @@ bool hss_extract_aux_data(const struct expanded_aux_data *aux, unsigned level,
 
     return true;
 }
+
+/*
+ * This computes the authentication code for a range of nodes within a key
+ * generation checkpoint (see hss_keygen.c).  We use the same key as the aux
+ * data does; the MAC'ed data starts with a prefix (with a zero first byte,
+ * so it can't be confused with nonempty aux data) giving the level and the
+ * range index, so a range can't be moved elsewhere
+ */
+void hss_keygen_checkpoint_mac( unsigned char *dest,
+                                unsigned hash, unsigned size_hash,
+                                const unsigned char *seed,
+                                unsigned level, merkle_index_t range,
+                                const unsigned char *nodes, size_t len_nodes) {
+    union hash_context ctx;
+    unsigned char key[ MAX_HASH ];
+    compute_seed_derive( key, hash, seed, &ctx );
+
+    unsigned char prefix[ 12 ];
+    put_bigendian( prefix, 0, 4 );
+    put_bigendian( prefix + 4, level, 4 );
+    put_bigendian( prefix + 8, range, 4 );
+    compute_hmac( dest, hash, size_hash, &ctx, key,
+                  prefix, sizeof prefix, nodes, len_nodes );
+
+    hss_zeroize( &ctx, sizeof ctx );
+    hss_zeroize( key, size_hash );
+}
+
+/*
+ * This checks whether a range within a key generation checkpoint has a
+ * valid authentication code (and so has already been computed)
+ */
+bool hss_keygen_checkpoint_check( const unsigned char *mac,
+                                unsigned hash, unsigned size_hash,
+                                const unsigned char *seed,
+                                unsigned level, merkle_index_t range,
+                                const unsigned char *nodes, size_t len_nodes) {
+    unsigned char expected_mac[ MAX_HASH ];
+    hss_keygen_checkpoint_mac( expected_mac, hash, size_hash, seed,
+                               level, range, nodes, len_nodes );
+    return 0 == memcmp_consttime( expected_mac, mac, size_hash );
+}
@@ -51,6 +51,19 @@ void hss_finalize_aux_data(struct expanded_aux_data *data,
                            unsigned size_hash, unsigned hash,
                            const unsigned char *seed);
 
+/* Compute (or check) the authentication code for a range of nodes within */
+/* a key generation checkpoint */
+void hss_keygen_checkpoint_mac( unsigned char *dest,
+                                unsigned hash, unsigned size_hash,
+                                const unsigned char *seed,
+                                unsigned level, merkle_index_t range,
+                                const unsigned char *nodes, size_t len_nodes);
+bool hss_keygen_checkpoint_check( const unsigned char *mac,
+                                unsigned hash, unsigned size_hash,
+                                const unsigned char *seed,
+                                unsigned level, merkle_index_t range,
+                                const unsigned char *nodes, size_t len_nodes);
+
 /* Get a set of intermediate nodes from the aux data */
 bool hss_extract_aux_data(const struct expanded_aux_data *aux, unsigned level,
             const struct hss_working_key *w, unsigned char *dest,
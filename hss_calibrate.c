@@ -0,0 +1,163 @@
+/*
+ * This measures how long the basic Merkle tree operations take on this
+ * machine; hss_generate_working_key uses these to decide how to split its
+ * work between threads.
+ *
+ * The obvious alternative (which is what we used to do) is to count hash
+ * compression operations; however the actual ratio between the cost of a
+ * leaf and the cost of an internal node depends on things like how many
+ * hashes the CPU can do in parallel, and if we get that wrong, we end up
+ * with one thread grinding away on a top subtree while the rest are idle
+ */
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "hss_calibrate.h"
+#include "hss_internal.h"
+#include "hash.h"
+#include "lm_common.h"
+#include "lm_ots_common.h"
+
+#define CAL_HEIGHT 4      /* We time computing a node with 2**CAL_HEIGHT */
+                          /* leaves below it (which is a full SIMD batch) */
+#define CAL_NODES 64      /* We time this many internal node combines */
+#define CAL_MIN_TIME 2000000 /* We repeat each measurement until we've */
+                          /* spent at least this long (in ns) on it */
+#define CAL_MAX_REPS 16   /* But never more than this many times */
+#define NOMINAL_HASH_COST 100 /* If we can't measure, assume this many */
+                          /* ns per hash compression operation */
+
+/*
+ * The cached values; 0 means we haven't measured it yet.  We may be called
+ * from several threads at once; if so, they might each measure the costs,
+ * which is wasteful, but harmless
+ */
+#define MAX_CACHED_OTS 8
+static atomic_ulong cached_leaf_cost[ MAX_CACHED_OTS ];
+static atomic_ulong cached_node_cost;
+
+unsigned long long hss_now(void) {
+#if defined( CLOCK_MONOTONIC )
+    struct timespec ts;
+    if (0 == clock_gettime( CLOCK_MONOTONIC, &ts )) {
+        return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+#endif
+    return (unsigned long long)clock() * (1000000000 / CLOCKS_PER_SEC);
+}
+
+/*
+ * This measures the cost of combining two nodes
+ */
+static unsigned long measure_node_cost( unsigned h ) {
+    unsigned hash_size = hss_hash_length(h);
+    unsigned char node[ 2 * MAX_HASH ];
+    unsigned char I[ I_LEN ];
+    memset( node, 0, sizeof node );
+    memset( I, 0, sizeof I );
+
+    unsigned long long best = 0, total = 0;
+    unsigned rep, i;
+    for (rep = 0; rep < CAL_MAX_REPS && (rep < 2 || total < CAL_MIN_TIME);
+                                                                    rep++) {
+        unsigned long long start = hss_now();
+        for (i=0; i<CAL_NODES; i++) {
+            hss_combine_internal_nodes( node, node, node + hash_size,
+                                        h, I, hash_size, i+1 );
+        }
+        unsigned long long elapsed = hss_now() - start;
+        total += elapsed;
+        if (rep == 0 || elapsed < best) best = elapsed;
+    }
+
+    unsigned long cost = best / CAL_NODES;
+    return cost ? cost : 1;
+}
+
+/*
+ * This measures the cost of computing a leaf; we time computing a small
+ * subtree, and subtract off the internal nodes
+ */
+static unsigned long measure_leaf_cost( param_set_t lm_type,
+                                        param_set_t lm_ots_type,
+                                        unsigned h, unsigned height,
+                                        unsigned long node_cost ) {
+    unsigned char seed[ SEED_LEN ];
+    unsigned char I[ I_LEN ];
+    unsigned char dest[ MAX_HASH ];
+    memset( seed, 0, sizeof seed );
+    memset( I, 0, sizeof I );
+
+    enum hss_error_code got_error = hss_error_none;
+    struct intermed_tree_detail detail;
+    detail.dest = dest;
+    detail.node_num = (merkle_index_t)1 << (height - CAL_HEIGHT);
+    detail.seed = seed;
+    detail.lm_type = lm_type;
+    detail.lm_ots_type = lm_ots_type;
+    detail.h = h;
+    detail.tree_height = height;
+    detail.I = I;
+    detail.node_count = 1;
+    detail.got_error = &got_error;
+
+    unsigned long long best = 0, total = 0;
+    unsigned rep;
+    for (rep = 0; rep < CAL_MAX_REPS && (rep < 2 || total < CAL_MIN_TIME);
+                                                                    rep++) {
+        unsigned long long start = hss_now();
+        hss_gen_intermediate_tree( &detail, 0 );
+        unsigned long long elapsed = hss_now() - start;
+        total += elapsed;
+        if (rep == 0 || elapsed < best) best = elapsed;
+    }
+    if (got_error != hss_error_none) return 0;
+
+    unsigned num_leaves = 1 << CAL_HEIGHT;
+    unsigned long long internal = (unsigned long long)(num_leaves-1) *
+                                                             node_cost;
+    if (best <= internal) return 1;
+    unsigned long cost = (best - internal) / num_leaves;
+    return cost ? cost : 1;
+}
+
+void hss_get_calibrated_costs( param_set_t lm_type, param_set_t lm_ots_type,
+                               unsigned long *leaf_cost,
+                               unsigned long *node_cost ) {
+    unsigned h, height;
+    unsigned w, p;
+    if (!lm_look_up_parameter_set( lm_type, &h, 0, &height ) ||
+        !lm_ots_look_up_parameter_set( lm_ots_type, 0, 0, &w, &p, 0 ) ||
+        height < CAL_HEIGHT) {
+        /* We don't know what this is; we'll guess something */
+        *leaf_cost = 128 * 256 * NOMINAL_HASH_COST;
+        *node_cost = NOMINAL_HASH_COST;
+        return;
+    }
+
+    unsigned long node = atomic_load_explicit( &cached_node_cost,
+                                               memory_order_relaxed );
+    if (node == 0) {
+        node = measure_node_cost( h );
+        atomic_store_explicit( &cached_node_cost, node,
+                               memory_order_relaxed );
+    }
+    *node_cost = node;
+
+    unsigned long leaf = 0;
+    if (lm_ots_type < MAX_CACHED_OTS) {
+        leaf = atomic_load_explicit( &cached_leaf_cost[ lm_ots_type ],
+                                     memory_order_relaxed );
+    }
+    if (leaf == 0) {
+        leaf = measure_leaf_cost( lm_type, lm_ots_type, h, height, node );
+        if (leaf == 0) {
+            /* The measurement failed; fall back to counting hashes */
+            leaf = (unsigned long)p * (1UL << w) * node;
+        } else if (lm_ots_type < MAX_CACHED_OTS) {
+            atomic_store_explicit( &cached_leaf_cost[ lm_ots_type ], leaf,
+                                   memory_order_relaxed );
+        }
+    }
+    *leaf_cost = leaf;
+}
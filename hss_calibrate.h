@@ -0,0 +1,26 @@
+#if !defined( HSS_CALIBRATE_H_ )
+#define HSS_CALIBRATE_H_
+
+#include "common_defs.h"
+
+/*
+ * This gives the measured costs (in nanoseconds) of the two operations that
+ * building a Merkle tree consists of: computing a leaf (the OTS public key,
+ * and the leaf hash), and combining two nodes into their parent.  The leaf
+ * cost is what we see when the leaves are computed in batches (the way
+ * hss_gen_intermediate_tree does them), and so it reflects the SIMD hardware
+ * we're running on.
+ *
+ * The first time we're asked about a specific OTS parameter set, we time
+ * a few computations; after that, we return the cached values
+ */
+void hss_get_calibrated_costs( param_set_t lm_type, param_set_t lm_ots_type,
+                               unsigned long *leaf_cost,
+                               unsigned long *node_cost );
+
+/*
+ * This returns a monotonic clock, in nanoseconds
+ */
+unsigned long long hss_now(void);
+
+#endif /* HSS_CALIBRATE_H_ */
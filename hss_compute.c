@@ -25,10 +25,76 @@ static int trailing_1_bits(merkle_index_t n) {
 }
 
 /*
- * Compute the value of an internal node within a Merkle tree
+ * Compute the values of 'count' consecutive leaves (starting at leaf q),
+ * and then combine them 'height' levels up the tree, placing the resulting
+ * count >> height node values into dest.  count must be a multiple of
+ * 2**height (and q must be aligned to that), and must be no larger than
+ * MAX_HASH_LANES.
+ * We do all the leaves at once; the OTS public keys are computed in
+ * lockstep (one leaf per SIMD lane), and then each level of the leaf and
+ * internal node hashes is done as a single multi-buffer hash
  */
-static enum hss_error_code hss_compute_internal_node( unsigned char *dest,
+static enum hss_error_code compute_leaf_batch( unsigned char *dest,
+                            merkle_index_t q, unsigned count, unsigned height,
+                            struct seed_derive *derive,
+                            const struct lm_ots_kernel *ots,
+                            unsigned h, unsigned hash_size,
+                            merkle_index_t tree_size,
+                            const unsigned char *I) {
+    unsigned char node[ MAX_HASH_LANES ][ MAX_HASH ];
+    unsigned char msg[ MAX_HASH_LANES ][ INTR_MAX_LEN ];
+    unsigned char *node_ptr[ MAX_HASH_LANES ];
+    const unsigned char *msg_ptr[ MAX_HASH_LANES ];
+    unsigned char pub_key[ MAX_HASH_LANES * MAX_HASH ];
+    unsigned i;
+
+    /* Generate the OTS public keys */
+    hss_seed_derive_set_q( derive, q );
+    if (!ots->generate_public_keys(I,
+                   q, count, derive, pub_key, sizeof pub_key)) {
+        return hss_error_internal;
+    }
+
+    /* Hash them to form the leaf nodes */
+    merkle_index_t r = q + tree_size;
+    for (i=0; i<count; i++) {
+        memcpy( msg[i] + LEAF_I, I, I_LEN );
+        put_bigendian( msg[i] + LEAF_R, r + i, 4 );
+        SET_D( msg[i] + LEAF_D, D_LEAF );
+        memcpy( msg[i] + LEAF_PK, pub_key + i*hash_size, hash_size );
+        msg_ptr[i] = msg[i];
+        node_ptr[i] = node[i];
+    }
+    hss_hash_multi( node_ptr, h, msg_ptr, LEAF_LEN(hash_size), count );
+
+    /* Now combine them, one level at a time */
+    for (; height > 0; height--) {
+        count >>= 1;
+        r >>= 1;
+        for (i=0; i<count; i++) {
+            memcpy( msg[i] + INTR_I, I, I_LEN );
+            put_bigendian( msg[i] + INTR_R, r + i, 4 );
+            SET_D( msg[i] + INTR_D, D_INTR );
+            memcpy( msg[i] + INTR_PK, node[2*i], hash_size );
+            memcpy( msg[i] + INTR_PK + hash_size, node[2*i+1], hash_size );
+        }
+        hss_hash_multi( node_ptr, h, msg_ptr, INTR_LEN(hash_size), count );
+    }
+
+    for (i=0; i<count; i++) {
+        memcpy( dest + i*hash_size, node[i], hash_size );
+    }
+
+    return hss_error_none;
+}
+
+/*
+ * Compute the values of node_count consecutive internal nodes (starting
+ * at node_num) within a Merkle tree
+ */
+static enum hss_error_code hss_compute_internal_nodes( unsigned char *dest,
                             merkle_index_t node_num, 
+                            unsigned node_count,
                             const unsigned char *seed,
                             param_set_t lm_type,
                             param_set_t lm_ots_type,
@@ -50,67 +116,105 @@ static enum hss_error_code hss_compute_internal_node( unsigned char *dest,
     }
     merkle_index_t q = r - tree_size;
 
-    merkle_index_t i;
-    unsigned ots_len = lm_ots_get_public_key_len(lm_ots_type);
-    unsigned char pub_key[ LEAF_MAX_LEN ];
-    memcpy( pub_key + LEAF_I, I, I_LEN );
-    SET_D( pub_key + LEAF_D, D_LEAF );
-
+    const struct lm_ots_kernel *ots = lm_ots_look_up_kernel( lm_ots_type );
+    if (!ots) return hss_error_bad_param_set;
     struct seed_derive derive;
     if (!hss_seed_derive_init( &derive, lm_type, lm_ots_type,
                                I, seed)) {
         return hss_error_bad_param_set;
     }
+    enum hss_error_code status = hss_error_none;
 
-    for (i=0;; i++, r++, q++) {
-        /* Generate the next OTS public key */
-        hss_seed_derive_set_q( &derive, q );
-        if (!lm_ots_generate_public_key(lm_ots_type, I,
-                   q, &derive, pub_key + LEAF_PK, ots_len)) {
-            return hss_error_bad_param_set; /* The only reason the above */
-                                            /* could fail */
-        }
+    /*
+     * Figure out how many leaves we'll do at once; that's the number of
+     * hashes we can do in parallel (rounded down to a power of 2, so that
+     * each batch is a complete subtree)
+     */
+    unsigned lanes = hss_hash_lanes(h);
+    unsigned batch_height = 0;
+    while ((2U << batch_height) <= lanes) batch_height++;
 
+    if (batch_height >= levels_to_bottom) {
         /*
-         * For the subtree which this leaf node forms the final piece, put the
-         * destination to where we'll want it, either on the stack, or if this
-         * is the final piece, to where the caller specified
+         * Each node has few enough leaves that we can do several nodes in
+         * a single batch
          */
-        unsigned char *current_buf;
-        int stack_offset = trailing_1_bits( i );
-        if (stack_offset == levels_to_bottom) {
-            current_buf = dest;
-        } else {
-            current_buf = &stack[stack_offset * hash_size ];
+        unsigned nodes_per_batch = 1U << (batch_height - levels_to_bottom);
+        unsigned i;
+        for (i=0; i<node_count; i += nodes_per_batch) {
+            unsigned this_batch = node_count - i;
+            if (this_batch > nodes_per_batch) this_batch = nodes_per_batch;
+            status = compute_leaf_batch( dest + i * hash_size,
+                            q + ((merkle_index_t)i << levels_to_bottom),
+                            this_batch << levels_to_bottom, levels_to_bottom,
+                            &derive, ots, h, hash_size,
+                            tree_size, I );
+            if (status != hss_error_none) break;
         }
+        hss_seed_derive_done( &derive );
+        return status;
+    }
 
-        /* Hash it to form the leaf node */
-        put_bigendian( pub_key + LEAF_R, r, 4);
-        union hash_context ctx;
-        hss_hash_ctx( current_buf, h, &ctx, pub_key, LEAF_LEN(hash_size) );
-
-        /* Work up the stack, combining right nodes with the left nodes */
-        /* that we've already computed */
-        unsigned sp;
-        for (sp = 1; sp <= stack_offset; sp++) {
-            hss_combine_internal_nodes( current_buf,
-                            &stack[(sp-1) * hash_size], current_buf,
-                            h, I, hash_size,
-                            r >> sp );
-        }
+    /*
+     * Each node is made up of multiple batches; compute each node by
+     * computing the batches (each of which gives us the root of a subtree
+     * of height batch_height), and combining them using a stack
+     */
+    unsigned levels_above_batch = levels_to_bottom - batch_height;
+    unsigned batch_size = 1U << batch_height;
+    unsigned node;
+    for (node = 0; node < node_count; node++, dest += hash_size) {
+        merkle_index_t i;
+        merkle_index_t batch_r = r >> batch_height;
+        for (i=0;; i++, batch_r++, q += batch_size) {
+            /*
+             * For the subtree which this batch forms the final piece, put the
+             * destination to where we'll want it, either on the stack, or if
+             * this is the final piece, to where the caller specified
+             */
+            unsigned char *current_buf;
+            int stack_offset = trailing_1_bits( i );
+            if (stack_offset == levels_above_batch) {
+                current_buf = dest;
+            } else {
+                current_buf = &stack[stack_offset * hash_size ];
+            }
+
+            /* Compute the root of the next batch */
+            status = compute_leaf_batch( current_buf, q, batch_size,
+                            batch_height, &derive, ots,
+                            h, hash_size, tree_size, I );
+            if (status != hss_error_none) {
+                hss_seed_derive_done( &derive );
+                return status;
+            }
+
+            /* Work up the stack, combining right nodes with the left nodes */
+            /* that we've already computed */
+            unsigned sp;
+            for (sp = 1; sp <= stack_offset; sp++) {
+                hss_combine_internal_nodes( current_buf,
+                                &stack[(sp-1) * hash_size], current_buf,
+                                h, I, hash_size,
+                                batch_r >> sp );
+            }
 
-        /* We're not at a left branch, or at the target node */
+            /* We're not at a left branch, or at the target node */
 
-        /* Because we've set current_buf to point to where we want to place */
-        /* the result of this loop, we don't need to memcpy it */
+            /* Because we've set current_buf to point to where we want to */
+            /* place the result of this loop, we don't need to memcpy it */
 
-        /* Check if this was the last leaf (and so we've just computed the */
-        /* target node) */
-        if (stack_offset == levels_to_bottom) {
-            /* We're at the target node; the node we were asked to compute */
-            /* We've already placed the value into dest, so we're all done */
-            break;
+            /* Check if this was the last batch (and so we've just computed */
+            /* the target node) */
+            if (stack_offset == levels_above_batch) {
+                /* We're at the target node; the node we were asked to */
+                /* compute.  We've already placed the value into dest, so */
+                /* we're done with this node */
+                break;
+            }
         }
+        r += (merkle_index_t)1 << levels_to_bottom;
+        q += batch_size;
     }
 
     hss_seed_derive_done( &derive );
@@ -147,10 +251,14 @@ void hss_gen_intermediate_tree(const void *data,
     unsigned hash_len = hss_hash_length(d->h);
     unsigned i;
 
-    for (i=0; i<d->node_count; i++) {
-        unsigned char result[ MAX_HASH ];
-        enum hss_error_code status = hss_compute_internal_node( result,
-                            d->node_num + i, 
+    /* We compute the nodes a handful at a time (so that, if they're near */
+    /* the bottom of the tree, we can compute several at once) */
+    for (i=0; i<d->node_count; i += MAX_HASH_LANES) {
+        unsigned char result[ MAX_HASH_LANES * MAX_HASH ];
+        unsigned count = d->node_count - i;
+        if (count > MAX_HASH_LANES) count = MAX_HASH_LANES;
+        enum hss_error_code status = hss_compute_internal_nodes( result,
+                            d->node_num + i, count,
                             d->seed,
                             d->lm_type,
                             d->lm_ots_type,
@@ -159,16 +267,16 @@ void hss_gen_intermediate_tree(const void *data,
                             d->I);
 
         /* Report the results */
-        hss_thread_before_write(col);
         if (status == hss_error_none) {
-            /* Copy out the resulting hash */
-            memcpy( d->dest + i*hash_len, result, hash_len );
+            /* Copy out the resulting hashes; no other work item writes */
+            /* to this range, so we don't need the write lock */
+            memcpy( d->dest + i*hash_len, result, count*hash_len );
         } else {
             /* Something went wrong; report the bad news */
+            hss_thread_before_write(col);
             *d->got_error = status;
             hss_thread_after_write(col);  /* No point in working more */
             return;
         }
-        hss_thread_after_write(col);
     }
 }
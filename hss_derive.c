@@ -50,6 +50,7 @@ bool hss_seed_derive_init( struct seed_derive *derive,
     derive->I = I;
     derive->master_seed = seed;
     /* q, j will be set later */
+
 #if SECRET_METHOD == 2
     /* Grab the hash function to use */
     if (!lm_look_up_parameter_set(lm, &derive->hash, &derive->m, 0)) {
@@ -61,49 +62,116 @@ bool hss_seed_derive_init( struct seed_derive *derive,
     if (derive->m != SEED_LEN) {
         return false;
     }
+    int hash = derive->hash;    /* Our the parameter set's hash function */
+#else
+    int hash = HASH;            /* Use our standard one */
 #endif
 
+    /* Set up the parts of the PRG hash that don't change; set_q and */
+    /* set_j will fill in the rest */
+    if (!hss_hash_block_init( &derive->prg, hash, PRG_LEN(SEED_LEN) )) {
+        return false;
+    }
+    hss_hash_block_set( &derive->prg, PRG_I, I, I_LEN );
+    hss_hash_block_set_byte( &derive->prg, PRG_FF, 0xff );
+    hss_hash_block_set( &derive->prg, PRG_SEED, seed, SEED_LEN );
+
     return true;
 }
 
 /* This sets the internal 'q' value for seed derivation object */
 void hss_seed_derive_set_q( struct seed_derive *derive, merkle_index_t q ) {
+    unsigned char q_buffer[4];
     derive->q = q;
+    put_bigendian( q_buffer, q, 4 );
+    hss_hash_block_set( &derive->prg, PRG_Q, q_buffer, 4 );
 }
 
 /* This sets the internal 'j' value for seed derivation object */
 void hss_seed_derive_set_j( struct seed_derive *derive, unsigned j ) {
     derive->j = j;
+    hss_hash_block_set_byte( &derive->prg, PRG_J, j >> 8 );
+    hss_hash_block_set_byte( &derive->prg, PRG_J+1, j );
 }
 
+#if SECRET_METHOD == 2
+#define PRG_HASH(derive) ((derive)->hash) /* Our parameter set's hash */
+#else
+#define PRG_HASH(derive) HASH             /* Our standard one */
+#endif
 
 /* This derives the current seed value.  If increment_j is set, it'll then */
 /* reset the object to the next j value */
 void hss_seed_derive( unsigned char *seed, struct seed_derive *derive,
                  bool increment_j ) {
-    unsigned char buffer[ PRG_MAX_LEN ];
-    memcpy( buffer + PRG_I, derive->I, I_LEN );
-    put_bigendian( buffer + PRG_Q, derive->q, 4 );
-    put_bigendian( buffer + PRG_J, derive->j, 2 );
-    buffer[PRG_FF] = 0xff;
-    memcpy( buffer + PRG_SEED, derive->master_seed, SEED_LEN );
+    hss_hash_block( seed, PRG_HASH(derive), &derive->prg );
 
-#if SECRET_METHOD == 2
-    int hash = derive->hash;    /* Our the parameter set's hash function */
-#else
-    int hash = HASH;            /* Use our standard one */
-#endif
+    if (increment_j) hss_seed_derive_set_j( derive, derive->j + 1 );
+}
 
-    hss_hash( seed, hash, buffer, PRG_LEN(SEED_LEN) );
+/* This does the same, but writes the seed directly into the hash block */
+/* (at the given offset); this is what the Winternitz chain code wants */
+void hss_seed_derive_to_block( struct hash_block *dest, size_t offset,
+                 struct seed_derive *derive, bool increment_j ) {
+    hss_hash_block_to_block( dest, offset, PRG_HASH(derive), &derive->prg );
 
-    hss_zeroize( buffer, PRG_LEN(SEED_LEN) );
+    if (increment_j) hss_seed_derive_set_j( derive, derive->j + 1 );
+}
 
-    if (increment_j) derive->j += 1;
+/* This derives a series of seeds at once; because the PRG hashes differ */
+/* only in j, we can compute them in parallel */
+void hss_seed_derive_lanes( struct hash_block_lanes *dest, size_t offset,
+                 struct seed_derive *derive, unsigned lanes ) {
+    struct hash_block_lanes prg;
+    unsigned lane;
+
+    hss_hash_block_lanes_broadcast( &prg, &derive->prg );
+    for (lane = 0; lane < lanes; lane++) {
+        unsigned j = derive->j + lane;
+        hss_hash_block_lanes_set_byte( &prg, lane, PRG_J, j >> 8 );
+        hss_hash_block_lanes_set_byte( &prg, lane, PRG_J+1, j );
+    }
+    hss_hash_block_lanes_to_block( dest, offset, PRG_HASH(derive),
+                                   &prg, lanes );
+    hss_seed_derive_set_j( derive, derive->j + lanes );
+
+    hss_zeroize( &prg, sizeof prg );
+}
+
+/* These derive the seeds for a series of q values; we use this when */
+/* computing several OTS public keys at once.  We keep a PRG block for each */
+/* q value; they differ only in q; from then on, we update only j */
+void hss_seed_derive_q_lanes_init( struct seed_derive_q_lanes *lanes,
+                      struct seed_derive *derive, unsigned count ) {
+    unsigned lane;
+    lanes->count = count;
+    hss_hash_block_lanes_broadcast( &lanes->prg, &derive->prg );
+    for (lane = 0; lane < count; lane++) {
+        unsigned char q_buffer[4];
+        put_bigendian( q_buffer, derive->q + lane, 4 );
+        hss_hash_block_lanes_set( &lanes->prg, lane, PRG_Q, q_buffer, 4 );
+    }
+}
+
+void hss_seed_derive_q_lanes( struct hash_block_lanes *dest, size_t offset,
+                      struct seed_derive_q_lanes *lanes,
+                      struct seed_derive *derive, bool increment_j ) {
+    hss_hash_block_lanes_set_byte_all( &lanes->prg, PRG_J, derive->j >> 8 );
+    hss_hash_block_lanes_set_byte_all( &lanes->prg, PRG_J+1, derive->j );
+    hss_hash_block_lanes_to_block( dest, offset, PRG_HASH(derive),
+                                   &lanes->prg, lanes->count );
+    if (increment_j) hss_seed_derive_set_j( derive, derive->j + 1 );
+}
+
+void hss_seed_derive_q_lanes_done( struct seed_derive_q_lanes *lanes ) {
+    /* The PRG hash blocks have the master seed in them */
+    hss_zeroize( &lanes->prg, sizeof lanes->prg );
 }
 
 /* This is called when we're done with a seed derivation object */
 void hss_seed_derive_done( struct seed_derive *derive ) {
-    /* No secrets here */
+    /* The PRG hash block has the master seed in it */
+    hss_zeroize( &derive->prg, sizeof derive->prg );
 }
 
 #elif SECRET_METHOD == 1
@@ -302,6 +370,59 @@ void hss_seed_derive( unsigned char *seed, struct seed_derive *derive,
     }
 }
 
+/* This does the same, but writes the seed directly into the hash block */
+void hss_seed_derive_to_block( struct hash_block *dest, size_t offset,
+                 struct seed_derive *derive, bool increment_j ) {
+    unsigned char seed[ SEED_LEN ];
+    hss_seed_derive( seed, derive, increment_j );
+    hss_hash_block_set( dest, offset, seed, SEED_LEN );
+    hss_zeroize( seed, SEED_LEN );
+}
+
+/* And the same, for multiple lanes at once.  We don't try to do anything */
+/* clever; most of the time, the seeds come straight out of j_seed */
+void hss_seed_derive_lanes( struct hash_block_lanes *dest, size_t offset,
+                 struct seed_derive *derive, unsigned lanes ) {
+    unsigned char seed[ SEED_LEN ];
+    unsigned lane;
+    for (lane = 0; lane < lanes; lane++) {
+        hss_seed_derive( seed, derive, true );
+        hss_hash_block_lanes_set( dest, lane, offset, seed, SEED_LEN );
+    }
+    hss_zeroize( seed, SEED_LEN );
+}
+
+/* And for a series of q values.  Moving between q values means */
+/* recomputing the path through the q-tree, so this isn't cheap; however */
+/* it's still small compared to the chains themselves */
+void hss_seed_derive_q_lanes_init( struct seed_derive_q_lanes *lanes,
+                      struct seed_derive *derive, unsigned count ) {
+    lanes->count = count;
+}
+
+void hss_seed_derive_q_lanes( struct hash_block_lanes *dest, size_t offset,
+                      struct seed_derive_q_lanes *lanes,
+                      struct seed_derive *derive, bool increment_j ) {
+    unsigned char seed[ SEED_LEN ];
+    merkle_index_t q = derive->q;
+    unsigned j = derive->j_value[ derive->j_levels - 1 ] &
+                                  (derive->j_mask - 1);
+    unsigned lane;
+    for (lane = 0; lane < lanes->count; lane++) {
+        hss_seed_derive_set_q( derive, q + lane );
+        hss_seed_derive_set_j( derive, j );
+        hss_seed_derive( seed, derive, false );
+        hss_hash_block_lanes_set( dest, lane, offset, seed, SEED_LEN );
+    }
+    hss_seed_derive_set_q( derive, q );
+    hss_seed_derive_set_j( derive, increment_j ? j+1 : j );
+    hss_zeroize( seed, SEED_LEN );
+}
+
+void hss_seed_derive_q_lanes_done( struct seed_derive_q_lanes *lanes ) {
+    /* Nothing to clean up */
+}
+
 /* This is called when we're done with a seed derivation object */
 /* This makes sure any secret values are zeroized */
 void hss_seed_derive_done( struct seed_derive *derive ) {
@@ -2,6 +2,7 @@
 #define HSS_DERIVE_H_
 
 #include "common_defs.h"
+#include "hash.h"
 
 #include "config.h"
 
@@ -19,6 +20,10 @@ struct seed_derive {
     unsigned hash;  /* Hash function to use */
     unsigned m;     /* Length of hash function */
 #endif
+#if SECRET_METHOD == 0 || SECRET_METHOD == 2
+    struct hash_block prg;  /* The PRG hash, with I, q, j and the seed */
+                            /* already in place.  Note: this is secret */
+#endif
 
 #if SECRET_METHOD == 1
     unsigned q_levels, j_levels;
@@ -67,6 +72,42 @@ void hss_seed_derive_set_j( struct seed_derive *derive, unsigned j );
 void hss_seed_derive( unsigned char *seed, struct seed_derive *derive,
                       bool increment_j );
 
+/* This does the same, but writes the seed into the hash block dest */
+/* (starting at offset), rather than to a byte buffer */
+void hss_seed_derive_to_block( struct hash_block *dest, size_t offset,
+                      struct seed_derive *derive, bool increment_j );
+
+/* This generates the seeds for the next 'lanes' j values (the current */
+/* j, j+1, ...), writing them into the first 'lanes' lanes of dest, */
+/* starting at offset; this leaves j set to the one after the last */
+void hss_seed_derive_lanes( struct hash_block_lanes *dest, size_t offset,
+                      struct seed_derive *derive, unsigned lanes );
+
+/*
+ * This is used to generate the seeds for a series of q values (the current
+ * q, q+1, ...) at once, one per lane.  We use this when we compute
+ * several OTS public keys at the same time.  Usage:
+ *   hss_seed_derive_q_lanes_init( &lanes, derive, count );
+ *   hss_seed_derive_q_lanes( dest, offset, &lanes, derive, true );
+ *      (as many times as needed; each time, it writes the seeds for the
+ *       current j value to the first count lanes of dest, starting at
+ *       offset; and if increment_j is set, it sets up for the next j)
+ *   hss_seed_derive_q_lanes_done( &lanes );
+ */
+struct seed_derive_q_lanes {
+    unsigned count;
+#if SECRET_METHOD == 0 || SECRET_METHOD == 2
+    struct hash_block_lanes prg;  /* The PRG hashes for each q value */
+                                  /* Note: this is secret */
+#endif
+};
+void hss_seed_derive_q_lanes_init( struct seed_derive_q_lanes *lanes,
+                      struct seed_derive *derive, unsigned count );
+void hss_seed_derive_q_lanes( struct hash_block_lanes *dest, size_t offset,
+                      struct seed_derive_q_lanes *lanes,
+                      struct seed_derive *derive, bool increment_j );
+void hss_seed_derive_q_lanes_done( struct seed_derive_q_lanes *lanes );
+
 /* This needs to be called when we done with a seed_derive */
 /* That structure contains keying data, this makes sure those are cleaned */
 void hss_seed_derive_done( struct seed_derive *derive );
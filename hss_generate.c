@@ -30,6 +30,7 @@
 #include "hash.h"
 #include "hss_thread.h"
 #include "hss_reserve.h"
+#include "hss_calibrate.h"
 #include "lm_ots_common.h"
 #include "endian.h"
 
@@ -45,6 +46,21 @@
     /* the work, and so we end up going not that much faster than single */
     /* threaded mode */
 
+#define WORK_ITEMS_PER_TRACK 4 /* We aim to split the work into about this */
+                         /* many work items for each thread; enough so */
+                         /* that the threads finish at about the same time */
+#define MIN_WORK_ITEM_COST 20000 /* We don't issue work items that we */
+                         /* expect to take less than this (in ns); the */
+                         /* overhead of issuing them would dominate */
+#define BACKGROUND_WORK_ITEM_COST 5000000 /* When we build subtrees in the */
+                         /* background, we don't issue work items that we */
+                         /* expect to take longer than this (in ns); a */
+                         /* foreground request that shares the threads may */
+                         /* need to wait for one to finish */
+
+#define MAX_ORDERS (MAX_HSS_LEVELS * MAX_SUBLEVELS * NUM_SUBTREE) /* The */
+                         /* most orders a working key can need */
+
 /*
  * This routine assumes that we have filled in the bottom node_count nodes of
  * the subtree; it tries to compute as many internal nodes as possible
@@ -173,15 +189,35 @@ struct init_order {
                                   /* threads do do anything */
                                   /* We may still need to build the */
                                   /* interiors of the subtrees, of course */
+    char background;              /* If set, this isn't needed for the */
+                                  /* first signature (it's a BUILDING or */
+                                  /* NEXT subtree), and so can be done in */
+                                  /* the background */
 #if DO_FLOATING_POINT
-    float cost;                   /* Approximate number of hash compression */
-                                  /* operations per node */
+    float cost;                   /* Estimated time (ns) to compute one */
+                                  /* node */
+    unsigned max_per_request;     /* The most nodes we ask for in a single */
+                                  /* work item */
     struct sub_order *sub;        /* If non-NULL, this gives details on how */
                                   /* we want to subdivide the order between */
                                   /* different threads */
 #endif
 };
 
+/*
+ * The state of a load whose BUILDING and NEXT subtrees are being built in
+ * the background.  We keep the orders here (rather than on our stack), as
+ * once the threads are done, we still need to combine the suborders and fill
+ * in the upper nodes of the subtrees
+ */
+struct background_load {
+    struct thread_collection *col;
+    enum hss_error_code got_error;
+    unsigned count_order;
+    struct init_order order[1];   /* We malloc enough space for */
+                                  /* count_order of these */
+};
+
 #if DO_FLOATING_POINT
     /* This comparison function sorts the most expensive orders first */
 static int compare_order_by_cost(const void *a, const void *b) {
@@ -226,27 +262,310 @@ static unsigned my_log2(float f) {
 }
 #endif
 
+#if DO_FLOATING_POINT
 /*
- * This is the point of this entire file.
- *
- * It fills in an already allocated working key, based on the private key
+ * This decides how we split the orders into work items; which ones we
+ * subdivide, and how many nodes we ask for at a time for the rest.
+ * If max_target is nonzero, we don't aim for work items more expensive
+ * than that
  */
-bool hss_generate_working_key(
+static void plan_orders(struct init_order *order, unsigned count_order,
+                        unsigned num_tracks, float max_target) {
+    /* Generate an estimate of the total cost */
+    float est_total = estimate_total_cost( order, count_order );
+
+    /*
+     * Estimate how much we should target each work item should take; if
+     * the most expensive work item takes longer than that, it becomes the
+     * critical path (the other threads will finish, and wait for it)
+     */
+    float est_max_per_work_item = est_total /
+                               (WORK_ITEMS_PER_TRACK * num_tracks);
+    if (max_target > 0 && est_max_per_work_item > max_target) {
+        est_max_per_work_item = max_target;
+    }
+    if (est_max_per_work_item < MIN_WORK_ITEM_COST) {
+        est_max_per_work_item = MIN_WORK_ITEM_COST;
+    }
+
+    /* We use this to decide the granularity of the requests we make; */
+    /* we make each one about as expensive as our target */
+    unsigned i;
+    for (i=0; i<count_order; i++) {
+        struct init_order *p_order = &order[i];
+        p_order->max_per_request = UINT_MAX;
+        if (num_tracks > 1 && p_order->cost > 0) {
+            float nodes = est_max_per_work_item / p_order->cost;
+            if (nodes < p_order->count_nodes) {
+                p_order->max_per_request = nodes;
+            }
+            if (p_order->max_per_request == 0) p_order->max_per_request = 1;
+        }
+    }
+
+    /* Scan through the items, and see which ones should be subdivided */
+    /* (if we have only one thread, there's no point) */
+    for (i=0; num_tracks > 1 && i<count_order; i++) {
+        struct init_order *p_order = &order[i];
+        if (p_order->cost <= est_max_per_work_item) {
+            break; /* Break because once we hit this point, the rest of the */
+                   /* items will be cheaper */
+        }
+
+            /* Try to subdivide each item into subdiv pieces */
+        unsigned subdiv = my_log2(p_order->cost / est_max_per_work_item);
+        struct subtree *subtree = p_order->subtree;
+            /* Make sure we don't try to subdivide lower than what the */
+            /* Merkle tree structure allows */
+        if (subdiv > subtree->levels_below) subdiv = subtree->levels_below;
+        if (subdiv == 0) continue;
+        merkle_index_t max_subdiv = (merkle_index_t)1 << subtree->levels_below;
+        if (subdiv > max_subdiv) subdiv = max_subdiv;
+        if (subdiv <= 1) continue;
+
+        const struct merkle_level *tree = p_order->tree;
+        size_t hash_len = tree->hash_size;
+        merkle_index_t count_nodes = p_order->count_nodes;
+        size_t total_hash = (hash_len * count_nodes) << subdiv;
+        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
+                                                     tree->subtree_size;
+        struct sub_order *sub = malloc( sizeof *sub + total_hash );
+        if (!sub) continue;  /* On malloc failure, don't bother trying */
+                             /* to subdivide */
+
+            /* Fill in the details of this suborder */
+        sub->level = subdiv;
+        sub->num_hashes = 1 << subdiv;
+        sub->node_num_first_target = 
+                (subtree->left_leaf >> subtree->levels_below) +
+                     ((merkle_index_t)1 << (h_subtree + subtree->level));
+        p_order->sub = sub;
+    }
+}
+#endif
+
+/*
+ * This issues the work items to generate the bottom nodes that the orders
+ * list
+ */
+static void issue_orders(struct thread_collection *col,
+                         struct init_order *order, unsigned count_order,
+                         enum hss_error_code *got_error) {
+    unsigned i;
+    for (i=0; i<count_order; i++) {
+        struct init_order *p_order = &order[i];
+        if (p_order->already_computed_lower) continue;  /* If it's already */
+                                                  /* done, we needn't bother */
+
+        const struct merkle_level *tree = p_order->tree;
+        struct subtree *subtree = p_order->subtree;
+        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
+                                                     tree->subtree_size;
+        merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
+        unsigned hash_size = tree->hash_size;
+#if DO_FLOATING_POINT
+        unsigned max_per_request = p_order->max_per_request;
+#else
+        unsigned max_per_request = UINT_MAX;
+#endif
+
+        /* If we're skipping a value, make sure we compute up to there */
+        merkle_index_t right_side = p_order->count_nodes;
+        if (p_order->prev_node && right_side > p_order->prev_index) {
+            right_side = p_order->prev_index;
+        }
+
+        merkle_index_t n;
+        struct intermed_tree_detail detail;
+
+        detail.seed = (p_order->next_tree ? tree->seed_next : tree->seed);
+        detail.lm_type = tree->lm_type;
+        detail.lm_ots_type = tree->lm_ots_type;
+        detail.h = tree->h;
+        detail.tree_height = tree->level;
+        detail.I = (p_order->next_tree ? tree->I_next : tree->I);
+        detail.got_error = got_error;
+
+#if DO_FLOATING_POINT
+        /* Check if we're actually doing a suborder */
+        struct sub_order *sub = p_order->sub;
+        if (sub) {
+            /* Issue all the orders separately */
+            unsigned hash_len = tree->hash_size;
+            for (n = 0; n < p_order->count_nodes; n++ ) {
+                if (n == right_side) continue;  /* Skip the omitted value */
+                unsigned char *dest = &sub->h[ n * sub->num_hashes * hash_len ];
+                merkle_index_t node_num = (sub->node_num_first_target+n) << sub->level;
+                int k;
+                for (k=0; k < sub->num_hashes; k++) {
+                    detail.dest = dest;
+                    dest += hash_len;
+                    detail.node_num = node_num;
+                    node_num++;
+                    detail.node_count = 1;
+
+                    hss_thread_issue_work(col, hss_gen_intermediate_tree,
+                                          &detail, sizeof detail );
+                }
+            }
+            continue;
+        }
+#endif
+        {
+            /* We're not doing a suborder; issue the request in as large of */
+            /* a chunk as we're allowed */
+            for (n = 0; n < p_order->count_nodes; ) {
+                merkle_index_t this_req = right_side - n;
+                if (this_req > max_per_request) this_req = max_per_request;
+                if (this_req == 0) {
+                    /* We hit the value we're skipping; skip it, and go on to */
+                    /* the real right side */
+                    n++;
+                    right_side = p_order->count_nodes;
+                    continue;
+                }
+
+                /* Issue a work order for the next this_req elements */
+                detail.dest = &subtree->nodes[ hash_size * (lower_index + n)];
+                detail.node_num = (subtree->left_leaf >> subtree->levels_below) +
+                     n + ((merkle_index_t)1 << (h_subtree + subtree->level));
+                detail.node_count = this_req;
+
+                hss_thread_issue_work(col, hss_gen_intermediate_tree,
+                                      &detail, sizeof detail );
+
+                n += this_req;
+             }
+         }
+    }
+}
+
+/*
+ * This frees the suborders (if we're giving up after an error)
+ */
+static void free_suborders(struct init_order *order, unsigned count_order) {
+#if DO_FLOATING_POINT
+    unsigned i;
+    for (i=0; i<count_order; i++) {
+        free( order[i].sub );
+        order[i].sub = 0;
+    }
+#endif
+}
+
+/*
+ * Once the work items for the orders have all completed, this finishes off
+ * the subtrees
+ */
+static void finish_orders(struct init_order *order, unsigned count_order) {
+    struct init_order *p_order;
+    unsigned i;
+#if DO_FLOATING_POINT
+    /*
+     * Now, if we did have suborders, recombine them into what was actually
+     * wanted
+     */
+    for (i=0; i<count_order; i++) {
+        p_order = &order[i];
+        struct sub_order *sub = p_order->sub;
+        if (!sub) continue;   /* This order wasn't subdivided */
+
+        const struct merkle_level *tree = p_order->tree;
+        const unsigned char *I = (p_order->next_tree ? tree->I_next : tree->I);
+        struct subtree *subtree = p_order->subtree;
+        unsigned hash_size = tree->hash_size;
+        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
+                                                     tree->subtree_size;
+        merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
+
+        int n;
+        for (n = 0; n < p_order->count_nodes; n++ ) {
+            if (p_order->prev_node && n == p_order->prev_index) continue;
+
+            hash_subtree( &subtree->nodes[ hash_size * (lower_index + n)],
+                          &sub->h[ hash_size * sub->num_hashes * n ],
+                          sub->level, sub->node_num_first_target + n,
+                          hash_size, tree->h, I);
+        }
+
+        free( sub );
+        p_order->sub = 0;
+    }
+#endif
+
+    /*
+     * Now we have generated the lower level nodes of the subtrees; go back and
+     * fill in the higher level nodes.
+     * We do this in backwards order, so that we do the lower levels of the trees
+     * first (as lower levels are cheaper, they'll be listed later in the
+     * array; that's how we sorted, them, remember?).
+     * That means if any subtrees inherit the root values of lower trees,
+     * we compute those root values first
+     */
+    for (i=count_order; i>0; i--) {
+        p_order = &order[i-1];
+        const struct merkle_level *tree = p_order->tree;
+        const unsigned char *I = (p_order->next_tree ? tree->I_next : tree->I);
+        struct subtree *subtree = p_order->subtree;
+
+        if (p_order->prev_node) {
+            /* This subtree did have a bottom node that was the root node */
+            /* of a lower subtree; fill it in */
+            unsigned hash_size = tree->hash_size;
+            unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
+                                                         tree->subtree_size;
+            merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
+
+                /* Where in the subtree we place the previous root */
+            unsigned set_index = (lower_index + p_order->prev_index) * hash_size; 
+            memcpy( &subtree->nodes[ set_index ], p_order->prev_node, hash_size );
+        }
+
+        /* Now, fill in all the internal nodes of the subtree */
+        fill_subtree(tree, subtree, p_order->count_nodes, I);
+    }
+}
+
+/*
+ * This checks if the background part of the last load has completed (or,
+ * if wait is set, waits for it); if it has, it finishes the subtrees off
+ */
+bool hss_wait_background_load(struct hss_working_key *w, bool wait) {
+    struct background_load *load = w->pending_load;
+    if (!load) return true;     /* Nothing in progress */
+
+    if (!wait && !hss_thread_poll( load->col )) {
+        return false;           /* Still working on it */
+    }
+
+    hss_thread_done( load->col );
+    if (load->got_error != hss_error_none) {
+            /* One of the worker threads detected an error; the working */
+            /* key is no longer usable */
+        free_suborders( load->order, load->count_order );
+        w->status = load->got_error;
+    } else {
+        finish_orders( load->order, load->count_order );
+    }
+    free( load );
+    w->pending_load = NULL;
+    return true;
+}
+
+/*
+ * This reads in the private key, and sets up the working key to match it
+ * (the current count and the seed, I values of each level).  It then lists
+ * the orders to build the bottom nodes of the subtrees (as much of them as
+ * we need, given the current count); order has room for MAX_ORDERS entries
+ */
+static bool list_orders(
     bool (*read_private_key)(unsigned char *private_key,
             size_t len_private_key, void *context),
         void *context,
-    const unsigned char *aux_data, size_t len_aux_data,  /* Optional */
+    const unsigned char *aux_data, size_t len_aux_data,
     struct hss_working_key *w,
+    struct init_order *order, int *p_count_order,
     struct hss_extra_info *info) {
-    struct hss_extra_info temp_info = { 0 };
-    if (!info) info = &temp_info;
-
-    if (!w) {
-        info->error_code = hss_error_got_null;
-        return false;
-    }
-    w->status = hss_error_key_uninitialized; /* In case we detect an */
-                                             /* error midway */
 
     if (!read_private_key && !context) {
         info->error_code = hss_error_no_private_buffer;
@@ -254,7 +573,7 @@ bool hss_generate_working_key(
     }
 
     /* Read the private key */
-    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    unsigned char private_key[ PRIVATE_SUBKEY_LEN ];
     if (read_private_key) {
         if (!read_private_key( private_key, PRIVATE_KEY_LEN, context)) {
             info->error_code = hss_error_private_key_read_failed;
@@ -264,6 +583,21 @@ bool hss_generate_working_key(
         memcpy( private_key, context, PRIVATE_KEY_LEN );
     }
 
+    /* If it's a sub-key, it's longer; we need the rest of it */
+    bool subkey = w->levels < MAX_HSS_LEVELS &&
+           private_key[PRIVATE_KEY_PARAM_SET + w->levels] == PARM_SET_SUBKEY;
+    if (subkey) {
+        if (read_private_key) {
+            if (!read_private_key( private_key, PRIVATE_SUBKEY_LEN,
+                                   context)) {
+                info->error_code = hss_error_private_key_read_failed;
+                goto failed;
+            }
+        } else {
+            memcpy( private_key, context, PRIVATE_SUBKEY_LEN );
+        }
+    }
+
     /*
      * Make sure that the private key and the allocated working key are
      * compatible; that the working_key was initialized with the same
@@ -289,6 +623,7 @@ bool hss_generate_working_key(
             info->error_code = hss_error_internal;
             goto failed;
         }
+        if (subkey) compressed[w->levels] = PARM_SET_SUBKEY;
         if (0 != memcmp( private_key + PRIVATE_KEY_PARAM_SET, compressed,
                       PRIVATE_KEY_PARAM_SET_LEN )) {
                /* The working set was initiallized with a different parmset */
@@ -297,6 +632,17 @@ bool hss_generate_working_key(
         }
     }
 
+    /* Any checkpoints we have from a previous key are now useless */
+    hss_reset_checkpoints( w->tree[w->levels-1] );
+
+    /* A sub-key can go only so far */
+    w->max_count = w->tree_max_count;
+    if (subkey) {
+        sequence_t subkey_max = get_bigendian(
+                 private_key + PRIVATE_SUBKEY_MAX, PRIVATE_SUBKEY_MAX_LEN );
+        if (subkey_max < w->max_count) w->max_count = subkey_max;
+    }
+
     sequence_t current_count = get_bigendian(
                  private_key + PRIVATE_KEY_INDEX, PRIVATE_KEY_INDEX_LEN );
     if (current_count > w->max_count) {
@@ -369,9 +715,6 @@ bool hss_generate_working_key(
      * the nodes on the bottom levels of the subtrees that need to be
      * initialized
      */
-        /* There are enough structures in this array to handle the maximum */
-        /* number of orders we'll ever see */
-    struct init_order order[MAX_HSS_LEVELS * MAX_SUBLEVELS * NUM_SUBTREE];
     struct init_order *p_order = order;
     int count_order = 0;
 
@@ -443,6 +786,8 @@ bool hss_generate_working_key(
             p_order->prev_index = (tree->current_index >> active->levels_below) & (num_bottom_nodes-1);
 
             p_order->already_computed_lower = already_computed_lower;
+            p_order->background = 0;   /* We need this for the first */
+                                       /* signature */
             p_order++; count_order++;
 
             /* For the next subtree, here's where our root will be */
@@ -494,6 +839,7 @@ bool hss_generate_working_key(
                 p_order->prev_index = 0;
 
                 p_order->already_computed_lower = already_computed_lower;
+                p_order->background = 1;
                 p_order++; count_order++;
             } else if (j > 0) {
                 tree->subtree[j][BUILDING_TREE]->current_index = 0;
@@ -557,6 +903,7 @@ bool hss_generate_working_key(
                     p_order->prev_index = 0;
 
                     p_order->already_computed_lower = 0;
+                    p_order->background = 1;
                     p_order++; count_order++;
                 }
                 next_prev_node = next_next_node;
@@ -566,9 +913,32 @@ bool hss_generate_working_key(
          }
     }
 
+    *p_count_order = count_order;
+    hss_zeroize( private_key, sizeof private_key );
+    return true;
+
+failed:
+    hss_zeroize( private_key, sizeof private_key );
+    return false;
+}
+
+/*
+ * This puts the orders into the order we'll issue them.  If calibrated is
+ * set, the cost estimates are based on how long computing a leaf and an
+ * internal node actually takes on this machine (hss_get_calibrated_costs
+ * measures that the first time we see a parameter set); we do that if we
+ * have several threads.  Otherwise, how we divide up the work doesn't matter;
+ * all we need is the order, so we count hashes instead
+ */
+static void sort_orders(struct init_order *order, int count_order,
+                        bool calibrated) {
 #if DO_FLOATING_POINT
-    /* Fill in the cost estimates */
+    /*
+     * Fill in the cost estimates
+     */
+    int i;
     for (i=0; i<count_order; i++) {
+        struct init_order *p_order = &order[i];
         p_order = &order[i];
 
         /*
@@ -581,23 +951,30 @@ bool hss_generate_working_key(
             p_order->cost = 0;
             continue;
         }
-        unsigned winternitz = 8;
-        unsigned p = 128;
-        (void)lm_ots_look_up_parameter_set(p_order->tree->lm_ots_type, 0, 0,
-                                           &winternitz, &p, 0);
+        const struct merkle_level *tree = p_order->tree;
+        unsigned long leaf_cost, node_cost;
+        if (calibrated) {
+            hss_get_calibrated_costs( tree->lm_type, tree->lm_ots_type,
+                                      &leaf_cost, &node_cost );
+        } else {
+            unsigned winternitz = 8;
+            unsigned p = 128;
+            (void)lm_ots_look_up_parameter_set(tree->lm_ots_type, 0, 0,
+                                               &winternitz, &p, 0);
+            leaf_cost = (unsigned long)p << winternitz;
+            node_cost = 1;
+        }
 
         struct subtree *subtree = p_order->subtree;
         unsigned levels_below = subtree->levels_below;
 
         /*
-         * Estimate the number of hashes that we'll need to compute to compute
-         * one node; this is the number of leaf nodes times the number of
-         * hashes used during a winternitz computation.  This ignores a few
-         * other hashes, but gets the vast bulk of them
+         * The cost of one node is the cost of the leaves below it, and of
+         * the internal nodes that combine them
          */
-        p_order->cost = (float)((merkle_index_t)1<<levels_below) *
-                        (float)p *
-                        (float)(1<<winternitz);
+        float leaves = (float)((merkle_index_t)1<<levels_below);
+        p_order->cost = leaves * (float)leaf_cost +
+                        (leaves - 1) * (float)node_cost;
     }
 
     /*
@@ -619,287 +996,190 @@ bool hss_generate_working_key(
      */
     qsort( order, count_order, sizeof *order, compare_order_by_subtree_level );
 #endif
+}
 
-#if DO_FLOATING_POINT
-    /* Generate an estimate of the total cost */
-    float est_total = estimate_total_cost( order, count_order );
+/*
+ * Once the subtrees are built, this finishes off the working key
+ */
+static bool complete_working_key(struct hss_working_key *w,
+                                 struct hss_extra_info *info) {
+    /*
+     * Now, create all the signed public keys
+     * Again, we could parallelize this; it's also fast enough not to be worth
+     * the complexity
+     */
+    int i;
+    for (i = 1; i < w->levels; i++) {
+        if (!hss_create_signed_public_key( w->signed_pk[i], w->siglen[i-1],
+                                       w->tree[i], w->tree[i-1], w )) {
+            info->error_code = hss_error_internal; /* Really shouldn't */
+                                                   /* happen */
+            return false;
+        }
+    }
 
-    /* Estimate how much we should target each work item should take */
-    unsigned num_tracks = 4 * hss_thread_num_tracks(info->num_threads);
-    if (num_tracks == 0) num_tracks = 4;   /* Divide by 0; just say no */
-    float est_max_per_work_item = est_total / num_tracks;
+    /*
+     * And, we make each level as not needing an update from below (as we've
+     * initialized them as already having the first update)
+     */
+    for (i = 0; i < w->levels - 1; i++) {
+        w->tree[i]->update_count = UPDATE_DONE;
+    }
 
-    /* Scan through the items, and see which ones should be subdivided */
-    for (i=0; i<count_order; i++) {
-        p_order = &order[i];
-        if (p_order->cost <= est_max_per_work_item) {
-            break; /* Break because once we hit this point, the rest of the */
-                   /* items will be cheaper */
-        }
+    w->status = hss_error_none; /* This working key has been officially */
+                                /* initialized, and now can be used */
+    return true;
+}
 
-            /* Try to subdivide each item into subdiv pieces */
-        unsigned subdiv = my_log2(p_order->cost / est_max_per_work_item);
-        struct subtree *subtree = p_order->subtree;
-            /* Make sure we don't try to subdivide lower than what the */
-            /* Merkle tree structure allows */
-        if (subdiv > subtree->levels_below) subdiv = subtree->levels_below;
-        if (subdiv == 0) continue;
-        merkle_index_t max_subdiv = (merkle_index_t)1 << subtree->levels_below;
-        if (subdiv > max_subdiv) subdiv = max_subdiv;
-        if (subdiv <= 1) continue;
+/*
+ * This gets the working key ready to be loaded; it makes sure that
+ * nothing from a previous load is still going on
+ */
+static void reset_working_key(struct hss_working_key *w) {
+    /* If we're still updating or building the subtrees from the previous */
+    /* load, wait for that to finish (as we're about to overwrite them) */
+    hss_wait_pending_updates( w );
+    w->maintenance_error = hss_error_none;
+    w->pending_advance = false;
+    (void)hss_wait_background_load( w, true );
+    w->deferred_updates = 0;
+    hss_generate_working_key_cancel( w );
+    hss_wait_async_reserve( w );  /* That reservation was for the old key */
+    unsigned i;
+    for (i=0; i<MAX_HSS_LEVELS; i++) {
+        w->next_signed_pk_q[i] = NO_SIGNED_PK; /* Those are for the old */
+                                               /* NEXT trees */
+    }
+    w->status = hss_error_key_uninitialized; /* In case we detect an */
+                                             /* error midway */
+}
 
-        const struct merkle_level *tree = p_order->tree;
-        size_t hash_len = tree->hash_size;
-        merkle_index_t count_nodes = p_order->count_nodes;
-        size_t total_hash = (hash_len * count_nodes) << subdiv;
-        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
-                                                     tree->subtree_size;
-        struct sub_order *sub = malloc( sizeof *sub + total_hash );
-        if (!sub) continue;  /* On malloc failure, don't bother trying */
-                             /* to subdivide */
+/*
+ * This is the point of this entire file.
+ *
+ * It fills in an already allocated working key, based on the private key
+ */
+bool hss_generate_working_key(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    const unsigned char *aux_data, size_t len_aux_data,  /* Optional */
+    struct hss_working_key *w,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
 
-            /* Fill in the details of this suborder */
-        sub->level = subdiv;
-        sub->num_hashes = 1 << subdiv;
-        sub->node_num_first_target = 
-                (subtree->left_leaf >> subtree->levels_below) +
-                     ((merkle_index_t)1 << (h_subtree + subtree->level));
-        p_order->sub = sub;
+    if (!w) {
+        info->error_code = hss_error_got_null;
+        return false;
     }
-#endif
+    reset_working_key( w );
 
-    /* Now, generate all the nodes we've listed in parallel */
-    struct thread_collection *col = hss_thread_init(info->num_threads);
-    enum hss_error_code got_error = hss_error_none;
+        /* There are enough structures in this array to handle the maximum */
+        /* number of orders we'll ever see */
+    struct init_order order[MAX_ORDERS];
+    int count_order;
+    if (!list_orders( read_private_key, context, aux_data, len_aux_data,
+                      w, order, &count_order, info )) {
+        return false;
+    }
 
-       /* We use this to decide the granularity of the requests we make */
-#if DO_FLOATING_POINT
-    unsigned core_target = 5 * hss_thread_num_tracks(info->num_threads);
-    float prev_cost = 0;
-#endif
+    unsigned num_tracks = hss_thread_pool_num_tracks(info->thread_pool,
+                                                     info->num_threads);
+    if (num_tracks == 0) num_tracks = 1;   /* Divide by 0; just say no */
+    sort_orders( order, count_order, num_tracks > 1 );
 
-    for (i=0; i<count_order; i++) {
-        p_order = &order[i];
-        if (p_order->already_computed_lower) continue;  /* If it's already */
-                                                  /* done, we needn't bother */
-            /* If this work order is cheaper than what we've issued, allow */
-            /* for a greater amount of consolidation */
-#if DO_FLOATING_POINT
-        if (prev_cost > 0) {
-            if (p_order->cost <= 2 * prev_cost) {
-                /* The cost per node has decreased by a factor of 2 (at */
-                /* least); allow a single core to do more of the work */
-                float ratio = prev_cost / p_order->cost;
-                if (ratio > 1000) {
-                    core_target = 1;
+    /*
+     * If we've been asked to, we build only what we need for the first
+     * signature (the ACTIVE subtrees) now; the BUILDING and NEXT subtrees
+     * are built in the background (and hss_generate_signature waits for them
+     * only if it gets to the point where it needs them).  If we don't have
+     * threads to do that, we just do everything now
+     */
+    struct background_load *load = 0;
+    int i;
+    if (info->background_load) {
+        int count_background = 0;
+        for (i=0; i<count_order; i++) {
+            if (order[i].background) count_background++;
+        }
+        struct thread_collection *bg_col = 0;
+        if (count_background > 0) {
+            bg_col = hss_thread_init_background( info->thread_pool,
+                                                 info->num_threads );
+        }
+        if (bg_col) {
+            load = malloc( sizeof *load +
+                           (count_background - 1) * sizeof *order );
+            if (!load) hss_thread_done( bg_col ); /* On malloc failure, */
+                                     /* just do everything now */
+        }
+        if (load) {
+            /* Move the background orders over (keeping them in the same */
+            /* relative order) */
+            int fg = 0, bg = 0;
+            for (i=0; i<count_order; i++) {
+                if (order[i].background) {
+                    load->order[bg++] = order[i];
                 } else {
-                    core_target = core_target / ratio;
-                    if (core_target == 0) core_target = 1;
+                    order[fg++] = order[i];
                 }
-                prev_cost = p_order->cost;
             }
-        } else {
-            prev_cost = p_order->cost;
-        }
-#endif
-
-        const struct merkle_level *tree = p_order->tree;
-        struct subtree *subtree = p_order->subtree;
-        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
-                                                     tree->subtree_size;
-        merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
-        unsigned hash_size = tree->hash_size;
-#if DO_FLOATING_POINT
-        unsigned max_per_request = p_order->count_nodes / core_target;
-        if (max_per_request == 0) max_per_request = 1;
-#else
-        unsigned max_per_request = UINT_MAX;
-#endif
-
-        /* If we're skipping a value, make sure we compute up to there */
-        merkle_index_t right_side = p_order->count_nodes;
-        if (p_order->prev_node && right_side > p_order->prev_index) {
-            right_side = p_order->prev_index;
+            count_order = fg;
+            load->col = bg_col;
+            load->got_error = hss_error_none;
+            load->count_order = count_background;
         }
-
-        merkle_index_t n;
-        struct intermed_tree_detail detail;
-
-        detail.seed = (p_order->next_tree ? tree->seed_next : tree->seed);
-        detail.lm_type = tree->lm_type;
-        detail.lm_ots_type = tree->lm_ots_type;
-        detail.h = tree->h;
-        detail.tree_height = tree->level;
-        detail.I = (p_order->next_tree ? tree->I_next : tree->I);
-        detail.got_error = &got_error;
+    }
 
 #if DO_FLOATING_POINT
-        /* Check if we're actually doing a suborder */
-        struct sub_order *sub = p_order->sub;
-        if (sub) {
-            /* Issue all the orders separately */
-            unsigned hash_len = tree->hash_size;
-            for (n = 0; n < p_order->count_nodes; n++ ) {
-                if (n == right_side) continue;  /* Skip the omitted value */
-                unsigned char *dest = &sub->h[ n * sub->num_hashes * hash_len ];
-                merkle_index_t node_num = (sub->node_num_first_target+n) << sub->level;
-                int k;
-                for (k=0; k < sub->num_hashes; k++) {
-                    detail.dest = dest;
-                    dest += hash_len;
-                    detail.node_num = node_num;
-                    node_num++;
-                    detail.node_count = 1;
-
-                    hss_thread_issue_work(col, hss_gen_intermediate_tree,
-                                          &detail, sizeof detail );
-                }
-            }
-            continue;
-        }
+    /* Decide how to split the orders into work items */
+    plan_orders( order, count_order, num_tracks, 0 );
+    if (load) {
+        plan_orders( load->order, load->count_order, num_tracks,
+                     BACKGROUND_WORK_ITEM_COST );
+    }
 #endif
-        {
-            /* We're not doing a suborder; issue the request in as large of */
-            /* a chunk as we're allowed */
-            for (n = 0; n < p_order->count_nodes; ) {
-                merkle_index_t this_req = right_side - n;
-                if (this_req > max_per_request) this_req = max_per_request;
-                if (this_req == 0) {
-                    /* We hit the value we're skipping; skip it, and go on to */
-                    /* the real right side */
-                    n++;
-                    right_side = p_order->count_nodes;
-                    continue;
-                }
-
-                /* Issue a work order for the next this_req elements */
-                detail.dest = &subtree->nodes[ hash_size * (lower_index + n)];
-                detail.node_num = (subtree->left_leaf >> subtree->levels_below) +
-                     n + ((merkle_index_t)1 << (h_subtree + subtree->level));
-                detail.node_count = this_req;
 
-                hss_thread_issue_work(col, hss_gen_intermediate_tree,
-                                      &detail, sizeof detail );
+    /* Now, generate all the nodes we've listed in parallel */
+    struct thread_collection *col = hss_thread_init_pool(info->thread_pool,
+                                                         info->num_threads);
+    enum hss_error_code got_error = hss_error_none;
 
-                n += this_req;
-             }
-         }
-    }
+    issue_orders( col, order, count_order, &got_error );
 
     /* We've issued all the order; now wait until all the work is done */
     hss_thread_done(col);
     if (got_error != hss_error_none) {
             /* One of the worker threads detected an error */
-#if DO_FLOATING_POINT
             /* Don't leak suborders on an intermediate error */
-        for (i=0; i<count_order; i++) {
-            free( order[i].sub );
+        free_suborders( order, count_order );
+        if (load) {
+            hss_thread_done( load->col );
+            free_suborders( load->order, load->count_order );
+            free( load );
         }
-#endif
         info->error_code = got_error;
-        goto failed;
+        return false;
     }
 
-#if DO_FLOATING_POINT
     /*
-     * Now, if we did have suborders, recombine them into what was actually
-     * wanted
+     * Now that the threads are free, start them on the background orders;
+     * from here on, hss_wait_background_load is responsible for them
      */
-    for (i=0; i<count_order; i++) {
-        p_order = &order[i];
-        struct sub_order *sub = p_order->sub;
-        if (!sub) continue;   /* This order wasn't subdivided */
-
-        const struct merkle_level *tree = p_order->tree;
-        const unsigned char *I = (p_order->next_tree ? tree->I_next : tree->I);
-        struct subtree *subtree = p_order->subtree;
-        unsigned hash_size = tree->hash_size;
-        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
-                                                     tree->subtree_size;
-        merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
-
-        int n;
-        for (n = 0; n < p_order->count_nodes; n++ ) {
-            if (p_order->prev_node && n == p_order->prev_index) continue;
-
-            hash_subtree( &subtree->nodes[ hash_size * (lower_index + n)],
-                          &sub->h[ hash_size * sub->num_hashes * n ],
-                          sub->level, sub->node_num_first_target + n,
-                          hash_size, tree->h, I);
-        }
-
-        free( sub );
-        p_order->sub = 0;
+    if (load) {
+        issue_orders( load->col, load->order, load->count_order,
+                      &load->got_error );
+        w->pending_load = load;
     }
-#endif
-
-    /*
-     * Now we have generated the lower level nodes of the subtrees; go back and
-     * fill in the higher level nodes.
-     * We do this in backwards order, so that we do the lower levels of the trees
-     * first (as lower levels are cheaper, they'll be listed later in the
-     * array; that's how we sorted, them, remember?).
-     * That means if any subtrees inherit the root values of lower trees,
-     * we compute those root values first
-     */
-    for (i=count_order; i>0; i--) {
-        p_order = &order[i-1];
-        const struct merkle_level *tree = p_order->tree;
-        const unsigned char *I = (p_order->next_tree ? tree->I_next : tree->I);
-        struct subtree *subtree = p_order->subtree;
 
-        if (p_order->prev_node) {
-            /* This subtree did have a bottom node that was the root node */
-            /* of a lower subtree; fill it in */
-            unsigned hash_size = tree->hash_size;
-            unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
-                                                         tree->subtree_size;
-            merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
-
-                /* Where in the subtree we place the previous root */
-            unsigned set_index = (lower_index + p_order->prev_index) * hash_size; 
-            memcpy( &subtree->nodes[ set_index ], p_order->prev_node, hash_size );
-        }
-
-        /* Now, fill in all the internal nodes of the subtree */
-        fill_subtree(tree, subtree, p_order->count_nodes, I);
-    }
+    finish_orders( order, count_order );
 
     /*
      * Hey; we've initialized all the subtrees (at least, as far as what
      * they'd be expected to be given the current count); hurray!
      */
-
-    /*
-     * Now, create all the signed public keys
-     * Again, we could parallelize this; it's also fast enough not to be worth
-     * the complexity
-     */
-    for (i = 1; i < w->levels; i++) {
-        if (!hss_create_signed_public_key( w->signed_pk[i], w->siglen[i-1],
-                                       w->tree[i], w->tree[i-1], w )) {
-            info->error_code = hss_error_internal; /* Really shouldn't */
-                                                   /* happen */
-            goto failed;
-        }
-    }
-    hss_zeroize( private_key, sizeof private_key );
-
-    /*
-     * And, we make each level as not needing an update from below (as we've
-     * initialized them as already having the first update)
-     */
-    for (i = 0; i < w->levels - 1; i++) {
-        w->tree[i]->update_count = UPDATE_DONE;
-    }
-
-    w->status = hss_error_none; /* This working key has been officially */
-                                /* initialized, and now can be used */
-    return true;
-
-failed:
-    hss_zeroize( private_key, sizeof private_key );
-    return false;
+    return complete_working_key( w, info );
 }
 
 #if DO_FLOATING_POINT
@@ -907,10 +1187,11 @@ failed:
  * This goes through the order, and estimates the total amount
  * This assumes that the highest cost element is listed first
  *
- * It returns the estimated number of hash compression operations total
+ * It returns the estimated total cost (in the same units as the cost of
+ * each order)
  *
- * We use floating point because the number of hash compression functions can
- * vary a *lot*; floating point has great dynamic range. 
+ * We use floating point because the costs can vary a *lot*; floating point
+ * has great dynamic range. 
  */
 static float estimate_total_cost( struct init_order *order,
                                   unsigned count_order ) {
@@ -928,3 +1209,280 @@ static float estimate_total_cost( struct init_order *order,
     return total_cost;
 }
 #endif
+
+/*
+ * Step-wise loading.  This is for applications that can't afford to have
+ * hss_generate_working_key take over the thread for the entire time (for
+ * example, an event loop); instead, they do the work a slice at a time.
+ *
+ * We go through the same orders hss_generate_working_key would (in the same
+ * order), except that we do them ourselves, rather than issuing them to the
+ * threads.  We measure the work in hash compression operations; to keep
+ * each slice about as large as the application asks for, we compute an
+ * expensive node as 2**subdiv pieces, which we combine as we go
+ */
+#define STEPWISE_PIECE_HASHES 16384  /* We try not to do more than this */
+                         /* many hashes as a single piece of work */
+
+struct stepwise_load {
+    int count_order;
+    int cur_order;               /* The order we're working on */
+    merkle_index_t cur_node;     /* The bottom node within that order */
+    merkle_index_t cur_piece;    /* If we're computing that node in pieces, */
+                                 /* the next piece */
+    unsigned long long hashes_done;  /* Our progress so far */
+    unsigned long long hashes_total; /* What we'll have done at the end */
+    unsigned char stack[ MAX_MERKLE_HEIGHT * MAX_HASH ]; /* The pieces (and */
+                                 /* combinations of pieces) that we haven't */
+                                 /* been able to combine yet */
+    struct init_order order[ MAX_ORDERS ];
+};
+
+/*
+ * This gives the number of hashes we count for computing a node with
+ * 2**height leaves below it
+ */
+static unsigned long long node_hashes(const struct merkle_level *tree,
+                                      unsigned height) {
+    unsigned winternitz = 8;
+    unsigned p = 128;
+    (void)lm_ots_look_up_parameter_set(tree->lm_ots_type, 0, 0,
+                                       &winternitz, &p, 0);
+    unsigned long long leaves = (unsigned long long)1 << height;
+    return leaves * ((unsigned long long)p << winternitz) + (leaves - 1);
+}
+
+/*
+ * This gives the number of levels below the bottom nodes of this order
+ * that we split each node into
+ */
+static unsigned step_subdiv(const struct init_order *p_order) {
+    unsigned levels_below = p_order->subtree->levels_below;
+    unsigned subdiv;
+    for (subdiv = 0; subdiv < levels_below; subdiv++) {
+        if (node_hashes( p_order->tree, levels_below - subdiv ) <=
+                                                     STEPWISE_PIECE_HASHES) {
+            break;
+        }
+    }
+    return subdiv;
+}
+
+bool hss_generate_working_key_init(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    const unsigned char *aux_data, size_t len_aux_data,  /* Optional */
+    struct hss_working_key *w,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+
+    if (!w) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+    reset_working_key( w );
+
+    struct stepwise_load *load = malloc( sizeof *load );
+    if (!load) {
+        info->error_code = hss_error_out_of_memory;
+        return false;
+    }
+    if (!list_orders( read_private_key, context, aux_data, len_aux_data,
+                      w, load->order, &load->count_order, info )) {
+        free( load );
+        return false;
+    }
+    sort_orders( load->order, load->count_order, false );
+
+    /* Figure out how much work we have ahead of us */
+    load->hashes_total = 0;
+    int i;
+    for (i=0; i<load->count_order; i++) {
+        struct init_order *p_order = &load->order[i];
+#if DO_FLOATING_POINT
+        p_order->sub = 0;     /* We don't use suborders here */
+#endif
+        if (p_order->already_computed_lower) continue;
+        merkle_index_t count = p_order->count_nodes;
+        if (p_order->prev_node && p_order->prev_index < count) count--;
+        load->hashes_total += count *
+              node_hashes( p_order->tree, p_order->subtree->levels_below );
+    }
+    load->cur_order = 0;
+    load->cur_node = 0;
+    load->cur_piece = 0;
+    load->hashes_done = 0;
+
+    w->stepwise_load = load;
+    return true;
+}
+
+bool hss_generate_working_key_step(
+    struct hss_working_key *w,
+    unsigned long max_hashes,
+    bool *done,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+    if (done) *done = false;
+
+    if (!w) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+    struct stepwise_load *load = w->stepwise_load;
+    if (!load) {
+        if (w->status == hss_error_none) {
+            /* We've already finished */
+            if (done) *done = true;
+            return true;
+        }
+        info->error_code = w->status;
+        return false;
+    }
+
+    enum hss_error_code got_error = hss_error_none;
+    unsigned long long limit = load->hashes_done + max_hashes;
+    bool did_something = false;
+    while (load->cur_order < load->count_order) {
+        /* Always do at least one piece; otherwise, stop once we've */
+        /* done what we were asked to */
+        if (did_something && load->hashes_done >= limit) break;
+
+        struct init_order *p_order = &load->order[ load->cur_order ];
+        if (p_order->already_computed_lower ||
+                             load->cur_node >= p_order->count_nodes) {
+            /* Nothing (more) to do for this order; on to the next */
+            load->cur_order++;
+            load->cur_node = 0;
+            load->cur_piece = 0;
+            continue;
+        }
+        if (p_order->prev_node && load->cur_node == p_order->prev_index) {
+            /* We'll fill this one in from the subtree below */
+            load->cur_node++;
+            continue;
+        }
+
+        const struct merkle_level *tree = p_order->tree;
+        struct subtree *subtree = p_order->subtree;
+        unsigned h_subtree = (subtree->level == 0) ? tree->top_subtree_size :
+                                                     tree->subtree_size;
+        merkle_index_t lower_index = ((merkle_index_t)1 << h_subtree) - 1;
+        unsigned hash_size = tree->hash_size;
+        const unsigned char *I = (p_order->next_tree ? tree->I_next : tree->I);
+        merkle_index_t node_num = (subtree->left_leaf >> subtree->levels_below) +
+             load->cur_node + ((merkle_index_t)1 << (h_subtree + subtree->level));
+        unsigned subdiv = step_subdiv( p_order );
+
+        struct intermed_tree_detail detail;
+        detail.seed = (p_order->next_tree ? tree->seed_next : tree->seed);
+        detail.lm_type = tree->lm_type;
+        detail.lm_ots_type = tree->lm_ots_type;
+        detail.h = tree->h;
+        detail.tree_height = tree->level;
+        detail.I = I;
+        detail.got_error = &got_error;
+
+        if (subdiv == 0) {
+            /* The nodes are cheap; do as many as we have room for (up to */
+            /* the one we skip) */
+            unsigned long long per_node = node_hashes( tree,
+                                                 subtree->levels_below );
+            merkle_index_t right_side = p_order->count_nodes;
+            if (p_order->prev_node && p_order->prev_index > load->cur_node &&
+                                      p_order->prev_index < right_side) {
+                right_side = p_order->prev_index;
+            }
+            merkle_index_t this_req = 1;
+            if (limit > load->hashes_done + per_node) {
+                unsigned long long n = (limit - load->hashes_done) / per_node;
+                if (n > right_side - load->cur_node) {
+                    n = right_side - load->cur_node;
+                }
+                this_req = n;
+            }
+            detail.dest = &subtree->nodes[ hash_size *
+                                           (lower_index + load->cur_node) ];
+            detail.node_num = node_num;
+            detail.node_count = this_req;
+            hss_gen_intermediate_tree( &detail, 0 );
+
+            load->cur_node += this_req;
+            load->hashes_done += this_req * per_node;
+        } else {
+            /* Compute the next piece, and combine it with the previous */
+            /* pieces as far as we can */
+            unsigned char cur_val[ MAX_HASH ];
+            merkle_index_t piece_num = (node_num << subdiv) + load->cur_piece;
+            detail.dest = cur_val;
+            detail.node_num = piece_num;
+            detail.node_count = 1;
+            hss_gen_intermediate_tree( &detail, 0 );
+            load->hashes_done += node_hashes( tree,
+                                       subtree->levels_below - subdiv );
+
+            merkle_index_t k = load->cur_piece;
+            unsigned height = 0;
+            for (; k & 1; k >>= 1, height++) {
+                /* This is a right node; combine it with the left one */
+                piece_num >>= 1;
+                hss_combine_internal_nodes( cur_val,
+                                &load->stack[ height * hash_size ], cur_val,
+                                tree->h, I, hash_size, piece_num );
+                load->hashes_done += 1;
+            }
+
+            load->cur_piece++;
+            if (load->cur_piece == (merkle_index_t)1 << subdiv) {
+                /* That was the last piece; we have the node */
+                memcpy( &subtree->nodes[ hash_size *
+                                         (lower_index + load->cur_node) ],
+                        cur_val, hash_size );
+                load->cur_node++;
+                load->cur_piece = 0;
+            } else {
+                memcpy( &load->stack[ height * hash_size ], cur_val,
+                        hash_size );
+            }
+        }
+        if (got_error != hss_error_none) {
+            info->error_code = got_error;
+            hss_generate_working_key_cancel( w );
+            return false;
+        }
+        did_something = true;
+    }
+
+    if (load->cur_order < load->count_order) {
+        return true;        /* More to do next time */
+    }
+
+    /* We've computed all the bottom nodes; finish things off */
+    finish_orders( load->order, load->count_order );
+    free( load );
+    w->stepwise_load = NULL;
+    if (!complete_working_key( w, info )) return false;
+
+    if (done) *done = true;
+    return true;
+}
+
+bool hss_generate_working_key_progress(
+    const struct hss_working_key *w,
+    unsigned long long *hashes_done,
+    unsigned long long *hashes_total) {
+    if (!w || !w->stepwise_load) return false;
+    if (hashes_done) *hashes_done = w->stepwise_load->hashes_done;
+    if (hashes_total) *hashes_total = w->stepwise_load->hashes_total;
+    return true;
+}
+
+void hss_generate_working_key_cancel(struct hss_working_key *w) {
+    if (!w || !w->stepwise_load) return;
+    free( w->stepwise_load );
+    w->stepwise_load = NULL;
+    w->status = hss_error_key_uninitialized;
+}
@@ -2,6 +2,7 @@
 #define HSS_INTERNAL_H_
 
 #include <stdlib.h>
+#include <stdatomic.h>
 #include "common_defs.h"
 #include "hss.h"
 #include "config.h"
@@ -17,6 +18,9 @@
 
 #define PARM_SET_END 0xff   /* We set this marker in the parameter set */
                             /* when fewer than the maximum levels are used */
+#define PARM_SET_SUBKEY 0xfe /* In a sub-key, we use this marker in place */
+                            /* of the first PARM_SET_END (so that code that */
+                            /* doesn't know about sub-keys rejects them) */
 
 
 /*
@@ -36,7 +40,18 @@
 #define PRIVATE_KEY_LEN (PRIVATE_KEY_SEED + PRIVATE_KEY_SEED_LEN) /* That's */
                                                                 /* 48 bytes */
 
+/*
+ * A sub-key is a private key that may sign with only a range of sequence
+ * numbers; it's a private key, followed by the last sequence number it may
+ * use
+ */
+#define PRIVATE_SUBKEY_MAX PRIVATE_KEY_LEN
+#define PRIVATE_SUBKEY_MAX_LEN 8
+#define PRIVATE_SUBKEY_LEN (PRIVATE_SUBKEY_MAX + PRIVATE_SUBKEY_MAX_LEN)
+
 struct merkle_level;
+struct hss_mutex;
+struct hss_event;
 struct hss_working_key {
     unsigned levels;
     enum hss_error_code status;   /* What is the status of this key */
@@ -47,10 +62,38 @@ struct hss_working_key {
                                   /* Will be higher than the 'current count' */
                                   /* if some signaures are 'reserved' */
     sequence_t max_count;         /* The maximum count we can ever have */
+    sequence_t tree_max_count;    /* The maximum count the trees allow */
+                                  /* (max_count is lower for a sub-key) */
     unsigned autoreserve;         /* How many signatures to attempt to */
                                   /* reserve if the signing process hits */
                                   /* the end of the current reservation */
 
+        /* If adaptive_interval is nonzero, we size autoreservations from */
+        /* the signing rate (see hss_set_adaptive_reserve) */
+    unsigned long long adaptive_interval; /* Target time between writes */
+                                  /* (ns) */
+    unsigned adaptive_max;        /* Most we'll ever reserve */
+    unsigned long long adaptive_last_time; /* When we last reserved */
+    sequence_t adaptive_last_count; /* The count at that time */
+    double adaptive_rate;         /* Smoothed signatures per ns; 0 if we */
+                                  /* haven't measured it yet */
+    double adaptive_latency;      /* Smoothed time (ns) a write takes */
+
+        /* If non-NULL, we reserve signatures asynchronously (see */
+        /* hss_set_async_reserve) */
+    bool (*async_write)(const unsigned char *private_key,
+                        size_t len_private_key, void *context);
+    void *async_context;
+    unsigned async_window;        /* How many we reserve at a time */
+    sequence_t async_target;      /* The reserve_count being written; 0 if */
+                                  /* there's no write in flight */
+    bool async_failed;            /* Set if that write failed */
+    atomic_bool async_pending;    /* Set while we're waiting for the */
+                                  /* application to complete that write */
+                                  /* (so we ignore any other completions) */
+    unsigned char async_key[PRIVATE_KEY_INDEX_LEN]; /* What's being written */
+    struct hss_event *async_done; /* Raised when the write is complete */
+
     size_t signature_len;         /* The length of the HSS signature */
 
     unsigned char *stack;         /* The stack memory used by the subtrees */
@@ -71,8 +114,40 @@ struct hss_working_key {
                                   /* current root value, signed by the */
                                   /* previous level.  Unused for the */
                                   /* topmost level */
+    unsigned char *next_signed_pk[MAX_HSS_LEVELS]; /* The signed public */
+                                  /* keys for the NEXT trees, computed */
+                                  /* ahead of time (so that switching to */
+                                  /* them doesn't hold up a signature) */
+    merkle_index_t next_signed_pk_q[MAX_HSS_LEVELS]; /* The parent leaf */
+                                  /* that signed each of them, or */
+                                  /* NO_SIGNED_PK if we haven't yet */
+#define NO_SIGNED_PK (~(merkle_index_t)0)
     struct merkle_level *tree[MAX_HSS_LEVELS]; /* The structures that manage */
                                   /* each individual level */
+
+    struct background_load *pending_load; /* If non-NULL, the BUILDING and */
+                                  /* NEXT subtrees are still being */
+                                  /* computed in the background */
+    unsigned deferred_updates;    /* The number of signatures we generated */
+                                  /* while that was happening, and so */
+                                  /* haven't done the updates for */
+    merkle_index_t deferred_index; /* The bottom tree index after the first */
+                                  /* of those signatures */
+    struct stepwise_load *stepwise_load; /* If non-NULL, we're in the */
+                                  /* middle of a step-wise load */
+
+    struct thread_collection *maintenance; /* If non-NULL, the threads */
+                                  /* that are doing the subtree updates */
+                                  /* after the last signature */
+    enum hss_error_code maintenance_error; /* Set if those failed */
+    bool pending_advance;         /* Set if the last signature was the */
+                                  /* last one of a subtree, and we haven't */
+                                  /* switched to the next one yet */
+    sequence_t advance_count;     /* The count after that signature */
+
+    struct hss_mutex *lock;       /* Held while we update the working key */
+                                  /* (so that several threads can sign */
+                                  /* with it); NULL if we're not threaded */
 };
 
 #define MIN_SUBTREE    2  /* All subtrees (other than the root subtree) have */
@@ -90,6 +165,7 @@ struct merkle_level {
     unsigned h, hash_size;        /* Hash function, width */
     param_set_t lm_type;
     param_set_t lm_ots_type;      /* OTS parameter */
+    const struct lm_ots_kernel *ots; /* The OTS routines for lm_ots_type */
     merkle_index_t current_index; /* The number of signatures this tree has */
                                   /* generated so far */
     merkle_index_t max_index;     /* 1<<level - 1 */
@@ -127,6 +203,21 @@ struct merkle_level {
 #define NUM_SUBTREE 3    /* Maximum number of subtrees we have at each level */
     struct subtree *subtree[MAX_SUBLEVELS][NUM_SUBTREE];
 
+       /* The Winternitz checkpoint cache.  When we compute the OTS public */
+       /* keys for the bottom BUILDING subtree, we save the checkpoints */
+       /* (see lm_ots.h) for some of those leaves, so that when we get */
+       /* around to signing with them, it's cheaper.  We have two banks */
+       /* (so that when we're signing with a leaf from one subtree, we */
+       /* don't touch the checkpoints for that subtree while building the */
+       /* next); each bank holds the first checkpoint_leaves leaves of a */
+       /* bottom subtree.  Only the bottom Merkle tree has this, and only */
+       /* if it has more than one sublevel and the memory budget allows */
+    unsigned checkpoint_leaves;   /* Number of leaves per bank; 0 if we */
+                                  /* don't have a cache */
+    merkle_index_t *checkpoint_q; /* The leaf each entry is for */
+#define NO_CHECKPOINT (~(merkle_index_t)0) /* Entry is unused */
+    unsigned char *checkpoint;    /* The checkpoints themselves */
+
        /* The I values for the current Merkle tree, and the next one */
     unsigned char I[I_LEN], I_next[I_LEN];
 
@@ -192,6 +283,53 @@ void hss_combine_internal_nodes( unsigned char *dest,
         int h, const unsigned char *I, unsigned hash_size,
         merkle_index_t node_num);
 
+/* Empty the Winternitz checkpoint cache of a tree */
+void hss_reset_checkpoints(struct merkle_level *tree);
+
+/* Wait for the subtree updates from the last signature; the finish version */
+/* also does the rest of what the next signature needs */
+void hss_wait_pending_updates(struct hss_working_key *w);
+bool hss_finish_pending_updates(struct hss_working_key *w,
+                                struct hss_extra_info *info);
+
+/*
+ * What we need to generate the bottom level OTS signature, once we've
+ * claimed a leaf for it.  We copy everything out of the working key, so
+ * that we can generate the OTS signature without holding the lock
+ */
+struct bottom_ots {
+    const struct lm_ots_kernel *ots;
+    param_set_t lm_type;
+    param_set_t lm_ots_type;
+    unsigned h, hash_size;
+    merkle_index_t q;             /* The leaf we've claimed */
+    unsigned char I[I_LEN];
+    unsigned char seed[SEED_LEN];
+    unsigned char *checkpoint;    /* If we had the Winternitz checkpoints */
+                                  /* for the leaf, a malloc'ed copy */
+    unsigned char *ots_sig;       /* Where in the signature the OTS */
+                                  /* signature goes */
+};
+
+/*
+ * This claims the next leaf of the working key, and writes everything in the
+ * signature except for the bottom OTS signature (which is left zeroed); the
+ * caller then needs to call hss_release_bottom_ots (whether or not it
+ * generates that OTS signature)
+ */
+bool hss_claim_signature(struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    unsigned char *signature, size_t signature_buf_len,
+    struct bottom_ots *b, struct hss_extra_info *info);
+void hss_release_bottom_ots(struct bottom_ots *b);
+
+/* Check on (or, if wait is set, wait for) a background load of the working */
+/* key; returns true if there's no longer a load in progress.  If the load */
+/* failed, this sets w->status */
+bool hss_wait_background_load(struct hss_working_key *w, bool wait);
+
 bool hss_create_signed_public_key(unsigned char *signed_key,
                                     size_t len_signature,
                                     struct merkle_level *tree,
@@ -239,5 +377,9 @@ void validate_internal_sig(const void *data,
 struct seed_derive;
 void lm_ots_generate_randomizer(unsigned char *c, unsigned n,
                                 struct seed_derive *seed);
+void lm_ots_hash_message(unsigned char *Q, unsigned h, unsigned n,
+                         const unsigned char *I, merkle_index_t q,
+                         const unsigned char *C,
+                         const void *message, size_t message_len);
 
 #endif /* HSS_INTERNAL_H_ */
@@ -21,72 +21,113 @@ static int trailing_1_bits(merkle_index_t n) {
 }
 
 /*
- * This creates a private key (and the correspond public key, and optionally
- * the aux data for that key)
- * Parameters:
- * generate_random - the function to be called to generate randomness.  This
- *       is assumed to be a pointer to a cryptographically secure rng,
- *       otherwise all security is lost.  This function is expected to fill
- *       output with 'length' uniformly distributed bits, and return 1 on
- *       success, 0 if something went wrong
- * levels - the number of levels for the key pair (2-8)
- * lm_type - an array of the LM registry entries for the various levels;
- *      entry 0 is the topmost
- * lm_ots_type - an array of the LM-OTS registry entries for the various
- *      levels; again, entry 0 is the topmost
- * update_private_key, context - the function that is called when the
- *      private key is generated; it is expected to store it to secure NVRAM
- *      If this is NULL, then the context pointer is reinterpretted to mean
- *      where in RAM the private key is expected to be placed
- * public_key - where to store the public key
- * len_public_key - length of the above buffer; see hss_get_public_key_len
- *      if you need a hint.
- * aux_data - where to store the optional aux data.  This is not required, but
- *      if provided, can be used to speed up the hss_generate_working_key
- *      process;
- * len_aux_data - the length of the above buffer.  This is not fixed length;
- *      the function will run different time/memory trade-offs based on the
- *      length provided
- *
- * This returns true on success, false on failure
+ * Key generation checkpoints.  When we're asked to, we record the nodes we
+ * compute at the level we do in parallel (see compute_public_key), a range
+ * at a time, into an application-provided buffer; each range is followed by
+ * an HMAC (keyed the same way as the aux data), so that if we're
+ * interrupted, hss_resume_private_key can skip the ranges that have already
+ * been done (and detect any that were damaged).  The format of the
+ * checkpoint is:
+ * For each range (in ascending order):
+ *   - The node values for that range (range_nodes hashes)
+ *   - The HMAC of (level, range index, node values)
  */
-bool hss_generate_private_key(
-    bool (*generate_random)(void *output, size_t length),
-    unsigned levels,
-    const param_set_t *lm_type,
-    const param_set_t *lm_ots_type,
-    bool (*update_private_key)(unsigned char *private_key,
-            size_t len_private_key, void *context),
-        void *context,
-    unsigned char *public_key, size_t len_public_key,
-    unsigned char *aux_data, size_t len_aux_data,
-    struct hss_extra_info *info) {
+#define CHECKPOINT_LEVEL 12  /* If the aux data doesn't have a level at or */
+                        /* below this, we checkpoint the nodes at this */
+                        /* level (or just below the root, if the tree is */
+                        /* smaller) */
+#define MAX_CHECKPOINT_RANGES 4096 /* We never split the checkpoint into */
+                        /* more ranges than this */
 
-    struct hss_extra_info info_temp = { 0 };
-    if (!info) info = &info_temp;
+/*
+ * A key generation shard is the checkpoint records for a contiguous set of
+ * ranges (shard i of n gets ranges i*R/n through (i+1)*R/n - 1, where R is
+ * the total number of ranges), preceeded by a header:
+ *   - The number of shards (4 bytes)
+ *   - The index of this shard (4 bytes)
+ *   - The level the ranges are at (4 bytes)
+ *   - The I value of the top level tree (I_LEN bytes); this tells us which
+ *     key the shard belongs to (the HMACs on the ranges would, too, however
+ *     a range that fails its HMAC looks just like one that was damaged)
+ */
+#define SHARD_HEADER_LEN (12 + I_LEN)
 
-    if (!generate_random) {
-        /* We *really* need random numbers */
-        info->error_code = hss_error_no_randomness;
-        return false;
+struct keygen_checkpoint {
+    unsigned char *data;
+    size_t len_data;
+    bool fresh;         /* Set if this is a new checkpoint (and so none of */
+                        /* the ranges are valid yet) */
+    bool (*written)(const unsigned char *checkpoint,
+                    size_t offset, size_t len, void *context);
+    void *context;
+};
+
+/*
+ * This finds the level that we'll checkpoint (and so the level that
+ * compute_public_key computes in parallel when it's checkpointing).  We
+ * search down from CHECKPOINT_LEVEL for an aux level (so we can write those
+ * nodes directly into the aux data); if there isn't one, we use
+ * CHECKPOINT_LEVEL itself.  We never go higher than that; the checkpoint
+ * (which holds all the nodes at this level) would get huge
+ */
+static unsigned checkpoint_level(unsigned h0, aux_level_t aux_level) {
+    unsigned top = h0-1;
+    if (top > CHECKPOINT_LEVEL) top = CHECKPOINT_LEVEL;
+    unsigned level;
+    for (level = top; level > 2; level--) {
+        if (aux_level & ((aux_level_t)1 << level)) return level;
+    }
+    return top;
+}
+
+/*
+ * When we checkpoint, the aux data can't include any level higher than
+ * checkpoint_level; we compute the ranges as a whole, and so never see the
+ * nodes within them (and a range we resume from the checkpoint doesn't have
+ * them at all).  This drops any such levels, so that the aux data we write
+ * (and MAC) is all filled in.  It doesn't change the checkpoint level
+ */
+static aux_level_t checkpoint_aux_level(unsigned h0, aux_level_t aux_level) {
+    unsigned top = h0-1;
+    if (top > CHECKPOINT_LEVEL) top = CHECKPOINT_LEVEL;
+    unsigned level;
+    for (level = top+1; level < h0; level++) {
+        aux_level &= ~((aux_level_t)1 << level);
     }
+    if (0 == (aux_level & ~0x80000000UL)) return 0;  /* Nothing left */
+    return aux_level;
+}
+
+static merkle_index_t checkpoint_ranges(unsigned level) {
+    merkle_index_t level_nodes = (merkle_index_t)1 << level;
+    if (level_nodes > MAX_CHECKPOINT_RANGES) return MAX_CHECKPOINT_RANGES;
+    return level_nodes;
+}
+
+/*
+ * This checks the parameters that hss_generate_private_key (and
+ * hss_resume_private_key) are passed, and looks up the top level
+ * parameter set
+ */
+static bool check_keygen_parameters( unsigned levels,
+    const param_set_t *lm_type, const param_set_t *lm_ots_type,
+    size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned *h, unsigned *size_hash, unsigned *h0,
+    struct hss_extra_info *info ) {
     if (levels < MIN_HSS_LEVELS || levels > MAX_HSS_LEVELS) {
         /* parameter out of range */
         info->error_code = hss_error_bad_param_set;
         return false;
     }
 
-    unsigned h0;  /* The height of the root tree */
-    unsigned h;   /* The hash function used */
-    unsigned size_hash;  /* The size of each hash that would appear in the */
-                  /* aux data */
-    if (!lm_look_up_parameter_set(lm_type[0], &h, &size_hash, &h0)) {
+    if (!lm_look_up_parameter_set(lm_type[0], h, size_hash, h0)) {
         info->error_code = hss_error_bad_param_set;
         return false;
     }
 
     /* Check the public_key_len */
-    if (4 + 4 + 4 + I_LEN + size_hash > len_public_key) {
+    if (4 + 4 + 4 + I_LEN + *size_hash > len_public_key) {
         info->error_code = hss_error_buffer_overflow;
         /* public key won't fit in the buffer we're given */
         return false;
@@ -107,46 +148,131 @@ bool hss_generate_private_key(
         return false;
     }
 
-    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    return true;
+}
 
-        /* First step: format the private key */
-    put_bigendian( private_key + PRIVATE_KEY_INDEX, 0,
-                   PRIVATE_KEY_INDEX_LEN );
-    if (!hss_compress_param_set( private_key + PRIVATE_KEY_PARAM_SET,
-                   levels, lm_type, lm_ots_type,
-                   PRIVATE_KEY_PARAM_SET_LEN )) {
-        info->error_code = hss_error_bad_param_set;
-        return false;
-    }
-    if (!(*generate_random)( private_key + PRIVATE_KEY_SEED,
-                   PRIVATE_KEY_SEED_LEN )) {
-        info->error_code = hss_error_bad_randomness;
+/*
+ * This computes the nodes for the checkpoint ranges first_range through
+ * last_range-1, skipping the ones the checkpoint says are already done
+ * (unless it's fresh).  We go through the ranges in batches; after each
+ * batch, we record the nodes we computed in the checkpoint (and tell the
+ * application about them, so it can write them out).  checkpoint->data and
+ * dest refer to range first_range (and the offsets we report to the
+ * application are relative to that)
+ *
+ * details has the constant parts of the work order filled in
+ * On failure, this sets info->error_code, and returns false
+ */
+static bool compute_ranges( struct keygen_checkpoint *checkpoint,
+    unsigned char *dest,
+    merkle_index_t first_range, merkle_index_t last_range,
+    merkle_index_t range_nodes, unsigned level,
+    struct intermed_tree_detail *details,
+    const unsigned char *private_seed, unsigned size_hash,
+    struct hss_extra_info *info ) {
+    unsigned h = details->h;
+    merkle_index_t level_nodes = (merkle_index_t)1 << level;
+    size_t len_nodes = (size_t)range_nodes * size_hash;
+    size_t len_record = len_nodes + size_hash;
+    unsigned batch_size = 4 * hss_thread_pool_num_tracks(info->thread_pool,
+                                                         info->num_threads);
+    bool *issued = malloc( (last_range - first_range) * sizeof *issued );
+    if (!issued) {
+        info->error_code = hss_error_out_of_memory;
         return false;
     }
 
-        /* Now make sure that the private key is written to NVRAM */
-    if (update_private_key) {
-        if (!(*update_private_key)( private_key, PRIVATE_KEY_LEN, context)) {
-            /* initial write of private key didn't take */
-            info->error_code = hss_error_private_key_write_failed;
-            hss_zeroize( private_key, sizeof private_key );
-            return false;
+    merkle_index_t r = first_range;
+    while (r < last_range) {
+        struct thread_collection *col = hss_thread_init_pool(
+                             info->thread_pool, info->num_threads);
+        merkle_index_t first = r;
+        unsigned count = 0;
+        for (; r < last_range && count < batch_size; r++) {
+            unsigned char *record = checkpoint->data +
+                                         (r - first_range) * len_record;
+            unsigned char *range_dest = dest + (r - first_range) * len_nodes;
+            issued[r - first_range] = false;
+            if (!checkpoint->fresh) {
+                /* See if we've already done this one */
+                if (hss_keygen_checkpoint_check( record + len_nodes,
+                             h, size_hash, private_seed, level, r,
+                             record, len_nodes )) {
+                    memcpy( range_dest, record, len_nodes );
+                    continue;
+                }
+            }
+            details->dest = range_dest;
+            details->node_num = level_nodes + r * range_nodes;
+            details->node_count = range_nodes;
+            hss_thread_issue_work(col, hss_gen_intermediate_tree,
+                                  details, sizeof *details );
+            issued[r - first_range] = true;
+            count++;
         }
-    } else {
-        if (context == 0) {
-            /* We weren't given anywhere to place the private key */
-            info->error_code = hss_error_no_private_buffer;
-            hss_zeroize( private_key, sizeof private_key );
+        hss_thread_done(col);
+        if (*details->got_error != hss_error_none) {
+            info->error_code = *details->got_error;
+            free( issued );
             return false;
         }
-        memcpy( context, private_key, PRIVATE_KEY_LEN );
+
+        /* Record the ranges we just computed, and tell the application */
+        /* about each run of them */
+        merkle_index_t i, run_start = first;
+        for (i = first; i <= r; i++) {
+            if (i < r && issued[i - first_range]) {
+                unsigned char *record = checkpoint->data +
+                                         (i - first_range) * len_record;
+                memcpy( record, dest + (i - first_range) * len_nodes,
+                        len_nodes );
+                hss_keygen_checkpoint_mac( record + len_nodes, h,
+                             size_hash, private_seed,
+                             level, i, record, len_nodes );
+                continue;
+            }
+            /* End of a run (if we have one) */
+            if (i > run_start && checkpoint->written &&
+                !checkpoint->written( checkpoint->data,
+                               (run_start - first_range) * len_record,
+                               (i - run_start) * len_record,
+                               checkpoint->context )) {
+                info->error_code = hss_error_checkpoint_write_failed;
+                free( issued );
+                return false;
+            }
+            run_start = i + 1;
+        }
     }
+    free( issued );
+    return true;
+}
+
+/*
+ * This computes the top level Merkle tree (and hence the public key, and the
+ * aux data) for the given private key.  If checkpoint is non-NULL, we
+ * record our progress there (and skip whatever it says we've already done)
+ *
+ * On failure, this sets info->error_code; it also sets *fatal if the
+ * failure means the private key should be discarded
+ */
+static bool compute_public_key( const unsigned char *private_key,
+    const param_set_t *lm_type, const param_set_t *lm_ots_type,
+    unsigned levels, unsigned h, unsigned size_hash, unsigned h0,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    struct keygen_checkpoint *checkpoint,
+    bool *fatal, struct hss_extra_info *info ) {
+
+    *fatal = false;
 
     /* Figure out what would be the best trade-off for the aux level */
     struct expanded_aux_data *expanded_aux_data = 0, aux_data_storage;
+    aux_level_t aux_level = 0;
     if (aux_data != NULL) {
-        aux_level_t aux_level = hss_optimal_aux_level( len_aux_data, lm_type,
+        aux_level = hss_optimal_aux_level( len_aux_data, lm_type,
                                        lm_ots_type, NULL );
+        if (checkpoint) aux_level = checkpoint_aux_level( h0, aux_level );
         hss_store_aux_marker( aux_data, aux_level );
 
         /* Set up the aux data pointers */
@@ -158,7 +284,6 @@ bool hss_generate_private_key(
     unsigned char seed[SEED_LEN];
     if (!hss_generate_root_seed_I_value( seed, I, private_key+PRIVATE_KEY_SEED)) {
         info->error_code = hss_error_internal;
-        hss_zeroize( private_key, sizeof private_key );
         return false;
     }
 
@@ -168,13 +293,21 @@ bool hss_generate_private_key(
     /* First of all, figure out the appropriate level to compute up to */
     /* in parallel.  We'll do the lower of the bottom-most level that */
     /* appears in the aux data, and 4*log2 of the number of core we have */
-    unsigned num_cores = hss_thread_num_tracks(info->num_threads);
+    /* (if we're checkpointing, we need a level that doesn't depend on the */
+    /* number of cores, so we use checkpoint_level instead) */
+    unsigned num_cores = hss_thread_pool_num_tracks(info->thread_pool,
+                                                    info->num_threads);
     unsigned level;
     unsigned char *dest = 0;  /* The area we actually write to */
     void *temp_buffer = 0;  /* The buffer we need to free when done */
+    unsigned target_level = 0;
+    if (checkpoint) target_level = checkpoint_level( h0, aux_level );
     for (level = h0-1; level > 2; level--) {
             /* If our bottom-most aux data is at this level, we want it */
-        if (expanded_aux_data && expanded_aux_data->data[level]) {
+            /* (unless we're checkpointing at a lower level; the aux */
+            /* data above that is filled in as we combine the nodes) */
+        if (expanded_aux_data && expanded_aux_data->data[level] &&
+                             (!checkpoint || level == target_level)) {
                 /* Write directly into the aux area */
             dest = expanded_aux_data->data[level];
             break;
@@ -182,11 +315,19 @@ bool hss_generate_private_key(
 
             /* If going to a higher levels would mean that we wouldn't */
             /* effectively use all the cores we have, use this level */ 
-        if ((1<<level) < 4*num_cores) {
+        if (checkpoint ? level == target_level :
+                         (1<<level) < 4*num_cores) {
                 /* We'll write into a temp area; malloc the space */
             size_t temp_buffer_size = (size_t)size_hash << level;
             temp_buffer = malloc(temp_buffer_size);
             if (!temp_buffer) {
+                if (checkpoint) {
+                    /* We can't move to another level; the checkpoint */
+                    /* is laid out for this one */
+                    hss_zeroize( seed, sizeof seed );
+                    info->error_code = hss_error_out_of_memory;
+                    return false;
+                }
                 /* Couldn't malloc it; try again with s smaller buffer */
                 continue;
             }
@@ -204,14 +345,6 @@ bool hss_generate_private_key(
         /* level == 2 if we reach here, so the buffer is big enough */
     }
 
-    /*
-     * Now, issue all the work items to generate the intermediate hashes
-     * These intermediate passes are potentially computed in parallel;
-     * allowing that is why we use this funky thread_collection and details
-     * structure
-     */
-    struct thread_collection *col = hss_thread_init(info->num_threads);
-
     struct intermed_tree_detail details;
         /* Set the values in the details structure that are constant */
     details.seed = seed;
@@ -224,43 +357,75 @@ bool hss_generate_private_key(
                                                      /* on an error */
     details.got_error = &got_error;
 
-    merkle_index_t j;
         /* # of nodes at this level */
     merkle_index_t level_nodes = (merkle_index_t)1 << level;
-        /* the index of the node we're generating right now */
-    merkle_index_t node_num = level_nodes;
+
+    if (!checkpoint) {
         /*
-         * We'd prefer not to issue a separate work item for every node; we
-         * might be doing millions of node (if we have a large aux data space)
-         * and we end up malloc'ing a large structure for every work order.
-         * So, if we do have a large number of requires, aggregate them
+         * Now, issue all the work items to generate the intermediate hashes
+         * These intermediate passes are potentially computed in parallel;
+         * allowing that is why we use this funky thread_collection and
+         * details structure
          */
-    merkle_index_t increment = level_nodes / (10 * num_cores);
+        struct thread_collection *col = hss_thread_init_pool(
+                                 info->thread_pool, info->num_threads);
+
+        merkle_index_t j;
+            /* the index of the node we're generating right now */
+        merkle_index_t node_num = level_nodes;
+            /*
+             * We'd prefer not to issue a separate work item for every node;
+             * we might be doing millions of node (if we have a large aux
+             * data space) and we end up malloc'ing a large structure for
+             * every work order.  So, if we do have a large number of
+             * requires, aggregate them
+             */
+        merkle_index_t increment = level_nodes / (10 * num_cores);
 #define MAX_INCREMENT 20000
-    if (increment > MAX_INCREMENT) increment = MAX_INCREMENT;
-    if (increment == 0) increment = 1;
-    for (j=0; j < level_nodes; ) {
-        unsigned this_increment;
-        if (level_nodes - j < increment) {
-            this_increment = level_nodes - j;
-        } else {
-            this_increment = increment;
-       }
+        if (increment > MAX_INCREMENT) increment = MAX_INCREMENT;
+        if (increment == 0) increment = 1;
+        for (j=0; j < level_nodes; ) {
+            unsigned this_increment;
+            if (level_nodes - j < increment) {
+                this_increment = level_nodes - j;
+            } else {
+                this_increment = increment;
+           }
 
-        /* Set the particulars of this specific work item */
-        details.dest = dest + j*size_hash;
-        details.node_num = node_num;
-        details.node_count = this_increment;
+            /* Set the particulars of this specific work item */
+            details.dest = dest + j*size_hash;
+            details.node_num = node_num;
+            details.node_count = this_increment;
 
-        /* Issue a separate work request for every node at this level */
-        hss_thread_issue_work(col, hss_gen_intermediate_tree,
-                              &details, sizeof details );
+            /* Issue a separate work request for every node at this level */
+            hss_thread_issue_work(col, hss_gen_intermediate_tree,
+                                  &details, sizeof details );
 
-        j += this_increment;
-        node_num += this_increment;
+            j += this_increment;
+            node_num += this_increment;
+        }
+        /* Now wait for all those work items to complete */
+        hss_thread_done(col);
+    } else {
+        /* We're checkpointing */
+        merkle_index_t num_ranges = checkpoint_ranges( level );
+        merkle_index_t range_nodes = level_nodes / num_ranges;
+        if (checkpoint->len_data <
+                   (size_t)num_ranges * (range_nodes + 1) * size_hash) {
+            free( temp_buffer );
+            hss_zeroize( seed, sizeof seed );
+            info->error_code = hss_error_buffer_overflow;
+            return false;
+        }
+        if (!compute_ranges( checkpoint, dest, 0, num_ranges, range_nodes,
+                             level, &details, private_key+PRIVATE_KEY_SEED,
+                             size_hash, info )) {
+            free( temp_buffer );
+            hss_zeroize( seed, sizeof seed );
+            *fatal = (got_error != hss_error_none);
+            return false;
+        }
     }
-    /* Now wait for all those work items to complete */
-    hss_thread_done(col);
 
     hss_zeroize( seed, sizeof seed );
 
@@ -269,12 +434,7 @@ bool hss_generate_private_key(
     if (got_error != hss_error_none) {
         /* We failed; give up */
         info->error_code = got_error;
-        hss_zeroize( private_key, sizeof private_key );
-        if (update_private_key) {
-            (void)(*update_private_key)(private_key, PRIVATE_KEY_LEN, context);
-        } else {
-            hss_zeroize( context, PRIVATE_KEY_LEN );
-        }
+        *fatal = true;
         free(temp_buffer);
         return false;
     }
@@ -346,13 +506,634 @@ bool hss_generate_private_key(
     memcpy( public_key, root_hash, size_hash );
     public_key += size_hash; len_public_key -= size_hash;
 
-    /* Hey, what do you know -- it all worked! */
+    free(temp_buffer);
+    return true;
+}
+
+/*
+ * This formats a new private key (with a fresh seed from generate_random),
+ * and hands it to update_private_key (or places it in context); the local
+ * copy is left in private_key
+ */
+static bool create_private_key(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type,
+    const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *private_key,
+    struct hss_extra_info *info) {
+        /* First step: format the private key */
+    put_bigendian( private_key + PRIVATE_KEY_INDEX, 0,
+                   PRIVATE_KEY_INDEX_LEN );
+    if (!hss_compress_param_set( private_key + PRIVATE_KEY_PARAM_SET,
+                   levels, lm_type, lm_ots_type,
+                   PRIVATE_KEY_PARAM_SET_LEN )) {
+        info->error_code = hss_error_bad_param_set;
+        return false;
+    }
+    if (!(*generate_random)( private_key + PRIVATE_KEY_SEED,
+                   PRIVATE_KEY_SEED_LEN )) {
+        info->error_code = hss_error_bad_randomness;
+        return false;
+    }
+
+        /* Now make sure that the private key is written to NVRAM */
+    if (update_private_key) {
+        if (!(*update_private_key)( private_key, PRIVATE_KEY_LEN, context)) {
+            /* initial write of private key didn't take */
+            info->error_code = hss_error_private_key_write_failed;
+            hss_zeroize( private_key, PRIVATE_KEY_LEN );
+            return false;
+        }
+    } else {
+        if (context == 0) {
+            /* We weren't given anywhere to place the private key */
+            info->error_code = hss_error_no_private_buffer;
+            hss_zeroize( private_key, PRIVATE_KEY_LEN );
+            return false;
+        }
+        memcpy( context, private_key, PRIVATE_KEY_LEN );
+    }
+
+    return true;
+}
+
+/*
+ * This creates a private key (and the correspond public key, and optionally
+ * the aux data for that key)
+ * Parameters:
+ * generate_random - the function to be called to generate randomness.  This
+ *       is assumed to be a pointer to a cryptographically secure rng,
+ *       otherwise all security is lost.  This function is expected to fill
+ *       output with 'length' uniformly distributed bits, and return 1 on
+ *       success, 0 if something went wrong
+ * levels - the number of levels for the key pair (2-8)
+ * lm_type - an array of the LM registry entries for the various levels;
+ *      entry 0 is the topmost
+ * lm_ots_type - an array of the LM-OTS registry entries for the various
+ *      levels; again, entry 0 is the topmost
+ * update_private_key, context - the function that is called when the
+ *      private key is generated; it is expected to store it to secure NVRAM
+ *      If this is NULL, then the context pointer is reinterpretted to mean
+ *      where in RAM the private key is expected to be placed
+ * public_key - where to store the public key
+ * len_public_key - length of the above buffer; see hss_get_public_key_len
+ *      if you need a hint.
+ * aux_data - where to store the optional aux data.  This is not required, but
+ *      if provided, can be used to speed up the hss_generate_working_key
+ *      process;
+ * len_aux_data - the length of the above buffer.  This is not fixed length;
+ *      the function will run different time/memory trade-offs based on the
+ *      length provided
+ * checkpoint - if non-NULL, where to record our progress (see
+ *      hss_generate_private_key_checkpointed)
+ *
+ * This returns true on success, false on failure
+ */
+static bool generate_private_key(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type,
+    const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    struct keygen_checkpoint *checkpoint,
+    struct hss_extra_info *info) {
+
+    struct hss_extra_info info_temp = { 0 };
+    if (!info) info = &info_temp;
+
+    if (!generate_random) {
+        /* We *really* need random numbers */
+        info->error_code = hss_error_no_randomness;
+        return false;
+    }
+
+    unsigned h0;  /* The height of the root tree */
+    unsigned h;   /* The hash function used */
+    unsigned size_hash;  /* The size of each hash that would appear in the */
+                  /* aux data */
+    if (!check_keygen_parameters( levels, lm_type, lm_ots_type,
+                                  len_public_key, aux_data, len_aux_data,
+                                  &h, &size_hash, &h0, info )) {
+        return false;
+    }
+
+    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    if (!create_private_key( generate_random, levels, lm_type, lm_ots_type,
+                             update_private_key, context, private_key,
+                             info )) {
+        return false;
+    }
+
+    bool fatal;
+    bool success = compute_public_key( private_key, lm_type, lm_ots_type,
+                       levels, h, size_hash, h0,
+                       public_key, len_public_key,
+                       aux_data, len_aux_data, checkpoint, &fatal, info );
     hss_zeroize( private_key, sizeof private_key ); /* Zeroize local copy of */
                                                    /* the private key */
-    free(temp_buffer);
+    if (!success && fatal) {
+        /* The stored private key is no good; clear it out */
+        if (update_private_key) {
+            (void)(*update_private_key)(private_key, PRIVATE_KEY_LEN, context);
+        } else {
+            hss_zeroize( context, PRIVATE_KEY_LEN );
+        }
+    }
+
+    /* Hey, what do you know -- it all worked! (or didn't, as the case */
+    /* may be) */
+    return success;
+}
+
+bool hss_generate_private_key(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type,
+    const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    struct hss_extra_info *info) {
+    return generate_private_key( generate_random, levels, lm_type,
+                       lm_ots_type, update_private_key, context,
+                       public_key, len_public_key, aux_data, len_aux_data,
+                       0, info );
+}
+
+/*
+ * This is the same as hss_generate_private_key, except that we record our
+ * progress in the checkpoint buffer as we go (calling checkpoint_written
+ * after each batch of ranges, so the application can write them out)
+ */
+bool hss_generate_private_key_checkpointed(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type,
+    const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned char *checkpoint, size_t len_checkpoint,
+    bool (*checkpoint_written)(const unsigned char *checkpoint,
+                               size_t offset, size_t len, void *context),
+        void *checkpoint_context,
+    struct hss_extra_info *info) {
+    struct hss_extra_info info_temp = { 0 };
+    if (!info) info = &info_temp;
+
+    if (!checkpoint) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+    struct keygen_checkpoint cp;
+    cp.data = checkpoint;
+    cp.len_data = len_checkpoint;
+    cp.fresh = true;
+    cp.written = checkpoint_written;
+    cp.context = checkpoint_context;
+
+    return generate_private_key( generate_random, levels, lm_type,
+                       lm_ots_type, update_private_key, context,
+                       public_key, len_public_key, aux_data, len_aux_data,
+                       &cp, info );
+}
+
+/*
+ * This reads in a private key that we're in the middle of generating the
+ * public key for (either after an interruption, or because we're doing it
+ * in shards), and looks up its parameter sets
+ */
+static bool read_keygen_private_key( unsigned char *private_key,
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned *levels, param_set_t *lm_type, param_set_t *lm_ots_type,
+    struct hss_extra_info *info ) {
+    if (!read_private_key && !context) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+    if (!hss_get_parameter_set( levels, lm_type, lm_ots_type,
+                                read_private_key, context )) {
+        info->error_code = hss_error_private_key_read_failed;
+        return false;
+    }
+    if (read_private_key) {
+        if (!read_private_key( private_key, PRIVATE_KEY_LEN, context)) {
+            hss_zeroize( private_key, PRIVATE_KEY_LEN );
+            info->error_code = hss_error_private_key_read_failed;
+            return false;
+        }
+    } else {
+        memcpy( private_key, context, PRIVATE_KEY_LEN );
+    }
+    if (get_bigendian( private_key + PRIVATE_KEY_INDEX,
+                       PRIVATE_KEY_INDEX_LEN ) != 0 ||
+        (*levels < MAX_HSS_LEVELS &&
+         private_key[PRIVATE_KEY_PARAM_SET + *levels] == PARM_SET_SUBKEY)) {
+        /* This private key has been used to sign (or it's a sub-key); */
+        /* it's not one that's in the middle of being generated */
+        hss_zeroize( private_key, PRIVATE_KEY_LEN );
+        info->error_code = hss_error_key_already_used;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * This computes the public key (and aux data) for a private key that has
+ * already been written, using whatever valid ranges the checkpoint has
+ */
+static bool resume_public_key(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    struct keygen_checkpoint *cp,
+    struct hss_extra_info *info) {
+    unsigned levels;
+    param_set_t lm_type[ MAX_HSS_LEVELS ], lm_ots_type[ MAX_HSS_LEVELS ];
+    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    if (!read_keygen_private_key( private_key, read_private_key, context,
+                                  &levels, lm_type, lm_ots_type, info )) {
+        return false;
+    }
+    unsigned h0, h, size_hash;
+    if (!check_keygen_parameters( levels, lm_type, lm_ots_type,
+                                  len_public_key, aux_data, len_aux_data,
+                                  &h, &size_hash, &h0, info )) {
+        hss_zeroize( private_key, sizeof private_key );
+        return false;
+    }
+
+    bool fatal;
+    bool success = compute_public_key( private_key, lm_type, lm_ots_type,
+                       levels, h, size_hash, h0,
+                       public_key, len_public_key,
+                       aux_data, len_aux_data, cp, &fatal, info );
+    hss_zeroize( private_key, sizeof private_key );
+    return success;
+}
+
+/*
+ * This picks up an interrupted hss_generate_private_key_checkpointed; we
+ * reread the private key it wrote, and then compute the public key (and aux
+ * data), skipping the ranges the checkpoint says are already done
+ */
+bool hss_resume_private_key(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned char *checkpoint, size_t len_checkpoint,
+    bool (*checkpoint_written)(const unsigned char *checkpoint,
+                               size_t offset, size_t len, void *context),
+        void *checkpoint_context,
+    struct hss_extra_info *info) {
+    struct hss_extra_info info_temp = { 0 };
+    if (!info) info = &info_temp;
+
+    if (!checkpoint) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+
+    struct keygen_checkpoint cp;
+    cp.data = checkpoint;
+    cp.len_data = len_checkpoint;
+    cp.fresh = false;
+    cp.written = checkpoint_written;
+    cp.context = checkpoint_context;
+
+    return resume_public_key( read_private_key, context,
+                       public_key, len_public_key, aux_data, len_aux_data,
+                       &cp, info );
+}
+
+/*
+ * The length of the checkpoint buffer that
+ * hss_generate_private_key_checkpointed needs.  This depends on the
+ * length of the aux data (as we checkpoint the nodes at the lowest aux
+ * level, if that's lower than CHECKPOINT_LEVEL)
+ * Returns 0 on error
+ */
+size_t hss_get_keygen_checkpoint_len(unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type,
+                   size_t len_aux_data) {
+    unsigned h, size_hash, h0;
+    if (levels < MIN_HSS_LEVELS || levels > MAX_HSS_LEVELS) return 0;
+    if (!lm_look_up_parameter_set(lm_type[0], &h, &size_hash, &h0)) return 0;
+
+    aux_level_t aux_level = 0;
+    if (len_aux_data > 0) {
+        aux_level = hss_optimal_aux_level( len_aux_data, lm_type,
+                                           lm_ots_type, NULL );
+    }
+    unsigned level = checkpoint_level( h0, aux_level );
+    merkle_index_t num_ranges = checkpoint_ranges( level );
+    merkle_index_t range_nodes = ((merkle_index_t)1 << level) / num_ranges;
+
+    return (size_t)num_ranges * (range_nodes + 1) * size_hash;
+}
+
+/*
+ * This creates a private key whose public key will be computed in shards
+ */
+bool hss_generate_private_key_for_shards(
+    bool (*generate_random)(void *output, size_t length),
+    unsigned levels,
+    const param_set_t *lm_type,
+    const param_set_t *lm_ots_type,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    struct hss_extra_info *info) {
+    struct hss_extra_info info_temp = { 0 };
+    if (!info) info = &info_temp;
+
+    if (!generate_random) {
+        info->error_code = hss_error_no_randomness;
+        return false;
+    }
+    unsigned h, size_hash, h0;
+    if (!check_keygen_parameters( levels, lm_type, lm_ots_type,
+                                  HSS_MAX_PUBLIC_KEY_LEN, 0, 0,
+                                  &h, &size_hash, &h0, info )) {
+        return false;
+    }
+
+    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    bool success = create_private_key( generate_random, levels, lm_type,
+                             lm_ots_type, update_private_key, context,
+                             private_key, info );
+    hss_zeroize( private_key, sizeof private_key );
+    return success;
+}
+
+/*
+ * This works out which ranges a shard covers
+ */
+static bool shard_layout( unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type,
+                   size_t len_aux_data,
+                   unsigned shard, unsigned num_shards,
+                   unsigned *level, merkle_index_t *first_range,
+                   merkle_index_t *last_range, merkle_index_t *range_nodes,
+                   unsigned *size_hash ) {
+    unsigned h, h0;
+    if (levels < MIN_HSS_LEVELS || levels > MAX_HSS_LEVELS) return false;
+    if (!lm_look_up_parameter_set(lm_type[0], &h, size_hash, &h0)) {
+        return false;
+    }
+
+    aux_level_t aux_level = 0;
+    if (len_aux_data > 0) {
+        aux_level = hss_optimal_aux_level( len_aux_data, lm_type,
+                                           lm_ots_type, NULL );
+    }
+    *level = checkpoint_level( h0, aux_level );
+    merkle_index_t num_ranges = checkpoint_ranges( *level );
+    if (num_shards == 0 || num_shards > num_ranges || shard >= num_shards) {
+        return false;
+    }
+    *range_nodes = ((merkle_index_t)1 << *level) / num_ranges;
+    *first_range = (merkle_index_t)(((uint_fast64_t)shard * num_ranges) /
+                                                               num_shards);
+    *last_range = (merkle_index_t)(((uint_fast64_t)(shard+1) * num_ranges) /
+                                                               num_shards);
+    return true;
+}
+
+/*
+ * The length of the output of hss_generate_keygen_shard
+ * Returns 0 on error
+ */
+size_t hss_get_keygen_shard_len(unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type,
+                   size_t len_aux_data,
+                   unsigned shard, unsigned num_shards) {
+    unsigned level, size_hash;
+    merkle_index_t first_range, last_range, range_nodes;
+    if (!shard_layout( levels, lm_type, lm_ots_type, len_aux_data,
+                       shard, num_shards, &level, &first_range, &last_range,
+                       &range_nodes, &size_hash )) {
+        return 0;
+    }
+    return SHARD_HEADER_LEN + (size_t)(last_range - first_range) *
+                                           (range_nodes + 1) * size_hash;
+}
+
+/*
+ * This computes one shard of the top level tree
+ */
+bool hss_generate_keygen_shard(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    size_t len_aux_data,
+    unsigned shard, unsigned num_shards,
+    unsigned char *output, size_t len_output,
+    struct hss_extra_info *info) {
+    struct hss_extra_info info_temp = { 0 };
+    if (!info) info = &info_temp;
+
+    if (!output) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+
+    unsigned levels;
+    param_set_t lm_type[ MAX_HSS_LEVELS ], lm_ots_type[ MAX_HSS_LEVELS ];
+    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    if (!read_keygen_private_key( private_key, read_private_key, context,
+                                  &levels, lm_type, lm_ots_type, info )) {
+        return false;
+    }
+
+    unsigned level, size_hash, h, h0;
+    merkle_index_t first_range, last_range, range_nodes;
+    if (!lm_look_up_parameter_set(lm_type[0], &h, &size_hash, &h0) ||
+        !shard_layout( levels, lm_type, lm_ots_type, len_aux_data,
+                       shard, num_shards, &level, &first_range, &last_range,
+                       &range_nodes, &size_hash )) {
+        hss_zeroize( private_key, sizeof private_key );
+        info->error_code = hss_error_bad_param_set;
+        return false;
+    }
+    size_t len_nodes = (size_t)(last_range - first_range) *
+                                         range_nodes * size_hash;
+    size_t len_records = len_nodes +
+                  (size_t)(last_range - first_range) * size_hash;
+    if (len_output < SHARD_HEADER_LEN + len_records) {
+        hss_zeroize( private_key, sizeof private_key );
+        info->error_code = hss_error_buffer_overflow;
+        return false;
+    }
+
+    unsigned char I[I_LEN];
+    unsigned char seed[SEED_LEN];
+    if (!hss_generate_root_seed_I_value( seed, I,
+                                     private_key+PRIVATE_KEY_SEED)) {
+        hss_zeroize( private_key, sizeof private_key );
+        info->error_code = hss_error_internal;
+        return false;
+    }
+
+    unsigned char *dest = malloc( len_nodes );
+    if (!dest) {
+        hss_zeroize( seed, sizeof seed );
+        hss_zeroize( private_key, sizeof private_key );
+        info->error_code = hss_error_out_of_memory;
+        return false;
+    }
+
+    struct intermed_tree_detail details;
+    details.seed = seed;
+    details.lm_type = lm_type[0];
+    details.lm_ots_type = lm_ots_type[0];
+    details.h = h;
+    details.tree_height = h0;
+    details.I = I;
+    enum hss_error_code got_error = hss_error_none;
+    details.got_error = &got_error;
+
+    struct keygen_checkpoint cp;
+    cp.data = output + SHARD_HEADER_LEN;
+    cp.len_data = len_records;
+    cp.fresh = true;
+    cp.written = 0;
+    cp.context = 0;
+
+    bool success = compute_ranges( &cp, dest, first_range, last_range,
+                       range_nodes, level, &details,
+                       private_key+PRIVATE_KEY_SEED, size_hash, info );
+    hss_zeroize( seed, sizeof seed );
+    hss_zeroize( private_key, sizeof private_key );
+    free( dest );
+    if (!success) return false;
+
+    put_bigendian( output, num_shards, 4 );
+    put_bigendian( output + 4, shard, 4 );
+    put_bigendian( output + 8, level, 4 );
+    memcpy( output + 12, I, I_LEN );
     return true;
 }
 
+/*
+ * This combines the shard outputs into the public key and aux data.  We
+ * lay the shards out as a checkpoint, and then do what
+ * hss_resume_private_key does (which fills in anything that's missing)
+ */
+bool hss_merge_keygen_shards(
+    bool (*read_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+        void *context,
+    unsigned char *public_key, size_t len_public_key,
+    unsigned char *aux_data, size_t len_aux_data,
+    unsigned num_shards,
+    const unsigned char *const *shards, const size_t *len_shards,
+    struct hss_extra_info *info) {
+    struct hss_extra_info info_temp = { 0 };
+    if (!info) info = &info_temp;
+
+    if (!shards || !len_shards || (!read_private_key && !context)) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+
+    /* We need the I value, to check that the shards are for this key */
+    unsigned levels;
+    param_set_t lm_type[ MAX_HSS_LEVELS ], lm_ots_type[ MAX_HSS_LEVELS ];
+    unsigned char private_key[ PRIVATE_KEY_LEN ];
+    if (!read_keygen_private_key( private_key, read_private_key, context,
+                                  &levels, lm_type, lm_ots_type, info )) {
+        return false;
+    }
+    unsigned char I[I_LEN];
+    unsigned char seed[SEED_LEN];
+    bool got_I = hss_generate_root_seed_I_value( seed, I,
+                                     private_key+PRIVATE_KEY_SEED);
+    hss_zeroize( seed, sizeof seed );
+    hss_zeroize( private_key, sizeof private_key );
+    if (!got_I) {
+        info->error_code = hss_error_internal;
+        return false;
+    }
+    if (!aux_data) len_aux_data = 0;
+    size_t len_checkpoint = hss_get_keygen_checkpoint_len( levels, lm_type,
+                                           lm_ots_type, len_aux_data );
+    if (len_checkpoint == 0) {
+        info->error_code = hss_error_bad_param_set;
+        return false;
+    }
+    unsigned char *checkpoint = malloc( len_checkpoint );
+    if (!checkpoint) {
+        info->error_code = hss_error_out_of_memory;
+        return false;
+    }
+    /* Ranges that no shard provides are left zero; they won't pass the */
+    /* HMAC check, and so we'll compute them */
+    memset( checkpoint, 0, len_checkpoint );
+
+    unsigned i;
+    for (i=0; i<num_shards; i++) {
+        unsigned level, size_hash;
+        merkle_index_t first_range, last_range, range_nodes;
+        if (!shard_layout( levels, lm_type, lm_ots_type, len_aux_data,
+                           i, num_shards, &level, &first_range, &last_range,
+                           &range_nodes, &size_hash )) {
+            free( checkpoint );
+            info->error_code = hss_error_bad_shard;
+            return false;
+        }
+        if (!shards[i]) continue;   /* We'll do this one ourselves */
+        size_t len_record = (size_t)(range_nodes + 1) * size_hash;
+        size_t len_records = (last_range - first_range) * len_record;
+        const unsigned char *s = shards[i];
+        if (len_shards[i] != SHARD_HEADER_LEN + len_records ||
+                get_bigendian( s, 4 ) != num_shards ||
+                get_bigendian( s + 4, 4 ) != i ||
+                get_bigendian( s + 8, 4 ) != level ||
+                0 != memcmp( s + 12, I, I_LEN )) {
+            free( checkpoint );
+            info->error_code = hss_error_bad_shard;
+            return false;
+        }
+        memcpy( checkpoint + first_range * len_record,
+                s + SHARD_HEADER_LEN, len_records );
+    }
+
+    struct keygen_checkpoint cp;
+    cp.data = checkpoint;
+    cp.len_data = len_checkpoint;
+    cp.fresh = false;
+    cp.written = 0;
+    cp.context = 0;
+
+    bool success = resume_public_key( read_private_key, context,
+                       public_key, len_public_key, aux_data, len_aux_data,
+                       &cp, info );
+    free( checkpoint );
+    return success;
+}
+
 /*
  * The length of the private key
  */
@@ -363,3 +1144,15 @@ size_t hss_get_private_key_len(unsigned levels,
        /* export it outside this module */
     return PRIVATE_KEY_LEN;
 }
+
+/*
+ * The length of a sub-key (see hss_split_working_key)
+ */
+size_t hss_get_private_subkey_len(unsigned levels,
+                   const param_set_t *lm_type,
+                   const param_set_t *lm_ots_type) {
+       /* We mark a sub-key in the first unused parameter set slot; if */
+       /* there isn't one, we can't have sub-keys */
+    if (levels >= MAX_HSS_LEVELS) return 0;
+    return PRIVATE_SUBKEY_LEN;
+}
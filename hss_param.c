@@ -91,7 +91,7 @@ bool hss_get_parameter_set( unsigned *levels,
     unsigned level;
     for (level=0; level < MAX_HSS_LEVELS; level++) {
         unsigned char c = private_key[PRIVATE_KEY_PARAM_SET + level];
-        if (c == PARM_SET_END) break;
+        if (c == PARM_SET_END || c == PARM_SET_SUBKEY) break;
             /* Decode this level's parameter set */
         param_set_t lm = (c >> 4);
         param_set_t ots = (c & 0x0f);
@@ -2,6 +2,8 @@
 #include "common_defs.h"
 #include "hss_internal.h"
 #include "hss_reserve.h"
+#include "hss_thread.h"
+#include "hss_calibrate.h"
 #include "endian.h"
 
 /*
@@ -30,6 +32,217 @@ bool hss_set_autoreserve(struct hss_working_key *w,
     return true;
 }
 
+/*
+ * Set the adaptive autoreserve; the target interval is in milliseconds
+ * (0 turns it off)
+ */
+bool hss_set_adaptive_reserve(struct hss_working_key *w,
+            unsigned write_interval, unsigned max_lost_sigs,
+            struct hss_extra_info *info) {
+    if (!w) {
+        if (info) info->error_code = hss_error_got_null;
+        return false;
+    }
+
+    hss_mutex_lock( w->lock );
+    w->adaptive_interval = (unsigned long long)write_interval * 1000000;
+    w->adaptive_max = max_lost_sigs;
+    w->adaptive_last_time = 0;  /* Start measuring afresh */
+    w->adaptive_rate = 0;
+    w->adaptive_latency = 0;
+    hss_mutex_unlock( w->lock );
+    return true;
+}
+
+/*
+ * This decides how many extra signatures to reserve, when we're in
+ * adaptive mode.  We want to write (at most) once per adaptive_interval;
+ * at the rate we've seen recently, that means reserving what we'd sign in
+ * that long (plus what we'd sign while the write itself is in progress).
+ * The rate is measured between successive reservations, and smoothed so
+ * that we follow a burst within a couple of writes.  autoreserve is the
+ * floor, and adaptive_max the ceiling (as whatever we've reserved is lost
+ * if we crash)
+ */
+static sequence_t adaptive_reserve(struct hss_working_key *w,
+                                   sequence_t cur_count,
+                                   unsigned long long now) {
+    if (w->adaptive_last_time != 0 && now > w->adaptive_last_time &&
+                                  cur_count > w->adaptive_last_count) {
+        double rate = (double)(cur_count - w->adaptive_last_count) /
+                                       (now - w->adaptive_last_time);
+        if (w->adaptive_rate == 0) {
+            w->adaptive_rate = rate;
+        } else {
+            w->adaptive_rate = (w->adaptive_rate + rate) / 2;
+        }
+    }
+    w->adaptive_last_time = now;
+    w->adaptive_last_count = cur_count;
+
+    double want = w->adaptive_rate *
+                        (w->adaptive_interval + w->adaptive_latency);
+    if (want < w->autoreserve) want = w->autoreserve;
+    if (want > w->adaptive_max) want = w->adaptive_max;
+    return (sequence_t)want;
+}
+
+/*
+ * Record how long a reservation write took
+ */
+static void adaptive_note_latency(struct hss_working_key *w,
+                                  unsigned long long latency) {
+    if (w->adaptive_latency == 0) {
+        w->adaptive_latency = latency;
+    } else {
+        w->adaptive_latency = (w->adaptive_latency + latency) / 2;
+    }
+}
+
+/*
+ * Asynchronous reservations.  Rather than writing the private key when we
+ * run out of reserved signatures (and having the signature wait for that),
+ * we ask the application to start writing the next window once the current
+ * one is half used; we keep signing out of the current window while that
+ * write is in flight, and the application tells us when it's done
+ * (hss_async_reserve_done).  We only wait if we use up the current window
+ * before then.
+ *
+ * This checks on (or, if wait is set, waits for) the write in flight; once
+ * it's complete, its reservation is ours.  This returns false if it's still
+ * in flight
+ */
+static bool reap_async_write(struct hss_working_key *w, bool wait) {
+    if (w->async_target == 0) return true;  /* Nothing in flight */
+    if (!hss_event_check( w->async_done, wait )) return false;
+    if (!w->async_failed) {
+        w->reserve_count = w->async_target;
+        put_bigendian( w->private_key + PRIVATE_KEY_INDEX, w->reserve_count,
+                       PRIVATE_KEY_INDEX_LEN );
+    }
+    w->async_target = 0;
+    return true;
+}
+
+void hss_wait_async_reserve(struct hss_working_key *w) {
+    (void)reap_async_write( w, true );
+}
+
+/*
+ * This asks the application to start writing a reservation of window
+ * signatures past base
+ */
+static bool start_async_write(struct hss_working_key *w, sequence_t base,
+                              unsigned window) {
+    sequence_t target = (w->max_count - base <= window) ? w->max_count :
+                                                          base + window;
+    put_bigendian( w->async_key, target, PRIVATE_KEY_INDEX_LEN );
+    /* Make sure that a stale completion (which we should have ignored, */
+    /* but let's be careful) isn't mistaken for this write's */
+    (void)hss_event_check( w->async_done, false );
+    w->async_target = target;
+    w->async_failed = false;
+    atomic_store( &w->async_pending, true );
+    if (!w->async_write( w->async_key, PRIVATE_KEY_INDEX_LEN,
+                         w->async_context )) {
+        /* It couldn't even get started.  The application may have */
+        /* called hss_async_reserve_done anyways; that's not a */
+        /* completion we can trust */
+        atomic_store( &w->async_pending, false );
+        (void)hss_event_check( w->async_done, false );
+        w->async_target = 0;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * This makes sure the reservation covers the signature that takes us to
+ * new_count (waiting if it doesn't, yet), and starts writing the next
+ * window if we're far enough into this one
+ */
+static bool advance_async(struct hss_working_key *w, sequence_t new_count,
+                          struct hss_extra_info *info) {
+    (void)reap_async_write( w, false );
+
+    if (new_count > w->reserve_count) {
+        /* We've used up both windows; we need to wait */
+        if (w->async_target == 0 &&
+                   !start_async_write( w, new_count - 1, w->async_window )) {
+            info->error_code = hss_error_private_key_write_failed;
+            return false;
+        }
+        (void)reap_async_write( w, true );
+        if (new_count > w->reserve_count) {
+            /* The write failed */
+            info->error_code = hss_error_private_key_write_failed;
+            return false;
+        }
+    }
+
+    /* If we've used half of the current window, start on the next one */
+    /* (if that fails, we'll try again on the next signature) */
+    if (w->async_target == 0 && w->reserve_count < w->max_count &&
+                w->reserve_count - new_count <= w->async_window / 2) {
+        (void)start_async_write( w, w->reserve_count, w->async_window );
+    }
+    return true;
+}
+
+/*
+ * This turns on (or, if async_write is NULL, off) asynchronous reservations
+ */
+bool hss_set_async_reserve(struct hss_working_key *w,
+            bool (*async_write)(const unsigned char *private_key,
+                                size_t len_private_key, void *context),
+            void *context, unsigned window,
+            struct hss_extra_info *info) {
+    if (!w) {
+        if (info) info->error_code = hss_error_got_null;
+        return false;
+    }
+    if (async_write && window == 0) {
+        if (info) info->error_code = hss_error_bad_param_set;
+        return false;
+    }
+
+    hss_mutex_lock( w->lock );
+    hss_wait_async_reserve( w );
+    bool success = true;
+    if (async_write && !w->async_done) {
+        /* We need to be able to wait for the application to tell us */
+        /* it's done; without threads, we can't */
+        w->async_done = hss_event_create();
+        if (!w->async_done) {
+            if (info) info->error_code = hss_error_no_threads;
+            success = false;
+        }
+    }
+    if (success) {
+        w->async_write = async_write;
+        w->async_context = context;
+        w->async_window = window;
+    }
+    hss_mutex_unlock( w->lock );
+    return success;
+}
+
+/*
+ * The application calls this when the write it started is complete.  This
+ * might be called from any thread (including from within async_write
+ * itself, if the write finished immediately), and so all we do here is
+ * note the result, and raise the flag.  A completion with no write in
+ * flight is ignored
+ */
+void hss_async_reserve_done(struct hss_working_key *w, bool success) {
+    if (!w) return;
+    /* Ignore it if there's no write in flight (or if we've already been */
+    /* told about this one) */
+    if (!atomic_exchange( &w->async_pending, false )) return;
+    w->async_failed = !success;
+    hss_event_signal( w->async_done );
+}
+
 /*
  * This is called when we generate a signature; it checks if we need
  * to write out a new private key (and advance the reservation); if it
@@ -43,6 +256,9 @@ bool hss_advance_count(struct hss_working_key *w, sequence_t cur_count,
         struct hss_extra_info *info, bool *trash_private_key) {
 
     if (cur_count == w->max_count) {
+        /* If we're writing a reservation, it needs to land before we */
+        /* trash the private key (or else it would undo that) */
+        hss_wait_async_reserve( w );
         /* We hit the end of the root; this will be the last signature */
         /* this private key can do */
         w->status = hss_error_private_key_expired; /* Fail if they try to */
@@ -66,12 +282,23 @@ bool hss_advance_count(struct hss_working_key *w, sequence_t cur_count,
     }
     sequence_t new_count = cur_count + 1;
 
+    if (w->async_write) {
+        return advance_async( w, new_count, info );
+    }
+
     if (new_count > w->reserve_count) {
         /* We need to advance the reservation */
 
+        sequence_t autoreserve = w->autoreserve;
+        unsigned long long start = 0;
+        if (w->adaptive_interval) {
+            start = hss_now();
+            autoreserve = adaptive_reserve( w, cur_count, start );
+        }
+
         /* Check if we have enough space to do the entire autoreservation */
-        if (w->max_count - new_count > w->autoreserve) {
-            new_count += w->autoreserve;
+        if (w->max_count - new_count > autoreserve) {
+            new_count += autoreserve;
         } else {
             /* If we don't have enough space, reserve what we can */
             new_count = w->max_count;
@@ -80,8 +307,12 @@ bool hss_advance_count(struct hss_working_key *w, sequence_t cur_count,
         put_bigendian( w->private_key + PRIVATE_KEY_INDEX, new_count,
                        PRIVATE_KEY_INDEX_LEN );
         if (update_private_key) {
-            if (!update_private_key(w->private_key, PRIVATE_KEY_INDEX_LEN,
-                                   context)) {
+            bool write_ok = update_private_key(w->private_key,
+                                   PRIVATE_KEY_INDEX_LEN, context);
+            if (w->adaptive_interval) {
+                adaptive_note_latency( w, hss_now() - start );
+            }
+            if (!write_ok) {
                  /* Oops, we couldn't write the private key; undo the */
                  /* reservation advance (and return an error) */
                  info->error_code = hss_error_private_key_write_failed;
@@ -98,6 +329,24 @@ bool hss_advance_count(struct hss_working_key *w, sequence_t cur_count,
     return true;
 }
 
+/*
+ * Figure out what the current count is (the sequence number of the next
+ * signature)
+ */
+static sequence_t get_current_count(const struct hss_working_key *w) {
+    sequence_t current_count = 0;
+    int i;
+    for (i = 0; i<w->levels; i++) {
+        struct merkle_level *tree = w->tree[i];
+            /* -1 because the current_index counts the signatures to the */
+            /* current next level */
+        current_count = (current_count << tree->level) +
+                                                  tree->current_index - 1;
+    }
+    current_count += 1;   /* The bottom-most tree isn't advanced */
+    return current_count;
+}
+
 /*
  * This will make sure that (at least) N signatures are reserved; that is, we
  * won't need to actually call the update function for the next N signatures
@@ -108,24 +357,21 @@ bool hss_advance_count(struct hss_working_key *w, sequence_t cur_count,
  * Note that if, N (or more) signatures are already reserved, this won't do
  * anything.
  */
-bool hss_reserve_signature(
+static bool reserve_signature(
     struct hss_working_key *w,
     bool (*update_private_key)(unsigned char *private_key,
             size_t len_private_key, void *context),
     void *context,
     unsigned sigs_to_reserve,
     struct hss_extra_info *info) {
-    struct hss_extra_info temp_info = { 0 };
-    if (!info) info = &temp_info;
-    if (!w) {
-        info->error_code = hss_error_got_null;
-        return false;
-    }
     if (w->status != hss_error_none) {
         info->error_code = w->status;;
         return false;
     }
 
+    /* Don't let an asynchronous write land after ours */
+    hss_wait_async_reserve( w );
+
     if (sigs_to_reserve > w->max_count) {
         info->error_code = hss_error_not_that_many_sigs_left;
         return false; /* Very funny */
@@ -146,16 +392,7 @@ bool hss_reserve_signature(
     }
 
     /* Figure out what the current count is */
-    sequence_t current_count = 0;
-    int i;
-    for (i = 0; i<w->levels; i++) {
-        struct merkle_level *tree = w->tree[i];
-            /* -1 because the current_index counts the signatures to the */
-            /* current next level */
-        current_count = (current_count << tree->level) +
-                                                  tree->current_index - 1;
-    }
-    current_count += 1;   /* The bottom-most tree isn't advanced */
+    sequence_t current_count = get_current_count( w );
 
     sequence_t new_reserve_count;  /* This is what the new reservation */
                      /* setting would be (if we accept the reservation) */
@@ -192,3 +429,165 @@ bool hss_reserve_signature(
 
     return true;
 }
+
+bool hss_reserve_signature(
+    struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    unsigned sigs_to_reserve,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+    if (!w) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+
+    /* Other threads may be signing with this working key */
+    hss_mutex_lock( w->lock );
+    bool success = reserve_signature( w, update_private_key, context,
+                                      sigs_to_reserve, info );
+    hss_mutex_unlock( w->lock );
+    return success;
+}
+
+/*
+ * This splits the signatures left in the working key into sub-keys
+ */
+static bool split_working_key(
+    struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    unsigned num_subkeys,
+    unsigned char *const *subkeys,
+    struct hss_extra_info *info) {
+    if (w->status != hss_error_none) {
+        info->error_code = w->status;
+        return false;
+    }
+
+    /* Don't let an asynchronous write land after we retire the key */
+    hss_wait_async_reserve( w );
+
+    /* If we're given a raw private key, make sure it's the one we're */
+    /* thinking of */
+    if (!update_private_key) {
+        if (0 != memcmp( context, w->private_key, PRIVATE_KEY_LEN)) {
+            info->error_code = hss_error_key_mismatch;
+            return false;   /* Private key mismatch */
+        }
+    }
+
+    /* We mark the sub-keys in the first unused parameter set slot */
+    unsigned levels = w->levels;
+    if (levels >= MAX_HSS_LEVELS) {
+        info->error_code = hss_error_bad_param_set;
+        return false;
+    }
+
+    /* The signatures we have left are current_count through max_count */
+    /* Note: if a signature is being generated, it's already claimed its */
+    /* sequence number, and so it's not in this range */
+    /* (max_count is below 2**64-1, so this doesn't overflow) */
+    sequence_t current_count = get_current_count( w );
+    sequence_t num_left = w->max_count - current_count + 1;
+    if (num_subkeys > num_left) {
+        info->error_code = hss_error_not_that_many_sigs_left;
+        return false;
+    }
+
+    /* Divide them evenly; if each sub-key gets at least a bottom tree, */
+    /* we move the boundaries up to the start of a bottom tree (so each */
+    /* signer starts with a fresh one; this never pushes a boundary past */
+    /* the end) */
+    sequence_t per_subkey = num_left / num_subkeys;
+    unsigned bottom_height = w->tree[levels-1]->level;
+    sequence_t bottom_mask = ((sequence_t)1 << bottom_height) - 1;
+    bool align = (per_subkey > bottom_mask);
+    unsigned i;
+    sequence_t start = current_count;
+    for (i=0; i<num_subkeys; i++) {
+        sequence_t end;       /* The last sequence number of this one */
+        if (i == num_subkeys - 1) {
+            end = w->max_count;
+        } else {
+            end = current_count + (i+1) * per_subkey;
+            if (align) end = (end + bottom_mask) & ~bottom_mask;
+            end -= 1;
+        }
+
+        unsigned char *subkey = subkeys[i];
+        memcpy( subkey, w->private_key, PRIVATE_KEY_LEN );
+        put_bigendian( subkey + PRIVATE_KEY_INDEX, start,
+                       PRIVATE_KEY_INDEX_LEN );
+        subkey[PRIVATE_KEY_PARAM_SET + levels] = PARM_SET_SUBKEY;
+        put_bigendian( subkey + PRIVATE_SUBKEY_MAX, end,
+                       PRIVATE_SUBKEY_MAX_LEN );
+        start = end + 1;
+    }
+
+    /* Now, retire the private key (so those signatures can't be used */
+    /* twice); we do this just as if we had hit the end of the key */
+    if (update_private_key) {
+        unsigned char private_key[PRIVATE_KEY_LEN];
+        memset( private_key, PARM_SET_END, PRIVATE_KEY_LEN );
+        if (!update_private_key(private_key, PRIVATE_KEY_LEN, context)) {
+            info->error_code = hss_error_private_key_write_failed;
+            return false;
+        }
+    } else {
+        memset( context, PARM_SET_END, PRIVATE_KEY_LEN );
+    }
+    memset( w->private_key, PARM_SET_END, PRIVATE_KEY_LEN );
+    w->status = hss_error_private_key_expired;
+
+    return true;
+}
+
+bool hss_split_working_key(
+    struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    unsigned num_subkeys,
+    unsigned char *const *subkeys, size_t len_subkey,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+    if (!w || !subkeys) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+    unsigned i;
+    for (i=0; i<num_subkeys; i++) {
+        if (!subkeys[i]) {
+            info->error_code = hss_error_got_null;
+            return false;
+        }
+    }
+    if (num_subkeys == 0) {
+        info->error_code = hss_error_bad_param_set;
+        return false;
+    }
+    if (len_subkey < PRIVATE_SUBKEY_LEN) {
+        info->error_code = hss_error_buffer_overflow;
+        return false;
+    }
+
+    /* Other threads may be signing with this working key */
+    hss_mutex_lock( w->lock );
+    bool success = split_working_key( w, update_private_key, context,
+                                      num_subkeys, subkeys, info );
+    hss_mutex_unlock( w->lock );
+
+    if (!success) {
+        /* Make sure we don't leave anything that looks like a usable */
+        /* sub-key */
+        for (i=0; i<num_subkeys; i++) {
+            hss_zeroize( subkeys[i], len_subkey );
+        }
+    }
+    return success;
+}
@@ -18,4 +18,7 @@ bool hss_advance_count(struct hss_working_key *w, sequence_t new_count,
         void *context,
         struct hss_extra_info *info, bool *trash_private_key);
 
+/* Wait for an asynchronous reservation write that's in flight */
+void hss_wait_async_reserve(struct hss_working_key *w);
+
 #endif /* HSS_RESERVE_H_ */
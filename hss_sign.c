@@ -16,6 +16,19 @@
 #include "lm_ots_common.h"
 #include "hss_derive.h"
 
+/*
+ * This returns the checkpoint cache entry that leaf r would be placed into,
+ * or -1 if it's not a leaf that we cache
+ */
+static int checkpoint_entry(const struct merkle_level *tree,
+                            merkle_index_t r) {
+    unsigned height = tree->subtree_size;  /* Size of the bottom subtrees */
+    merkle_index_t offset = r & (((merkle_index_t)1 << height) - 1);
+    if (offset >= tree->checkpoint_leaves) return -1;
+    unsigned bank = (r >> height) & 1;
+    return bank * tree->checkpoint_leaves + offset;
+}
+
 /*
  * This adds one leaf to the building and next subtree.
  */
@@ -55,12 +68,25 @@ static enum subtree_build_status subtree_add_next_node(
     if (!hss_seed_derive_init( &derive, tree->lm_type, tree->lm_ots_type,
                        I, seed )) return subtree_got_error;
     hss_seed_derive_set_q(&derive, r);
-    if (!lm_ots_generate_public_key(tree->lm_ots_type, I,
-                   r, &derive, pub_key + LEAF_PK, ots_len)) {
+
+    /* If this is a leaf of the bottom BUILDING subtree that we cache, */
+    /* save the checkpoints */
+    int entry = -1;
+    unsigned char *checkpoint = NULL;
+    if (!next_tree && subtree->levels_below == 0) {
+        entry = checkpoint_entry( tree, r );
+    }
+    if (entry >= 0) {
+        checkpoint = &tree->checkpoint[ entry * tree->ots->checkpoint_len ];
+        tree->checkpoint_q[entry] = NO_CHECKPOINT;
+    }
+    if (!tree->ots->generate_public_key(I,
+                   r, &derive, pub_key + LEAF_PK, ots_len, checkpoint)) {
         hss_seed_derive_done(&derive);
         return subtree_got_error;
     }
     hss_seed_derive_done(&derive);
+    if (entry >= 0) tree->checkpoint_q[entry] = r;
 
     /* Hash it to form the leaf node */
     union hash_context ctx;
@@ -100,11 +126,12 @@ static enum subtree_build_status subtree_add_next_node(
         subtree_index >>= 1;
     }
 
-    /* If we haven't got out of the stack, put the value there */
+    /* If we haven't got out of the stack, put the value there.  The */
+    /* stacks of all the subtrees are carved out of one array, however */
+    /* only the work item building this subtree writes to this stack, */
+    /* so we don't need the write lock */
     if (i < subtree->levels_below) {
-        if (col) hss_thread_before_write(col);
         memcpy( subtree->stack + (i * hash_size), cur_val, hash_size );
-        if (col) hss_thread_after_write(col);
     }
 
     /* Ok, we've done another node */
@@ -162,16 +189,19 @@ static int hss_step_next_tree (struct merkle_level *tree,
 }
 
 /*
- * Generate the next Merkle signature for a given level
+ * Generate a Merkle signature for a given level, using leaf current_index of
+ * the tree with the given I, seed; path lists the subtrees (one per
+ * sublevel) that hold the authentication path
  */
-static int generate_merkle_signature(
+static int sign_with_leaf(
                      unsigned char *signature, unsigned signature_len,
                      struct merkle_level *tree,
-                     const struct hss_working_key *w,
+                     struct subtree *const *path,
+                     const unsigned char *I, const unsigned char *seed,
+                     merkle_index_t current_index,
                      const void *message, size_t message_len) {
     /* First off, write the index value */
     if (signature_len < 4) return 0;
-    merkle_index_t current_index = tree->current_index;
     put_bigendian( signature, current_index, 4 );
     signature += 4; signature_len -= 4;
 
@@ -180,19 +210,35 @@ static int generate_merkle_signature(
     if (ots_sig_size == 0 || ots_sig_size > signature_len) return 0;
     if (message == NULL) {
         /* Internal interface: if message = NULL, we're supposed to */
-        /* generate everything *except* the OTS signature */
-        memset( signature, 0, ots_sig_size );
+        /* generate everything *except* the OTS signature; we leave that */
+        /* part of the signature alone (the caller takes care of it) */
+        ;
     } else {
         struct seed_derive derive;
         if (!hss_seed_derive_init( &derive,
                             tree->lm_type, tree->lm_ots_type,
-                            tree->I, tree->seed )) return 0;
+                            I, seed )) return 0;
         hss_seed_derive_set_q(&derive, current_index);
-        bool success = lm_ots_generate_signature( tree->lm_ots_type, tree->I,
+
+        /* If we have the checkpoints for this leaf, use them (they're */
+        /* only for the bottom tree, and so never for the NEXT tree) */
+        unsigned char *checkpoint = NULL;
+        int entry = (I == tree->I) ? checkpoint_entry( tree, current_index ) :
+                                     -1;
+        if (entry >= 0 && tree->checkpoint_q[entry] == current_index) {
+            checkpoint = &tree->checkpoint[ entry *
+                                            tree->ots->checkpoint_len ];
+        }
+        bool success = tree->ots->generate_signature( I,
                                     current_index, &derive,
                                     message, message_len, false,
-                                    signature, ots_sig_size);
+                                    signature, ots_sig_size, checkpoint);
         hss_seed_derive_done(&derive);
+        if (checkpoint) {
+            /* We won't need them again (and they're secret) */
+            tree->checkpoint_q[entry] = NO_CHECKPOINT;
+            hss_zeroize( checkpoint, tree->ots->checkpoint_len );
+        }
         if (!success) return 0;
     }
     signature += ots_sig_size; signature_len -= ots_sig_size;
@@ -208,7 +254,7 @@ static int generate_merkle_signature(
     unsigned n = tree->hash_size;
     for (i = tree->sublevels-1; i>=0; i--) {
         int height = (i == 0) ? tree->top_subtree_size : tree->subtree_size;
-        struct subtree *subtree = tree->subtree[i][ACTIVE_TREE];
+        struct subtree *subtree = path[i];
         merkle_index_t subtree_index = (index &
                                             (((merkle_index_t)1 << height) - 1)) +
                                        ((merkle_index_t)1 << height);
@@ -221,6 +267,29 @@ static int generate_merkle_signature(
         index >>= height;
     }
 
+    return 1;
+}
+
+/*
+ * Generate the next Merkle signature for a given level
+ */
+static int generate_merkle_signature(
+                     unsigned char *signature, unsigned signature_len,
+                     struct merkle_level *tree,
+                     const struct hss_working_key *w,
+                     const void *message, size_t message_len) {
+    struct subtree *path[MAX_SUBLEVELS];
+    unsigned i;
+    for (i=0; i<tree->sublevels; i++) {
+        path[i] = tree->subtree[i][ACTIVE_TREE];
+    }
+    merkle_index_t current_index = tree->current_index;
+    if (!sign_with_leaf( signature, signature_len, tree, path,
+                         tree->I, tree->seed, current_index,
+                         message, message_len )) {
+        return 0;
+    }
+
     /* Mark that we've generated a signature */
     tree->current_index = current_index + 1;
 
@@ -263,12 +332,119 @@ bool hss_create_signed_public_key(unsigned char *signed_key,
     return true;
 }
 
+/*
+ * Once a NEXT tree is complete, we can have the parent sign its root ahead
+ * of time, so that switching to it is just a matter of swapping in that
+ * signed public key (and doesn't hold up the signature that needs it).
+ * This figures out how the parent will sign it: which leaf, and where the
+ * authentication path for that leaf will be by then.  It returns false if
+ * we can't do that yet
+ */
+struct sign_next_detail {
+    struct hss_working_key *w;
+    unsigned level;         /* The level whose NEXT tree we sign */
+    merkle_index_t index;   /* The parent leaf we sign it with */
+    bool parent_next;       /* Set if that's in the parent's NEXT tree */
+    unsigned first_building; /* Else, the parent sublevels from this one */
+                            /* down use the BUILDING subtrees */
+    enum hss_error_code *got_error;
+};
+static bool plan_next_signed_pk(struct sign_next_detail *d,
+                                const struct hss_working_key *w,
+                                unsigned level) {
+    const struct merkle_level *tree = w->tree[level];
+    const struct merkle_level *parent = w->tree[level-1];
+    unsigned j;
+
+    /* The NEXT tree must be complete */
+    for (j=0; j<tree->sublevels; j++) {
+        if (tree->subtree[j][NEXT_TREE]->current_index != MAX_SUBINDEX) {
+            return false;
+        }
+    }
+    d->level = level;
+
+    merkle_index_t index = parent->current_index;
+    if (index > parent->max_index) {
+        /* The parent will have switched to its NEXT tree by then, and so */
+        /* will sign this with its first leaf */
+        if (level == 1) return false;   /* Actually, we'll have run out */
+        for (j=0; j<parent->sublevels; j++) {
+            if (parent->subtree[j][NEXT_TREE]->current_index !=
+                                                         MAX_SUBINDEX) {
+                return false;
+            }
+        }
+        d->index = 0;
+        d->parent_next = true;
+        return true;
+    }
+
+    /* If this is the first leaf of a subtree, the parent will have */
+    /* switched to the BUILDING subtree by then; it must be complete */
+    unsigned levels_below = 0;
+    d->first_building = parent->sublevels;
+    for (j = parent->sublevels-1; j>0; j--) {
+        levels_below += parent->subtree_size;
+        if (0 != (index & (((merkle_index_t)1 << levels_below)-1))) break;
+        const struct subtree *building = parent->subtree[j][BUILDING_TREE];
+        if (building->left_leaf != index ||
+            building->current_index != (merkle_index_t)1 << levels_below) {
+            return false;
+        }
+        d->first_building = j;
+    }
+    d->index = index;
+    d->parent_next = false;
+    return true;
+}
+
+/* This signs the root of the NEXT tree */
+/* It is (potentially) run within a thread */
+static void do_sign_next( const void *detail, struct thread_collection *col) {
+    const struct sign_next_detail *d = detail;
+    struct hss_working_key *w = d->w;
+    struct merkle_level *tree = w->tree[d->level];
+    struct merkle_level *parent = w->tree[d->level-1];
+    unsigned char *signed_key = w->next_signed_pk[d->level];
+    size_t len_signature = w->siglen[d->level-1];
+
+    struct subtree *path[MAX_SUBLEVELS];
+    unsigned j;
+    for (j=0; j<parent->sublevels; j++) {
+        int bank = d->parent_next ? NEXT_TREE :
+                   j >= d->first_building ? BUILDING_TREE : ACTIVE_TREE;
+        path[j] = parent->subtree[j][bank];
+    }
+
+    /* Where we place the public key */
+    unsigned char *public_key = signed_key + len_signature;
+    put_bigendian( public_key + 0, tree->lm_type, 4 );
+    put_bigendian( public_key + 4, tree->lm_ots_type, 4 );
+    memcpy( public_key + 8, tree->I_next, I_LEN );
+    unsigned hash_size = tree->hash_size;
+    memcpy( public_key + 8 + I_LEN, tree->subtree[0][NEXT_TREE]->nodes,
+            hash_size );
+    unsigned len_public_key = 8 + I_LEN + hash_size;
+
+    if (!sign_with_leaf( signed_key, len_signature, parent, path,
+                     d->parent_next ? parent->I_next : parent->I,
+                     d->parent_next ? parent->seed_next : parent->seed,
+                     d->index, public_key, len_public_key )) {
+        /* Report failure */
+        hss_thread_before_write(col);
+        *d->got_error = hss_error_internal;
+        hss_thread_after_write(col);
+    }
+}
+
 struct gen_sig_detail {
     unsigned char *signature;
     size_t signature_len;
     const unsigned char *message;
     size_t message_len;
     struct hss_working_key *w;
+    merkle_index_t index;      /* The bottom tree leaf we sign with */
     enum hss_error_code *got_error;
 };
 /* This does the actual signature generation */
@@ -301,8 +477,15 @@ static void do_gen_sig( const void *detail, struct thread_collection *col) {
     const unsigned char *message = d->message;
     size_t message_len = d->message_len;
 
-    if (!generate_merkle_signature(signature, signature_len,
-              w->tree[ levels-1 ], w, message, message_len)) {
+    /* The caller advances the bottom tree (as there may be several of */
+    /* these going at once) */
+    struct merkle_level *tree = w->tree[ levels-1 ];
+    struct subtree *path[MAX_SUBLEVELS];
+    for (i=0; i<tree->sublevels; i++) {
+        path[i] = tree->subtree[i][ACTIVE_TREE];
+    }
+    if (!sign_with_leaf(signature, signature_len, tree, path,
+              tree->I, tree->seed, d->index, message, message_len)) {
         goto failed;
     }
 
@@ -316,9 +499,121 @@ failed:
     hss_thread_after_write(col);
 }
 
+/*
+ * For the expensive OTS parameter sets (e.g. W8), the bottom level OTS
+ * signature is most of the work of generating a signature; if we have
+ * threads, we split its Winternitz chains into several work items
+ */
+#define MIN_SPLIT_HASHES 4096  /* Don't bother splitting an OTS signature */
+                               /* unless a public key takes at least this */
+                               /* many hashes */
+
+struct gen_chains_detail {
+    const struct bottom_ots *b;
+    const unsigned char *Q;    /* The randomized hash we're signing */
+    unsigned first_chain;
+    unsigned num_chains;
+    unsigned char *y;          /* Where in the signature the chains go */
+    enum hss_error_code *got_error;
+};
+/* This computes a range of the chains of the OTS signature */
+/* It is (potentially) run within a thread */
+static void do_gen_chains( const void *detail, struct thread_collection *col) {
+    const struct gen_chains_detail *d = detail;
+    const struct bottom_ots *b = d->b;
+    unsigned char y[ MAX_P * MAX_HASH ];
+    size_t len_y = d->num_chains * b->hash_size;
+
+    struct seed_derive derive;
+    if (!hss_seed_derive_init( &derive, b->lm_type, b->lm_ots_type,
+                               b->I, b->seed )) goto failed;
+    hss_seed_derive_set_q( &derive, b->q );
+    bool success = b->ots->generate_signature_chains( b->I, b->q,
+                             &derive, d->Q, d->first_chain, d->num_chains,
+                             y, NULL );
+    hss_seed_derive_done( &derive );
+    if (!success) goto failed;
+
+    /* Copy the chains into the signature (no other work item writes */
+    /* to this range, so we don't need the write lock) */
+    memcpy( d->y, y, len_y );
+    return;
+
+failed:
+    hss_thread_before_write(col);
+    *d->got_error = hss_error_internal;
+    hss_thread_after_write(col);
+}
+
+/*
+ * This generates the bottom level OTS signature for a leaf we've claimed.
+ * We don't hold the working key lock while we do this (it's most of the
+ * work of a signature, and the signatures of different leaves are
+ * independent), and so we look only at what's in b.  If it's worth it, we
+ * split the Winternitz chains into several work items; we do the part that
+ * can't be split (the randomizer and the message hash) ourselves
+ */
+static bool generate_bottom_ots( const struct bottom_ots *b,
+                                 const void *message, size_t message_len,
+                                 struct hss_extra_info *info ) {
+    const struct lm_ots_kernel *ots = b->ots;
+    size_t ots_sig_size = lm_ots_get_signature_len( b->lm_ots_type );
+    unsigned tracks = hss_thread_pool_num_tracks( info->thread_pool,
+                                                  info->num_threads );
+    struct seed_derive derive;
+    if (!hss_seed_derive_init( &derive, b->lm_type, b->lm_ots_type,
+                               b->I, b->seed )) return false;
+    hss_seed_derive_set_q( &derive, b->q );
+
+    if (b->checkpoint || (ots->p << ots->w) < MIN_SPLIT_HASHES ||
+                                                        tracks < 2) {
+        /* Not worth splitting (if we have the checkpoints for this leaf, */
+        /* it's cheap anyways); do it the normal way */
+        bool success = ots->generate_signature( b->I, b->q, &derive,
+                                    message, message_len, false,
+                                    b->ots_sig, ots_sig_size, b->checkpoint);
+        hss_seed_derive_done( &derive );
+        return success;
+    }
+
+    /* Fill in the parameter set and randomizer, and hash the message */
+    unsigned n = ots->n;
+    unsigned char Q[ MAX_HASH ];
+    put_bigendian( b->ots_sig, ots->lm_ots_type, 4 );
+    lm_ots_generate_randomizer( b->ots_sig + 4, n, &derive );
+    hss_seed_derive_done( &derive );
+    lm_ots_hash_message( Q, ots->h, n, b->I, b->q, b->ots_sig + 4,
+                         message, message_len );
+
+    /* And issue the chains, spread evenly over the threads */
+    struct thread_collection *col = hss_thread_init_pool(info->thread_pool,
+                                                         info->num_threads);
+    enum hss_error_code got_error = hss_error_none;
+    struct gen_chains_detail detail;
+    detail.b = b;
+    detail.Q = Q;
+    detail.got_error = &got_error;
+    unsigned p = ots->p;
+    unsigned chains_per_track = (p + tracks - 1) / tracks;
+    unsigned i;
+    for (i = 0; i < p; i += chains_per_track) {
+        detail.first_chain = i;
+        detail.num_chains = p - i;
+        if (detail.num_chains > chains_per_track) {
+            detail.num_chains = chains_per_track;
+        }
+        detail.y = b->ots_sig + 4 + n + i*n;
+        hss_thread_issue_work(col, do_gen_chains, &detail, sizeof detail);
+    }
+    hss_thread_done(col);
+
+    return got_error == hss_error_none;
+}
+
 struct step_next_detail {
     struct hss_working_key *w;
     struct merkle_level *tree;
+    unsigned count;         /* The number of steps to take */
     enum hss_error_code *got_error;
 };
 /* This steps the next tree */
@@ -327,18 +622,23 @@ static void do_step_next( const void *detail, struct thread_collection *col) {
     const struct step_next_detail *d = detail;
     struct hss_working_key *w = d->w;
     struct merkle_level *tree = d->tree;
-
-    if (!hss_step_next_tree( tree, w, col )) {
-        /* Report failure */
-        hss_thread_before_write(col);
-        *d->got_error = hss_error_internal;
-        hss_thread_after_write(col);
+    unsigned i;
+
+    for (i=0; i<d->count; i++) {
+        if (!hss_step_next_tree( tree, w, col )) {
+            /* Report failure */
+            hss_thread_before_write(col);
+            *d->got_error = hss_error_internal;
+            hss_thread_after_write(col);
+            return;
+        }
     }
 }
 
 struct step_building_detail {
     struct merkle_level *tree;
     struct subtree *subtree;
+    unsigned count;         /* The number of steps to take */
     enum hss_error_code *got_error;
 };
 /* This steps the building tree */
@@ -348,47 +648,44 @@ static void do_step_building( const void *detail,
     const struct step_building_detail *d = detail;
     struct merkle_level *tree = d->tree;
     struct subtree *subtree = d->subtree;
-
-    switch (subtree_add_next_node( subtree, tree, 0, col )) {
-    case subtree_got_error: default:
-        /* Huh? Report failure */
-        hss_thread_before_write(col);
-        *d->got_error = hss_error_internal;
-        hss_thread_after_write(col);
-        break;
-    case subtree_more_to_do:
-    case subtree_did_last_node:
-    case subtree_all_done:
-         break;
+    unsigned i;
+
+    for (i=0; i<d->count; i++) {
+        switch (subtree_add_next_node( subtree, tree, 0, col )) {
+        case subtree_got_error: default:
+            /* Huh? Report failure */
+            hss_thread_before_write(col);
+            *d->got_error = hss_error_internal;
+            hss_thread_after_write(col);
+            return;
+        case subtree_more_to_do:
+        case subtree_did_last_node:
+        case subtree_all_done:
+             break;
+        }
     }
 }
 
-struct update_parent_detail {
-    struct hss_working_key *w;
-    enum hss_error_code *got_error;
-};
 /*
  * This gives an update to the parent (non-bottom Merkle trees)
  */
-static void do_update_parent( const void *detail,
-                                            struct thread_collection *col) {
-    const struct update_parent_detail *d = detail;
-    struct hss_working_key *w = d->w;
+static bool update_parent( struct hss_working_key *w,
+                           struct thread_collection *col) {
     unsigned levels = w->levels;
     unsigned current_level = levels - 2;  /* We start with the first */
                                           /* non-bottom level */
     for (;;) {
         struct merkle_level *tree = w->tree[current_level];
         switch (tree->update_count) {
-        case UPDATE_DONE: return;   /* No more updates needed */
+        case UPDATE_DONE: return true;   /* No more updates needed */
         case UPDATE_NEXT:           /* Our job is to update the next tree */
             tree->update_count = UPDATE_PARENT;
-            if (current_level == 0) return; /* No next tree to update */
-            if (!hss_step_next_tree( tree, w, col )) goto failed;
-            return;
+            if (current_level == 0) return true; /* No next tree to update */
+            if (!hss_step_next_tree( tree, w, col )) return false;
+            return true;
         case UPDATE_PARENT:         /* Our job is to update our parent */
             tree->update_count = UPDATE_BUILDING + 0;
-            if (current_level == 0) return; /* No parent to update */
+            if (current_level == 0) return true; /* No parent to update */
             current_level -= 1;
             continue;
         default: {
@@ -399,7 +696,7 @@ static void do_update_parent( const void *detail,
                 /* We've completed all the updates we need to do (until */
                 /* the next time we need to sign something) */
                 tree->update_count = UPDATE_DONE;
-                return;
+                return true;
             }
 
             /* Next time, update the next BUILDING subtree */
@@ -414,192 +711,211 @@ static void do_update_parent( const void *detail,
             /* Check if we'd actually use the building tree */
             if (subtree->left_leaf >= tree_leaves) {
                     /* We'll never use it; don't bother updating it */
-                return;
+                return true;
             }
 
             /* We'll use the BUILDING_TREE, actually add a node */
             switch (subtree_add_next_node( subtree, tree, 0, col )) {
-            case subtree_got_error: default: goto failed; /* Huh? */
+            case subtree_got_error: default: return false; /* Huh? */
             case subtree_did_last_node:
             case subtree_all_done:
             case subtree_more_to_do:
                 /* We're done everything we need to do for this step */
-                return;
+                return true;
             }
         }
         }
     }
+}
 
-failed:
-    /* Huh? Report failure */
-    hss_thread_before_write(col);
-    *d->got_error = hss_error_internal;
-    hss_thread_after_write(col);
+struct update_parent_detail {
+    struct hss_working_key *w;
+    unsigned count;         /* The number of updates to give */
+    enum hss_error_code *got_error;
+};
+/* This gives the parent its updates */
+/* It is (potentially) run within a thread */
+static void do_update_parent( const void *detail,
+                                            struct thread_collection *col) {
+    const struct update_parent_detail *d = detail;
+    unsigned i;
+
+    for (i=0; i<d->count; i++) {
+        if (!update_parent( d->w, col )) {
+            /* Huh? Report failure */
+            hss_thread_before_write(col);
+            *d->got_error = hss_error_internal;
+            hss_thread_after_write(col);
+            return;
+        }
+    }
 }
 
 /*
- * Code to actually generate the signature
+ * This issues the orders to sign any NEXT trees that are complete (and
+ * haven't been signed yet)
  */
-bool hss_generate_signature(
-    struct hss_working_key *w,
-    bool (*update_private_key)(unsigned char *private_key,
-            size_t len_private_key, void *context),
-    void *context,
-    const void *message, size_t message_len,
-    unsigned char *signature, size_t signature_buf_len,
-    struct hss_extra_info *info) {
-    struct hss_extra_info temp_info = { 0 };
-    if (!info) info = &temp_info;
-    int i;
-    bool trash_private_key = false;
-
-    info->last_signature = false;
-
-    if (!w) {
-         info->error_code = hss_error_got_null;
-         goto failed;
-    }
-    if (w->status != hss_error_none) {
-        info->error_code = w->status;
-        goto failed;
-    }
-
-    /* If we're given a raw private key, make sure it's the one we're */
-    /* thinking of */
-    if (!update_private_key) {
-        if (0 != memcmp( context, w->private_key, PRIVATE_KEY_LEN)) {
-            info->error_code = hss_error_key_mismatch;
-            return false;   /* Private key mismatch */
+static void issue_sign_next(struct thread_collection *col,
+                            struct hss_working_key *w,
+                            enum hss_error_code *got_error) {
+    unsigned i;
+    for (i=1; i<w->levels; i++) {
+        struct sign_next_detail sign_detail;
+        if (w->next_signed_pk_q[i] != NO_SIGNED_PK ||
+                           !plan_next_signed_pk( &sign_detail, w, i )) {
+            continue;
         }
-    }
+        sign_detail.w = w;
+        sign_detail.got_error = got_error;
+        w->next_signed_pk_q[i] = sign_detail.index;
 
-    /* Check if the buffer we were given is too short */
-    if (w->signature_len > signature_buf_len) {
-        /* The signature would overflow the buffer */
-        info->error_code = hss_error_buffer_overflow;
-        goto failed;
+        hss_thread_issue_work(col, do_sign_next, &sign_detail, sizeof sign_detail);
     }
+}
 
+/*
+ * This issues the orders that update the BUILDING and NEXT subtrees (and give
+ * the parent trees their update) after count signatures; index is the
+ * current index of the bottom tree after the first of those signatures was
+ * generated.  We issue one order per subtree we update (which takes all
+ * count steps for that subtree)
+ */
+static void issue_updates(struct thread_collection *col,
+                          struct hss_working_key *w,
+                          merkle_index_t index, unsigned count,
+                          enum hss_error_code *got_error) {
     unsigned levels = w->levels;
-    /*
-     * Compile the current count
-     */
-    sequence_t current_count = 0;
-    for (i=0; i < levels; i++) {
-        struct merkle_level *tree = w->tree[i];
-        current_count <<= tree->level;
-            /* We subtract 1 because the nonbottom trees are already advanced */
-        current_count += (sequence_t)tree->current_index - 1;
-    }
-    current_count += 1;   /* Bottom most tree isn't already advanced */
-
-    /* Ok, try to advance the private key */
-    if (!hss_advance_count(w, current_count,
-                               update_private_key, context, info,
-                               &trash_private_key)) {
-        /* hss_advance_count fills in the error reason */
-        goto failed;
-    }
-
-       /* Ok, now actually generate the signature */
-
-    /* We'll be doing several things in parallel */
-    struct thread_collection *col = hss_thread_init(info->num_threads);
-    enum hss_error_code got_error = hss_error_none;
-
-    /* Generate the signature */
-    {
-        struct gen_sig_detail gen_detail;
-        gen_detail.signature = signature;
-        gen_detail.signature_len = w->signature_len;
-        gen_detail.message = message;
-        gen_detail.message_len = message_len;
-        gen_detail.w = w;
-        gen_detail.got_error = &got_error;
+    int i;
 
-        hss_thread_issue_work(col, do_gen_sig, &gen_detail, sizeof gen_detail);
-    }
+    /* If any NEXT tree has been completed, sign it now (we do this first, */
+    /* as the rest may update what we look at) */
+    issue_sign_next( col, w, got_error );
 
     /* Update the bottom level next tree */
     if (levels > 1) {
         struct step_next_detail step_detail;
         step_detail.w = w;
         step_detail.tree = w->tree[levels-1];
-        step_detail.got_error = &got_error;
+        step_detail.count = count;
+        step_detail.got_error = got_error;
 
         hss_thread_issue_work(col, do_step_next, &step_detail, sizeof step_detail);
     }
 
     /* Issue orders to step each of the building subtrees in the bottom tree */
-    int skipped_a_level = 0;   /* Set if the below issued didn't issue an */
-                               /* order for at least one level */
+    unsigned not_skipped = count; /* The number of signatures for which the */
+                               /* below issued an order for every level */
     {
         struct merkle_level *tree = w->tree[levels-1];
-        merkle_index_t updates_before_end = tree->max_index - tree->current_index + 1;
         int h_subtree = tree->subtree_size;
         for (i=1; i<tree->sublevels; i++) {
             struct subtree *subtree = tree->subtree[i][BUILDING_TREE];
-                /* Check if there is a building tree */
-            if (updates_before_end < (merkle_index_t)1 <<
-                                         (subtree->levels_below + h_subtree)) {
-                /* No; we're at the last subtree within this tree */
-                skipped_a_level = 1;
-                continue;
+                /* Check which of the signatures have a building tree; */
+                /* it's the ones up to the point where we're at the last */
+                /* subtree within this tree */
+            merkle_index_t last_index = tree->max_index + 1 -
+                        ((merkle_index_t)1 << (subtree->levels_below + h_subtree));
+            unsigned steps = 0;
+            if (last_index >= index) {
+                steps = (last_index - index + 1 < count) ?
+                                         last_index - index + 1 : count;
             }
+            if (steps < not_skipped) not_skipped = steps;
+            if (steps == 0) continue;
+
             struct step_building_detail step_detail;
             step_detail.tree = tree;
             step_detail.subtree = subtree;
-            step_detail.got_error = &got_error;
+            step_detail.count = steps;
+            step_detail.got_error = got_error;
 
             hss_thread_issue_work(col, do_step_building, &step_detail, sizeof step_detail);
 
         }
             /* If there's only one sublevel, act as if we always skipped a sublevel */
-        if (tree->sublevels == 1) skipped_a_level = 1;
+        if (tree->sublevels == 1) not_skipped = 0;
     }
 
     /*
-     * And, if we're allowed to give the parent a chance to update, and
-     * there's a parent with some updating that needs to be done, schedule
-     * that to be done
+     * And, for the signatures where we're allowed to give the parent a
+     * chance to update, if there's a parent with some updating that needs to
+     * be done, schedule that to be done
      */
-    if (skipped_a_level &&
+    if (not_skipped < count &&
         levels > 1 && w->tree[levels-2]->update_count != UPDATE_DONE) {
         struct update_parent_detail detail;
         detail.w = w;
-        detail.got_error = &got_error;
+        detail.count = count - not_skipped;
+        detail.got_error = got_error;
         hss_thread_issue_work(col, do_update_parent, &detail, sizeof detail);
     }
+}
 
-    /* Wait for all of them to finish */ 
-    hss_thread_done(col);
+/*
+ * After the last signature of a bottom tree, the updates are what typically
+ * complete the NEXT trees, and we need those trees signed before the next
+ * signature.  So, we do those updates, and then sign the NEXT trees, in
+ * order, as a single work item
+ */
+struct updates_detail {
+    struct hss_working_key *w;
+    merkle_index_t index;
+    enum hss_error_code *got_error;
+};
+static void do_updates_then_sign( const void *detail,
+                                  struct thread_collection *col) {
+    const struct updates_detail *d = detail;
+    issue_updates( NULL, d->w, d->index, 1, d->got_error );
+    issue_sign_next( NULL, d->w, d->got_error );
+}
 
-    /* Check if any of them reported a failure */
-    if (got_error != hss_error_none) {
-        info->error_code = got_error;
-        goto failed;
+/*
+ * This does the updates that the signatures we generated while the working
+ * key was being loaded in the background skipped (the load must be done by
+ * now).  We do them in the order we would have, one signature at a time
+ */
+static bool catch_up_updates(struct hss_working_key *w,
+                             struct hss_extra_info *info) {
+    while (w->deferred_updates > 0) {
+        struct thread_collection *col = hss_thread_init_pool(
+                                  info->thread_pool, info->num_threads);
+        enum hss_error_code got_error = hss_error_none;
+        issue_updates( col, w, w->deferred_index, 1, &got_error );
+        hss_thread_done(col);
+        if (got_error != hss_error_none) {
+            /* We've left the subtrees half updated; this working key */
+            /* is no longer usable */
+            w->status = got_error;
+            info->error_code = got_error;
+            return false;
+        }
+        w->deferred_index += 1;
+        w->deferred_updates -= 1;
     }
+    return true;
+}
 
-    current_count += 1;  /* The new count is one more than what is */
-                         /* implied by the initial state of the Merkle trees */
-
-    /*
-     * Now, we scan to see if we exhausted a Merkle tree, and need to update it
-     * At the same time, we check to see if we need to advance the subtrees
-     */
-    sequence_t cur_count = current_count;
+/*
+ * Once the signatures up to (but not including) cur_count have been
+ * generated, this scans to see if we exhausted a Merkle tree, and need to
+ * update it.  At the same time, we check to see if we need to advance the
+ * subtrees
+ */
+static bool advance_subtrees(struct hss_working_key *w, sequence_t cur_count,
+                             struct hss_extra_info *info) {
     unsigned merkle_levels_below = 0;
     int switch_merkle = w->levels;
     struct merkle_level *tree;
+    int i;
     for (i = w->levels-1; i>=0; i--, merkle_levels_below += tree->level) {
         tree = w->tree[i];
 
         if (0 == (cur_count & (((sequence_t)1 << (merkle_levels_below + tree->level))-1))) {
             /* We exhausted this tree */
             if (i == 0) {
-                /* We've run out of signatures; we've already caught this */
-                /* above; just make *sure* we've marked the key as */
-                /* unusable, and give up */
+                /* We've run out of signatures; hss_advance_count has */
+                /* already caught this; just make *sure* we've marked */
+                /* the key as unusable, and give up */
                 w->status = hss_error_private_key_expired;
                 break;
             }
@@ -666,6 +982,9 @@ done_advancing:
             }
         }
 
+        /* The checkpoints we have are for the old tree */
+        hss_reset_checkpoints( tree );
+
         /* Copy in the value of seed, I we'll use for the new tree */
         memcpy( tree->seed, tree->seed_next, SEED_LEN );
         memcpy( tree->I, tree->I_next, I_LEN );
@@ -687,19 +1006,313 @@ done_advancing:
 
          tree->current_index = 0;  /* We're starting this from scratch */
 
+         /* If we've already signed the new level, just swap that in */
+         if (w->next_signed_pk_q[i] == parent->current_index) {
+             unsigned char *signed_pk = w->next_signed_pk[i];
+             w->next_signed_pk[i] = w->signed_pk[i];
+             w->signed_pk[i] = signed_pk;
+             w->next_signed_pk_q[i] = NO_SIGNED_PK;
+             parent->current_index += 1;
+             parent->update_count = UPDATE_NEXT;
+             continue;
+         }
+         w->next_signed_pk_q[i] = NO_SIGNED_PK;
+
          /* Generate the signature of the new level */
          if (!hss_create_signed_public_key( w->signed_pk[i], w->siglen[i-1],
                                         tree, parent, w )) {
             info->error_code = hss_error_internal;
+            return false;
+        }
+    }
+
+
+    return true;
+}
+
+/*
+ * Compile the current count (the sequence number of the next signature)
+ */
+static sequence_t get_current_count(const struct hss_working_key *w) {
+    sequence_t current_count = 0;
+    unsigned i;
+    for (i=0; i < w->levels; i++) {
+        const struct merkle_level *tree = w->tree[i];
+        current_count <<= tree->level;
+            /* We subtract 1 because the nonbottom trees are already advanced */
+        current_count += (sequence_t)tree->current_index - 1;
+    }
+    current_count += 1;   /* Bottom most tree isn't already advanced */
+    return current_count;
+}
+
+/*
+ * This returns true if the signature that takes us to count is the last one
+ * of the bottom subtree (that is, we'll need to switch subtrees, and so we
+ * need the ones we've been building)
+ */
+static bool at_subtree_end(const struct hss_working_key *w,
+                           sequence_t count) {
+    const struct merkle_level *tree = w->tree[w->levels-1];
+    unsigned bottom_size = (tree->sublevels > 1) ? tree->subtree_size :
+                                                   tree->level;
+    return 0 == (count & (((sequence_t)1 << bottom_size) - 1));
+}
+
+/*
+ * This waits for the updates that the last signature started in the
+ * background to finish
+ */
+void hss_wait_pending_updates(struct hss_working_key *w) {
+    hss_thread_done( w->maintenance );
+    w->maintenance = NULL;
+}
+
+/*
+ * This waits for the updates that the last signature started, and then (if
+ * that signature was the last one of the bottom subtree) switches to the
+ * next subtree.  After this, the working key is ready for the next signature
+ */
+bool hss_finish_pending_updates(struct hss_working_key *w,
+                                struct hss_extra_info *info) {
+    hss_wait_pending_updates( w );
+    if (w->maintenance_error != hss_error_none) {
+        /* We've left the subtrees half updated; this working key is no */
+        /* longer usable */
+        w->status = w->maintenance_error;
+        info->error_code = w->maintenance_error;
+        w->maintenance_error = hss_error_none;
+        w->pending_advance = false;
+        return false;
+    }
+    if (w->pending_advance) {
+        w->pending_advance = false;
+        if (!advance_subtrees( w, w->advance_count, info )) {
+            w->status = info->error_code;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * If the working key was loaded in the background, wait for it to complete
+ * (along with anything the last signature left for us to do).  The caller
+ * holds the lock
+ */
+static bool finish_working_key(struct hss_working_key *w,
+                               struct hss_extra_info *info) {
+    if (!hss_finish_pending_updates( w, info )) return false;
+    (void)hss_wait_background_load( w, true );
+    if (w->status != hss_error_none) {
+        info->error_code = w->status;
+        return false;
+    }
+    return catch_up_updates( w, info );
+}
+
+bool hss_finish_working_key(struct hss_working_key *w,
+                            struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+
+    if (!w) {
+        info->error_code = hss_error_got_null;
+        return false;
+    }
+    hss_mutex_lock( w->lock );
+    bool success = finish_working_key( w, info );
+    hss_mutex_unlock( w->lock );
+    return success;
+}
+
+/*
+ * This claims the next leaf, and writes everything except the bottom OTS
+ * signature.  This is the part of signing that updates the working key, and
+ * so we do it while holding the lock; it's cheap (apart from the occasional
+ * signature that needs to wait for the subtree updates), and so threads
+ * that sign with the same working key don't hold each other up for long
+ */
+bool hss_claim_signature(struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    unsigned char *signature, size_t signature_buf_len,
+    struct bottom_ots *b, struct hss_extra_info *info) {
+    int i;
+    bool trash_private_key = false;
+
+    info->last_signature = false;
+    info->used_checkpoint = false;
+    b->checkpoint = NULL;
+
+    if (!w) {
+         info->error_code = hss_error_got_null;
+         memset( signature, 0, signature_buf_len );
+         return false;
+    }
+    hss_mutex_lock( w->lock );
+
+    /* If the last signature took us to the end of a subtree, we need to */
+    /* finish switching to the next one */
+    if (w->pending_advance && !hss_finish_pending_updates( w, info )) {
+        goto failed;
+    }
+    if (w->status != hss_error_none) {
+        info->error_code = w->status;
+        goto failed;
+    }
+
+    /* If we're given a raw private key, make sure it's the one we're */
+    /* thinking of */
+    if (!update_private_key) {
+        if (0 != memcmp( context, w->private_key, PRIVATE_KEY_LEN)) {
+            info->error_code = hss_error_key_mismatch;
+            hss_mutex_unlock( w->lock );
+            return false;   /* Private key mismatch */
+        }
+    }
+
+    /* Check if the buffer we were given is too short */
+    if (w->signature_len > signature_buf_len) {
+        /* The signature would overflow the buffer */
+        info->error_code = hss_error_buffer_overflow;
+        goto failed;
+    }
+
+    unsigned levels = w->levels;
+    sequence_t current_count = get_current_count( w );
+
+    /*
+     * If the working key is still being loaded in the background, we can
+     * go ahead (and skip the updates for now), unless this signature takes
+     * us to the end of the bottom subtree; then we need the subtrees being
+     * built, and so we wait for them
+     */
+    bool defer_updates = false;
+    if (w->pending_load || w->deferred_updates > 0) {
+        bool need_subtrees = at_subtree_end( w, current_count + 1 );
+        if (!hss_wait_background_load( w, need_subtrees )) {
+            defer_updates = true;
+        } else if (w->status != hss_error_none) {
+            info->error_code = w->status;
+            goto failed;
+        } else if (!catch_up_updates( w, info )) {
             goto failed;
         }
     }
 
+    /* Ok, try to advance the private key; once this is done, the leaf */
+    /* is ours (the reservation covers it), even after we drop the lock */
+    if (!hss_advance_count(w, current_count,
+                               update_private_key, context, info,
+                               &trash_private_key)) {
+        /* hss_advance_count fills in the error reason */
+        goto failed;
+    }
+
+    /* The bottom tree index, once this signature is generated */
+    struct merkle_level *bottom = w->tree[levels-1];
+    merkle_index_t index_after = bottom->current_index + 1;
+
+    /* Locate the bottom level OTS signature; we fill it in later */
+    unsigned char *ots_sig = signature + 4;
+    for (i=1; i<levels; i++) {
+        ots_sig += w->signed_pk_len[i];
+    }
+    ots_sig += 4;
+    memset( ots_sig, 0, lm_ots_get_signature_len( bottom->lm_ots_type ));
+
+    /* Generate the rest of the signature (which is just copying) */
+    enum hss_error_code got_error = hss_error_none;
+    struct gen_sig_detail gen_detail;
+    gen_detail.signature = signature;
+    gen_detail.signature_len = w->signature_len;
+    gen_detail.message = NULL;
+    gen_detail.message_len = 0;
+    gen_detail.w = w;
+    gen_detail.index = index_after - 1;
+    gen_detail.got_error = &got_error;
+    do_gen_sig( &gen_detail, NULL );
+    if (got_error != hss_error_none) {
+        info->error_code = got_error;
+        goto failed;
+    }
+
+    /* Copy out what we need to generate the OTS signature */
+    merkle_index_t q = index_after - 1;
+    b->ots = bottom->ots;
+    b->lm_type = bottom->lm_type;
+    b->lm_ots_type = bottom->lm_ots_type;
+    b->h = bottom->h;
+    b->hash_size = bottom->hash_size;
+    b->q = q;
+    memcpy( b->I, bottom->I, I_LEN );
+    memcpy( b->seed, bottom->seed, SEED_LEN );
+    b->ots_sig = ots_sig;
+    int entry = checkpoint_entry( bottom, q );
+    if (entry >= 0 && bottom->checkpoint_q[entry] == q) {
+        /* We have the checkpoints for this leaf; take them (we won't */
+        /* need them again, and they're secret).  If we can't get the */
+        /* memory, we just do without */
+        unsigned char *checkpoint = &bottom->checkpoint[ entry *
+                                             bottom->ots->checkpoint_len ];
+        b->checkpoint = malloc( bottom->ots->checkpoint_len );
+        if (b->checkpoint) {
+            memcpy( b->checkpoint, checkpoint, bottom->ots->checkpoint_len );
+            info->used_checkpoint = true;
+        }
+        bottom->checkpoint_q[entry] = NO_CHECKPOINT;
+        hss_zeroize( checkpoint, bottom->ots->checkpoint_len );
+    }
+    bottom->current_index = index_after;
+
+    /*
+     * Now, update the subtrees for the next signature.  The caller doesn't
+     * need to wait for that; if we have threads, we do it in the background
+     * (once the updates the previous signature started are done), and
+     * return the signature now.  If this signature was the last one of the
+     * bottom subtree, we switch to the next subtree at the start of the next
+     * signature (as that's when we need it)
+     */
+    if (!hss_finish_pending_updates( w, info )) goto failed;
+    if (defer_updates) {
+        /* We're putting that off until the load is done */
+        if (w->deferred_updates == 0) w->deferred_index = index_after;
+        w->deferred_updates += 1;
+    } else {
+        w->maintenance = hss_thread_init_background( info->thread_pool,
+                                                     info->num_threads );
+        if (index_after > bottom->max_index) {
+            struct updates_detail detail;
+            detail.w = w;
+            detail.index = index_after;
+            detail.got_error = &w->maintenance_error;
+            hss_thread_issue_work( w->maintenance, do_updates_then_sign,
+                                   &detail, sizeof detail );
+        } else {
+            issue_updates( w->maintenance, w, index_after, 1,
+                           &w->maintenance_error );
+        }
+    }
+    if (at_subtree_end( w, current_count + 1 )) {
+        w->pending_advance = true;
+        w->advance_count = current_count + 1;
+    }
+    /* If we don't have threads (so the updates are already done), or if */
+    /* that was the last signature, there's no point in leaving this for */
+    /* later */
+    if ((!w->maintenance || info->last_signature) &&
+                           !hss_finish_pending_updates( w, info )) {
+        goto failed;
+    }
+
     /* And we've set things up for the next signature... */
 
     if (trash_private_key) {
         memset( w->private_key, PARM_SET_END, PRIVATE_KEY_LEN );
     }
+    hss_mutex_unlock( w->lock );
 
     return true;
 
@@ -708,6 +1321,8 @@ failed:
     if (trash_private_key) {
         memset( w->private_key, PARM_SET_END, PRIVATE_KEY_LEN );
     }
+    hss_mutex_unlock( w->lock );
+    hss_release_bottom_ots( b );
 
     /* On failure, make sure that we don't return anything that might be */
     /* misconstrued as a real signature */
@@ -715,6 +1330,219 @@ failed:
     return false;
 }
 
+/*
+ * We're done with the OTS signature for a leaf we've claimed; forget the
+ * secrets we copied out for it
+ */
+void hss_release_bottom_ots(struct bottom_ots *b) {
+    if (b->checkpoint) {
+        hss_zeroize( b->checkpoint, b->ots->checkpoint_len );
+        free( b->checkpoint );
+        b->checkpoint = NULL;
+    }
+    hss_zeroize( b->seed, SEED_LEN );
+}
+
+/*
+ * Code to actually generate the signature.  Several threads may call this
+ * with the same working key at once; they take turns claiming leaves (and
+ * updating the subtrees), and generate their OTS signatures in parallel
+ */
+bool hss_generate_signature(
+    struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    const void *message, size_t message_len,
+    unsigned char *signature, size_t signature_buf_len,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+
+    struct bottom_ots b;
+    if (!hss_claim_signature( w, update_private_key, context,
+                              signature, signature_buf_len, &b, info )) {
+        /* hss_claim_signature fills in the error reason */
+        return false;
+    }
+
+    /* If message = NULL, the caller is doing the OTS signature itself */
+    bool success = true;
+    if (message != NULL &&
+                !generate_bottom_ots( &b, message, message_len, info )) {
+        info->error_code = hss_error_internal;
+        memset( signature, 0, signature_buf_len );
+        success = false;
+    }
+    hss_release_bottom_ots( &b );
+
+    return success;
+}
+
+/*
+ * Generate signatures for a batch of messages.  We reserve all of them with
+ * (at most) one update to the private key, and then go through them a
+ * bottom subtree at a time; within a subtree, the signatures differ only in
+ * the bottom OTS signature (and which leaf it is), and so we generate them
+ * all in parallel, and then do the subtree updates for all of them at once
+ */
+bool hss_generate_signatures_batch(
+    struct hss_working_key *w,
+    bool (*update_private_key)(unsigned char *private_key,
+            size_t len_private_key, void *context),
+    void *context,
+    const void *const *messages, const size_t *message_lens,
+    size_t num_messages,
+    unsigned char *const *signatures, size_t signature_buf_len,
+    struct hss_extra_info *info) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+    bool trash_private_key = false;
+    size_t done = 0;   /* The number of signatures we've generated */
+    struct hss_mutex *lock = NULL;  /* The lock, once we hold it */
+
+    info->last_signature = false;
+
+    if (!w || !messages || !message_lens || !signatures) {
+         info->error_code = hss_error_got_null;
+         goto failed;
+    }
+    if (num_messages == 0) return true;
+
+    /* We hold the lock for the entire batch (as it keeps updating the */
+    /* subtrees as it goes) */
+    lock = w->lock;
+    hss_mutex_lock( lock );
+
+    /* Finish up anything that the previous signature (or load) left */
+    if (!finish_working_key( w, info )) goto failed;
+
+    /* If we're given a raw private key, make sure it's the one we're */
+    /* thinking of */
+    if (!update_private_key) {
+        if (0 != memcmp( context, w->private_key, PRIVATE_KEY_LEN)) {
+            info->error_code = hss_error_key_mismatch;
+            hss_mutex_unlock( lock );
+            return false;   /* Private key mismatch */
+        }
+    }
+
+    /* Check if the buffers we were given are too short */
+    if (w->signature_len > signature_buf_len) {
+        info->error_code = hss_error_buffer_overflow;
+        goto failed;
+    }
+
+    unsigned levels = w->levels;
+    sequence_t current_count = get_current_count( w );
+
+    /* Make sure we can do all of them before we do any */
+    if (num_messages - 1 > w->max_count - current_count) {
+        info->error_code = hss_error_not_that_many_sigs_left;
+        goto failed;
+    }
+
+    /* Advance the private key past the entire batch; this is the only */
+    /* update we'll make */
+    if (!hss_advance_count(w, current_count + (num_messages - 1),
+                               update_private_key, context, info,
+                               &trash_private_key)) {
+        /* hss_advance_count fills in the error reason */
+        goto failed;
+    }
+
+    struct merkle_level *bottom = w->tree[levels-1];
+    unsigned bottom_size = (bottom->sublevels > 1) ? bottom->subtree_size :
+                                                     bottom->level;
+    while (done < num_messages) {
+        /* The signatures that remain in the current bottom subtree */
+        sequence_t left_in_subtree = ((sequence_t)1 << bottom_size) -
+                    (current_count & (((sequence_t)1 << bottom_size) - 1));
+        unsigned count = (left_in_subtree < num_messages - done) ?
+                                 left_in_subtree : num_messages - done;
+        merkle_index_t index = bottom->current_index;
+
+        /* Generate those signatures */
+        struct thread_collection *col = hss_thread_init_pool(
+                                  info->thread_pool, info->num_threads);
+        enum hss_error_code got_error = hss_error_none;
+        unsigned i;
+        for (i=0; i<count; i++) {
+            struct gen_sig_detail gen_detail;
+            gen_detail.signature = signatures[done+i];
+            gen_detail.signature_len = w->signature_len;
+            gen_detail.message = messages[done+i];
+            gen_detail.message_len = message_lens[done+i];
+            gen_detail.w = w;
+            gen_detail.index = index + i;
+            gen_detail.got_error = &got_error;
+
+            hss_thread_issue_work(col, do_gen_sig, &gen_detail, sizeof gen_detail);
+        }
+        hss_thread_done(col);
+        if (got_error != hss_error_none) {
+            info->error_code = got_error;
+            goto failed;
+        }
+        bottom->current_index = index + count;
+        done += count;
+        current_count += count;
+
+        /* Update the subtrees for all of them, and move to the next */
+        /* subtree (if we've reached it) */
+        col = hss_thread_init_pool( info->thread_pool, info->num_threads );
+        issue_updates( col, w, index + 1, count, &got_error );
+        hss_thread_done(col);
+
+        /* Those updates may have completed some NEXT trees (issue_updates */
+        /* looked for those before the updates ran); if so, sign them now, */
+        /* so that advance_subtrees can just swap them in */
+        if (got_error == hss_error_none) {
+            col = hss_thread_init_pool( info->thread_pool,
+                                        info->num_threads );
+            issue_sign_next( col, w, &got_error );
+            hss_thread_done(col);
+        }
+        if (got_error != hss_error_none) {
+            /* We've left the subtrees half updated; this working key is */
+            /* no longer usable */
+            w->status = got_error;
+            info->error_code = got_error;
+            goto failed;
+        }
+        if (at_subtree_end( w, current_count ) &&
+                       !advance_subtrees( w, current_count, info )) {
+            w->status = info->error_code;
+            goto failed;
+        }
+    }
+
+    if (trash_private_key) {
+        memset( w->private_key, PARM_SET_END, PRIVATE_KEY_LEN );
+    }
+    hss_mutex_unlock( lock );
+
+    return true;
+
+failed:
+
+    if (trash_private_key) {
+        memset( w->private_key, PARM_SET_END, PRIVATE_KEY_LEN );
+    }
+    hss_mutex_unlock( lock );
+
+    /* On failure, make sure that we don't return anything that might be */
+    /* misconstrued as a real signature (including the ones we did */
+    /* generate; the caller doesn't know which those are) */
+    if (signatures) {
+        size_t i;
+        for (i=0; i<num_messages; i++) {
+            if (signatures[i]) memset( signatures[i], 0, signature_buf_len );
+        }
+    }
+    return false;
+}
+
 /*
  * Get the signature length
  */
@@ -45,46 +45,42 @@ bool hss_sign_init(
     ctx->status = hss_error_ctx_uninitialized; /* Until we hear otherwise, */
                                        /* we got a failure */
 
-    if (!w) {
-        info->error_code = hss_error_got_null;
-        return false;
-    }
-    if (w->status != hss_error_none) {
-        info->error_code = w->status;
+    /*
+     * Ask the signature generation process to claim a leaf, and do
+     * everything *except* the bottom level OTS signature (we don't have the
+     * message yet).  We get the leaf (and its I and seed values) back; we
+     * need to take them from there (rather than the working key), as
+     * another thread may be signing with the working key by the time we
+     * look at it
+     */
+    struct bottom_ots b;
+    if (!hss_claim_signature( w, update_private_key, context,
+                              signature, signature_len, &b, info )) {
+        /* On failure, hss_claim_signature fills in the failure reason */
+        ctx->status = info->error_code;
         return false;
     }
 
-    struct merkle_level *bottom = w->tree[ w->levels - 1 ];
-
-    unsigned char I[I_LEN];
-    memcpy( I, bottom->I, I_LEN );
-
     /* Compute the value of C we'll use */
-    merkle_index_t q = bottom->current_index;
+    merkle_index_t q = b.q;
     ctx->q = q;
-    int h = bottom->h;
+    int h = b.h;
     ctx->h = h;
 
     struct seed_derive derive;
-    if (!hss_seed_derive_init( &derive, bottom->lm_type, bottom->lm_ots_type,
-                       bottom->I, bottom->seed )) return false;
-    hss_seed_derive_set_q(&derive, q);
-    lm_ots_generate_randomizer( ctx->c, bottom->hash_size, &derive );
-    hss_seed_derive_done(&derive);
-
-    /*
-     * Ask the signature generation process to do everything *except*
-     * the bottom level OTS signature
-     */
-    bool success = hss_generate_signature( w,
-                            update_private_key, context,
-                            NULL, 0,  /* <--- we don't have the message yet */
-                            signature, signature_len, info );
+    bool success = hss_seed_derive_init( &derive, b.lm_type, b.lm_ots_type,
+                                         b.I, b.seed );
+    if (success) {
+        hss_seed_derive_set_q(&derive, q);
+        lm_ots_generate_randomizer( ctx->c, b.hash_size, &derive );
+        hss_seed_derive_done(&derive);
+    }
+    hss_release_bottom_ots( &b );  /* hss_sign_finalize rederives the */
+                              /* seed from the signature */
     if (!success) {
-        /* On failure, hss_generate_signature fills in the failure reason */
+        info->error_code = hss_error_internal;
         ctx->status = info->error_code;
-        hss_zeroize( &ctx->c, sizeof ctx->c );  /* People don't get to */
-                              /* learn what randomizer we would have used */
+        memset( signature, 0, signature_len );
         return false;
     }
 
@@ -92,11 +88,11 @@ bool hss_sign_init(
     hss_init_hash_context( h, &ctx->hash_ctx );
     {
         unsigned char prefix[ MESG_PREFIX_MAXLEN ];
-        memcpy( prefix + MESG_I, I, I_LEN );
+        memcpy( prefix + MESG_I, b.I, I_LEN );
         unsigned q_bin[4]; put_bigendian( q_bin, q, 4 );
         memcpy( prefix + MESG_Q, q_bin, 4 ); /* q */
         SET_D( prefix + MESG_D, D_MESG );
-        int n = bottom->hash_size;
+        int n = b.hash_size;
         memcpy( prefix + MESG_C, ctx->c, n );  /* C */
         hss_update_hash_context(h, &ctx->hash_ctx, prefix, MESG_PREFIX_LEN(n) );
     }
@@ -203,9 +199,9 @@ bool hss_sign_finalize(
                           I, seed );
     if (success) {
         hss_seed_derive_set_q( &derive, ctx->q );
-        success = lm_ots_generate_signature( 
-               ots_type, I, ctx->q, &derive, hash, 0, true,
-               signature, lm_ots_get_signature_len( ots_type ));
+        success = working_key->tree[i]->ots->generate_signature(
+               I, ctx->q, &derive, hash, 0, true,
+               signature, lm_ots_get_signature_len( ots_type ), NULL);
 
         hss_seed_derive_done( &derive );
     }
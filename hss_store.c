@@ -0,0 +1,534 @@
+/*
+ * This is the file-backed private key store (see hss_store.h for the API)
+ *
+ * The snapshot file looks like:
+ *    "HSSSTORE" (8 bytes)
+ *    generation (8 bytes)
+ *    number of slots (4 bytes)
+ *    for each slot: key length (4 bytes; 0 if empty), then the key (padded
+ *                   to HSS_MAX_PRIVATE_SUBKEY_LEN bytes)
+ *    checksum (4 bytes)
+ * It's never modified in place; we write a new one, and rename it over the
+ * old one.  Each snapshot has a new generation.
+ *
+ * The journal file looks like:
+ *    "HSSJOURN" (8 bytes)
+ *    generation (8 bytes)
+ *    records, each: slot (4 bytes), count (8 bytes), checksum (4 bytes)
+ * A record sets the slot's count (if it's higher than what's there); we
+ * ignore the journal entirely if its generation isn't the snapshot's (which
+ * happens if we crash between writing a new snapshot and resetting the
+ * journal; the new snapshot already has everything the journal did), and we
+ * stop at the first record whose checksum is bad (a write that was torn by a
+ * crash, and so was never reported as done)
+ *
+ * Only one hss_store may have the files open at a time (otherwise, each
+ * would write snapshots with its own idea of the counts, which could be lower
+ * than what the other has already handed out); we hold an exclusive flock on
+ * the journal while it's open.  A flock belongs to the open file, and so
+ * this also stops a process from opening the same store twice
+ *
+ * Locking: lock protects the slots and the journal tail (appends);
+ * sync_lock serializes the fsyncs and the compactions (and is always taken
+ * before lock, if we need both).  A thread appends its record under lock,
+ * and then waits its turn for sync_lock; if, by then, another thread's fsync
+ * has covered its record, it's done (that's the group commit)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "hss_store.h"
+#include "hss_internal.h"
+#include "hss_thread.h"
+#include "hss_zeroize.h"
+#include "endian.h"
+
+#define MAGIC_LEN 8
+#define GEN_LEN 8
+#define COUNT_LEN 4
+#define CHECK_LEN 4
+#define SNAPSHOT_HEADER_LEN (MAGIC_LEN + GEN_LEN + COUNT_LEN)
+#define SNAPSHOT_SLOT_LEN (COUNT_LEN + HSS_MAX_PRIVATE_SUBKEY_LEN)
+#define JOURNAL_HEADER_LEN (MAGIC_LEN + GEN_LEN)
+#define RECORD_LEN (COUNT_LEN + PRIVATE_KEY_INDEX_LEN + CHECK_LEN)
+#define MAX_SLOTS 0x10000   /* Sanity limit on a snapshot we read */
+#define COMPACT_RECORDS 256 /* Fold the journal into the snapshot once */
+                            /* it has this many records */
+
+static const unsigned char snapshot_magic[MAGIC_LEN] = "HSSSTORE";
+static const unsigned char journal_magic[MAGIC_LEN] = "HSSJOURN";
+
+struct hss_store_slot {
+    struct hss_store *store;
+    size_t len;                   /* Length of the key; 0 if empty */
+    unsigned char key[HSS_MAX_PRIVATE_SUBKEY_LEN];
+};
+
+struct hss_store {
+    char *snapshot_name;
+    char *temp_name;              /* Where we write the next snapshot */
+    char *journal_name;
+    char *dir_name;               /* The directory they're in */
+    int journal;                  /* The journal file (opened for append) */
+    sequence_t generation;        /* The generation of the snapshot */
+    struct hss_mutex *lock;       /* Protects the below */
+    struct hss_mutex *sync_lock;  /* Serializes syncs and compactions */
+    unsigned long appended;       /* Number of records ever appended */
+    unsigned long synced;         /* How many of those are on disk */
+                                  /* (written under sync_lock) */
+    unsigned records;             /* Number of records in the journal */
+    unsigned long syncs;          /* Number of fsyncs we've done */
+    bool failed;                  /* A journal write failed; we don't */
+                                  /* know what's on disk, and so we refuse */
+                                  /* to reserve anything more */
+    unsigned num_slots;
+    struct hss_store_slot *slot;
+};
+
+/*
+ * This is FNV-1a; it's there to detect torn writes, not attackers (who
+ * could just as easily change the private key itself)
+ */
+static unsigned long checksum( const unsigned char *p, size_t len ) {
+    unsigned long h = 0x811c9dc5;
+    while (len--) {
+        h ^= *p++;
+        h = (h * 0x01000193) & 0xffffffff;
+    }
+    return h;
+}
+
+static bool write_all( int fd, const unsigned char *p, size_t len ) {
+    while (len > 0) {
+        ssize_t n = write( fd, p, len );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all( int fd, unsigned char *p, size_t len ) {
+    while (len > 0) {
+        ssize_t n = read( fd, p, len );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return false;   /* Hit EOF */
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * This makes a rename within the directory durable.  Some filesystems don't
+ * support syncing a directory (EINVAL); there, the rename is as durable as
+ * it's going to get
+ */
+static bool sync_dir( const char *dir_name ) {
+    int fd = open( dir_name, O_RDONLY );
+    if (fd < 0) return false;
+    bool success = (0 == fsync( fd ) || errno == EINVAL);
+    close( fd );
+    return success;
+}
+
+/*
+ * This writes out a new snapshot (with all the slots as they are now), and
+ * then resets the journal to match it.  Called with both locks held
+ */
+static bool write_snapshot( struct hss_store *s ) {
+    size_t len = SNAPSHOT_HEADER_LEN + s->num_slots * SNAPSHOT_SLOT_LEN +
+                 CHECK_LEN;
+    unsigned char *buffer = malloc( len );
+    if (!buffer) return false;
+    memset( buffer, 0, len );
+
+    sequence_t generation = s->generation + 1;
+    unsigned char *p = buffer;
+    memcpy( p, snapshot_magic, MAGIC_LEN ); p += MAGIC_LEN;
+    put_bigendian( p, generation, GEN_LEN ); p += GEN_LEN;
+    put_bigendian( p, s->num_slots, COUNT_LEN ); p += COUNT_LEN;
+    unsigned i;
+    for (i=0; i<s->num_slots; i++) {
+        put_bigendian( p, s->slot[i].len, COUNT_LEN );
+        memcpy( p + COUNT_LEN, s->slot[i].key, s->slot[i].len );
+        p += SNAPSHOT_SLOT_LEN;
+    }
+    put_bigendian( p, checksum( buffer, p - buffer ), CHECK_LEN );
+
+    bool success = false;
+    int fd = open( s->temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+    if (fd >= 0) {
+        success = write_all( fd, buffer, len ) && 0 == fsync( fd );
+        if (0 != close( fd )) success = false;
+    }
+    hss_zeroize( buffer, len );
+    free( buffer );
+    if (!success ||
+        0 != rename( s->temp_name, s->snapshot_name ) ||
+        !sync_dir( s->dir_name )) {
+        unlink( s->temp_name );
+        return false;
+    }
+    s->generation = generation;
+
+    /* The snapshot now has everything the journal had; start a new one */
+    /* If we can't, then records we append would be ignored on reload */
+    /* (as the journal would claim the wrong generation); fail from here on */
+    unsigned char header[JOURNAL_HEADER_LEN];
+    memcpy( header, journal_magic, MAGIC_LEN );
+    put_bigendian( header + MAGIC_LEN, generation, GEN_LEN );
+    if (0 != ftruncate( s->journal, 0 ) ||
+        !write_all( s->journal, header, JOURNAL_HEADER_LEN ) ||
+        0 != fsync( s->journal )) {
+        s->failed = true;
+        return false;
+    }
+    s->records = 0;
+    s->synced = s->appended;  /* Whatever's been appended is in the */
+                              /* snapshot */
+    return true;
+}
+
+/*
+ * This reads the snapshot.  Returns 1 on success, 0 if it doesn't exist,
+ * -1 on error
+ */
+static int read_snapshot( struct hss_store *s, unsigned num_slots,
+                          struct hss_extra_info *info ) {
+    int fd = open( s->snapshot_name, O_RDONLY );
+    if (fd < 0) {
+        if (errno == ENOENT) return 0;
+        info->error_code = hss_error_private_key_read_failed;
+        return -1;
+    }
+    unsigned char header[SNAPSHOT_HEADER_LEN];
+    unsigned char *buffer = 0;
+    size_t len = 0;
+    int result = -1;
+    info->error_code = hss_error_private_key_read_failed;
+    if (!read_all( fd, header, SNAPSHOT_HEADER_LEN ) ||
+                0 != memcmp( header, snapshot_magic, MAGIC_LEN )) {
+        goto failed;
+    }
+    unsigned n = get_bigendian( header + MAGIC_LEN + GEN_LEN, COUNT_LEN );
+    if (n == 0 || n > MAX_SLOTS) goto failed;
+    if (num_slots != 0 && num_slots != n) {
+        info->error_code = hss_error_bad_param_set;
+        goto failed;
+    }
+    len = SNAPSHOT_HEADER_LEN + n * SNAPSHOT_SLOT_LEN + CHECK_LEN;
+    buffer = malloc( len );
+    s->slot = malloc( n * sizeof *s->slot );
+    if (!buffer || !s->slot) {
+        info->error_code = hss_error_out_of_memory;
+        goto failed;
+    }
+    memcpy( buffer, header, SNAPSHOT_HEADER_LEN );
+    if (!read_all( fd, buffer + SNAPSHOT_HEADER_LEN,
+                                      len - SNAPSHOT_HEADER_LEN )) {
+        goto failed;
+    }
+    if (checksum( buffer, len - CHECK_LEN ) !=
+                  get_bigendian( buffer + len - CHECK_LEN, CHECK_LEN )) {
+        goto failed;
+    }
+
+    s->generation = get_bigendian( buffer + MAGIC_LEN, GEN_LEN );
+    s->num_slots = n;
+    unsigned i;
+    const unsigned char *p = buffer + SNAPSHOT_HEADER_LEN;
+    for (i=0; i<n; i++, p += SNAPSHOT_SLOT_LEN) {
+        size_t key_len = get_bigendian( p, COUNT_LEN );
+        if (key_len > HSS_MAX_PRIVATE_SUBKEY_LEN) goto failed;
+        s->slot[i].store = s;
+        s->slot[i].len = key_len;
+        memset( s->slot[i].key, 0, HSS_MAX_PRIVATE_SUBKEY_LEN );
+        memcpy( s->slot[i].key, p + COUNT_LEN, key_len );
+    }
+    result = 1;
+failed:
+    if (buffer) {
+        hss_zeroize( buffer, len );
+        free( buffer );
+    }
+    close( fd );
+    return result;
+}
+
+/*
+ * This applies the journal to the slots.  Returns true if the journal is
+ * exactly an empty one for the current snapshot (and so doesn't need to be
+ * folded in)
+ */
+static bool replay_journal( struct hss_store *s ) {
+    unsigned char header[JOURNAL_HEADER_LEN];
+    if (!read_all( s->journal, header, JOURNAL_HEADER_LEN ) ||
+        0 != memcmp( header, journal_magic, MAGIC_LEN ) ||
+        s->generation != get_bigendian( header + MAGIC_LEN, GEN_LEN )) {
+        return false;   /* Not ours; ignore it */
+    }
+
+    bool empty = true;
+    unsigned char record[RECORD_LEN];
+    while (read_all( s->journal, record, RECORD_LEN )) {
+        empty = false;
+        if (checksum( record, RECORD_LEN - CHECK_LEN ) !=
+                get_bigendian( record + RECORD_LEN - CHECK_LEN, CHECK_LEN )) {
+            break;      /* Torn write; nothing after it is valid */
+        }
+        unsigned long index = get_bigendian( record, COUNT_LEN );
+        if (index >= s->num_slots) break;
+        struct hss_store_slot *slot = &s->slot[index];
+        const unsigned char *count = record + COUNT_LEN;
+        if (slot->len >= PRIVATE_KEY_INDEX_LEN &&
+                 memcmp( count, slot->key, PRIVATE_KEY_INDEX_LEN ) > 0) {
+            memcpy( slot->key, count, PRIVATE_KEY_INDEX_LEN );
+        }
+    }
+    /* If there's a partial record at the end, that also counts as */
+    /* 'not empty' (we want to get rid of it) */
+    if (empty && lseek( s->journal, 0, SEEK_END ) != JOURNAL_HEADER_LEN) {
+        empty = false;
+    }
+    return empty;
+}
+
+/*
+ * Build a file name from a prefix and a suffix
+ */
+static char *make_name( const char *prefix, size_t prefix_len,
+                        const char *suffix ) {
+    size_t suffix_len = strlen( suffix );
+    char *name = malloc( prefix_len + suffix_len + 1 );
+    if (name) {
+        memcpy( name, prefix, prefix_len );
+        memcpy( name + prefix_len, suffix, suffix_len + 1 );
+    }
+    return name;
+}
+
+struct hss_store *hss_store_open( const char *filename, unsigned num_slots,
+                                  struct hss_extra_info *info ) {
+    struct hss_extra_info temp_info = { 0 };
+    if (!info) info = &temp_info;
+    if (!filename) {
+        info->error_code = hss_error_got_null;
+        return 0;
+    }
+
+    struct hss_store *s = malloc( sizeof *s );
+    if (!s) {
+        info->error_code = hss_error_out_of_memory;
+        return 0;
+    }
+    memset( s, 0, sizeof *s );
+    s->journal = -1;
+
+    size_t len = strlen( filename );
+    const char *slash = strrchr( filename, '/' );
+    s->snapshot_name = make_name( filename, len, "" );
+    s->temp_name = make_name( filename, len, ".tmp" );
+    s->journal_name = make_name( filename, len, ".log" );
+    if (!slash) {
+        s->dir_name = make_name( ".", 1, "" );
+    } else {
+        s->dir_name = make_name( filename,
+                          slash == filename ? 1 : slash - filename, "" );
+    }
+    if (!s->snapshot_name || !s->temp_name || !s->journal_name ||
+                                                     !s->dir_name ||
+        !hss_mutex_create( &s->lock ) ||
+        !hss_mutex_create( &s->sync_lock )) {
+        info->error_code = hss_error_out_of_memory;
+        goto failed;
+    }
+
+    s->journal = open( s->journal_name, O_RDWR | O_CREAT | O_APPEND, 0600 );
+    if (s->journal < 0) {
+        info->error_code = hss_error_private_key_read_failed;
+        goto failed;
+    }
+    if (0 != flock( s->journal, LOCK_EX | LOCK_NB )) {
+        /* Someone else has it open */
+        info->error_code = hss_error_store_in_use;
+        goto failed;
+    }
+
+    int found = read_snapshot( s, num_slots, info );
+    if (found < 0) goto failed;
+
+    if (found == 0) {
+        /* New store; start with empty slots */
+        if (num_slots == 0 || num_slots > MAX_SLOTS) {
+            info->error_code = hss_error_bad_param_set;
+            goto failed;
+        }
+        s->slot = malloc( num_slots * sizeof *s->slot );
+        if (!s->slot) {
+            info->error_code = hss_error_out_of_memory;
+            goto failed;
+        }
+        memset( s->slot, 0, num_slots * sizeof *s->slot );
+        unsigned i;
+        for (i=0; i<num_slots; i++) s->slot[i].store = s;
+        s->num_slots = num_slots;
+    } else if (replay_journal( s )) {
+        return s;   /* Nothing in the journal to fold in */
+    }
+
+    /* Write the (new, or updated) snapshot, and start an empty journal */
+    if (!write_snapshot( s )) {
+        info->error_code = hss_error_private_key_write_failed;
+        goto failed;
+    }
+    return s;
+
+failed:
+    hss_store_close( s );
+    return 0;
+}
+
+void hss_store_close( struct hss_store *s ) {
+    if (!s) return;
+    if (s->journal >= 0) close( s->journal );
+    if (s->slot) {
+        hss_zeroize( s->slot, s->num_slots * sizeof *s->slot );
+        free( s->slot );
+    }
+    free( s->snapshot_name );
+    free( s->temp_name );
+    free( s->journal_name );
+    free( s->dir_name );
+    hss_mutex_free( s->lock );
+    hss_mutex_free( s->sync_lock );
+    free( s );
+}
+
+void *hss_store_slot( struct hss_store *s, unsigned index ) {
+    if (!s || index >= s->num_slots) return 0;
+    return &s->slot[index];
+}
+
+unsigned long hss_store_sync_count( struct hss_store *s ) {
+    hss_mutex_lock( s->sync_lock );
+    unsigned long syncs = s->syncs;
+    hss_mutex_unlock( s->sync_lock );
+    return syncs;
+}
+
+/*
+ * This makes sure that record number seq (and everything before it) is on
+ * disk.  If another thread's fsync already covered it by the time we get
+ * the sync_lock, we don't need to do anything
+ */
+static bool sync_journal( struct hss_store *s, unsigned long seq ) {
+    hss_mutex_lock( s->sync_lock );
+    if (s->synced < seq) {
+        hss_mutex_lock( s->lock );
+        unsigned long target = s->appended;  /* Everything appended so */
+                                             /* far goes out with this sync */
+        bool failed = s->failed;
+        hss_mutex_unlock( s->lock );
+
+        if (!failed && 0 == fsync( s->journal )) {
+            s->synced = target;
+            s->syncs++;
+        } else {
+            hss_mutex_lock( s->lock );
+            s->failed = true;
+            hss_mutex_unlock( s->lock );
+        }
+    }
+    bool success = (s->synced >= seq);
+
+    /* If the journal has gotten long, fold it into the snapshot.  If that */
+    /* fails, our record is still safe in the journal */
+    if (success) {
+        hss_mutex_lock( s->lock );
+        if (s->records >= COMPACT_RECORDS && !s->failed) {
+            (void)write_snapshot( s );
+        }
+        hss_mutex_unlock( s->lock );
+    }
+    hss_mutex_unlock( s->sync_lock );
+    return success;
+}
+
+bool hss_store_update_private_key( unsigned char *private_key,
+                                   size_t len_private_key, void *context ) {
+    struct hss_store_slot *slot = context;
+    if (!slot || len_private_key > HSS_MAX_PRIVATE_SUBKEY_LEN) return false;
+    struct hss_store *s = slot->store;
+
+    if (len_private_key == PRIVATE_KEY_INDEX_LEN) {
+        /* It's a reservation; that just updates the count */
+        unsigned char record[RECORD_LEN];
+        put_bigendian( record, slot - s->slot, COUNT_LEN );
+        memcpy( record + COUNT_LEN, private_key, PRIVATE_KEY_INDEX_LEN );
+        put_bigendian( record + RECORD_LEN - CHECK_LEN,
+                       checksum( record, RECORD_LEN - CHECK_LEN ), CHECK_LEN );
+
+        hss_mutex_lock( s->lock );
+        if (s->failed || slot->len < PRIVATE_KEY_INDEX_LEN) {
+            hss_mutex_unlock( s->lock );
+            return false;
+        }
+        if (!write_all( s->journal, record, RECORD_LEN )) {
+            /* We may have left a partial record; nothing we append after */
+            /* it would be seen on reload */
+            s->failed = true;
+            hss_mutex_unlock( s->lock );
+            return false;
+        }
+        if (memcmp( private_key, slot->key, PRIVATE_KEY_INDEX_LEN ) > 0) {
+            memcpy( slot->key, private_key, PRIVATE_KEY_INDEX_LEN );
+        }
+        unsigned long seq = ++s->appended;
+        s->records++;
+        hss_mutex_unlock( s->lock );
+
+        return sync_journal( s, seq );
+    }
+    if (len_private_key < PRIVATE_KEY_INDEX_LEN) return false;
+
+    /* It's an entire key (a new one, a sub-key, or one being retired); */
+    /* write a new snapshot with it */
+    hss_mutex_lock( s->sync_lock );
+    hss_mutex_lock( s->lock );
+    struct hss_store_slot save = *slot;
+    memset( slot->key, 0, HSS_MAX_PRIVATE_SUBKEY_LEN );
+    memcpy( slot->key, private_key, len_private_key );
+    slot->len = len_private_key;
+    bool success = !s->failed && write_snapshot( s );
+    if (!success) *slot = save;     /* It's not on disk; put it back */
+    hss_zeroize( &save, sizeof save );
+    hss_mutex_unlock( s->lock );
+    hss_mutex_unlock( s->sync_lock );
+    return success;
+}
+
+bool hss_store_read_private_key( unsigned char *private_key,
+                                 size_t len_private_key, void *context ) {
+    struct hss_store_slot *slot = context;
+    if (!slot) return false;
+    struct hss_store *s = slot->store;
+    hss_mutex_lock( s->lock );
+    bool success = (slot->len > 0 && len_private_key <= slot->len);
+    if (success) {
+        memcpy( private_key, slot->key, len_private_key );
+    }
+    hss_mutex_unlock( s->lock );
+    return success;
+}
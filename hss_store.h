@@ -0,0 +1,75 @@
+#if !defined( HSS_STORE_H_ )
+#define HSS_STORE_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include "hss.h"
+
+/*
+ * This is a file-backed place to keep private keys, so that the application
+ * doesn't have to write its own update_private_key/read_private_key
+ * functions.  It's crash consistent: once update_private_key returns
+ * success, the write is on disk, and a crash at any point will never leave
+ * us with a count lower than one we've reported as written.
+ *
+ * A store holds one or more private keys (slots); for example, you might put
+ * each sub-key from hss_split_working_key in its own slot.  It consists of
+ * two files:
+ * - The snapshot (the filename you give); this holds the full private keys,
+ *   and is only ever replaced atomically (we write a new copy and rename it
+ *   over the old one)
+ * - The journal (filename with ".log" appended); a reservation (which only
+ *   changes the count) appends a short record here instead of rewriting the
+ *   snapshot.  Once the journal gets long, we fold it into a new snapshot.
+ * Each reservation needs an fsync; if several threads reserve at once (each
+ * with its own slot), they share one (group commit)
+ *
+ * Usage:
+ *    struct hss_store *store = hss_store_open( "key.prv", 1, &info );
+ *    void *slot = hss_store_slot( store, 0 );
+ *    hss_generate_private_key( ..., hss_store_update_private_key, slot, ... );
+ *    w = hss_load_private_key( hss_store_read_private_key, slot, ... );
+ *    hss_generate_signature( w, hss_store_update_private_key, slot, ... );
+ *    ...
+ *    hss_store_close( store );
+ */
+struct hss_store;
+
+/*
+ * This opens the store (creating it, with num_slots empty slots, if it
+ * doesn't exist).  If it does exist, num_slots must either match, or be 0
+ * (which means 'however many it has').  Only one open store may use the
+ * files at a time; if it's already open (by this process or another one),
+ * this fails with hss_error_store_in_use
+ */
+struct hss_store *hss_store_open( const char *filename, unsigned num_slots,
+                                  struct hss_extra_info *info );
+
+/*
+ * This closes the store.  Everything we reported as written is already on
+ * disk, so this just releases the memory (and zeroizes the keys)
+ */
+void hss_store_close( struct hss_store *store );
+
+/*
+ * This returns the context to pass to the functions below for a specific
+ * slot (or NULL if there's no such slot)
+ */
+void *hss_store_slot( struct hss_store *store, unsigned index );
+
+/*
+ * These are the update_private_key and read_private_key functions; pass
+ * them to the HSS routines (along with the context from hss_store_slot).
+ * Reading an empty slot fails
+ */
+bool hss_store_update_private_key( unsigned char *private_key,
+                                   size_t len_private_key, void *context );
+bool hss_store_read_private_key( unsigned char *private_key,
+                                 size_t len_private_key, void *context );
+
+/*
+ * This returns the number of times we've synced the journal to disk (so the
+ * application can see how well group commit is doing)
+ */
+unsigned long hss_store_sync_count( struct hss_store *store );
+
+#endif /* HSS_STORE_H_ */
@@ -29,6 +29,7 @@
  * by the time hss_thread_done returns
  */
 #include <stdlib.h>
+#include <stdbool.h>
 
 /* This is our abstract object that stands for a set of threads */
 struct thread_collection;
@@ -42,6 +43,29 @@ struct thread_collection;
  */
 struct thread_collection *hss_thread_init(int);
 
+/*
+ * This is the same as hss_thread_init, except that if pool is non-NULL,
+ * the work items will be run by the pool's threads (rather than threads we
+ * spawn just for this collection).  The collection still needs to be
+ * cleaned up with hss_thread_done (which leaves the pool's threads alone)
+ */
+struct hss_thread_pool;
+struct thread_collection *hss_thread_init_pool(struct hss_thread_pool *pool,
+                                               int num_thread);
+
+/*
+ * This is the same as hss_thread_init_pool, except that the work items
+ * are run only when the threads have nothing else to do (that is, work
+ * issued to other collections goes first).  This is for work that we're
+ * doing in the background, and so we may return to the application before
+ * it's done; hss_thread_poll tells us whether it's finished, and
+ * hss_thread_done (which, for a background collection, may be called from
+ * a different thread than the one that created it) waits for it
+ */
+struct thread_collection *hss_thread_init_background(
+                                  struct hss_thread_pool *pool,
+                                  int num_thread);
+
 /*
  * This issues another work item to our collection of threads.  At some point
  * (between when hss_thread_issue_work is called and when hss_thread_done
@@ -49,6 +73,11 @@ struct thread_collection *hss_thread_init(int);
  * structure.  function may be called by this thread, or it may be called by a
  * different one.
  *
+ * Work items may be issued by any thread (including by the functions
+ * themselves); however, those issued by the thread that created the
+ * collection are cheaper (as that thread recycles the task slots without
+ * locking, while any other thread mallocs a fresh one)
+ *
  * The passed detail structure will not be referenced after this returns, and
  * hence it is safe if the caller modifies (or frees) it afterwards.  If the
  * function isn't completed by the time hss_thread_issue_work returns, we'll
@@ -83,6 +112,12 @@ void hss_thread_issue_work(struct thread_collection *col,
  */
 void hss_thread_done(struct thread_collection *col);
 
+/*
+ * This returns true if all the work items we have issued have been
+ * completed (without waiting for them, or cleaning up the collection)
+ */
+bool hss_thread_poll(struct thread_collection *col);
+
 /*
  * This should be called before a thread writes to common data
  *
@@ -101,7 +136,13 @@ void hss_thread_done(struct thread_collection *col);
  * We don't bother doing this if we're writing into a malloc'ed region, *if*
  * we're the only thread that will be writing into that specific region; we
  * assume that the malloc infrastructure will separate distinct malloc'ed
- * regions enough to avoid such race conditions
+ * regions enough to avoid such race conditions.  We also don't bother when
+ * a work item is copying out its results into a range of bytes that only it
+ * writes (e.g. its own slice of an array of hashes); C11 guarantees that
+ * distinct bytes are distinct memory locations, and taking a single lock for
+ * every result would serialize the threads when we have a lot of them.  The
+ * lock is for shared data (such as the error flag, which is written only
+ * when something goes wrong)
  *
  * [1] actually, automatic to the main thread; there are no literal globals
  *     in this package, apart from the verbose debugging flag
@@ -114,6 +155,35 @@ void hss_thread_before_write(struct thread_collection *collect);
  */
 void hss_thread_after_write(struct thread_collection *collect);
 
+/*
+ * This is a plain lock, not tied to any thread collection; we use it to
+ * serialize application threads that use the same working key.  Creating one
+ * returns false if we couldn't (we ran out of memory); the caller must fail
+ * then, as going on without the lock would let two threads use the same
+ * one-time key.  If we're not really threaded, this sets *mutex to NULL (and
+ * returns true); the lock/unlock/free routines accept NULL and do nothing
+ * (which is the right thing if there is only one thread)
+ */
+struct hss_mutex;
+bool hss_mutex_create(struct hss_mutex **mutex);
+void hss_mutex_lock(struct hss_mutex *mutex);
+void hss_mutex_unlock(struct hss_mutex *mutex);
+void hss_mutex_free(struct hss_mutex *mutex);
+
+/*
+ * This is a flag that one thread raises (hss_event_signal) and another waits
+ * for; hss_event_check returns true (and lowers the flag) if it has been
+ * raised; if wait is set, it waits for that.  Signalling doesn't take any
+ * lock the waiter might hold, and so it's safe to do from anywhere.
+ * Creating one returns NULL if we're not threaded (as there would never be
+ * anyone else to raise the flag while we wait)
+ */
+struct hss_event;
+struct hss_event *hss_event_create(void);
+void hss_event_signal(struct hss_event *event);
+bool hss_event_check(struct hss_event *event, bool wait);
+void hss_event_free(struct hss_event *event);
+
 /*
  * This gives the application guidance for how many worker threads we have
  * available, that is, how many work items we can expect to run at once
@@ -132,4 +202,11 @@ void hss_thread_after_write(struct thread_collection *collect);
  */
 unsigned hss_thread_num_tracks(int num_threads);
 
+/*
+ * This is the same as hss_thread_num_tracks, for the values we'll pass to
+ * hss_thread_init_pool
+ */
+unsigned hss_thread_pool_num_tracks(struct hss_thread_pool *pool,
+                                    int num_threads);
+
 #endif /* HSS_THREAD_H_ */
@@ -1,7 +1,19 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* For sched_getaffinity/pthread_setaffinity_np */
+#endif
 #include "hss_thread.h"
+#include "hss.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <stdio.h>
+#define USE_AFFINITY 1  /* We can ask which CPUs we're allowed to run on */
+#else
+#define USE_AFFINITY 0
+#endif
 
 /*
  * This is an implementation of our threaded abstraction using the
@@ -15,146 +27,632 @@
  * implementation handy to test it
  */
 
-#define MAX_THREAD 16   /* Number try to create more than 16 threads, no */
+#define MAX_THREAD 256  /* Never try to create more than 256 threads, no */
                         /* matter what the application tries to tell us */
 #define DEFAULT_THREAD 16 /* The number of threads to run if the */
                         /* application doesn't tell us otherwise (e.g. */
-                        /* passes in 0) */
+                        /* passes in 0), and we can't ask the OS how many */
+                        /* CPUs we have */
+#define MAX_NODE 64     /* The number of NUMA nodes we look for */
 
-#define MIN_DETAIL 16   /* So the alignment kludge we do doesn't waste space */
+#define SLOT_DETAIL 128 /* Detail structures up to this size fit within */
+                        /* a task slot (all the ones we use do); larger */
+                        /* ones are malloc'ed */
+#define SLOTS_PER_CHUNK 64 /* When we run out of task slots, we allocate */
+                        /* this many more at once */
 
-/* The information we track about a thread we may have launched */
-struct thread_state {
-    pthread_t thread_id;
-    enum { never_was, alive, dead } state;
-};
+/*
+ * The general design: each worker thread has its own deque of work items;
+ * the thread issuing the work spreads the items over the deques (round
+ * robin), and a worker that runs out of its own work steals from the
+ * other deques.  Each deque has its own lock, so the only contention is
+ * between the issuer and a worker (or between a thief and its victim).
+ * The work items themselves live in task slots that are allocated in
+ * chunks, and recycled for the next items; hence we don't do a malloc per
+ * work item.  Only the thread that created the collection takes slots from
+ * there (so it needs no lock); work issued by any other thread (e.g. by a
+ * work item) gets a slot malloc'ed by itself, which is freed when it's done
+ *
+ * A thread collection always runs its work through a pool; either one the
+ * application created (and which outlives the collection), or a private
+ * one (whose threads we start as work is issued, and which we shut down
+ * in hss_thread_done)
+ *
+ * Work issued to a background collection doesn't go onto the deques;
+ * instead, it goes onto a single queue within the pool, which the workers
+ * look at only when they can't find anything else to do
+ */
 
+/* A work item (or, when it's not in use, a free task slot) */
 struct work_item {
-    struct work_item *link;    /* They're in a linked list */
+    struct work_item *link;    /* The next item in the deque, or the next */
+                               /* slot in a free list */
 
     void (*function)(const void *detail,   /* Function to call */
                              struct thread_collection *col);
-
-        /* These two items are used to pass the thread state to the thread */
-        /* if this is the first work item for the thread to process */
-    struct thread_collection *col; /* The parent thread_collection */
-    struct thread_state *state; /* The pointer into the thread collection */
-                               /* state for the state of this thread */
+    struct thread_collection *col; /* The collection this was issued to */
+    void *big_detail;          /* If the detail structure didn't fit into */
+                               /* the slot, the malloc'ed copy */
+    bool lone;                 /* Set if this slot was malloc'ed by */
+                               /* itself (and so is freed when done) */
 
        /* The detail structure that we pass to the function */
-       /* We'll malloc enough space to hold the entire structure */
     union {                    /* union here so that the detail array is */
         void *align1;          /* correctly aligned for various datatypes */
         long long align2;
         void (*align3)(void);
-        unsigned char detail[MIN_DETAIL];
+        unsigned char detail[SLOT_DETAIL];
     } x;
 };
 
+/* A batch of task slots */
+struct slot_chunk {
+    struct slot_chunk *link;
+    struct work_item slot[SLOTS_PER_CHUNK];
+};
+
+/* The information we track about a worker thread */
+struct worker {
+    pthread_mutex_t lock;      /* Must be locked before the deque is */
+                               /* accessed */
+    struct work_item *head;    /* The deque of work items; the owner and */
+    struct work_item *tail;    /* the thieves both take from the head */
+                               /* (the oldest, and so the largest) */
+    pthread_t thread_id;
+    struct hss_thread_pool *pool;
+    int cpu;                   /* The CPU we pin the thread to (-1 if we */
+                               /* don't pin it) */
+    int node;                  /* The NUMA node that CPU is on; thieves */
+                               /* look on their own node first */
+};
+
+/*
+ * A set of worker threads.  These are either created (all at once) by
+ * hss_thread_pool_create, or (a thread at a time, as work is issued) by a
+ * collection for its own use
+ */
+struct hss_thread_pool {
+    pthread_mutex_t lock;       /* Used for the sleep/wakeup logic, and */
+                                /* when we start a thread */
+    pthread_cond_t work_ready;  /* Signalled when we add work (or when */
+                                /* we're shutting down) */
+    pthread_cond_t work_done;   /* Signalled when a collection has no more */
+                                /* pending work items */
+    atomic_uint sleeping;       /* Number of threads waiting on work_ready */
+    bool shutdown;              /* Set when the threads should exit */
+
+    unsigned max_thread;        /* The number of threads we may start */
+    atomic_uint num_started;    /* The number we actually have started */
+    struct worker *worker;      /* Array of max_thread entries */
+
+    pthread_mutex_t background_lock; /* Must be locked before the */
+                                /* background queue is accessed */
+    struct work_item *background_head; /* The queue of work items from */
+    struct work_item *background_tail; /* background collections */
+};
+
 struct thread_collection {
-    pthread_mutex_t lock;       /* Must be locked before this structure is */
-                                /* accessed if there might be a thread */
+    struct hss_thread_pool *pool; /* The threads that do our work */
+    bool own_pool;              /* Set if we created the pool just for us */
+                                /* (and so hss_thread_done frees it) */
+    bool background;            /* Set if our work goes onto the pool's */
+                                /* background queue */
+    atomic_uint pending;        /* The number of work items we've issued */
+                                /* that haven't finished yet */
+    pthread_t creator;          /* The thread that created us; only it */
+                                /* uses free_slots */
+    atomic_uint next_worker;    /* Which deque gets the next work item */
     pthread_mutex_t write_lock; /* Must be locked before common user data is */
                                 /* written */
 
-    unsigned num_thread;
-    unsigned current_ptr;       /* There two are here to avoid O(N) table */
-    unsigned num_alive;         /* scanning in the most common scenarios */
-
-        /* Information about the worker threads we may have created */
-    struct thread_state threads[MAX_THREAD];
-
-        /*
-         * Queue (FIFO) of work items submitted, and which can't be processed
-         * immedately.  We do a FIFO, rather than a stack, so that we perform
-         * the requests in the order they were issued (which isn't something
-         * the interface guarantees; however it doesn't interfere with the
-         * request ordering we ask applications to make)
-         */
-    struct work_item *top_work_queue;
-    struct work_item *end_work_queue;
+        /* The task slots.  Only the creator touches free_slots; */
+        /* the workers place the slots they're done with on returned_slots */
+    struct work_item *free_slots;
+    _Atomic(struct work_item *) returned_slots;
+    struct slot_chunk *chunks;  /* All the slots we've allocated */
 };
 
 /*
- * Allocate a thread control structure
+ * This returns the number of CPUs we're allowed to run on (or
+ * DEFAULT_THREAD if we can't tell), capped at MAX_THREAD.  This is the
+ * number of threads we use if the application says 0
  */
-struct thread_collection *hss_thread_init(int num_thread) {
-    if (num_thread == 0) num_thread = DEFAULT_THREAD;
-    if (num_thread <= 1) return 0;  /* Not an error: an indication to run */
-                                    /* single threaded */
-    if (num_thread > MAX_THREAD) num_thread = MAX_THREAD;
+static unsigned default_threads(void) {
+#if USE_AFFINITY
+    cpu_set_t set;
+    if (0 == sched_getaffinity( 0, sizeof set, &set )) {
+        int count = CPU_COUNT( &set );
+        if (count > MAX_THREAD) count = MAX_THREAD;
+        if (count > 0) return count;
+    }
+#endif
+    return DEFAULT_THREAD;
+}
 
-    struct thread_collection *col = malloc( sizeof *col );
-    if (!col) return 0;  /* On malloc failure, run single threaded */
+#if USE_AFFINITY
+/*
+ * The CPUs on this system, in NUMA node order; we read this from /sys the
+ * first time we need it (it's not going to change while we're running)
+ */
+static struct cpu_place {
+    int cpu;
+    int node;
+} cpu_order[ CPU_SETSIZE ];
+static unsigned cpu_order_len;
+static pthread_once_t cpu_order_once = PTHREAD_ONCE_INIT;
 
-    col->num_thread = num_thread;
+/*
+ * Parse a Linux cpulist (e.g. "0-3,8-11"); for each CPU listed that's not
+ * already in seen, place it at the end of cpu_order
+ */
+static void place_cpus(const char *list, int node, cpu_set_t *seen) {
+    while (*list) {
+        char *end;
+        long first = strtol( list, &end, 10 );
+        if (end == list) return;
+        long last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol( list, &end, 10 );
+            if (end == list) return;
+        }
+        long cpu;
+        for (cpu = first; cpu <= last; cpu++) {
+            if (cpu < 0 || cpu >= CPU_SETSIZE) break;
+            if (CPU_ISSET( cpu, seen )) continue;
+            CPU_SET( cpu, seen );   /* So we don't place it twice */
+            cpu_order[cpu_order_len].cpu = cpu;
+            cpu_order[cpu_order_len].node = node;
+            cpu_order_len += 1;
+        }
+        list = end;
+        if (*list == ',') list++;
+        else return;
+    }
+}
 
-    if (0 != pthread_mutex_init( &col->lock, 0 )) {
-        free(col);
-        return 0;
+static void read_cpu_order(void) {
+    cpu_set_t seen;
+    CPU_ZERO( &seen );
+    int node;
+    for (node = 0; node < MAX_NODE; node++) {
+        char name[ 64 ], list[ 1024 ];
+        sprintf( name, "/sys/devices/system/node/node%d/cpulist", node );
+        FILE *f = fopen( name, "r" );
+        if (!f) continue;
+        if (fgets( list, sizeof list, f )) {
+            place_cpus( list, node, &seen );
+        }
+        fclose(f);
     }
+}
+#endif
 
-    if (0 != pthread_mutex_init( &col->write_lock, 0 )) {
-        pthread_mutex_destroy( &col->lock );
-        free(col);
+/*
+ * If the pool will have a thread for every CPU we're allowed to run on,
+ * assign each worker a CPU, grouped by NUMA node (so that workers with
+ * adjacent indices, which get adjacent work items, share a node).  If we
+ * have fewer threads than that, we leave the scheduling to the OS (as the
+ * application may be running several of these at once, and we don't want
+ * them all piling onto the same CPUs).  We also don't pin if pin is false
+ * (which is what we do for the private pools a single operation creates;
+ * pinning is worth it only for threads that stick around)
+ */
+static void assign_cpus(struct hss_thread_pool *pool, bool pin) {
+    unsigned i;
+    for (i=0; i<pool->max_thread; i++) {
+        pool->worker[i].cpu = -1;
+        pool->worker[i].node = 0;
+    }
+#if USE_AFFINITY
+    if (!pin) return;
+    cpu_set_t allowed;
+    if (0 != sched_getaffinity( 0, sizeof allowed, &allowed )) return;
+    if (CPU_COUNT( &allowed ) != (int)pool->max_thread) return;
+
+    /* Go through the CPUs in node order, placing the ones we may use */
+    (void)pthread_once( &cpu_order_once, read_cpu_order );
+    unsigned placed = 0;
+    for (i = 0; i < cpu_order_len && placed < pool->max_thread; i++) {
+        int cpu = cpu_order[i].cpu;
+        if (!CPU_ISSET( cpu, &allowed )) continue;
+        CPU_CLR( cpu, &allowed );
+        pool->worker[placed].cpu = cpu;
+        pool->worker[placed].node = cpu_order[i].node;
+        placed += 1;
+    }
+
+    /* Anything we didn't find a node for (e.g. if there's no /sys), just */
+    /* put them at the end */
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE && placed < pool->max_thread; cpu++) {
+        if (!CPU_ISSET( cpu, &allowed )) continue;
+        pool->worker[placed].cpu = cpu;
+        pool->worker[placed].node = 0;
+        placed += 1;
+    }
+#else
+    (void)pin;
+#endif
+}
+
+/*
+ * Allocate a pool structure, with room for num_thread workers (none of which
+ * are started yet); pin is set if the workers should be pinned to CPUs
+ */
+static struct hss_thread_pool *allocate_pool(unsigned num_thread, bool pin) {
+    struct hss_thread_pool *pool = malloc( sizeof *pool );
+    if (!pool) return 0;
+    pool->worker = malloc( num_thread * sizeof *pool->worker );
+    if (!pool->worker) {
+        free(pool);
         return 0;
     }
 
-    col->current_ptr = 0;
-    col->num_alive = 0;
+    if (0 != pthread_mutex_init( &pool->lock, 0 )) goto failed_lock;
+    if (0 != pthread_cond_init( &pool->work_ready, 0 )) goto failed_ready;
+    if (0 != pthread_cond_init( &pool->work_done, 0 )) goto failed_done;
+    if (0 != pthread_mutex_init( &pool->background_lock, 0 )) {
+        goto failed_background;
+    }
     unsigned i;
     for (i=0; i<num_thread; i++) {
-        col->threads[i].state = never_was;
+        struct worker *p = &pool->worker[i];
+        if (0 != pthread_mutex_init( &p->lock, 0 )) {
+            while (i--) pthread_mutex_destroy( &pool->worker[i].lock );
+            goto failed_worker;
+        }
+        p->head = p->tail = 0;
+        p->pool = pool;
     }
-    col->top_work_queue = 0;
-    col->end_work_queue = 0;
+    atomic_init( &pool->sleeping, 0 );
+    atomic_init( &pool->num_started, 0 );
+    pool->shutdown = false;
+    pool->max_thread = num_thread;
+    pool->background_head = pool->background_tail = 0;
+    assign_cpus( pool, pin );
+    return pool;
+
+failed_worker:
+    pthread_mutex_destroy( &pool->background_lock );
+failed_background:
+    pthread_cond_destroy( &pool->work_done );
+failed_done:
+    pthread_cond_destroy( &pool->work_ready );
+failed_ready:
+    pthread_mutex_destroy( &pool->lock );
+failed_lock:
+    free( pool->worker );
+    free( pool );
+    return 0;
+}
 
-    return col;
+/*
+ * Tell the threads within a pool to exit (once they've run out of work),
+ * and then free it
+ */
+static void shut_down_pool(struct hss_thread_pool *pool) {
+    pthread_mutex_lock( &pool->lock );
+    pool->shutdown = true;
+    pthread_cond_broadcast( &pool->work_ready );
+    pthread_mutex_unlock( &pool->lock );
+
+    unsigned i, num_started = atomic_load( &pool->num_started );
+    for (i=0; i<num_started; i++) {
+        void *status;
+        pthread_join( pool->worker[i].thread_id, &status );
+    }
+
+    for (i=0; i<pool->max_thread; i++) {
+        pthread_mutex_destroy( &pool->worker[i].lock );
+    }
+    pthread_mutex_destroy( &pool->background_lock );
+    pthread_cond_destroy( &pool->work_done );
+    pthread_cond_destroy( &pool->work_ready );
+    pthread_mutex_destroy( &pool->lock );
+    free( pool->worker );
+    free( pool );
 }
 
 /*
- * This is the base routine that a worker thread runs
+ * Pull the work item off the front of the worker's deque (if any)
  */
-static void *worker_thread( void *arg ) {
-    struct work_item *w = arg;  /* The initial work item */
-    struct thread_collection *col = w->col;
-    struct thread_state *state = w->state;
+static struct work_item *pop_work(struct worker *p) {
+    pthread_mutex_lock( &p->lock );
+    struct work_item *w = p->head;
+    if (w) {
+        p->head = w->link;
+        if (!p->head) p->tail = 0;
+    }
+    pthread_mutex_unlock( &p->lock );
+    return w;
+}
 
-    for (;;) {
-        /* Perform the work item in front of us */
+/*
+ * Pull the work item off the front of the background queue (if any)
+ */
+static struct work_item *pop_background(struct hss_thread_pool *pool) {
+    pthread_mutex_lock( &pool->background_lock );
+    struct work_item *w = pool->background_head;
+    if (w) {
+        pool->background_head = w->link;
+        if (!pool->background_head) pool->background_tail = 0;
+    }
+    pthread_mutex_unlock( &pool->background_lock );
+    return w;
+}
+
+/*
+ * Look for something for worker 'me' to do; first in its own deque, and
+ * then by stealing from the others (those on our NUMA node first), and
+ * finally from the background queue
+ */
+static struct work_item *find_work(struct hss_thread_pool *pool,
+                                   unsigned me) {
+    struct work_item *w = pop_work( &pool->worker[me] );
+    if (w) return w;
+
+    /* Start with the deque after ours (so that the thieves don't all */
+    /* bang on deque 0).  Note that we might have been started before */
+    /* num_started was updated, so me may be >= num_started */
+    unsigned i, num_started = atomic_load( &pool->num_started );
+    int my_node = pool->worker[me].node;
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        unsigned j = me;
+        for (i=0; i<num_started; i++) {
+            j += 1;
+            if (j >= num_started) j = 0;
+            if (j == me) continue;
+            if ((pool->worker[j].node == my_node) != (pass == 0)) continue;
+            w = pop_work( &pool->worker[j] );
+            if (w) return w;
+        }
+    }
+    return pop_background( pool );
+}
+
+/*
+ * Perform a work item, and then tell its collection that it's done
+ */
+static void run_work(struct hss_thread_pool *pool, struct work_item *w) {
+    struct thread_collection *col = w->col;
+    if (w->big_detail) {
+        (w->function)(w->big_detail, col);
+        free(w->big_detail);
+    } else {
         (w->function)(w->x.detail, col);
+    }
 
-        /* Ok, we did that */
+    /* Give the slot back to the collection */
+    if (w->lone) {
         free(w);
+    } else {
+        w->link = atomic_load( &col->returned_slots );
+        while (!atomic_compare_exchange_weak( &col->returned_slots,
+                                              &w->link, w ))
+            ;
+    }
 
-        /* Check if there's anything else to do */
-        pthread_mutex_lock( &col->lock );
+    /* If this was the last thing the collection was waiting for, wake it */
+    /* up (and after this, we don't touch col; it may be freed) */
+    if (atomic_fetch_sub( &col->pending, 1 ) == 1) {
+        pthread_mutex_lock( &pool->lock );
+        pthread_cond_broadcast( &pool->work_done );
+        pthread_mutex_unlock( &pool->lock );
+    }
+}
 
-        w = col->top_work_queue;
-        if (w) {
-            /* More work; pull it off the queue */
-            col->top_work_queue = w->link;
-            if (w == col->end_work_queue) col->end_work_queue = 0;
+/*
+ * This is the base routine that a worker thread runs
+ */
+static void *worker_thread( void *arg ) {
+    struct worker *p = arg;
+    struct hss_thread_pool *pool = p->pool;
+    unsigned me = p - pool->worker;
 
-            /* And go handle it */
-            pthread_mutex_unlock( &col->lock );
+    for (;;) {
+        struct work_item *w = find_work( pool, me );
+        if (w) {
+            run_work( pool, w );
             continue;
         }
 
-        /* No more work for us to do; post our obituary */
-        state->state = dead;
-        col->num_alive -= 1;
-        pthread_mutex_unlock( &col->lock );
+        /* Nothing to do; go to sleep.  We bump sleeping before we look */
+        /* again, so that either we'll see the new work, or the thread */
+        /* issuing it will see that we're sleeping (and wake us up) */
+        pthread_mutex_lock( &pool->lock );
+        atomic_fetch_add( &pool->sleeping, 1 );
+        atomic_thread_fence( memory_order_seq_cst );
+        w = find_work( pool, me );
+        if (!w) {
+            if (pool->shutdown) {
+                /* We've been told to go away; and that's all folks */
+                atomic_fetch_sub( &pool->sleeping, 1 );
+                pthread_mutex_unlock( &pool->lock );
+                return 0;
+            }
+            pthread_cond_wait( &pool->work_ready, &pool->lock );
+        }
+        atomic_fetch_sub( &pool->sleeping, 1 );
+        pthread_mutex_unlock( &pool->lock );
+
+        if (w) run_work( pool, w );
+    }
+}
+
+/*
+ * Start another thread within the pool.  Returns false if we couldn't
+ */
+static bool start_thread(struct hss_thread_pool *pool) {
+    pthread_mutex_lock( &pool->lock );
+    unsigned i = atomic_load( &pool->num_started );
+    bool success = false;
+    if (i < pool->max_thread) {
+        if (0 == pthread_create( &pool->worker[i].thread_id, NULL,
+                                 worker_thread, &pool->worker[i] )) {
+#if USE_AFFINITY
+            if (pool->worker[i].cpu >= 0) {
+                /* Pin it (if that fails, no big deal) */
+                cpu_set_t set;
+                CPU_ZERO( &set );
+                CPU_SET( pool->worker[i].cpu, &set );
+                (void)pthread_setaffinity_np( pool->worker[i].thread_id,
+                                              sizeof set, &set );
+            }
+#endif
+            atomic_store( &pool->num_started, i+1 );
+            success = true;
+        } else {
+            /* Hmmm, couldn't spawn it; make do with what we have */
+            pool->max_thread = i;
+        }
+    }
+    pthread_mutex_unlock( &pool->lock );
+    return success;
+}
+
+/*
+ * Create a pool of threads
+ */
+struct hss_thread_pool *hss_thread_pool_create(int num_thread) {
+    if (num_thread == 0) num_thread = default_threads();
+    if (num_thread <= 1) return 0;  /* Not worth having a pool */
+    if (num_thread > MAX_THREAD) num_thread = MAX_THREAD;
+
+    struct hss_thread_pool *pool = allocate_pool( num_thread, true );
+    if (!pool) return 0;
 
-        /* And that's all folks */
+    /* Start up the threads; if we can't get them all, we'll make do */
+    /* with what we could get */
+    while (start_thread( pool ))
+        ;
+    if (atomic_load( &pool->num_started ) <= 1) {
+        /* Not enough threads to make it worthwhile */
+        shut_down_pool( pool );
         return 0;
     }
+
+    return pool;
+}
+
+void hss_thread_pool_free(struct hss_thread_pool *pool) {
+    if (!pool) return;
+    shut_down_pool( pool );
+}
+
+/*
+ * Allocate a thread control structure that uses the pool's threads (or, if
+ * pool is NULL, a private pool of up to num_thread threads)
+ */
+struct thread_collection *hss_thread_init_pool(struct hss_thread_pool *pool,
+                                               int num_thread) {
+    bool own_pool = false;
+    if (!pool) {
+        if (num_thread == 0) num_thread = default_threads();
+        if (num_thread <= 1) return 0;  /* Not an error: an indication to */
+                                        /* run single threaded */
+        if (num_thread > MAX_THREAD) num_thread = MAX_THREAD;
+        pool = allocate_pool( num_thread, false );
+        if (!pool) return 0;  /* On malloc failure, run single threaded */
+        own_pool = true;
+    }
+
+    struct thread_collection *col = malloc( sizeof *col );
+    if (!col) goto failed;
+
+    if (0 != pthread_mutex_init( &col->write_lock, 0 )) {
+        free(col);
+        goto failed;
+    }
+    col->pool = pool;
+    col->own_pool = own_pool;
+    col->background = false;
+    atomic_init( &col->pending, 0 );
+    col->creator = pthread_self();
+    atomic_init( &col->next_worker, 0 );
+    col->free_slots = 0;
+    atomic_init( &col->returned_slots, 0 );
+    col->chunks = 0;
+
+    return col;
+
+failed:
+    if (own_pool) shut_down_pool( pool );
+    return 0;
+}
+
+/*
+ * Allocate a thread control structure whose work is done only when the pool
+ * has nothing else to do
+ */
+struct thread_collection *hss_thread_init_background(
+                                  struct hss_thread_pool *pool,
+                                  int num_thread) {
+    struct thread_collection *col = hss_thread_init_pool( pool, num_thread );
+    if (col) col->background = true;
+    return col;
+}
+
+/*
+ * Allocate a thread control structure
+ */
+struct thread_collection *hss_thread_init(int num_thread) {
+    return hss_thread_init_pool( 0, num_thread );
+}
+
+/*
+ * Get a free task slot (or NULL if we can't allocate any more)
+ */
+static struct work_item *get_slot(struct thread_collection *col) {
+    struct work_item *w;
+    if (!pthread_equal( pthread_self(), col->creator )) {
+        /* We're not allowed to touch free_slots; get a slot of our own */
+        w = malloc( sizeof *w );
+        if (w) w->lone = true;
+        return w;
+    }
+
+    w = col->free_slots;
+    if (!w) {
+        /* Take back the slots the workers are done with */
+        w = atomic_exchange( &col->returned_slots, 0 );
+    }
+    if (!w) {
+        /* None available; allocate some more */
+        struct slot_chunk *chunk = malloc( sizeof *chunk );
+        if (!chunk) return 0;
+        chunk->link = col->chunks;
+        col->chunks = chunk;
+        unsigned i;
+        for (i=0; i<SLOTS_PER_CHUNK-1; i++) {
+            chunk->slot[i].link = &chunk->slot[i+1];
+            chunk->slot[i].lone = false;
+        }
+        chunk->slot[i].link = 0;
+        chunk->slot[i].lone = false;
+        w = &chunk->slot[0];
+    }
+    col->free_slots = w->link;
+    return w;
+}
+
+/*
+ * Return a task slot we got from get_slot, but didn't end up issuing
+ */
+static void put_slot(struct thread_collection *col, struct work_item *w) {
+    if (w->lone) {
+        free(w);
+    } else {
+        w->link = col->free_slots;
+        col->free_slots = w;
+    }
 }
 
 /*
  * This adds function/details to the list of things that need to be done
- * It either creates a thread to do it, or (if we're maxed out) add it to
- * our honey-do list (or, as last resort, just does it itself)
+ * It places it on one of the worker's deques (starting a new worker if we
+ * haven't started them all), or (as last resort) just does it itself
  */
 void hss_thread_issue_work(struct thread_collection *col,
             void (*function)(const void *detail,
@@ -166,86 +664,78 @@ void hss_thread_issue_work(struct thread_collection *col,
         function( detail, col );
         return;
     }
+    struct hss_thread_pool *pool = col->pool;
 
-    /* Allocate a work structure to hold this request */
-    size_t extra_space;
-    if (size_detail_structure < MIN_DETAIL) extra_space = 0;
-    else extra_space = size_detail_structure - MIN_DETAIL;
-    struct work_item *w = malloc(sizeof *w + extra_space);
-
+    /* Fill in a task slot with this request */
+    struct work_item *w = get_slot(col);
     if (!w) {
-        /* Can't allocate the work structure; fall back to single-threaded */
+        /* Can't allocate the task slot; fall back to single-threaded */
         function( detail, col );
         return;
     }
     w->col = col;
     w->function = function;
-    memcpy( w->x.detail, detail, size_detail_structure );
-
-    unsigned num_thread = col->num_thread;
-
-    pthread_mutex_lock( &col->lock );
-
-    /* Check if we can spawn a new thread */
-    if (col->num_alive < num_thread) {
-        /* There's supposed to be room for another */
-        /* Look for the empty slot */
-        unsigned i, j;
-        j = col->current_ptr;  /* Do round-robin (so we don't bang on */
-                               /* slot 0 whenever we try to start a thread) */
-        for (i=0; i<num_thread; i++, j = (j+1) % num_thread) {
-            struct thread_state *p = &col->threads[j];
-            switch (p->state) {
-            case alive: continue; /* This one's busy */
-            case dead:
-                {
-                /* This one just died; grab its status (not that we care, */
-                /* however that'll tell the thread library it can clean up) */
-                pthread_t thread_id = p->thread_id;
-                void *status;   /* Ignored, but we need to place thread */
-                                /* status somewhere */
-                pthread_mutex_unlock( &col->lock );
-                pthread_join( thread_id, &status );
-                pthread_mutex_lock( &col->lock );
-                p->state = never_was;
-                }
-                /* FALL THROUGH */
-            case never_was:
-                /* Now, we can spawn a new thread */
-                w->state = p;
-                if (0 != pthread_create( &p->thread_id,
-                                         NULL, worker_thread, w )) {
-                    /* Hmmm, couldn't spawn it; fall back */
-                    default: /* On error condition */
-                    pthread_mutex_unlock( &col->lock );
-                    free(w);
-                    function( detail, col );
-                    return;
-                }
-
-                /* We've kicked off the thread */
-                p->state = alive;
-                col->num_alive += 1;
-                    /* For the next request, start scanning at the next */
-                    /* thread object */
-                col->current_ptr = (j+1) % num_thread;
-                pthread_mutex_unlock( &col->lock );
-                return;
-            }
+    if (size_detail_structure <= SLOT_DETAIL) {
+        w->big_detail = 0;
+        memcpy( w->x.detail, detail, size_detail_structure );
+    } else {
+        w->big_detail = malloc( size_detail_structure );
+        if (!w->big_detail) {
+            put_slot( col, w );
+            function( detail, col );
+            return;
         }
-        col->num_alive = num_thread; /* Hmmmm, everything was alive??? */
+        memcpy( w->big_detail, detail, size_detail_structure );
+    }
+
+    /* If this is our own pool, start another thread if we're allowed */
+    unsigned num_started = atomic_load( &pool->num_started );
+    if (col->own_pool && num_started < pool->max_thread) {
+        if (start_thread( pool )) num_started += 1;
+    }
+    if (num_started == 0) {
+        /* We couldn't start any threads at all; do it ourselves */
+        free( w->big_detail );
+        put_slot( col, w );
+        function( detail, col );
+        return;
     }
 
-    /* We can't create any more threads; enqueue this (and someone will get */
-    /* to it) */
+    atomic_fetch_add( &col->pending, 1 );
     w->link = 0;
-    if (col->end_work_queue) {
-        col->end_work_queue->link = w;
+    if (col->background) {
+        /* Place it on the background queue */
+        pthread_mutex_lock( &pool->background_lock );
+        if (pool->background_tail) {
+            pool->background_tail->link = w;
+        } else {
+            pool->background_head = w;
+        }
+        pool->background_tail = w;
+        pthread_mutex_unlock( &pool->background_lock );
+    } else {
+        /* Place it on the next worker's deque */
+        unsigned j = atomic_fetch_add_explicit( &col->next_worker, 1,
+                                   memory_order_relaxed ) % num_started;
+        struct worker *p = &pool->worker[j];
+        pthread_mutex_lock( &p->lock );
+        if (p->tail) {
+            p->tail->link = w;
+        } else {
+            p->head = w;
+        }
+        p->tail = w;
+        pthread_mutex_unlock( &p->lock );
     }
-    col->end_work_queue = w;
-    if (!col->top_work_queue) col->top_work_queue = w;
 
-    pthread_mutex_unlock( &col->lock );
+    /* If there's someone sleeping, wake them up (see worker_thread for */
+    /* why this can't miss a thread that's about to go to sleep) */
+    atomic_thread_fence( memory_order_seq_cst );
+    if (atomic_load( &pool->sleeping ) > 0) {
+        pthread_mutex_lock( &pool->lock );
+        pthread_cond_signal( &pool->work_ready );
+        pthread_mutex_unlock( &pool->lock );
+    }
 }
 
 /*
@@ -254,31 +744,30 @@ void hss_thread_issue_work(struct thread_collection *col,
 void hss_thread_done(struct thread_collection *col) {
     if (!col) return;
 
-    unsigned i;
-    pthread_mutex_lock( &col->lock );
-    for (i=0; i<col->num_thread; i++) {
-        /*
-         * Wait for each thread that we have spawned.
-         * We're the only one that will spawn them, and so we don't have to
-         * worry about any new ones appearing while we scan through the list
-         */
-        if (col->threads[i].state != never_was) {
-            void *status;
-            pthread_t thread_id = col->threads[i].thread_id;
-            pthread_mutex_unlock( &col->lock );
-            pthread_join( thread_id, &status );
-            pthread_mutex_lock( &col->lock );
-        }
+    struct hss_thread_pool *pool = col->pool;
+    pthread_mutex_lock( &pool->lock );
+    while (atomic_load( &col->pending ) > 0) {
+        pthread_cond_wait( &pool->work_done, &pool->lock );
     }
-    pthread_mutex_unlock( &col->lock );
+    pthread_mutex_unlock( &pool->lock );
 
-    /* Ok, all the threads have finished; tear things down */
+    /* Ok, all the work items have finished; tear things down */
+    if (col->own_pool) shut_down_pool( pool );
 
-    pthread_mutex_destroy( &col->lock );
+    while (col->chunks) {
+        struct slot_chunk *chunk = col->chunks;
+        col->chunks = chunk->link;
+        free(chunk);
+    }
     pthread_mutex_destroy( &col->write_lock );
     free(col);
 }
 
+bool hss_thread_poll(struct thread_collection *col) {
+    if (!col) return true;
+    return atomic_load( &col->pending ) == 0;
+}
+
 void hss_thread_before_write(struct thread_collection *col) {
     if (!col) return;
     pthread_mutex_lock( &col->write_lock );
@@ -288,11 +777,98 @@ void hss_thread_after_write(struct thread_collection *col) {
     if (!col) return;
     pthread_mutex_unlock( &col->write_lock );
 }
+
+struct hss_mutex {
+    pthread_mutex_t lock;
+};
+
+bool hss_mutex_create(struct hss_mutex **result) {
+    struct hss_mutex *mutex = malloc( sizeof *mutex );
+    *result = 0;
+    if (!mutex) return false;
+    if (0 != pthread_mutex_init( &mutex->lock, 0 )) {
+        free(mutex);
+        return false;
+    }
+    *result = mutex;
+    return true;
+}
+
+void hss_mutex_lock(struct hss_mutex *mutex) {
+    if (!mutex) return;
+    pthread_mutex_lock( &mutex->lock );
+}
+
+void hss_mutex_unlock(struct hss_mutex *mutex) {
+    if (!mutex) return;
+    pthread_mutex_unlock( &mutex->lock );
+}
+
+void hss_mutex_free(struct hss_mutex *mutex) {
+    if (!mutex) return;
+    pthread_mutex_destroy( &mutex->lock );
+    free(mutex);
+}
+
+struct hss_event {
+    pthread_mutex_t lock;
+    pthread_cond_t raised;
+    bool flag;
+};
+
+struct hss_event *hss_event_create(void) {
+    struct hss_event *event = malloc( sizeof *event );
+    if (!event) return 0;
+    if (0 != pthread_mutex_init( &event->lock, 0 )) {
+        free(event);
+        return 0;
+    }
+    if (0 != pthread_cond_init( &event->raised, 0 )) {
+        pthread_mutex_destroy( &event->lock );
+        free(event);
+        return 0;
+    }
+    event->flag = false;
+    return event;
+}
+
+void hss_event_signal(struct hss_event *event) {
+    if (!event) return;
+    pthread_mutex_lock( &event->lock );
+    event->flag = true;
+    pthread_cond_broadcast( &event->raised );
+    pthread_mutex_unlock( &event->lock );
+}
+
+bool hss_event_check(struct hss_event *event, bool wait) {
+    if (!event) return false;
+    pthread_mutex_lock( &event->lock );
+    while (wait && !event->flag) {
+        pthread_cond_wait( &event->raised, &event->lock );
+    }
+    bool raised = event->flag;
+    event->flag = false;
+    pthread_mutex_unlock( &event->lock );
+    return raised;
+}
+
+void hss_event_free(struct hss_event *event) {
+    if (!event) return;
+    pthread_cond_destroy( &event->raised );
+    pthread_mutex_destroy( &event->lock );
+    free(event);
+}
     
 
 unsigned hss_thread_num_tracks(int num_thread) {
-    if (num_thread == 0) num_thread = DEFAULT_THREAD;
+    if (num_thread == 0) num_thread = default_threads();
     if (num_thread <= 1) return 1;
     if (num_thread >= MAX_THREAD) return MAX_THREAD;
     return num_thread;
 }
+
+unsigned hss_thread_pool_num_tracks(struct hss_thread_pool *pool,
+                                    int num_thread) {
+    if (!pool) return hss_thread_num_tracks( num_thread );
+    return atomic_load( &pool->num_started );
+}
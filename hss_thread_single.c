@@ -1,4 +1,5 @@
 #include "hss_thread.h"
+#include "hss.h"
 
 /*
  * This is a trivial implementation of our threading abstraction.
@@ -13,6 +14,29 @@ struct thread_collection *hss_thread_init(int num_thread) {
     return 0;
 }
 
+/*
+ * We can't create a pool of threads, either; the application will just
+ * pass NULL in as the pool
+ */
+struct hss_thread_pool *hss_thread_pool_create(int num_thread) {
+    return 0;
+}
+
+void hss_thread_pool_free(struct hss_thread_pool *pool) {
+    ;
+}
+
+struct thread_collection *hss_thread_init_pool(struct hss_thread_pool *pool,
+                                               int num_thread) {
+    return 0;
+}
+
+struct thread_collection *hss_thread_init_background(
+                                  struct hss_thread_pool *pool,
+                                  int num_thread) {
+    return 0;
+}
+
 /*
  * This asks that function be called sometime between now, and when
  * hss_thread_done is called.  We just go ahead, and do it now
@@ -34,6 +58,14 @@ void hss_thread_done(struct thread_collection *collect) {
     ;
 }
 
+/*
+ * Everything we were asked to do has been done (as we did it when it was
+ * issued)
+ */
+bool hss_thread_poll(struct thread_collection *collect) {
+    return true;
+}
+
 /*
  * A thread calls this when it will write into a common area (so that no
  * other thread will access it at the same time).  No threads means that
@@ -50,6 +82,48 @@ void hss_thread_after_write(struct thread_collection *collect) {
     ;
 }
 
+/*
+ * Without threads, there's no one else to lock out; we don't bother
+ * creating a lock at all.  Note that this means that an application that
+ * has its own threads needs to link with the threaded version of the
+ * library if they share a working key
+ */
+bool hss_mutex_create(struct hss_mutex **mutex) {
+    *mutex = 0;
+    return true;
+}
+
+void hss_mutex_lock(struct hss_mutex *mutex) {
+    ;
+}
+
+void hss_mutex_unlock(struct hss_mutex *mutex) {
+    ;
+}
+
+void hss_mutex_free(struct hss_mutex *mutex) {
+    ;
+}
+
+/*
+ * Nor can anyone signal us while we wait
+ */
+struct hss_event *hss_event_create(void) {
+    return 0;
+}
+
+void hss_event_signal(struct hss_event *event) {
+    ;
+}
+
+bool hss_event_check(struct hss_event *event, bool wait) {
+    return false;
+}
+
+void hss_event_free(struct hss_event *event) {
+    ;
+}
+
 /*
  * This tells the application that we really have only one thread
  * (the main one)
@@ -57,3 +131,8 @@ void hss_thread_after_write(struct thread_collection *collect) {
 unsigned hss_thread_num_tracks(int num_thread) {
     return 1;
 }
+
+unsigned hss_thread_pool_num_tracks(struct hss_thread_pool *pool,
+                                    int num_thread) {
+    return 1;
+}
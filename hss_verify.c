@@ -88,7 +88,8 @@ bool hss_validate_signature(
     /* key to use to validate the top level signature */
     public_key += 4;
 
-    struct thread_collection *col = hss_thread_init(info->num_threads);
+    struct thread_collection *col = hss_thread_init_pool(info->thread_pool,
+                                                         info->num_threads);
     enum hss_error_code got_error = hss_error_none;
     struct verify_detail detail;
     detail.got_error = &got_error;
@@ -32,6 +32,21 @@ bool lm_ots_generate_public_key(
     struct seed_derive *seed,
     unsigned char *public_key, size_t public_key_len);
 
+/*
+ * Compute the public keys for 'count' consecutive q values (q, q+1, ...)
+ * at once; count may be as large as MAX_HASH_LANES.  The public keys are
+ * placed one after another into the public_key buffer.  This gives the
+ * same results as calling lm_ots_generate_public_key on each; it's faster
+ * on CPUs that can compute several hashes in parallel
+ */
+bool lm_ots_generate_public_keys(
+    param_set_t lm_ots_type,
+    const unsigned char *I,
+    merkle_index_t q,
+    unsigned count,
+    struct seed_derive *seed,
+    unsigned char *public_key, size_t public_key_len);
+
 /*
  * Sign a message.  Warning: the caller is expected to make sure that it signs
  * only one message with a given seed/I/q set
@@ -55,6 +70,58 @@ bool lm_ots_generate_signature(
     const void *message, size_t message_len, bool prehashed,
     unsigned char *signature, size_t signature_len);
 
+/*
+ * The OTS routines for a specific parameter set.  We have a separate copy of
+ * the code for each parameter set, compiled with the parameters (n, w, p, ls)
+ * as constants, so that the inner loops don't have to look them up.  The
+ * Merkle trees look up their kernel once (when the working key is loaded)
+ * and call these directly; the routines above look it up each time.
+ * The routines take the same parameters as the above routines (except for
+ * the parameter set, which is implicit)
+ *
+ * In addition, generate_public_key can optionally save checkpoints (the
+ * intermediate values every checkpoint_step steps along each Winternitz
+ * chain) into the checkpoint buffer (checkpoint_len bytes); if that is
+ * passed to generate_signature later (for the same I, q), it can start each
+ * chain from the nearest checkpoint, rather than from the start.  Pass NULL
+ * to either if you don't have that buffer.  Warning: these checkpoints are
+ * just as secret as the seed is
+ */
+struct lm_ots_kernel {
+    param_set_t lm_ots_type;    /* The parameter set this is for */
+    unsigned h, n, w, p, ls;    /* Same as lm_ots_look_up_parameter_set */
+    unsigned checkpoint_step;   /* How often we checkpoint the chains */
+    size_t checkpoint_len;      /* Size of the checkpoints of one OTS key */
+    bool (*generate_public_key)(const unsigned char *I, merkle_index_t q,
+                   struct seed_derive *seed,
+                   unsigned char *public_key, size_t public_key_len,
+                   unsigned char *checkpoint);
+    bool (*generate_public_keys)(const unsigned char *I, merkle_index_t q,
+                   unsigned count, struct seed_derive *seed,
+                   unsigned char *public_key, size_t public_key_len);
+    bool (*generate_signature)(const unsigned char *I, merkle_index_t q,
+                   struct seed_derive *seed,
+                   const void *message, size_t message_len, bool prehashed,
+                   unsigned char *signature, size_t signature_len,
+                   const unsigned char *checkpoint);
+        /*
+         * This computes just the Winternitz chains first_chain through
+         * first_chain + num_chains - 1 of the signature of the randomized
+         * message hash Q (see lm_ots_hash_message), and places them into y.
+         * This allows the caller to split up computing a signature
+         */
+    bool (*generate_signature_chains)(const unsigned char *I,
+                   merkle_index_t q, struct seed_derive *seed,
+                   const unsigned char *Q,
+                   unsigned first_chain, unsigned num_chains,
+                   unsigned char *y, const unsigned char *checkpoint);
+};
+
+/*
+ * Return the kernel for this parameter set, or NULL if we don't support it
+ */
+const struct lm_ots_kernel *lm_ots_look_up_kernel(param_set_t lm_ots_type);
+
 /* The include file for the verification routine */
 #include "lm_ots_verify.h"
 
@@ -71,8 +71,8 @@ unsigned lm_ots_hashes_per_public_key(param_set_t lm_ots_type) {
     return num_dig * (1 << wint) + 1;
 }
 
-/* Todo: some of these values depend only on w; why do we need to recompute */
-/* them each time??? */
+/* This is the general version; the per parameter set kernels use */
+/* lm_ots_digits instead, which does the work for all the digits at once */
 unsigned lm_ots_coef(const unsigned char *Q, unsigned i, unsigned w) {
     unsigned index = (i * w) / 8;    /* Which byte holds the coefficient */
                                      /* we want */
@@ -13,4 +13,47 @@ unsigned lm_ots_compute_checksum(const unsigned char *Q, unsigned Q_len,
                                  unsigned w, unsigned ls);
 unsigned lm_ots_coef(const unsigned char *Q, unsigned i, unsigned w);
 
+/*
+ * The OTS kernels (the sign, verify and public key routines) are compiled
+ * once for each parameter set, with the parameters as constants; this asks
+ * the compiler to inline the generic versions into each of them (so that it
+ * can fold those constants in)
+ */
+#if defined( __GNUC__ )
+#define LM_OTS_INLINE static inline __attribute__((always_inline))
+#else
+#define LM_OTS_INLINE static inline
+#endif
+
+/*
+ * This expands the n byte hash Q into the p Winternitz digits that we
+ * actually sign (the digits of Q, followed by the digits of the checksum).
+ * This gives the same results as calling lm_ots_coef on Q with the checksum
+ * appended; however, when the kernels inline this with w, n, p and ls
+ * known, the digit extraction becomes straight-line code, rather than
+ * the shifts, masks and divisions lm_ots_coef does for every digit
+ */
+LM_OTS_INLINE void lm_ots_digits(unsigned char *digit, const unsigned char *Q,
+                        unsigned n, unsigned w, unsigned p, unsigned ls) {
+    unsigned max_digit = (1<<w) - 1;
+    unsigned digits_per_byte = 8/w;
+    unsigned sum = 0;
+    unsigned i, k;
+
+    for (i=0; i<n; i++) {
+        for (k=0; k<digits_per_byte; k++) {
+            unsigned d = (Q[i] >> (8 - w*(k+1))) & max_digit;
+            digit[ i*digits_per_byte + k ] = d;
+            sum += max_digit - d;
+        }
+    }
+
+    /* Now the checksum digits; these are the leading digits of the */
+    /* shifted 16 bit checksum */
+    sum <<= ls;
+    for (i = n*digits_per_byte, k = 0; i < p; i++, k++) {
+        digit[i] = (sum >> (16 - w*(k+1))) & max_digit;
+    }
+}
+
 #endif /* LM_OTS_COMMON_H_ */
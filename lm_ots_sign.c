@@ -12,17 +12,42 @@
 #include "hss_derive.h"
 #include "hss_internal.h"
 
-bool lm_ots_generate_public_key(
-    param_set_t lm_ots_type,
+/*
+ * We save a checkpoint every 2**(w/2) steps of each chain (for W8, that's
+ * every 16 steps); that's a balance between the memory the checkpoints take
+ * and the number of hashes the signer still needs to do.  The checkpoints
+ * for chain i are stored consecutively, starting with the chain start
+ */
+#define CHECKPOINT_STEP(w) (1U << ((w)/2))
+#define CHECKPOINTS_PER_CHAIN(w) (((1U << (w)) - 1) / CHECKPOINT_STEP(w) + 1)
+
+/*
+ * These are the generic versions of the OTS routines; they're inlined into
+ * the per parameter set kernels (at the bottom of this file), with the
+ * parameters h, n, w, p, ls being constants
+ */
+LM_OTS_INLINE bool generate_public_key(
+    unsigned h, unsigned n, unsigned w, unsigned p,
     const unsigned char *I, /* Public key identifier */
     merkle_index_t q,       /* Diversification string, 4 bytes value */
     struct seed_derive *seed,
-    unsigned char *public_key, size_t public_key_len) {
+    unsigned char *public_key, size_t public_key_len,
+    unsigned char *checkpoint) { /* Where to save the checkpoints; NULL */
+                            /* if the caller doesn't want them */
+    unsigned max_digit = (1<<w) - 1;
+    unsigned step = CHECKPOINT_STEP(w);
+    size_t chain_checkpoint_len = CHECKPOINTS_PER_CHAIN(w) * n;
+
+    if (public_key_len < n) return false;
 
-    /* Look up the parameter set */
-    unsigned h, n, w, p, ls;
-    if (!lm_ots_look_up_parameter_set( lm_ots_type, &h, &n, &w, &p, &ls ))
-        return false;
+    /* Set up the block we'll use for the Winternitz chain hashes; this */
+    /* already has the padding and the I, q values in place */
+    struct hash_block block;
+    if (!hss_hash_block_init( &block, h, ITER_LEN(n) )) return false;
+    hss_hash_block_set( &block, ITER_I, I, I_LEN );
+    unsigned char buf[ MAX_HASH ];
+    put_bigendian( buf, q, 4 );
+    hss_hash_block_set( &block, ITER_Q, buf, 4 );
 
     /* Start the hash that computes the final value */
     union hash_context public_ctx;
@@ -38,35 +63,165 @@ bool lm_ots_generate_public_key(
 
     /* Now generate the public key */
     /* This is where we spend the majority of the time during key gen and */
-    /* signing operations; it would make sense to attempt to try to take */
-    /* advantage of parallel (SIMD) hardware; even if we use it nowhere */
-    /* else, we'd get a significant speed up */
+    /* signing operations; hence if we have parallel (SIMD) hardware, we */
+    /* run several chains at once */
     int i, j;
 
-    unsigned char buf[ ITER_MAX_LEN ];
-    memcpy( buf + ITER_I, I, I_LEN );
-    put_bigendian( buf + ITER_Q, q, 4 );
-    union hash_context ctx;
-
     hss_seed_derive_set_j( seed, 0 );
 
-    for (i=0; i<p; i++) {
-        hss_seed_derive( buf + ITER_PREV, seed, i < p-1 );
-        put_bigendian( buf + ITER_K, i, 2 );
-        /* We'll place j in the buffer below */
-        for (j=0; j < (1<<w) - 1; j++) {
-            buf[ITER_J] = j;
+    unsigned num_lanes = hss_hash_lanes(h);
+    if (num_lanes > 1) {
+        /* Each lane holds an independent chain; as all the chains are the */
+        /* same length, the lanes all step in lockstep */
+        struct hash_block_lanes chains;
+        hss_hash_block_lanes_broadcast( &chains, &block );
+        for (i=0; i<p; i += num_lanes) {
+            unsigned lanes = p - i;
+            if (lanes > num_lanes) lanes = num_lanes;
+            unsigned lane;
+
+            /* Generate the starting points of all the chains at once */
+            hss_seed_derive_lanes( &chains, ITER_PREV, seed, lanes );
+            for (lane = 0; lane < lanes; lane++) {
+                hss_hash_block_lanes_set_byte( &chains, lane, ITER_K,
+                                               (i + lane) >> 8 );
+                hss_hash_block_lanes_set_byte( &chains, lane, ITER_K+1,
+                                               (i + lane) );
+            }
+            for (j=0;; j++) {
+                if (checkpoint && j % step == 0) {
+                    for (lane = 0; lane < lanes; lane++) {
+                        hss_hash_block_lanes_get( checkpoint +
+                                   (i+lane) * chain_checkpoint_len +
+                                   (j / step) * n,
+                                   &chains, lane, ITER_PREV, n );
+                    }
+                }
+                if (j == max_digit) break;
 
-            hss_hash_ctx( buf + ITER_PREV, h, &ctx, buf, ITER_LEN(n) );
+                hss_hash_block_lanes_set_byte_all( &chains, ITER_J, j );
+
+                hss_hash_block_lanes_to_block( &chains, ITER_PREV, h,
+                                               &chains, lanes );
+            }
+            /* Include the chain ends in the hash (in order) */
+            for (lane = 0; lane < lanes; lane++) {
+                hss_hash_block_lanes_get( buf, &chains, lane, ITER_PREV, n );
+                hss_update_hash_context(h, &public_ctx, buf, n );
+            }
+        }
+        hss_zeroize( &chains, sizeof chains );
+    } else {
+        /* No SIMD hardware; do the chains one at a time */
+        for (i=0; i<p; i++) {
+            hss_seed_derive_to_block( &block, ITER_PREV, seed, i < p-1 );
+            hss_hash_block_set_byte( &block, ITER_K, i >> 8 );
+            hss_hash_block_set_byte( &block, ITER_K+1, i );
+            /* We'll place j in the block below */
+            for (j=0;; j++) {
+                if (checkpoint && j % step == 0) {
+                    hss_hash_block_get( checkpoint +
+                                   i * chain_checkpoint_len + (j / step) * n,
+                                   &block, ITER_PREV, n );
+                }
+                if (j == max_digit) break;
+
+                hss_hash_block_set_byte( &block, ITER_J, j );
+
+                hss_hash_block_to_block( &block, ITER_PREV, h, &block );
+            }
+            /* Include that in the hash */
+            hss_hash_block_get( buf, &block, ITER_PREV, n );
+            hss_update_hash_context(h, &public_ctx, buf, n );
         }
-        /* Include that in the hash */
-        hss_update_hash_context(h, &public_ctx, buf + ITER_PREV, n );
     }
 
     /* And the result of the running hash is the public key */
     hss_finalize_hash_context( h, &public_ctx, public_key );
 
-    hss_zeroize( &ctx, sizeof ctx );
+    hss_zeroize( &block, sizeof block );
+
+    return true;
+}
+
+/*
+ * This generates the public keys for 'count' consecutive leaves (q, q+1,
+ * ...) at once; count may be up to MAX_HASH_LANES.  Here, each lane works
+ * on a different OTS key; because all the keys have the same chain lengths,
+ * all the lanes do the same number of hashes, and no lane goes idle
+ * (compare to generate_public_key, which has idle lanes if the number
+ * of chains is not a multiple of the number of lanes).  The public keys are
+ * written consecutively into public_key
+ */
+LM_OTS_INLINE bool generate_public_keys(
+    unsigned h, unsigned n, unsigned w, unsigned p,
+    const unsigned char *I, /* Public key identifier */
+    merkle_index_t q,       /* Diversification string of the first key */
+    unsigned count,         /* Number of keys to generate */
+    struct seed_derive *seed,
+    unsigned char *public_key, size_t public_key_len) {
+
+    if (count > MAX_HASH_LANES || public_key_len < count * n) return false;
+    if (count == 1) {
+        return generate_public_key( h, n, w, p, I, q, seed,
+                                    public_key, public_key_len, NULL );
+    }
+
+    /* Set up the Winternitz chain blocks; each lane gets its own q */
+    struct hash_block block;
+    if (!hss_hash_block_init( &block, h, ITER_LEN(n) )) return false;
+    hss_hash_block_set( &block, ITER_I, I, I_LEN );
+    struct hash_block_lanes chains;
+    hss_hash_block_lanes_broadcast( &chains, &block );
+
+    /* Start the hashes that compute the final values */
+    struct hash_lanes_context public_ctx;
+    unsigned char buf[ MAX_HASH_LANES ][ MAX_HASH ];
+    const unsigned char *buf_ptr[ MAX_HASH_LANES ];
+    unsigned char *public_key_ptr[ MAX_HASH_LANES ];
+    unsigned lane;
+    hss_init_hash_lanes_context( h, &public_ctx );
+    for (lane = 0; lane < count; lane++) {
+        unsigned char prehash_prefix[ PBLC_PREFIX_LEN ];
+        memcpy( prehash_prefix + PBLC_I, I, I_LEN );
+        put_bigendian( prehash_prefix + PBLC_Q, q + lane, 4 );
+        SET_D( prehash_prefix + PBLC_D, D_PBLC );
+        memcpy( buf[lane], prehash_prefix, PBLC_PREFIX_LEN );
+        hss_hash_block_lanes_set( &chains, lane, ITER_Q,
+                                  prehash_prefix + PBLC_Q, 4 );
+        buf_ptr[lane] = buf[lane];
+        public_key_ptr[lane] = public_key + lane * n;
+    }
+    hss_update_hash_lanes_context( h, &public_ctx, buf_ptr, PBLC_PREFIX_LEN,
+                                   count );
+
+    int i, j;
+    struct seed_derive_q_lanes seed_lanes;
+    hss_seed_derive_set_j( seed, 0 );
+    hss_seed_derive_q_lanes_init( &seed_lanes, seed, count );
+    for (i=0; i<p; i++) {
+        hss_seed_derive_q_lanes( &chains, ITER_PREV, &seed_lanes, seed,
+                                 i < p-1 );
+        hss_hash_block_lanes_set_byte_all( &chains, ITER_K, i >> 8 );
+        hss_hash_block_lanes_set_byte_all( &chains, ITER_K+1, i );
+        for (j=0; j < (1<<w) - 1; j++) {
+            hss_hash_block_lanes_set_byte_all( &chains, ITER_J, j );
+
+            hss_hash_block_lanes_to_block( &chains, ITER_PREV, h,
+                                           &chains, count );
+        }
+        /* Include the chain ends in the hashes */
+        for (lane = 0; lane < count; lane++) {
+            hss_hash_block_lanes_get( buf[lane], &chains, lane, ITER_PREV, n );
+        }
+        hss_update_hash_lanes_context( h, &public_ctx, buf_ptr, n, count );
+    }
+
+    /* And the result of the running hashes are the public keys */
+    hss_finalize_hash_lanes_context( h, &public_ctx, public_key_ptr, count );
+
+    hss_seed_derive_q_lanes_done( &seed_lanes );
+    hss_zeroize( &chains, sizeof chains );
 
     return true;
 }
@@ -87,18 +242,104 @@ void lm_ots_generate_randomizer(unsigned char *c, unsigned n,
 }
 
 
-bool lm_ots_generate_signature(
+/*
+ * This computes the randomized message hash Q (the hash of I, q, D_MESG, the
+ * randomizer C and the message), which is the value the OTS signature
+ * actually signs
+ */
+void lm_ots_hash_message(unsigned char *Q, unsigned h, unsigned n,
+                         const unsigned char *I, merkle_index_t q,
+                         const unsigned char *C,
+                         const void *message, size_t message_len) {
+    union hash_context ctx;
+    hss_init_hash_context(h, &ctx);
+
+    /* First, we hash the message prefix */
+    unsigned char prefix[MESG_PREFIX_MAXLEN];
+    memcpy( prefix + MESG_I, I, I_LEN );
+    put_bigendian( prefix + MESG_Q, q, 4 );
+    SET_D( prefix + MESG_D, D_MESG );
+    memcpy( prefix + MESG_C, C, n );
+    hss_update_hash_context(h, &ctx, prefix, MESG_PREFIX_LEN(n) );
+
+        /* Then, the message */
+    hss_update_hash_context(h, &ctx, message, message_len );
+    hss_finalize_hash_context( h, &ctx, Q );
+}
+
+/*
+ * This computes the Winternitz chains first_chain through
+ * first_chain + num_chains - 1 of the signature of the randomized hash Q,
+ * placing them (consecutively) into y
+ */
+LM_OTS_INLINE bool sign_chains(
+    unsigned h, unsigned n, unsigned w, unsigned p, unsigned ls,
+    const unsigned char *I, /* Public key identifier */
+    merkle_index_t q,       /* Diversification string, 4 bytes value */
+    struct seed_derive *seed,
+    const unsigned char *Q, /* The randomized hash we're signing */
+    unsigned first_chain, unsigned num_chains,
+    unsigned char *y,
+    const unsigned char *checkpoint) { /* The checkpoints that */
+                            /* generate_public_key saved, or NULL */
+    if (first_chain > p || num_chains > p - first_chain) return false;
+
+    /* Convert the randomized hash (and its checksum) into digits */
+    unsigned char digit[ MAX_P ];
+    lm_ots_digits( digit, Q, n, w, p, ls );
+
+    unsigned i;
+    struct hash_block block;
+    if (!hss_hash_block_init( &block, h, ITER_LEN(n) )) return false;
+
+    /* Preset the parts of the block that don't change */
+    hss_hash_block_set( &block, ITER_I, I, I_LEN );
+    unsigned char q_buf[4];
+    put_bigendian( q_buf, q, 4 );
+    hss_hash_block_set( &block, ITER_Q, q_buf, 4 );
+    
+    unsigned step = CHECKPOINT_STEP(w);
+    size_t chain_checkpoint_len = CHECKPOINTS_PER_CHAIN(w) * n;
+    unsigned last_chain = first_chain + num_chains;
+    hss_seed_derive_set_j( seed, first_chain );
+    for (i=first_chain; i<last_chain; i++) {
+        hss_hash_block_set_byte( &block, ITER_K, i >> 8 );
+        hss_hash_block_set_byte( &block, ITER_K+1, i );
+        unsigned j;
+        if (checkpoint) {
+            /* Start from the last checkpoint at or before our digit */
+            j = digit[i] - digit[i] % step;
+            hss_hash_block_set( &block, ITER_PREV, checkpoint +
+                         i * chain_checkpoint_len + (j / step) * n, n );
+        } else {
+            /* Start from the beginning of the chain */
+            j = 0;
+            hss_seed_derive_to_block( &block, ITER_PREV, seed,
+                                      i<last_chain-1 );
+        }
+        for (; j<digit[i]; j++) {
+            hss_hash_block_set_byte( &block, ITER_J, j );
+            hss_hash_block_to_block( &block, ITER_PREV, h, &block );
+        }
+        hss_hash_block_get( &y[ n * (i - first_chain) ], &block,
+                            ITER_PREV, n );
+    }
+
+    hss_zeroize( &block, sizeof block );
+
+    return true;
+}
+
+LM_OTS_INLINE bool generate_signature(
     param_set_t lm_ots_type,
+    unsigned h, unsigned n, unsigned w, unsigned p, unsigned ls,
     const unsigned char *I, /* Public key identifier */
     merkle_index_t q,       /* Diversification string, 4 bytes value */
     struct seed_derive *seed,
     const void *message, size_t message_len, bool prehashed,
-    unsigned char *signature, size_t signature_len) {
-
-    /* Look up the parameter set */
-    unsigned h, n, w, p, ls;
-    if (!lm_ots_look_up_parameter_set( lm_ots_type, &h, &n, &w, &p, &ls ))
-        return false;
+    unsigned char *signature, size_t signature_len,
+    const unsigned char *checkpoint) { /* The checkpoints that */
+                            /* generate_public_key saved, or NULL */
 
     /* Check if we have enough room */
     if (signature_len < 4 + n + p*n) return false;
@@ -106,7 +347,6 @@ bool lm_ots_generate_signature(
     /* Export the parameter set to the signature */
     put_bigendian( signature, lm_ots_type, 4 );
 
-    union hash_context ctx;
     /* Select the randomizer.  Note: we do this determanistically, because
      * upper levels of the HSS tree sometimes sign the same message with the
      * same index (between multiple reboots), hence we want to make sure that
@@ -119,49 +359,116 @@ bool lm_ots_generate_signature(
     }
 
     /* Compute the initial hash */
-    unsigned char Q[MAX_HASH + 2];
+    unsigned char Q[MAX_HASH];
     if (!prehashed) {
-        hss_init_hash_context(h, &ctx);
-
-        /* First, we hash the message prefix */
-        unsigned char prefix[MESG_PREFIX_MAXLEN];
-        memcpy( prefix + MESG_I, I, I_LEN );
-        put_bigendian( prefix + MESG_Q, q, 4 );
-        SET_D( prefix + MESG_D, D_MESG );
-        memcpy( prefix + MESG_C, signature+4, n );
-        hss_update_hash_context(h, &ctx, prefix, MESG_PREFIX_LEN(n) );
-
-            /* Then, the message */
-        hss_update_hash_context(h, &ctx, message, message_len );
-        hss_finalize_hash_context( h, &ctx, Q );
+        lm_ots_hash_message( Q, h, n, I, q, signature+4,
+                             message, message_len );
     } else {
         memcpy( Q, message, n );
     }
 
-    /* Append the checksum to the randomized hash */
-    put_bigendian( &Q[n], lm_ots_compute_checksum(Q, n, w, ls), 2 );
+    /* And sign it */
+    return sign_chains( h, n, w, p, ls, I, q, seed, Q, 0, p,
+                        signature + 4 + n, checkpoint );
+}
 
-    int i;
-    unsigned char tmp[ITER_MAX_LEN];
+/*
+ * Now, the kernels for each parameter set we support
+ */
+#define LM_OTS_KERNEL(name, type, h, n, w, p, ls)                           \
+static bool name##_public_key(const unsigned char *I, merkle_index_t q,    \
+                   struct seed_derive *seed,                                \
+                   unsigned char *public_key, size_t public_key_len,        \
+                   unsigned char *checkpoint) {                             \
+    return generate_public_key( h, n, w, p, I, q, seed,                     \
+                                public_key, public_key_len, checkpoint );   \
+}                                                                           \
+static bool name##_public_keys(const unsigned char *I, merkle_index_t q,   \
+                   unsigned count, struct seed_derive *seed,                \
+                   unsigned char *public_key, size_t public_key_len) {      \
+    return generate_public_keys( h, n, w, p, I, q, count, seed,             \
+                                 public_key, public_key_len );              \
+}                                                                           \
+static bool name##_signature(const unsigned char *I, merkle_index_t q,     \
+                   struct seed_derive *seed,                                \
+                   const void *message, size_t message_len, bool prehashed, \
+                   unsigned char *signature, size_t signature_len,          \
+                   const unsigned char *checkpoint) {                       \
+    return generate_signature( type, h, n, w, p, ls, I, q, seed,            \
+                               message, message_len, prehashed,             \
+                               signature, signature_len, checkpoint );      \
+}                                                                           \
+static bool name##_signature_chains(const unsigned char *I,                \
+                   merkle_index_t q, struct seed_derive *seed,              \
+                   const unsigned char *Q,                                  \
+                   unsigned first_chain, unsigned num_chains,               \
+                   unsigned char *y, const unsigned char *checkpoint) {     \
+    return sign_chains( h, n, w, p, ls, I, q, seed, Q,                      \
+                        first_chain, num_chains, y, checkpoint );           \
+}                                                                           \
+static const struct lm_ots_kernel name = {                                  \
+    type, h, n, w, p, ls,                                                   \
+    CHECKPOINT_STEP(w), (p) * CHECKPOINTS_PER_CHAIN(w) * (n),               \
+    name##_public_key, name##_public_keys, name##_signature,                \
+    name##_signature_chains                                                 \
+};
 
-    /* Preset the parts of tmp that don't change */
-    memcpy( tmp + ITER_I, I, I_LEN );
-    put_bigendian( tmp + ITER_Q, q, 4 );
-    
-    hss_seed_derive_set_j( seed, 0 );
-    for (i=0; i<p; i++) {
-        put_bigendian( tmp + ITER_K, i, 2 );
-        hss_seed_derive( tmp + ITER_PREV, seed, i<p-1 );
-        unsigned a = lm_ots_coef( Q, i, w );
-        unsigned j;
-        for (j=0; j<a; j++) {
-            tmp[ITER_J] = j;
-            hss_hash_ctx( tmp + ITER_PREV, h, &ctx, tmp, ITER_LEN(n) );
-        }
-        memcpy( &signature[ 4 + n + n*i ], tmp + ITER_PREV, n );
+LM_OTS_KERNEL( kernel_n32_w1, LMOTS_SHA256_N32_W1, HASH_SHA256, 32, 1, 265, 7 )
+LM_OTS_KERNEL( kernel_n32_w2, LMOTS_SHA256_N32_W2, HASH_SHA256, 32, 2, 133, 6 )
+LM_OTS_KERNEL( kernel_n32_w4, LMOTS_SHA256_N32_W4, HASH_SHA256, 32, 4,  67, 4 )
+LM_OTS_KERNEL( kernel_n32_w8, LMOTS_SHA256_N32_W8, HASH_SHA256, 32, 8,  34, 0 )
+
+const struct lm_ots_kernel *lm_ots_look_up_kernel(param_set_t lm_ots_type) {
+    switch (lm_ots_type) {
+    case LMOTS_SHA256_N32_W1: return &kernel_n32_w1;
+    case LMOTS_SHA256_N32_W2: return &kernel_n32_w2;
+    case LMOTS_SHA256_N32_W4: return &kernel_n32_w4;
+    case LMOTS_SHA256_N32_W8: return &kernel_n32_w8;
+    default: return NULL;
     }
+}
+
+/*
+ * And the external routines that take the parameter set explicitly
+ */
+bool lm_ots_generate_public_key(
+    param_set_t lm_ots_type,
+    const unsigned char *I, /* Public key identifier */
+    merkle_index_t q,       /* Diversification string, 4 bytes value */
+    struct seed_derive *seed,
+    unsigned char *public_key, size_t public_key_len) {
+    const struct lm_ots_kernel *ots = lm_ots_look_up_kernel( lm_ots_type );
+    if (!ots) return false;
 
-    hss_zeroize( &ctx, sizeof ctx );
+    return ots->generate_public_key( I, q, seed, public_key, public_key_len,
+                                     NULL );
+}
 
-    return true;
+bool lm_ots_generate_public_keys(
+    param_set_t lm_ots_type,
+    const unsigned char *I, /* Public key identifier */
+    merkle_index_t q,       /* Diversification string of the first key */
+    unsigned count,         /* Number of keys to generate */
+    struct seed_derive *seed,
+    unsigned char *public_key, size_t public_key_len) {
+    const struct lm_ots_kernel *ots = lm_ots_look_up_kernel( lm_ots_type );
+    if (!ots) return false;
+
+    return ots->generate_public_keys( I, q, count, seed,
+                                      public_key, public_key_len );
+}
+
+bool lm_ots_generate_signature(
+    param_set_t lm_ots_type,
+    const unsigned char *I, /* Public key identifier */
+    merkle_index_t q,       /* Diversification string, 4 bytes value */
+    struct seed_derive *seed,
+    const void *message, size_t message_len, bool prehashed,
+    unsigned char *signature, size_t signature_len) {
+    const struct lm_ots_kernel *ots = lm_ots_look_up_kernel( lm_ots_type );
+    if (!ots) return false;
+
+    return ots->generate_signature( I, q, seed, message, message_len,
+                                    prehashed, signature, signature_len,
+                                    NULL );
 }
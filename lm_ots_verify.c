@@ -10,49 +10,22 @@
 #include "common_defs.h"
 
 /*
- * This validate a OTS signature for a message.  It doesn't actually use the
- * public key explicitly; instead, it just produces the root key, based on the
- * message; the caller is assumed to compare it to the expected value
- * Parameters:
- * - computed_public_key - where to place the reconstructed root.  It is
- *      assumed that the caller has allocated enough space
- * - I: the nonce value ("I") to use
- * - q: diversification string
- * - message - the message to verify
- * - message_len - the length of the message
- * - message_prehashed - true if the message has already undergone the initial
- *              (D_MESG) hash
- * - signature - the signature
- * - signature_len - the length of the signature
- * - parameter_set - what we expect the parameter set to be
- *
- * This returns true on successfully recomputing a root value; whether it is
- * the right one is something the caller would need to verify
+ * This is the generic version of the signature validation; it's inlined into
+ * the per parameter set versions below, with h, n, w, p, ls being constants
  */
-bool lm_ots_validate_signature_compute(
+LM_OTS_INLINE bool validate_signature_compute(
+    unsigned h, unsigned n, unsigned w, unsigned p, unsigned ls,
     unsigned char *computed_public_key,
     const unsigned char *I, merkle_index_t q,
     const void *message, size_t message_len, bool message_prehashed,
-    const unsigned char *signature, size_t signature_len,
-    param_set_t expected_parameter_set) {
-    if (signature_len < 4) return false;  /* Ha, ha, very funny... */
-
-    /* We don't trust the parameter set that's in the signature; verify it */
-    param_set_t parameter_set = get_bigendian( signature, 4 );
-    if (parameter_set != expected_parameter_set) {
-        return false;
-    }
-
-    unsigned h, n, w, p, ls;
-    if (!lm_ots_look_up_parameter_set( parameter_set, &h, &n, &w, &p, &ls ))
-        return false;
+    const unsigned char *signature, size_t signature_len) {
 
     if (signature_len != 4 + n * (p+1)) return false;
 
     const unsigned char *C = signature + 4;
     const unsigned char *y = C + n;
 
-    unsigned char Q[MAX_HASH + 2];
+    unsigned char Q[MAX_HASH];
     if (message_prehashed) {
         memcpy( Q, message, n );
      } else {
@@ -74,8 +47,9 @@ bool lm_ots_validate_signature_compute(
         hss_finalize_hash_context( h, &ctx, Q );
     }
 
-    /* Append the checksum to the randomized hash */
-    put_bigendian( &Q[n], lm_ots_compute_checksum(Q, n, w, ls), 2 );
+    /* Convert the randomized hash (and its checksum) into digits */
+    unsigned char digit[ MAX_P ];
+    lm_ots_digits( digit, Q, n, w, p, ls );
 
     /* And, start building the parts for the final hash */
     union hash_context final_ctx; 
@@ -90,25 +64,101 @@ bool lm_ots_validate_signature_compute(
     }
 
     int i;
-    unsigned char tmp[ITER_MAX_LEN];
+    struct hash_block block;
+    if (!hss_hash_block_init( &block, h, ITER_LEN(n) )) return false;
 
-    /* Preset the parts of tmp that don't change */
-    memcpy( tmp + ITER_I, I, I_LEN );
-    put_bigendian( tmp + ITER_Q, q, 4 );
+    /* Preset the parts of the block that don't change */
+    hss_hash_block_set( &block, ITER_I, I, I_LEN );
+    {
+        unsigned char q_buf[4];
+        put_bigendian( q_buf, q, 4 );
+        hss_hash_block_set( &block, ITER_Q, q_buf, 4 );
+    }
 
     unsigned max_digit = (1<<w) - 1;
-    for (i=0; i<p; i++) {
-        put_bigendian( tmp + ITER_K, i, 2 );
-        memcpy( tmp + ITER_PREV, y + i*n, n );
-        unsigned a = lm_ots_coef( Q, i, w );
-        unsigned j;
-        for (j=a; j<max_digit; j++) {
-            union hash_context ctx;
-            tmp[ITER_J] = j;
-            hss_hash_ctx( tmp + ITER_PREV, h, &ctx, tmp, ITER_LEN(n) );
+    unsigned num_lanes = hss_hash_lanes(h);
+    if (num_lanes > 1) {
+        /*
+         * We have SIMD hardware; run several chains at once.  Here, the
+         * chains are of different lengths; whenever one finishes, we load
+         * the next chain into its lane, so that all the lanes stay busy
+         * (until we run out of chains).  Because the chains finish out of
+         * order, we save the chain ends, and hash them in order at the end
+         */
+        unsigned char result[ MAX_HASH * MAX_P ];
+        struct hash_block_lanes chains;
+        unsigned chain[ MAX_HASH_LANES ]; /* Which chain is in each lane */
+        unsigned step[ MAX_HASH_LANES ];  /* Where it is in that chain */
+        bool busy[ MAX_HASH_LANES ];      /* Is this lane in use? */
+        unsigned lane, next_chain = 0;
+
+        hss_hash_block_lanes_broadcast( &chains, &block );
+        for (lane = 0; lane < num_lanes; lane++) busy[lane] = false;
+
+        for (;;) {
+            /* Load chains into any idle lanes */
+            unsigned lanes = 0;   /* The number of lanes we need to hash */
+            for (lane = 0; lane < num_lanes; lane++) {
+                while (!busy[lane] && next_chain < p) {
+                    i = next_chain++;
+                    unsigned a = digit[i];
+                    if (a == max_digit) {
+                        /* This chain is already complete */
+                        memcpy( &result[i*n], y + i*n, n );
+                        continue;
+                    }
+                    hss_hash_block_lanes_set_byte( &chains, lane, ITER_K,
+                                                   i >> 8 );
+                    hss_hash_block_lanes_set_byte( &chains, lane, ITER_K+1,
+                                                   i );
+                    hss_hash_block_lanes_set( &chains, lane, ITER_PREV,
+                                              y + i*n, n );
+                    chain[lane] = i;
+                    step[lane] = a;
+                    busy[lane] = true;
+                }
+                if (busy[lane]) {
+                    hss_hash_block_lanes_set_byte( &chains, lane, ITER_J,
+                                                   step[lane] );
+                    lanes = lane + 1;
+                }
+            }
+            if (lanes == 0) break;  /* Everything's done */
+
+            /* Advance all the chains by one step */
+            hss_hash_block_lanes_to_block( &chains, ITER_PREV, h,
+                                           &chains, lanes );
+
+            /* And retire any chains that have finished */
+            for (lane = 0; lane < lanes; lane++) {
+                if (!busy[lane]) continue;
+                step[lane] += 1;
+                if (step[lane] == max_digit) {
+                    hss_hash_block_lanes_get( &result[chain[lane]*n],
+                                         &chains, lane, ITER_PREV, n );
+                    busy[lane] = false;
+                }
+            }
         }
 
-        hss_update_hash_context(h, &final_ctx, tmp + ITER_PREV, n );
+        hss_update_hash_context(h, &final_ctx, result, p*n );
+    } else {
+        /* No SIMD hardware; do the chains one at a time */
+        for (i=0; i<p; i++) {
+            unsigned char buf[ MAX_HASH ];
+            hss_hash_block_set_byte( &block, ITER_K, i >> 8 );
+            hss_hash_block_set_byte( &block, ITER_K+1, i );
+            hss_hash_block_set( &block, ITER_PREV, y + i*n, n );
+            unsigned a = digit[i];
+            unsigned j;
+            for (j=a; j<max_digit; j++) {
+                hss_hash_block_set_byte( &block, ITER_J, j );
+                hss_hash_block_to_block( &block, ITER_PREV, h, &block );
+            }
+
+            hss_hash_block_get( buf, &block, ITER_PREV, n );
+            hss_update_hash_context(h, &final_ctx, buf, n );
+        }
     }
 
     /* Ok, finalize the public key hash */
@@ -120,3 +170,76 @@ bool lm_ots_validate_signature_compute(
      */
     return true;
 }
+
+/*
+ * The versions for each parameter set we support
+ */
+#define LM_OTS_VALIDATE(name, h, n, w, p, ls)                               \
+static bool name(unsigned char *computed_public_key,                        \
+                 const unsigned char *I, merkle_index_t q,                  \
+                 const void *message, size_t message_len,                   \
+                 bool message_prehashed,                                    \
+                 const unsigned char *signature, size_t signature_len) {    \
+    return validate_signature_compute( h, n, w, p, ls, computed_public_key, \
+                                I, q, message, message_len,                 \
+                                message_prehashed,                          \
+                                signature, signature_len );                 \
+}
+
+LM_OTS_VALIDATE( validate_n32_w1, HASH_SHA256, 32, 1, 265, 7 )
+LM_OTS_VALIDATE( validate_n32_w2, HASH_SHA256, 32, 2, 133, 6 )
+LM_OTS_VALIDATE( validate_n32_w4, HASH_SHA256, 32, 4,  67, 4 )
+LM_OTS_VALIDATE( validate_n32_w8, HASH_SHA256, 32, 8,  34, 0 )
+
+/*
+ * This validate a OTS signature for a message.  It doesn't actually use the
+ * public key explicitly; instead, it just produces the root key, based on the
+ * message; the caller is assumed to compare it to the expected value
+ * Parameters:
+ * - computed_public_key - where to place the reconstructed root.  It is
+ *      assumed that the caller has allocated enough space
+ * - I: the nonce value ("I") to use
+ * - q: diversification string
+ * - message - the message to verify
+ * - message_len - the length of the message
+ * - message_prehashed - true if the message has already undergone the initial
+ *              (D_MESG) hash
+ * - signature - the signature
+ * - signature_len - the length of the signature
+ * - parameter_set - what we expect the parameter set to be
+ *
+ * This returns true on successfully recomputing a root value; whether it is
+ * the right one is something the caller would need to verify
+ */
+bool lm_ots_validate_signature_compute(
+    unsigned char *computed_public_key,
+    const unsigned char *I, merkle_index_t q,
+    const void *message, size_t message_len, bool message_prehashed,
+    const unsigned char *signature, size_t signature_len,
+    param_set_t expected_parameter_set) {
+    if (signature_len < 4) return false;  /* Ha, ha, very funny... */
+
+    /* We don't trust the parameter set that's in the signature; verify it */
+    param_set_t parameter_set = get_bigendian( signature, 4 );
+    if (parameter_set != expected_parameter_set) {
+        return false;
+    }
+
+    /* And look up the routine for that parameter set (once; all the per */
+    /* digit work is within that routine) */
+    bool (*validate)(unsigned char *computed_public_key,
+                 const unsigned char *I, merkle_index_t q,
+                 const void *message, size_t message_len,
+                 bool message_prehashed,
+                 const unsigned char *signature, size_t signature_len);
+    switch (parameter_set) {
+    case LMOTS_SHA256_N32_W1: validate = validate_n32_w1; break;
+    case LMOTS_SHA256_N32_W2: validate = validate_n32_w2; break;
+    case LMOTS_SHA256_N32_W4: validate = validate_n32_w4; break;
+    case LMOTS_SHA256_N32_W8: validate = validate_n32_w8; break;
+    default: return false;
+    }
+
+    return validate( computed_public_key, I, q, message, message_len,
+                     message_prehashed, signature, signature_len );
+}
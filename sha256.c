@@ -15,12 +15,19 @@
 #include "sha256.h"
 #include "endian.h"
 
-#if !USE_OPENSSL && !defined(EXT_SHA256_H)
+#if USE_X86_SIMD && defined(__x86_64__) && \
+                    (defined(__GNUC__) || defined(__clang__))
+#define X86_SIMD 1     /* We can compile (and runtime select) the x86 */
+                       /* SIMD versions */
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define X86_SIMD 0
+#endif
 
-/* If we don't have OpenSSL, here's a SHA256 implementation */
 #define SHA256_FINALCOUNT_SIZE  8
 #define SHA256_K_SIZE	        64
-static const unsigned long K[SHA256_K_SIZE] = {
+static const uint32_t K[SHA256_K_SIZE] = {
     0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
     0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
     0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
@@ -36,55 +43,55 @@ static const unsigned long K[SHA256_K_SIZE] = {
     0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
 };
 
+/* The initial hash value */
+static const uint32_t H0[8] = {
+    0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+    0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+};
+
 /* Various logical functions */
 
-/* Rotate x right by rot bits */
-static unsigned long RORc(unsigned long x, int rot) {
-    rot &= 31; if (rot == 0) return x;
-    unsigned long right = ((x&0xFFFFFFFFUL)>>rot );
-    unsigned long left  = ((x&0xFFFFFFFFUL)<<(32-rot) );
-    return (right|left) & 0xFFFFFFFFUL;
+/* Rotate x right by rot bits (1 <= rot <= 31) */
+static uint32_t RORc(uint32_t x, int rot) {
+    return (x >> rot) | (x << (32-rot));
 }
 #define Ch(x,y,z)       (z ^ (x & (y ^ z)))
-#define Maj(x,y,z)      (((x | y) & z) | (x & y)) 
+#define Maj(x,y,z)      (((x | y) & z) | (x & y))
 #define S(x, n)         RORc((x),(n))
-#define R(x, n)         (((x)&0xFFFFFFFFUL)>>(n))
+#define R(x, n)         ((x)>>(n))
 #define Sigma0(x)       (S(x, 2) ^ S(x, 13) ^ S(x, 22))
 #define Sigma1(x)       (S(x, 6) ^ S(x, 11) ^ S(x, 25))
 #define Gamma0(x)       (S(x, 7) ^ S(x, 18) ^ R(x, 3))
 #define Gamma1(x)       (S(x, 17) ^ S(x, 19) ^ R(x, 10))
 
-static void sha256_compress (SHA256_CTX * ctx, const void *buf)
+/*
+ * This performs the SHA-256 compression function on a single 512-bit block,
+ * which has already been converted into 16 words in the CPU's native format.
+ * This is the portable version
+ */
+static void compress_words_portable(uint32_t state[8], const uint32_t *block)
 {
-    unsigned long S0, S1, S2, S3, S4, S5, S6, S7, W[SHA256_K_SIZE], t0, t1, t;
+    uint32_t S0, S1, S2, S3, S4, S5, S6, S7, W[SHA256_K_SIZE], t0, t1, t;
     int i;
-    const unsigned char *p;
 
     /* copy state into S */
-    S0 = ctx->h[0];
-    S1 = ctx->h[1];
-    S2 = ctx->h[2];
-    S3 = ctx->h[3];
-    S4 = ctx->h[4];
-    S5 = ctx->h[5];
-    S6 = ctx->h[6];
-    S7 = ctx->h[7];
+    S0 = state[0];
+    S1 = state[1];
+    S2 = state[2];
+    S3 = state[3];
+    S4 = state[4];
+    S5 = state[5];
+    S6 = state[6];
+    S7 = state[7];
 
-    /*
-     * We've been asked to perform the hash computation on this 512-bit string.
-     * SHA256 interprets that as an array of 16 bigendian 32 bit numbers; copy
-     * it, and convert it into 16 unsigned long's of the CPU's native format
-     */
-    p = buf;
     for (i=0; i<16; i++) {
-        W[i] = get_bigendian( p, 4 );
-        p += 4;
+        W[i] = block[i];
     }
 
     /* fill W[16..63] */
     for (i = 16; i < SHA256_K_SIZE; i++) {
         W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
-    }        
+    }
 
     /* Compress */
 #define RND(a,b,c,d,e,f,g,h,i)                         \
@@ -95,35 +102,175 @@ static void sha256_compress (SHA256_CTX * ctx, const void *buf)
 
      for (i = 0; i < SHA256_K_SIZE; ++i) {
          RND(S0,S1,S2,S3,S4,S5,S6,S7,i);
-         t = S7; S7 = S6; S6 = S5; S5 = S4; 
+         t = S7; S7 = S6; S6 = S5; S5 = S4;
          S4 = S3; S3 = S2; S2 = S1; S1 = S0; S0 = t;
      }
-#undef RND     
- 
+#undef RND
+
     /* feedback */
-    ctx->h[0] += S0;
-    ctx->h[1] += S1;
-    ctx->h[2] += S2;
-    ctx->h[3] += S3;
-    ctx->h[4] += S4;
-    ctx->h[5] += S5;
-    ctx->h[6] += S6;
-    ctx->h[7] += S7;
+    state[0] += S0;
+    state[1] += S1;
+    state[2] += S2;
+    state[3] += S3;
+    state[4] += S4;
+    state[5] += S5;
+    state[6] += S6;
+    state[7] += S7;
+}
+
+#if X86_SIMD
+#define CPU_AVX2     0x01   /* We can use AVX2 (8 lanes) */
+#define CPU_AVX512   0x02   /* We can use AVX-512F (16 lanes) */
+#define CPU_SHA      0x04   /* We can use the SHA extensions */
+#define CPU_CHECKED  0x80   /* We've already queried the CPU */
+
+/*
+ * Find out what this CPU can do.  For the AVX instructions, we check both
+ * the CPU (whether it implements the instructions) and the OS (whether it'll
+ * save the wider registers on a context switch)
+ */
+static unsigned cpu_features(void) {
+    /* This is a cache of what the hardware can do; if two threads race */
+    /* to set it, they'll both write the same value */
+    static volatile unsigned features = 0;
+    unsigned f = features;
+    if (f & CPU_CHECKED) return f;
+
+    f = CPU_CHECKED;
+    unsigned a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        unsigned leaf1_c = c;
+        unsigned xcr0 = 0;
+        if ((leaf1_c & bit_OSXSAVE) && (leaf1_c & bit_AVX)) {
+            unsigned xcr0_hi;
+            __asm__ volatile( "xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0) );
+        }
+        if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+            if ((xcr0 & 0x06) == 0x06 &&  /* The OS saves XMM, YMM */
+                                (b & bit_AVX2)) f |= CPU_AVX2;
+            if ((xcr0 & 0xe6) == 0xe6 &&  /* ... and the ZMM/K regs */
+                                (b & bit_AVX512F)) f |= CPU_AVX512;
+            if ((b & bit_SHA) && (leaf1_c & bit_SSE4_1) &&
+                                (leaf1_c & bit_SSSE3)) f |= CPU_SHA;
+        }
+    }
+
+    features = f;
+    return f;
+}
+
+/*
+ * The SHA extensions version of the compression function.  These
+ * instructions want the state as the ABEF and CDGH halves, so we shuffle it
+ * into that format on the way in, and back on the way out
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress_words_sha(uint32_t state[8], const uint32_t *block) {
+    __m128i abef, cdgh, abef_save, cdgh_save, tmp, msg;
+    __m128i m[4];
+    int i;
+
+    tmp = _mm_loadu_si128( (const __m128i *)&state[0] );
+    cdgh = _mm_loadu_si128( (const __m128i *)&state[4] );
+    tmp = _mm_shuffle_epi32( tmp, 0xb1 );        /* CDAB */
+    cdgh = _mm_shuffle_epi32( cdgh, 0x1b );      /* EFGH */
+    abef = _mm_alignr_epi8( tmp, cdgh, 8 );      /* ABEF */
+    cdgh = _mm_blend_epi16( cdgh, tmp, 0xf0 );   /* CDGH */
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    for (i=0; i<4; i++) {
+        m[i] = _mm_loadu_si128( (const __m128i *)&block[4*i] );
+    }
+
+    /* Each pass does 4 rounds; m[i&3] holds the 4 message words for */
+    /* those rounds, which (after the first 4 passes) we compute from the */
+    /* previous 16 */
+    for (i=0; i<16; i++) {
+        if (i >= 4) {
+            tmp = _mm_add_epi32( _mm_sha256msg1_epu32( m[i&3], m[(i+1)&3] ),
+                                 _mm_alignr_epi8( m[(i+3)&3], m[(i+2)&3], 4 ));
+            m[i&3] = _mm_sha256msg2_epu32( tmp, m[(i+3)&3] );
+        }
+        msg = _mm_add_epi32( m[i&3],
+                             _mm_loadu_si128( (const __m128i *)&K[4*i] ));
+        cdgh = _mm_sha256rnds2_epu32( cdgh, abef, msg );
+        msg = _mm_shuffle_epi32( msg, 0x0e );
+        abef = _mm_sha256rnds2_epu32( abef, cdgh, msg );
+    }
+
+    abef = _mm_add_epi32( abef, abef_save );
+    cdgh = _mm_add_epi32( cdgh, cdgh_save );
+
+    tmp = _mm_shuffle_epi32( abef, 0x1b );       /* FEBA */
+    cdgh = _mm_shuffle_epi32( cdgh, 0xb1 );      /* DCHG */
+    abef = _mm_blend_epi16( tmp, cdgh, 0xf0 );   /* DCBA */
+    cdgh = _mm_alignr_epi8( cdgh, tmp, 8 );      /* HGFE */
+    _mm_storeu_si128( (__m128i *)&state[0], abef );
+    _mm_storeu_si128( (__m128i *)&state[4], cdgh );
+}
+#endif /* X86_SIMD */
+
+/*
+ * This performs the SHA-256 compression function on a single 512-bit block,
+ * using the SHA extensions if this CPU has them
+ */
+static void sha256_compress_words(uint32_t state[8], const uint32_t *block)
+{
+#if X86_SIMD
+    if (cpu_features() & CPU_SHA) {
+        compress_words_sha( state, block );
+        return;
+    }
+#endif
+    compress_words_portable( state, block );
+}
+
+/* Convert 4 bytes of bigendian data into a native word */
+static uint32_t load_bigendian_32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] <<  8) |  (uint32_t)p[3];
+}
+
+#if !USE_OPENSSL && !defined(EXT_SHA256_H)
+
+/* If we don't have OpenSSL, here's a SHA256 implementation */
+static void sha256_compress (SHA256_CTX * ctx, const void *buf)
+{
+    uint32_t state[8], W[16];
+    int i;
+    const unsigned char *p;
+
+    /*
+     * We've been asked to perform the hash computation on this 512-bit string.
+     * SHA256 interprets that as an array of 16 bigendian 32 bit numbers; copy
+     * it, and convert it into 16 words of the CPU's native format
+     */
+    p = buf;
+    for (i=0; i<16; i++) {
+        W[i] = load_bigendian_32( p );
+        p += 4;
+    }
+    for (i=0; i<8; i++) {
+        state[i] = ctx->h[i];
+    }
+
+    sha256_compress_words( state, W );
+
+    for (i=0; i<8; i++) {
+        ctx->h[i] = state[i];
+    }
 }
 
 void SHA256_Init (SHA256_CTX *ctx)
 {
+    int i;
     ctx->Nl = 0;
     ctx->Nh = 0;
     ctx->num = 0;
-    ctx->h[0] = 0x6A09E667UL;
-    ctx->h[1] = 0xBB67AE85UL;
-    ctx->h[2] = 0x3C6EF372UL;
-    ctx->h[3] = 0xA54FF53AUL;
-    ctx->h[4] = 0x510E527FUL;
-    ctx->h[5] = 0x9B05688CUL;
-    ctx->h[6] = 0x1F83D9ABUL;
-    ctx->h[7] = 0x5BE0CD19UL;
+    for (i=0; i<8; i++) {
+        ctx->h[i] = H0[i];
+    }
 }
 
 void SHA256_Update (SHA256_CTX *ctx, const void *src, unsigned int count)
@@ -175,9 +322,273 @@ void SHA256_Final (unsigned char *digest, SHA256_CTX *ctx)
     /*
      * The final state is an array of unsigned long's; place them as a series
      * of bigendian 4-byte words onto the output
-     */ 
+     */
     for (i=0; i<8; i++) {
         put_bigendian( digest + 4*i, ctx->h[i], 4 );
     }
 }
 #endif
+
+void sha256_block(uint32_t digest[8], const uint32_t block[16]) {
+    int i;
+    for (i=0; i<8; i++) {
+        digest[i] = H0[i];
+    }
+    sha256_compress_words( digest, block );
+}
+
+/*
+ * Here is the multi-buffer logic.  Here, the state and the message blocks of
+ * the independent hashes are interleaved by word, that is, state[i][lane] is
+ * word i of the state for hash 'lane'.  This is the layout the SIMD units
+ * want; a vector load of state[i] picks up word i of 8 or 16 hashes at once
+ */
+#if X86_SIMD
+/*
+ * The AVX2 version; this processes the 8 lanes starting at 'first'
+ */
+#define ROR8(x, n)   _mm256_or_si256( _mm256_srli_epi32((x), (n)), \
+                                      _mm256_slli_epi32((x), 32-(n)) )
+#define XOR8(x,y,z)  _mm256_xor_si256( _mm256_xor_si256((x), (y)), (z) )
+#define ADD8(x,y)    _mm256_add_epi32( (x), (y) )
+__attribute__((target("avx2")))
+static void compress_lanes_avx2(uint32_t state[8][SHA256_LANES],
+                          const uint32_t W[16][SHA256_LANES], unsigned first) {
+    __m256i s[8], w[16];
+    int i;
+    for (i=0; i<8; i++) {
+        s[i] = _mm256_loadu_si256( (const __m256i *)&state[i][first] );
+    }
+    for (i=0; i<16; i++) {
+        w[i] = _mm256_loadu_si256( (const __m256i *)&W[i][first] );
+    }
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+    __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+    for (i=0; i<SHA256_K_SIZE; i++) {
+        __m256i wi;
+        if (i < 16) {
+            wi = w[i];
+        } else {
+            __m256i w2 = w[(i-2) & 15], w15 = w[(i-15) & 15];
+            __m256i gamma1 = XOR8( ROR8(w2, 17), ROR8(w2, 19),
+                                   _mm256_srli_epi32(w2, 10) );
+            __m256i gamma0 = XOR8( ROR8(w15, 7), ROR8(w15, 18),
+                                   _mm256_srli_epi32(w15, 3) );
+            wi = ADD8( ADD8( gamma1, w[(i-7) & 15] ),
+                       ADD8( gamma0, w[i & 15] ) );
+            w[i & 15] = wi;
+        }
+        __m256i ch = _mm256_xor_si256( g,
+                       _mm256_and_si256( e, _mm256_xor_si256( f, g ) ) );
+        __m256i maj = _mm256_or_si256(
+                       _mm256_and_si256( _mm256_or_si256( a, b ), c ),
+                       _mm256_and_si256( a, b ) );
+        __m256i t0 = ADD8( ADD8( h, XOR8( ROR8(e, 6), ROR8(e, 11),
+                                          ROR8(e, 25) ) ),
+                           ADD8( ch, ADD8( _mm256_set1_epi32( K[i] ),
+                                           wi ) ) );
+        __m256i t1 = ADD8( XOR8( ROR8(a, 2), ROR8(a, 13), ROR8(a, 22) ),
+                           maj );
+        h = g; g = f; f = e; e = ADD8( d, t0 );
+        d = c; c = b; b = a; a = ADD8( t0, t1 );
+    }
+
+    s[0] = ADD8( s[0], a ); s[1] = ADD8( s[1], b );
+    s[2] = ADD8( s[2], c ); s[3] = ADD8( s[3], d );
+    s[4] = ADD8( s[4], e ); s[5] = ADD8( s[5], f );
+    s[6] = ADD8( s[6], g ); s[7] = ADD8( s[7], h );
+    for (i=0; i<8; i++) {
+        _mm256_storeu_si256( (__m256i *)&state[i][first], s[i] );
+    }
+}
+#undef ROR8
+#undef XOR8
+#undef ADD8
+
+/*
+ * The AVX-512 version; this processes all 16 lanes.  AVX-512 gives us
+ * rotates and three-input logical operations, which is where most of the
+ * win over AVX2 comes from
+ */
+#define ROR16(x, n)   _mm512_ror_epi32( (x), (n) )
+#define XOR16(x,y,z)  _mm512_ternarylogic_epi32( (x), (y), (z), 0x96 )
+#define ADD16(x,y)    _mm512_add_epi32( (x), (y) )
+__attribute__((target("avx512f")))
+static void compress_lanes_avx512(uint32_t state[8][SHA256_LANES],
+                          const uint32_t W[16][SHA256_LANES]) {
+    __m512i s[8], w[16];
+    int i;
+    for (i=0; i<8; i++) {
+        s[i] = _mm512_loadu_si512( (const void *)&state[i][0] );
+    }
+    for (i=0; i<16; i++) {
+        w[i] = _mm512_loadu_si512( (const void *)&W[i][0] );
+    }
+    __m512i a = s[0], b = s[1], c = s[2], d = s[3];
+    __m512i e = s[4], f = s[5], g = s[6], h = s[7];
+
+    for (i=0; i<SHA256_K_SIZE; i++) {
+        __m512i wi;
+        if (i < 16) {
+            wi = w[i];
+        } else {
+            __m512i w2 = w[(i-2) & 15], w15 = w[(i-15) & 15];
+            __m512i gamma1 = XOR16( ROR16(w2, 17), ROR16(w2, 19),
+                                    _mm512_srli_epi32(w2, 10) );
+            __m512i gamma0 = XOR16( ROR16(w15, 7), ROR16(w15, 18),
+                                    _mm512_srli_epi32(w15, 3) );
+            wi = ADD16( ADD16( gamma1, w[(i-7) & 15] ),
+                        ADD16( gamma0, w[i & 15] ) );
+            w[i & 15] = wi;
+        }
+            /* 0xca is 'e ? f : g'; 0xe8 is 'majority' */
+        __m512i ch = _mm512_ternarylogic_epi32( e, f, g, 0xca );
+        __m512i maj = _mm512_ternarylogic_epi32( a, b, c, 0xe8 );
+        __m512i t0 = ADD16( ADD16( h, XOR16( ROR16(e, 6), ROR16(e, 11),
+                                             ROR16(e, 25) ) ),
+                            ADD16( ch, ADD16( _mm512_set1_epi32( K[i] ),
+                                              wi ) ) );
+        __m512i t1 = ADD16( XOR16( ROR16(a, 2), ROR16(a, 13), ROR16(a, 22) ),
+                            maj );
+        h = g; g = f; f = e; e = ADD16( d, t0 );
+        d = c; c = b; b = a; a = ADD16( t0, t1 );
+    }
+
+    s[0] = ADD16( s[0], a ); s[1] = ADD16( s[1], b );
+    s[2] = ADD16( s[2], c ); s[3] = ADD16( s[3], d );
+    s[4] = ADD16( s[4], e ); s[5] = ADD16( s[5], f );
+    s[6] = ADD16( s[6], g ); s[7] = ADD16( s[7], h );
+    for (i=0; i<8; i++) {
+        _mm512_storeu_si512( (void *)&state[i][0], s[i] );
+    }
+}
+#undef ROR16
+#undef XOR16
+#undef ADD16
+#endif /* X86_SIMD */
+
+/*
+ * Compress one block for each of the first 'lanes' lanes.  The SIMD
+ * versions may also process the lanes past that; the caller doesn't look
+ * at those
+ */
+void sha256_compress_lanes(uint32_t state[8][SHA256_LANES],
+                           const uint32_t W[16][SHA256_LANES],
+                           unsigned lanes) {
+#if X86_SIMD
+    unsigned features = cpu_features();
+    if (features & CPU_AVX512) {
+        compress_lanes_avx512( state, W );
+        return;
+    }
+    if (features & CPU_AVX2) {
+        compress_lanes_avx2( state, W, 0 );
+        if (lanes > 8) compress_lanes_avx2( state, W, 8 );
+        return;
+    }
+#endif
+
+    /* No SIMD hardware; do them one at a time */
+    unsigned lane;
+    for (lane = 0; lane < lanes; lane++) {
+        uint32_t s[8], w[16];
+        int i;
+        for (i=0; i<8; i++) s[i] = state[i][lane];
+        for (i=0; i<16; i++) w[i] = W[i][lane];
+        sha256_compress_words( s, w );
+        for (i=0; i<8; i++) state[i][lane] = s[i];
+    }
+}
+
+void sha256_init_lanes(uint32_t state[8][SHA256_LANES]) {
+    unsigned i, lane;
+    for (i=0; i<8; i++) {
+        for (lane=0; lane<SHA256_LANES; lane++) {
+            state[i][lane] = H0[i];
+        }
+    }
+}
+
+void sha256_block_lanes(uint32_t digest[8][SHA256_LANES],
+                        const uint32_t block[16][SHA256_LANES],
+                        unsigned lanes) {
+    sha256_init_lanes( digest );
+    sha256_compress_lanes( digest, block, lanes );
+}
+
+unsigned sha256_lanes(void) {
+#if X86_SIMD
+    unsigned features = cpu_features();
+    if (features & CPU_AVX512) return 16;
+    if (features & CPU_AVX2) return 8;
+#endif
+    return 1;
+}
+
+/*
+ * Hash count messages, all of length len.  We do them in groups of
+ * SHA256_LANES; within a group, we step through the (padded) messages one
+ * 64 byte block at a time, compressing that block for all the messages at
+ * once
+ */
+void sha256_multi(unsigned char *const *digest,
+                  const unsigned char *const *message, size_t len,
+                  unsigned count) {
+    uint32_t state[8][SHA256_LANES];
+    uint32_t W[16][SHA256_LANES];
+    size_t num_block = (len + 1 + SHA256_FINALCOUNT_SIZE + 63) / 64;
+    unsigned first, lane, i;
+
+    /* We never look at the unused lanes; however the SIMD code will still */
+    /* process them; give it something defined to work on */
+    memset( W, 0, sizeof W );
+    memset( state, 0, sizeof state );
+
+    for (first = 0; first < count; first += SHA256_LANES) {
+        unsigned lanes = count - first;
+        if (lanes > SHA256_LANES) lanes = SHA256_LANES;
+
+        for (i=0; i<8; i++) {
+            for (lane = 0; lane < lanes; lane++) {
+                state[i][lane] = H0[i];
+            }
+        }
+
+        size_t block;
+        for (block = 0; block < num_block; block++) {
+            size_t offset = 64 * block;
+            for (lane = 0; lane < lanes; lane++) {
+                unsigned char buffer[64];
+                const unsigned char *p;
+                if (offset + 64 <= len) {
+                    /* Common case: this block is entirely message */
+                    p = message[first + lane] + offset;
+                } else {
+                    /* This block includes some padding */
+                    size_t this_len = (offset < len) ? len - offset : 0;
+                    memcpy( buffer, message[first + lane] + offset, this_len );
+                    memset( buffer + this_len, 0, 64 - this_len );
+                    if (offset <= len) buffer[ len - offset ] = 0x80;
+                    if (block == num_block - 1) {
+                        put_bigendian( buffer + 64 - SHA256_FINALCOUNT_SIZE,
+                                       (unsigned long long)len << 3,
+                                       SHA256_FINALCOUNT_SIZE );
+                    }
+                    p = buffer;
+                }
+                for (i=0; i<16; i++) {
+                    W[i][lane] = load_bigendian_32( p + 4*i );
+                }
+            }
+
+            sha256_compress_lanes( state, W, lanes );
+        }
+
+        for (lane = 0; lane < lanes; lane++) {
+            for (i=0; i<8; i++) {
+                put_bigendian( digest[first + lane] + 4*i, state[i][lane], 4 );
+            }
+        }
+    }
+}
@@ -1,13 +1,20 @@
 #if !defined(SHA256_H_)
 #define SHA256_H_
 
+#include <stdint.h>
+#include <stddef.h>
+
 #if defined( EXT_SHA256_H )
 #include EXT_SHA256_H
 #else
 
+#if !defined( USE_OPENSSL )
 #define USE_OPENSSL 1   /* We use the OpenSSL implementation for SHA-256 */
                         /* (which is quite a bit faster than our portable */
-                        /* C version) */
+                        /* C version, unless the CPU has the SHA */
+                        /* extensions, in which case we use those) */
+                        /* Build with -DUSE_OPENSSL=0 to avoid -lcrypto */
+#endif
 
 #if USE_OPENSSL
 
@@ -27,7 +34,7 @@ typedef struct {
 void SHA256_Init(SHA256_CTX *);  /* context */
 
 void SHA256_Update(SHA256_CTX *, /* context */
-                  const void *, /* input block */ 
+                  const void *, /* input block */
                   unsigned int);/* length of input block */
 
 void SHA256_Final(unsigned char *,
@@ -40,5 +47,70 @@ void SHA256_Final(unsigned char *,
 #define SHA256_LEN 32    /* The length of a SHA256 hash output */
 #endif
 
-#endif /* ifdef(SHA256_H_) */
+/*
+ * Single block SHA-256.  This hashes a message that the caller has already
+ * padded to exactly one 64 byte block (including the 0x80 byte and the
+ * bit length), and converted into 16 words in the CPU's native format;
+ * the digest is returned as 8 native words.  This is just the initial value
+ * plus one call to the compression function, with none of the buffering
+ * overhead of SHA256_Update/SHA256_Final
+ */
+void sha256_block(uint32_t digest[8], const uint32_t block[16]);
+
+/*
+ * Multi-buffer SHA-256.  Most of our time is spent computing huge numbers
+ * of short independent hashes (the Winternitz chains); these routines hash
+ * several of them at once, using whatever SIMD hardware the CPU has.  They
+ * are always our own code (whether or not USE_OPENSSL is set), and so they
+ * don't depend on the SHA256_CTX above
+ */
+#if !defined( USE_X86_SIMD )
+#define USE_X86_SIMD 1  /* 1 -> on x86-64 (and a GCC-compatible compiler), */
+                        /*      use AVX2/AVX-512/SHA extensions if CPUID */
+                        /*      says we have it */
+                        /* 0 -> always use the portable C code */
+#endif
+
+#define SHA256_LANES 16  /* The maximum number of messages we hash at once */
 
+/*
+ * This returns the number of messages the CPU can actually hash in
+ * parallel (16 with AVX-512, 8 with AVX2, 1 if we have nothing better than
+ * scalar code).  This is a hint to the caller on how many messages it would
+ * make sense to batch up
+ */
+unsigned sha256_lanes(void);
+
+/*
+ * This is the multi-buffer version of sha256_block; it hashes the
+ * (already padded) single block messages in the first 'lanes' lanes.  Both
+ * the blocks and the digests are interleaved by word; block[i][lane] is
+ * word i of the message in 'lane'.  The other lanes of digest will be
+ * overwritten with garbage
+ */
+void sha256_block_lanes(uint32_t digest[8][SHA256_LANES],
+                        const uint32_t block[16][SHA256_LANES],
+                        unsigned lanes);
+
+/*
+ * These are the lower level multi-buffer primitives, for callers that need
+ * to hash multi-block messages a block at a time.  sha256_init_lanes sets
+ * the state of every lane to the SHA-256 initial value, and
+ * sha256_compress_lanes runs the compression function on the first 'lanes'
+ * lanes (with the same interleaved layout as above)
+ */
+void sha256_init_lanes(uint32_t state[8][SHA256_LANES]);
+void sha256_compress_lanes(uint32_t state[8][SHA256_LANES],
+                           const uint32_t block[16][SHA256_LANES],
+                           unsigned lanes);
+
+/*
+ * Hash count independent messages, each of length len; the hash of
+ * message[i] is written to digest[i].  count may be any value; we'll
+ * process them SHA256_LANES at a time
+ */
+void sha256_multi(unsigned char *const *digest,
+                  const unsigned char *const *message, size_t len,
+                  unsigned count);
+
+#endif /* ifdef(SHA256_H_) */
@@ -0,0 +1,312 @@
+/*
+ * This tests out the batch signing logic; we sign the same messages both
+ * one at a time, and in batches, and make sure we get the same signatures
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hss.h"
+#include "test_hss.h"
+
+static bool rand_1(void *output, size_t len) {
+    unsigned char *p = output;
+    while (len--) *p++ = len;
+    return true;
+}
+
+/* Where the private keys are kept; we count how often they're written */
+struct private_key_store {
+    unsigned char private_key[ HSS_MAX_PRIVATE_KEY_LEN ];
+    unsigned updates;
+};
+
+static bool update_private_key(unsigned char *private_key,
+                               size_t len_private_key, void *context) {
+    struct private_key_store *store = context;
+    memcpy( store->private_key, private_key, len_private_key );
+    store->updates += 1;
+    return true;
+}
+
+static bool read_private_key(unsigned char *private_key,
+                             size_t len_private_key, void *context) {
+    struct private_key_store *store = context;
+    memcpy( private_key, store->private_key, len_private_key );
+    return true;
+}
+
+#define MAX_BATCH 100
+
+static unsigned long get_int(const unsigned char *p) {
+    unsigned long result = 0;
+    int i;
+    for (i=0; i<4; i++) {
+        result <<= 8;
+        result += p[i];
+    }
+    return result;
+}
+
+static unsigned lookup_h(param_set_t lm) {
+    switch (lm) {
+    case LMS_SHA256_N32_H5:  return 5;
+    case LMS_SHA256_N32_H10: return 10;
+    case LMS_SHA256_N32_H15: return 15;
+    default: return 0;
+    }
+}
+
+/* Pull the sequence number out of a two level signature */
+static unsigned long signature_count( unsigned levels, const param_set_t *lm,
+                             const param_set_t *ots,
+                             const unsigned char *sig ) {
+    if (levels != 2) return 0;
+    unsigned long top_q = get_int( sig + 4 );
+    size_t offset = hss_get_signature_len( 1, lm, ots ) + /* 4 + top sig */
+                    8 + 16 + 32;                          /* public key */
+    unsigned long bottom_q = get_int( sig + offset );
+    return (top_q << lookup_h( lm[1] )) + bottom_q;
+}
+
+static bool test_batch_parm( unsigned levels, const param_set_t *lm,
+                             const param_set_t *ots,
+                             const unsigned *batch_size, unsigned num_batch,
+                             size_t memory, struct hss_thread_pool *pool ) {
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    hss_extra_info_set_thread_pool( &info, pool );
+
+    size_t private_len = hss_get_private_key_len(levels, lm, ots);
+    size_t sig_len = hss_get_signature_len(levels, lm, ots);
+    if (private_len == 0 || sig_len == 0) {
+        printf( "  Bad parm set\n" );
+        return false;
+    }
+
+    struct private_key_store store[2];
+    unsigned char public_key[ HSS_MAX_PUBLIC_KEY_LEN ];
+    memset( store, 0, sizeof store );
+    if (!hss_generate_private_key( rand_1, levels, lm, ots,
+                    update_private_key, &store[0],
+                    public_key, sizeof public_key, 0, 0, 0 )) {
+        printf( "  Private key gen failed\n" );
+        return false;
+    }
+    memcpy( &store[1], &store[0], sizeof store[0] );
+
+    bool success_flag = false;
+    struct hss_working_key *w[2] = { 0, 0 };
+    unsigned char *sig = malloc( sig_len );
+    unsigned char *batch_sig = malloc( MAX_BATCH * sig_len );
+    unsigned char message[ MAX_BATCH ][ 16 ];
+    const void *messages[ MAX_BATCH ];
+    size_t message_lens[ MAX_BATCH ];
+    unsigned char *signatures[ MAX_BATCH ];
+    if (!sig || !batch_sig) goto failed;
+
+    unsigned i, j;
+    for (i=0; i<2; i++) {
+        w[i] = hss_load_private_key( read_private_key, &store[i],
+                                     memory, 0, 0, &info );
+        if (!w[i]) {
+            printf( "  Load private key failed\n" );
+            goto failed;
+        }
+    }
+
+    unsigned msg_num = 0;
+    for (i=0; i<num_batch; i++) {
+        unsigned n = batch_size[i];
+        for (j=0; j<n; j++) {
+            sprintf( (char *)message[j], "Message %u", msg_num + j );
+            messages[j] = message[j];
+            message_lens[j] = strlen( (char *)message[j] );
+            signatures[j] = batch_sig + j * sig_len;
+        }
+
+        store[1].updates = 0;
+        if (!hss_generate_signatures_batch( w[1], update_private_key,
+                         &store[1], messages, message_lens, n,
+                         signatures, sig_len, &info )) {
+            printf( "  Batch signature gen failed\n" );
+            goto failed;
+        }
+        if (store[1].updates > 1) {
+            printf( "  Batch updated the private key %u times\n",
+                    store[1].updates );
+            goto failed;
+        }
+
+        for (j=0; j<n; j++) {
+            if (!hss_generate_signature( w[0], update_private_key,
+                         &store[0], messages[j], message_lens[j],
+                         sig, sig_len, &info )) {
+                printf( "  Signature gen failed\n" );
+                goto failed;
+            }
+            if (0 != memcmp( sig, signatures[j], sig_len )) {
+                printf( "  Batch signature %u mismatch\n", msg_num + j );
+                goto failed;
+            }
+            if (!hss_validate_signature( public_key,
+                         messages[j], message_lens[j],
+                         signatures[j], sig_len, 0 )) {
+                printf( "  Batch signature %u didn't validate\n",
+                        msg_num + j );
+                goto failed;
+            }
+        }
+        msg_num += n;
+    }
+
+    /* The private key in storage must account for all the signatures */
+    /* we handed out; if we reload it, the next signature must be past */
+    /* them */
+    struct hss_working_key *reload = hss_load_private_key( read_private_key,
+                                     &store[1], 0, 0, 0, &info );
+    if (!reload) {
+        printf( "  Reload failed\n" );
+        goto failed;
+    }
+    bool ok = hss_generate_signature( reload, update_private_key, &store[1],
+                                      "After", 5, sig, sig_len, &info );
+    hss_free_working_key( reload );
+    if (!ok) {
+        printf( "  Signature after reload failed\n" );
+        goto failed;
+    }
+    if (signature_count( levels, lm, ots, sig ) < msg_num) {
+        printf( "  Reloaded key reused a signature\n" );
+        goto failed;
+    }
+
+    success_flag = true;
+failed:
+    hss_free_working_key( w[0] );
+    hss_free_working_key( w[1] );
+    free( sig );
+    free( batch_sig );
+    return success_flag;
+}
+
+/*
+ * Check that a batch that's larger than what's left in the key is rejected
+ * (without using anything up), and that one that exactly uses it up works
+ */
+static bool test_batch_end(void) {
+    param_set_t lm[1] = { LMS_SHA256_N32_H5 };
+    param_set_t ots[1] = { LMOTS_SHA256_N32_W2 };
+    size_t sig_len = hss_get_signature_len(1, lm, ots);
+
+    struct private_key_store store;
+    unsigned char public_key[ HSS_MAX_PUBLIC_KEY_LEN ];
+    memset( &store, 0, sizeof store );
+    if (!hss_generate_private_key( rand_1, 1, lm, ots,
+                    update_private_key, &store,
+                    public_key, sizeof public_key, 0, 0, 0 )) {
+        printf( "  Private key gen failed\n" );
+        return false;
+    }
+
+    bool success_flag = false;
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    unsigned char *batch_sig = malloc( 33 * sig_len );
+    const void *messages[33];
+    size_t message_lens[33];
+    unsigned char *signatures[33];
+    struct hss_working_key *w = hss_load_private_key( read_private_key,
+                                     &store, 0, 0, 0, &info );
+    if (!w || !batch_sig) goto failed;
+
+    unsigned i;
+    for (i=0; i<33; i++) {
+        messages[i] = "abc";
+        message_lens[i] = 3;
+        signatures[i] = batch_sig + i * sig_len;
+    }
+    store.updates = 0;
+    if (hss_generate_signatures_batch( w, update_private_key, &store,
+                         messages, message_lens, 33,
+                         signatures, sig_len, &info )) {
+        printf( "  Oversized batch succeeded\n" );
+        goto failed;
+    }
+    if (hss_extra_info_test_error_code(&info) !=
+                                    hss_error_not_that_many_sigs_left ||
+                                    store.updates != 0) {
+        printf( "  Oversized batch gave the wrong error\n" );
+        goto failed;
+    }
+
+    if (!hss_generate_signatures_batch( w, update_private_key, &store,
+                         messages, message_lens, 32,
+                         signatures, sig_len, &info )) {
+        printf( "  Full batch failed\n" );
+        goto failed;
+    }
+    if (!hss_extra_info_test_last_signature( &info )) {
+        printf( "  Last signature not reported\n" );
+        goto failed;
+    }
+    for (i=0; i<32; i++) {
+        if (!hss_validate_signature( public_key, "abc", 3,
+                                     signatures[i], sig_len, 0 )) {
+            printf( "  Signature %u didn't validate\n", i );
+            goto failed;
+        }
+    }
+    if (hss_generate_signatures_batch( w, update_private_key, &store,
+                         messages, message_lens, 1,
+                         signatures, sig_len, &info )) {
+        printf( "  Signing after the end succeeded\n" );
+        goto failed;
+    }
+
+    success_flag = true;
+failed:
+    hss_free_working_key( w );
+    free( batch_sig );
+    return success_flag;
+}
+
+bool test_batch(bool fast_flag, bool quiet_flag) {
+    bool success = false;
+    struct hss_thread_pool *pool = hss_thread_pool_create( 4 );
+
+    {
+        /* Batches that cross the bottom subtrees and trees at various */
+        /* places */
+        param_set_t lm[2] = { LMS_SHA256_N32_H5, LMS_SHA256_N32_H5 };
+        param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2 };
+        static const unsigned batch[] = { 1, 7, 40, 2, 100, 31, 33, 64, 1 };
+        if (!test_batch_parm( 2, lm, ots, batch,
+                              sizeof batch / sizeof *batch, 0, pool )) {
+            goto failed;
+        }
+        /* And again, without threads, and with the bottom tree in one */
+        /* subtree */
+        if (!test_batch_parm( 2, lm, ots, batch,
+                              sizeof batch / sizeof *batch, 1<<20, 0 )) {
+            goto failed;
+        }
+    }
+    {
+        /* Here, the bottom tree is split into several subtrees (as we */
+        /* give it as little memory as possible) */
+        param_set_t lm[2] = { LMS_SHA256_N32_H5, LMS_SHA256_N32_H10 };
+        param_set_t ots[2] = { LMOTS_SHA256_N32_W4, LMOTS_SHA256_N32_W2 };
+        static const unsigned batch[] = { 3, 100, 100, 13, 99, 100, 100,
+                                          100, 100, 100, 100, 100, 50 };
+        if (!test_batch_parm( 2, lm, ots, batch,
+                              sizeof batch / sizeof *batch, 0, pool )) {
+            goto failed;
+        }
+    }
+    if (!test_batch_end()) goto failed;
+
+    success = true;
+failed:
+    hss_thread_pool_free( pool );
+    return success;
+}
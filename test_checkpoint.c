@@ -0,0 +1,194 @@
+/*
+ * This tests out the Winternitz checkpoint cache.  First, we check at the
+ * OTS level: we generate the public key, saving the checkpoints, and make
+ * sure that a signature generated from the checkpoints is the same as one
+ * generated from scratch (and that it validates).  Then, we check at the
+ * HSS level: we load the same private key with a tiny memory budget (and so
+ * no checkpoint cache) and a large one, and make sure that both generate
+ * the same signatures (and that the large one does use its cache, once it's
+ * past the first bottom subtree)
+ */
+#include "test_hss.h"
+#include "hss.h"
+#include "lm_ots.h"
+#include "hss_derive.h"
+#include "common_defs.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static bool rand_1( void *output, size_t len) {
+    unsigned char *p = output;
+    while (len--) *p++ = 0x42 + 3*len;
+    return true;
+}
+
+static bool test_ots( param_set_t ots_type ) {
+    const struct lm_ots_kernel *ots = lm_ots_look_up_kernel( ots_type );
+    if (!ots) {
+        printf( "  Unable to find OTS kernel\n" );
+        return false;
+    }
+    unsigned n = ots->n;
+    size_t sig_len = lm_ots_get_signature_len( ots_type );
+    unsigned char I[I_LEN], seed[SEED_LEN];
+    memset( I, 0x11, I_LEN );
+    memset( seed, 0x22, SEED_LEN );
+
+    unsigned char *checkpoint = malloc( ots->checkpoint_len );
+    unsigned char *sig = malloc( sig_len );
+    unsigned char *sig_cp = malloc( sig_len );
+    bool success = false;
+    if (!checkpoint || !sig || !sig_cp) {
+        printf( "  Out of memory\n" );
+        goto failed;
+    }
+
+    merkle_index_t q;
+    for (q = 0; q < 4; q++) {
+        struct seed_derive derive;
+        unsigned char pub[MAX_HASH], pub_cp[MAX_HASH], computed[MAX_HASH];
+        if (!hss_seed_derive_init( &derive, LMS_SHA256_N32_H5, ots_type,
+                                   I, seed )) {
+            printf( "  Seed derive init failed\n" );
+            goto failed;
+        }
+        hss_seed_derive_set_q( &derive, q );
+        bool ok = ots->generate_public_key( I, q, &derive, pub, n, NULL );
+        hss_seed_derive_set_q( &derive, q );
+        ok = ok && ots->generate_public_key( I, q, &derive, pub_cp, n,
+                                                    checkpoint );
+        if (!ok || 0 != memcmp( pub, pub_cp, n )) {
+            hss_seed_derive_done( &derive );
+            printf( "  Public key mismatch when checkpointing\n" );
+            goto failed;
+        }
+
+        char message[ 30 ];
+        size_t len_message = sprintf( message, "Message %u", (unsigned)q );
+        hss_seed_derive_set_q( &derive, q );
+        ok = ots->generate_signature( I, q, &derive, message, len_message,
+                                      false, sig, sig_len, NULL );
+        hss_seed_derive_set_q( &derive, q );
+        ok = ok && ots->generate_signature( I, q, &derive,
+                                      message, len_message,
+                                      false, sig_cp, sig_len, checkpoint );
+        hss_seed_derive_done( &derive );
+        if (!ok || 0 != memcmp( sig, sig_cp, sig_len )) {
+            printf( "  Signature mismatch when using checkpoints\n" );
+            goto failed;
+        }
+
+        if (!lm_ots_validate_signature_compute( computed, I, q,
+                      message, len_message, false, sig_cp, sig_len,
+                      ots_type ) ||
+            0 != memcmp( computed, pub, n )) {
+            printf( "  Signature from checkpoints does not validate\n" );
+            goto failed;
+        }
+    }
+    success = true;
+failed:
+    free( checkpoint );
+    free( sig );
+    free( sig_cp );
+    return success;
+}
+
+static bool test_working_key( unsigned num_sig ) {
+    int levels = 1;
+    param_set_t lm[1] = { LMS_SHA256_N32_H15 };
+    param_set_t ots[1] = { LMOTS_SHA256_N32_W2 };
+    unsigned char priv_key[2][HSS_MAX_PRIVATE_KEY_LEN];
+    unsigned char pub_key[HSS_MAX_PUBLIC_KEY_LEN];
+    unsigned char aux_data[10000];
+    if (!hss_generate_private_key( rand_1, levels, lm, ots,
+                                   NULL, priv_key[0],
+                                   pub_key, sizeof pub_key,
+                                   aux_data, sizeof aux_data, 0)) {
+        printf( "  Error generating private key\n" );
+        return false;
+    }
+    memcpy( priv_key[1], priv_key[0], HSS_MAX_PRIVATE_KEY_LEN );
+
+    /* Key 0 has no room for the checkpoint cache; key 1 has plenty */
+    struct hss_working_key *w[2];
+    w[0] = hss_load_private_key( NULL, priv_key[0], 0,
+                                 aux_data, sizeof aux_data, 0 );
+    w[1] = hss_load_private_key( NULL, priv_key[1], 10000000,
+                                 aux_data, sizeof aux_data, 0 );
+    size_t len_sig = hss_get_signature_len( levels, lm, ots );
+    unsigned char *sig[2];
+    sig[0] = malloc( len_sig );
+    sig[1] = malloc( len_sig );
+    bool success = false;
+    if (!w[0] || !w[1] || !sig[0] || !sig[1]) {
+        printf( "  Error loading private key\n" );
+        goto failed;
+    }
+
+    unsigned i, j;
+    unsigned first_hit = num_sig;  /* The first signature key 1 generated */
+                                   /* from the checkpoint cache */
+    for (i=0; i<num_sig; i++) {
+        char message[ 30 ];
+        size_t len_message = sprintf( message, "Message %u", i );
+        for (j=0; j<2; j++) {
+            struct hss_extra_info info;
+            hss_init_extra_info( &info );
+            if (!hss_generate_signature( w[j], NULL, priv_key[j],
+                                    message, len_message,
+                                    sig[j], len_sig, &info )) {
+                printf( "  Error generating signature %u\n", i );
+                goto failed;
+            }
+            bool used = hss_extra_info_test_used_checkpoint( &info );
+            if (j == 0 && used) {
+                printf( "  Signature %u used a cache we have no room for\n",
+                        i );
+                goto failed;
+            }
+            if (j == 1 && used && first_hit == num_sig) first_hit = i;
+            if (j == 1 && !used && first_hit < num_sig) {
+                printf( "  Signature %u missed the checkpoint cache\n", i );
+                goto failed;
+            }
+        }
+        if (0 != memcmp( sig[0], sig[1], len_sig )) {
+            printf( "  Signature %u mismatch\n", i );
+            goto failed;
+        }
+        if (!hss_validate_signature( pub_key, message, len_message,
+                                     sig[1], len_sig, 0 )) {
+            printf( "  Signature %u does not validate\n", i );
+            goto failed;
+        }
+    }
+    /* Once we're past the first bottom subtree (which is well before */
+    /* the halfway point), every signature should come from the cache */
+    if (first_hit > num_sig / 2) {
+        printf( "  The checkpoint cache wasn't used\n" );
+        goto failed;
+    }
+    success = true;
+failed:
+    hss_free_working_key( w[0] );
+    hss_free_working_key( w[1] );
+    free( sig[0] );
+    free( sig[1] );
+    return success;
+}
+
+bool test_checkpoint(bool fast_flag, bool quiet_flag) {
+    static const param_set_t ots_type[] = {
+        LMOTS_SHA256_N32_W1, LMOTS_SHA256_N32_W2,
+        LMOTS_SHA256_N32_W4, LMOTS_SHA256_N32_W8 };
+    unsigned i;
+    for (i=0; i<sizeof ots_type / sizeof *ots_type; i++) {
+        if (!test_ots( ots_type[i] )) return false;
+    }
+
+    /* We need to go past the first bottom subtree (which we computed at */
+    /* load time, and so has no checkpoints) to see the cache in use */
+    return test_working_key( fast_flag ? 600 : 2000 );
+}
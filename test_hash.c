@@ -0,0 +1,175 @@
+/*
+ * This tests out the multi-buffer hash logic; we hash a number of random
+ * messages both with hss_hash_multi and one at a time with hss_hash, and
+ * check that we get the same answers.  We step through a range of message
+ * lengths (so that we hit all the interesting padding cases) and counts (so
+ * that we hit partially filled SIMD lanes)
+ *
+ * We also test the single block hash logic the same way; both for hashing
+ * to a buffer, and for writing the hash back into a block at an arbitrary
+ * offset (which is how the Winternitz chains use it), and the multiple lane
+ * incremental hash
+ */
+#include "test_hss.h"
+#include "hash.h"
+#include "common_defs.h"
+#include <stdio.h>
+#include <string.h>
+
+static int rand_seed;
+static int my_rand(void) {
+    rand_seed += rand_seed*rand_seed | 5;
+    return rand_seed >> 9;
+}
+
+#define MAX_LEN   200   /* The longest message we try */
+#define MAX_COUNT 35    /* The most messages we hash at once */
+
+static bool test_block(void) {
+    unsigned len, offset;
+    for (len = 0; len < 64; len++) {
+        unsigned char message[64];
+        unsigned char expected[MAX_HASH], actual[MAX_HASH];
+        struct hash_block block;
+        unsigned i;
+
+        for (i=0; i<len; i++) message[i] = my_rand();
+
+        if (!hss_hash_block_init( &block, HASH_SHA256, len )) {
+            if (len <= 55) {
+                printf( "  Single block init failed: len = %u\n", len );
+                return false;
+            }
+            continue;
+        }
+        if (len > 55) {
+            printf( "  Single block init succeeded: len = %u\n", len );
+            return false;
+        }
+        hss_hash_block_set( &block, 0, message, len );
+
+        hss_hash( expected, HASH_SHA256, message, len );
+        hss_hash_block( actual, HASH_SHA256, &block );
+        if (0 != memcmp( expected, actual, 32 )) {
+            printf( "  Single block hash mismatch: len = %u\n", len );
+            return false;
+        }
+
+        /* Now, try writing the hash back into the block at each */
+        /* possible offset */
+        for (offset = 0; offset + 32 <= len; offset++) {
+            struct hash_block temp = block;
+            unsigned char updated[64], result[64];
+            hss_hash_block_to_block( &temp, offset, HASH_SHA256, &block );
+            memcpy( updated, message, len );
+            memcpy( updated + offset, expected, 32 );
+
+            hss_hash_block_get( result, &temp, 0, len );
+            if (0 != memcmp( updated, result, len )) {
+                printf( "  Hash to block mismatch: len = %u offset = %u\n",
+                        len, offset );
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * This tests the multiple lane incremental hash; we feed the messages in
+ * pieces of random length
+ */
+static bool test_lanes_context(void) {
+    unsigned char message[MAX_HASH_LANES][MAX_LEN];
+    unsigned char result[MAX_HASH_LANES][MAX_HASH];
+    const unsigned char *message_ptr[MAX_HASH_LANES];
+    unsigned char *result_ptr[MAX_HASH_LANES];
+    unsigned len, count, i;
+
+    for (len = 0; len <= MAX_LEN; len += 11) {
+        for (count = 1; count <= MAX_HASH_LANES; count += 5) {
+            struct hash_lanes_context ctx;
+            for (i=0; i<count; i++) {
+                unsigned j;
+                for (j=0; j<len; j++) message[i][j] = my_rand();
+                result_ptr[i] = result[i];
+            }
+
+            hss_init_hash_lanes_context( HASH_SHA256, &ctx );
+            unsigned done = 0;
+            while (done < len) {
+                unsigned step = my_rand() % 80;
+                if (step > len - done) step = len - done;
+                for (i=0; i<count; i++) message_ptr[i] = message[i] + done;
+                hss_update_hash_lanes_context( HASH_SHA256, &ctx,
+                                               message_ptr, step, count );
+                done += step;
+            }
+            hss_finalize_hash_lanes_context( HASH_SHA256, &ctx,
+                                             result_ptr, count );
+
+            for (i=0; i<count; i++) {
+                unsigned char expected[MAX_HASH];
+                hss_hash( expected, HASH_SHA256, message[i], len );
+                if (0 != memcmp( result[i], expected, 32 )) {
+                    printf( "  Lanes context mismatch: len = %u count = %u "
+                            "index = %u\n", len, count, i );
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool test_hash(bool fast_flag, bool quiet_flag) {
+    static unsigned char message[MAX_COUNT][MAX_LEN];
+    static unsigned char result[MAX_COUNT][MAX_HASH];
+    unsigned char *result_ptr[MAX_COUNT];
+    const unsigned char *message_ptr[MAX_COUNT];
+    unsigned len, count, i;
+
+    if (!quiet_flag) {
+        printf( "    Hash lanes available: %u\n", hss_hash_lanes(HASH_SHA256) );
+    }
+
+    for (i=0; i<MAX_COUNT; i++) {
+        result_ptr[i] = result[i];
+        message_ptr[i] = message[i];
+    }
+
+    for (len = 0; len <= MAX_LEN; len++) {
+        for (count = 1; count <= MAX_COUNT; count++) {
+            if (fast_flag && len % 7 != 0 && count != MAX_COUNT) continue;
+            for (i=0; i<count; i++) {
+                unsigned j;
+                for (j=0; j<len; j++) message[i][j] = my_rand();
+            }
+            memset( result, 0, sizeof result );
+
+            hss_hash_multi( result_ptr, HASH_SHA256, message_ptr, len, count );
+
+            for (i=0; i<MAX_COUNT; i++) {
+                unsigned char expected[MAX_HASH];
+                if (i < count) {
+                    hss_hash( expected, HASH_SHA256, message[i], len );
+                } else {
+                    /* Make sure we didn't write past the last one */
+                    memset( expected, 0, sizeof expected );
+                }
+                if (0 != memcmp( result[i], expected, 32 )) {
+                    printf( "  Multi-hash mismatch: len = %u count = %u "
+                            "index = %u\n", len, count, i );
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (!test_block()) return false;
+    if (!test_lanes_context()) return false;
+
+    return true;
+}
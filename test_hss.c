@@ -19,9 +19,15 @@ static struct {
     bool (*test_enabled)(bool);        /* Check if this tests is enabled */
 } test_list[] = {
     { "testvector", test_testvector, "test vectors from the draft", false },
+    { "hash", test_hash, "multi-buffer hash test", false },
     { "keygen", test_keygen, "key generation function test", false },
+    { "keyresume", test_keyresume, "resumable and sharded key generation test", false },
     { "load", test_load, "key load test", false },
     { "sign", test_sign, "signature test", false },
+    { "checkpoint", test_checkpoint, "checkpoint cache test", false },
+    { "batch", test_batch, "batch signature test", false },
+    { "split", test_split, "key split test", false },
+    { "store", test_store, "private key store test", false },
     { "signinc", test_sign_inc, "incremental signature test", true },
     { "stat", test_stat, "statistical test", false },
     { "keyload", test_key_load, "key loading test", true },
@@ -15,6 +15,12 @@ extern bool test_key_load(bool fast_flag, bool quiet_flag);
 extern bool test_reserve(bool fast_flag, bool quiet_flag);
 extern bool test_thread(bool fast_flag, bool quiet_flag);
 extern bool test_h25(bool fast_flag, bool quiet_flag);
+extern bool test_hash(bool fast_flag, bool quiet_flag);
+extern bool test_checkpoint(bool fast_flag, bool quiet_flag);
+extern bool test_keyresume(bool fast_flag, bool quiet_flag);
+extern bool test_batch(bool fast_flag, bool quiet_flag);
+extern bool test_split(bool fast_flag, bool quiet_flag);
+extern bool test_store(bool fast_flag, bool quiet_flag);
 
 extern bool check_threading_on(bool fast_flag);
 extern bool check_h25(bool fast_flag);
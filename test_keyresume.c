@@ -0,0 +1,462 @@
+/*
+ * This tests out the resumable key generation logic.  We generate a key
+ * the normal way, and then again with a checkpoint; we interrupt that
+ * partway through (by having the checkpoint write fail), and make sure
+ * that hss_resume_private_key comes up with the same public key and aux data
+ * (and that it skips the ranges that were already done, and redoes any we
+ * damaged).  We also check that generating the key in shards, and merging
+ * them, gives the same answer
+ */
+#include "test_hss.h"
+#include "hss.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static bool rand_1( void *output, size_t len) {
+    unsigned char *p = output;
+    while (len--) *p++ = 0x35 + 7*len;
+    return true;
+}
+
+/* This gives a different key (for checking that we reject its shards) */
+static bool rand_2( void *output, size_t len) {
+    unsigned char *p = output;
+    while (len--) *p++ = 0x53 + 11*len;
+    return true;
+}
+
+/* The checkpoint_written callback; it counts the bytes written, and fails */
+/* once we've seen fail_after calls */
+struct write_state {
+    unsigned calls;
+    unsigned fail_after;
+    size_t bytes_written;
+};
+static bool checkpoint_written( const unsigned char *checkpoint,
+                                size_t offset, size_t len, void *context ) {
+    struct write_state *state = context;
+    if (state->calls++ >= state->fail_after) return false;
+    state->bytes_written += len;
+    return true;
+}
+
+static bool test_resume( param_set_t lm_type, size_t len_aux ) {
+    int levels = 1;
+    param_set_t lm[1] = { lm_type };
+    param_set_t ots[1] = { LMOTS_SHA256_N32_W2 };
+    unsigned char priv_key[HSS_MAX_PRIVATE_KEY_LEN];
+    unsigned char pub_key[2][HSS_MAX_PUBLIC_KEY_LEN];
+    unsigned char *aux[2] = { 0, 0 };
+    unsigned char *checkpoint = 0;
+    bool success = false;
+    size_t len_pub = hss_get_public_key_len( levels, lm, ots );
+    size_t len_aux_used = 0;
+    if (len_aux) len_aux_used = hss_get_aux_data_len( len_aux, levels,
+                                                      lm, ots );
+    size_t len_checkpoint = hss_get_keygen_checkpoint_len( levels, lm, ots,
+                                                           len_aux );
+    if (len_checkpoint == 0) {
+        printf( "  Bad checkpoint length\n" );
+        return false;
+    }
+    if (len_aux) {
+        aux[0] = malloc( len_aux );
+        aux[1] = malloc( len_aux );
+    }
+    checkpoint = malloc( len_checkpoint );
+    if ((len_aux && (!aux[0] || !aux[1])) || !checkpoint) {
+        printf( "  Out of memory\n" );
+        goto failed;
+    }
+
+    /* The reference key */
+    if (!hss_generate_private_key( rand_1, levels, lm, ots, NULL, priv_key,
+                                   pub_key[0], sizeof pub_key[0],
+                                   aux[0], len_aux, 0 )) {
+        printf( "  Error generating reference key\n" );
+        goto failed;
+    }
+
+    /* Now, the same key, but interrupted after the second batch */
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    hss_extra_info_set_threads( &info, 1 );
+    struct write_state state = { 0, 2, 0 };
+    memset( checkpoint, 0, len_checkpoint );
+    if (hss_generate_private_key_checkpointed( rand_1, levels, lm, ots,
+                                   NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux,
+                                   checkpoint, len_checkpoint,
+                                   checkpoint_written, &state, &info )) {
+        printf( "  Interrupted key generation succeeded\n" );
+        goto failed;
+    }
+    if (hss_extra_info_test_error_code( &info ) !=
+                                  hss_error_checkpoint_write_failed) {
+        printf( "  Interrupted key generation gave the wrong error\n" );
+        goto failed;
+    }
+    size_t bytes_done = state.bytes_written;
+    if (bytes_done == 0 || bytes_done >= len_checkpoint) {
+        printf( "  Unexpected amount of checkpoint written\n" );
+        goto failed;
+    }
+
+    /* Damage the first range; resume should redo that one, along with */
+    /* everything that wasn't done */
+    checkpoint[0] ^= 0x01;
+
+    struct write_state resume_state = { 0, ~0U, 0 };
+    if (!hss_resume_private_key( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux,
+                                   checkpoint, len_checkpoint,
+                                   checkpoint_written, &resume_state, 0 )) {
+        printf( "  Resume failed\n" );
+        goto failed;
+    }
+    if (0 != memcmp( pub_key[0], pub_key[1], len_pub )) {
+        printf( "  Resumed public key mismatch\n" );
+        goto failed;
+    }
+    if (0 != memcmp( aux[0], aux[1], len_aux_used )) {
+        printf( "  Resumed aux data mismatch\n" );
+        goto failed;
+    }
+    if (resume_state.bytes_written >= len_checkpoint) {
+        printf( "  Resume didn't skip the completed ranges\n" );
+        goto failed;
+    }
+
+    /* And one that was never interrupted gives the same answer */
+    struct write_state full_state = { 0, ~0U, 0 };
+    if (!hss_generate_private_key_checkpointed( rand_1, levels, lm, ots,
+                                   NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux,
+                                   checkpoint, len_checkpoint,
+                                   checkpoint_written, &full_state, 0 ) ||
+        0 != memcmp( pub_key[0], pub_key[1], len_pub ) ||
+        full_state.bytes_written != len_checkpoint) {
+        printf( "  Checkpointed key generation mismatch\n" );
+        goto failed;
+    }
+
+    /* A private key that has signed isn't one we can resume */
+    priv_key[7] = 1;
+    if (hss_resume_private_key( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux,
+                                   checkpoint, len_checkpoint,
+                                   0, 0, &info ) ||
+        hss_extra_info_test_error_code( &info ) !=
+                                  hss_error_key_already_used) {
+        printf( "  Resume of a used key gave the wrong error\n" );
+        goto failed;
+    }
+
+    success = true;
+failed:
+    free( aux[0] );
+    free( aux[1] );
+    free( checkpoint );
+    return success;
+}
+
+static bool test_shards( param_set_t lm_type, size_t len_aux,
+                         unsigned num_shards ) {
+    int levels = 1;
+    param_set_t lm[1] = { lm_type };
+    param_set_t ots[1] = { LMOTS_SHA256_N32_W2 };
+    unsigned char priv_key[HSS_MAX_PRIVATE_KEY_LEN];
+    unsigned char pub_key[2][HSS_MAX_PUBLIC_KEY_LEN];
+    unsigned char *aux[2] = { 0, 0 };
+    unsigned char *shard[8] = { 0 };
+    size_t len_shard[8];
+    bool success = false;
+    size_t len_pub = hss_get_public_key_len( levels, lm, ots );
+    size_t len_aux_used = 0;
+    if (len_aux) {
+        len_aux_used = hss_get_aux_data_len( len_aux, levels, lm, ots );
+        aux[0] = malloc( len_aux );
+        aux[1] = malloc( len_aux );
+        if (!aux[0] || !aux[1]) {
+            printf( "  Out of memory\n" );
+            goto failed;
+        }
+    }
+
+    /* The reference key */
+    if (!hss_generate_private_key( rand_1, levels, lm, ots, NULL, priv_key,
+                                   pub_key[0], sizeof pub_key[0],
+                                   aux[0], len_aux, 0 )) {
+        printf( "  Error generating reference key\n" );
+        goto failed;
+    }
+
+    /* The same key, for sharding */
+    if (!hss_generate_private_key_for_shards( rand_1, levels, lm, ots,
+                                   NULL, priv_key, 0 )) {
+        printf( "  Error generating sharded private key\n" );
+        goto failed;
+    }
+
+    unsigned i;
+    for (i=0; i<num_shards; i++) {
+        len_shard[i] = hss_get_keygen_shard_len( levels, lm, ots, len_aux,
+                                                 i, num_shards );
+        shard[i] = len_shard[i] ? malloc( len_shard[i] ) : 0;
+        if (!shard[i]) {
+            printf( "  Bad shard length\n" );
+            goto failed;
+        }
+        if (!hss_generate_keygen_shard( NULL, priv_key, len_aux,
+                                   i, num_shards,
+                                   shard[i], len_shard[i], 0 )) {
+            printf( "  Error generating shard %u\n", i );
+            goto failed;
+        }
+    }
+
+    /* A shard that's in the wrong place is rejected */
+    if (num_shards > 1) {
+        const unsigned char *swapped[8];
+        size_t len_swapped[8];
+        for (i=0; i<num_shards; i++) {
+            swapped[i] = shard[i < 2 ? i^1 : i];
+            len_swapped[i] = len_shard[i < 2 ? i^1 : i];
+        }
+        struct hss_extra_info info;
+        hss_init_extra_info( &info );
+        if (hss_merge_keygen_shards( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux, num_shards,
+                                   swapped, len_swapped, &info ) ||
+            hss_extra_info_test_error_code( &info ) != hss_error_bad_shard) {
+            printf( "  Misplaced shard accepted\n" );
+            goto failed;
+        }
+    }
+
+    /* So is a shard from a different key */
+    {
+        unsigned char other_key[HSS_MAX_PRIVATE_KEY_LEN];
+        unsigned char *other = malloc( len_shard[0] );
+        const unsigned char *mixed[8];
+        for (i=0; i<num_shards; i++) mixed[i] = shard[i];
+        mixed[0] = other;
+        struct hss_extra_info info;
+        hss_init_extra_info( &info );
+        bool rejected = other &&
+            hss_generate_private_key_for_shards( rand_2, levels, lm, ots,
+                                   NULL, other_key, 0 ) &&
+            hss_generate_keygen_shard( NULL, other_key, len_aux,
+                                   0, num_shards,
+                                   other, len_shard[0], 0 ) &&
+            !hss_merge_keygen_shards( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux, num_shards,
+                                   mixed, len_shard, &info ) &&
+            hss_extra_info_test_error_code( &info ) == hss_error_bad_shard;
+        free( other );
+        if (!rejected) {
+            printf( "  Shard from another key accepted\n" );
+            goto failed;
+        }
+    }
+
+    if (!hss_merge_keygen_shards( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux, num_shards,
+                                   (const unsigned char *const *)shard,
+                                   len_shard, 0 ) ||
+        0 != memcmp( pub_key[0], pub_key[1], len_pub ) ||
+        0 != memcmp( aux[0], aux[1], len_aux_used )) {
+        printf( "  Merged shards mismatch\n" );
+        goto failed;
+    }
+
+    /* A damaged range (as opposed to a damaged shard) is recomputed */
+    shard[num_shards-1][ len_shard[num_shards-1] - 1 ] ^= 0x01;
+    memset( pub_key[1], 0, sizeof pub_key[1] );
+    if (!hss_merge_keygen_shards( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux, num_shards,
+                                   (const unsigned char *const *)shard,
+                                   len_shard, 0 ) ||
+        0 != memcmp( pub_key[0], pub_key[1], len_pub )) {
+        printf( "  Merge with damaged range mismatch\n" );
+        goto failed;
+    }
+
+    /* A missing shard gets filled in by the merge */
+    free( shard[0] ); shard[0] = 0;
+    memset( pub_key[1], 0, sizeof pub_key[1] );
+    if (!hss_merge_keygen_shards( NULL, priv_key,
+                                   pub_key[1], sizeof pub_key[1],
+                                   aux[1], len_aux, num_shards,
+                                   (const unsigned char *const *)shard,
+                                   len_shard, 0 ) ||
+        0 != memcmp( pub_key[0], pub_key[1], len_pub )) {
+        printf( "  Merge with missing shard mismatch\n" );
+        goto failed;
+    }
+
+    success = true;
+failed:
+    for (i=0; i<8; i++) free( shard[i] );
+    free( aux[0] );
+    free( aux[1] );
+    return success;
+}
+
+/*
+ * Here, the aux data is big enough to have levels below the checkpoint
+ * level; we generate the key (either by resuming an interrupted
+ * checkpointed key generation, or by merging shards), and then make sure
+ * that the signatures we get with that aux data verify
+ */
+#define BIG_AUX_SIGS 64
+static bool test_big_aux( param_set_t lm_type, size_t len_aux,
+                          unsigned num_shards ) {
+    int levels = 1;
+    param_set_t lm[1] = { lm_type };
+    param_set_t ots[1] = { LMOTS_SHA256_N32_W2 };
+    unsigned char priv_key[HSS_MAX_PRIVATE_KEY_LEN];
+    unsigned char pub_key[HSS_MAX_PUBLIC_KEY_LEN];
+    unsigned char *aux = malloc( len_aux );
+    unsigned char *checkpoint = 0;
+    unsigned char *shard[8] = { 0 };
+    size_t len_shard[8];
+    unsigned char *sig = 0;
+    struct hss_working_key *w = 0;
+    bool success = false;
+    unsigned i;
+    if (!aux) {
+        printf( "  Out of memory\n" );
+        goto failed;
+    }
+
+    if (num_shards == 0) {
+        /* Interrupt a checkpointed key generation, and then resume it */
+        size_t len_checkpoint = hss_get_keygen_checkpoint_len( levels,
+                                                   lm, ots, len_aux );
+        checkpoint = len_checkpoint ? malloc( len_checkpoint ) : 0;
+        if (!checkpoint) {
+            printf( "  Bad checkpoint length\n" );
+            goto failed;
+        }
+        memset( checkpoint, 0, len_checkpoint );
+        struct write_state state = { 0, 2, 0 };
+        if (hss_generate_private_key_checkpointed( rand_1, levels, lm, ots,
+                                   NULL, priv_key,
+                                   pub_key, sizeof pub_key, aux, len_aux,
+                                   checkpoint, len_checkpoint,
+                                   checkpoint_written, &state, 0 )) {
+            printf( "  Interrupted key generation succeeded\n" );
+            goto failed;
+        }
+        if (!hss_resume_private_key( NULL, priv_key,
+                                   pub_key, sizeof pub_key, aux, len_aux,
+                                   checkpoint, len_checkpoint, 0, 0, 0 )) {
+            printf( "  Resume failed\n" );
+            goto failed;
+        }
+    } else {
+        /* Generate it in shards, and merge them */
+        if (!hss_generate_private_key_for_shards( rand_1, levels, lm, ots,
+                                   NULL, priv_key, 0 )) {
+            printf( "  Error generating sharded private key\n" );
+            goto failed;
+        }
+        for (i=0; i<num_shards; i++) {
+            len_shard[i] = hss_get_keygen_shard_len( levels, lm, ots,
+                                               len_aux, i, num_shards );
+            shard[i] = len_shard[i] ? malloc( len_shard[i] ) : 0;
+            if (!shard[i] ||
+                !hss_generate_keygen_shard( NULL, priv_key, len_aux,
+                                   i, num_shards,
+                                   shard[i], len_shard[i], 0 )) {
+                printf( "  Error generating shard %u\n", i );
+                goto failed;
+            }
+        }
+        if (!hss_merge_keygen_shards( NULL, priv_key,
+                                   pub_key, sizeof pub_key, aux, len_aux,
+                                   num_shards,
+                                   (const unsigned char *const *)shard,
+                                   len_shard, 0 )) {
+            printf( "  Merge failed\n" );
+            goto failed;
+        }
+    }
+
+    /* Now, sign with that key (and aux data), and check the signatures */
+    w = hss_load_private_key( NULL, priv_key, 0, aux, len_aux, 0 );
+    size_t len_sig = hss_get_signature_len( levels, lm, ots );
+    sig = malloc( len_sig );
+    if (!w || !sig) {
+        printf( "  Unable to load private key\n" );
+        goto failed;
+    }
+    for (i=0; i<BIG_AUX_SIGS; i++) {
+        static const char message[] = "Big aux";
+        if (!hss_generate_signature( w, NULL, priv_key,
+                                   message, sizeof message,
+                                   sig, len_sig, 0 )) {
+            printf( "  Signature failure\n" );
+            goto failed;
+        }
+        if (!hss_validate_signature( pub_key, message, sizeof message,
+                                   sig, len_sig, 0 )) {
+            printf( "  Signature %u with big aux data doesn't verify\n", i );
+            goto failed;
+        }
+    }
+
+    success = true;
+failed:
+    hss_free_working_key( w );
+    for (i=0; i<8; i++) free( shard[i] );
+    free( sig );
+    free( checkpoint );
+    free( aux );
+    return success;
+}
+
+bool test_keyresume(bool fast_flag, bool quiet_flag) {
+    /* No aux data; we checkpoint just below the root */
+    if (!test_resume( LMS_SHA256_N32_H10, 0 )) return false;
+
+    /* With aux data (which is above the checkpoint level, and so gets */
+    /* filled in from the checkpointed nodes) */
+    if (!test_resume( LMS_SHA256_N32_H10, 2000 )) return false;
+
+    /* A tall tree with lots of aux data (whose top level is far above */
+    /* level 12) still has a modest checkpoint */
+    param_set_t lm_h25[1] = { LMS_SHA256_N32_H25 };
+    param_set_t ots_w8[1] = { LMOTS_SHA256_N32_W8 };
+    size_t len_checkpoint = hss_get_keygen_checkpoint_len( 1, lm_h25,
+                                             ots_w8, 100000000 );
+    if (len_checkpoint == 0 || len_checkpoint > 2 * 32 << 12) {
+        printf( "  H25 checkpoint is %lu bytes\n",
+                (unsigned long)len_checkpoint );
+        return false;
+    }
+
+    if (!test_shards( LMS_SHA256_N32_H10, 0, 3 )) return false;
+    if (!test_shards( LMS_SHA256_N32_H10, 2000, 4 )) return false;
+
+    /* Aux data with levels below the checkpoint level (level 12) */
+    if (!test_big_aux( LMS_SHA256_N32_H15, 1100000, 0 )) return false;
+    if (!test_big_aux( LMS_SHA256_N32_H15, 1100000, 4 )) return false;
+
+    if (!fast_flag) {
+        if (!test_resume( LMS_SHA256_N32_H15, 0 )) return false;
+        if (!test_shards( LMS_SHA256_N32_H15, 0, 8 )) return false;
+    }
+
+    return true;
+}
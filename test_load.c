@@ -9,6 +9,8 @@
 #include "hss.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
 
 static bool rand_1( void *output, size_t len) {
     unsigned char *p = output;
@@ -89,6 +91,128 @@ static bool test_aux( param_set_t lm_setting ) {
     return true;
 }
 
+/*
+ * This tests the step-wise load; we load the key a slice at a time, and make
+ * sure that the signatures are the same as from a key loaded the normal way
+ */
+static bool test_stepwise( int levels, const param_set_t *lm,
+                           const param_set_t *ots, unsigned skip,
+                           unsigned long max_hashes ) {
+    unsigned char priv_key[2][HSS_MAX_PRIVATE_KEY_LEN];
+    unsigned char pub_key[HSS_MAX_PUBLIC_KEY_LEN];
+    size_t len_priv_key = hss_get_private_key_len(levels, lm, ots);
+    size_t len_sig = hss_get_signature_len(levels, lm, ots);
+    if (!len_priv_key || !len_sig) return false;
+    unsigned char *sig[2];
+    sig[0] = malloc(len_sig);
+    sig[1] = malloc(len_sig);
+    struct hss_working_key *w[2] = { 0, 0 };
+    bool success = false;
+    static unsigned char test_message[1] = "a";
+    if (!sig[0] || !sig[1]) goto failed;
+
+    if (!hss_generate_private_key( rand_1, levels, lm, ots,
+                                   NULL, priv_key[0],
+                                   pub_key, sizeof pub_key, 0, 0, 0)) {
+        printf( "Error generating private key\n" );
+        goto failed;
+    }
+
+    /* The reference key; advance it partway, so we load mid-subtree */
+    w[0] = hss_load_private_key( NULL, priv_key[0], 0, 0, 0, 0 );
+    if (!w[0]) {
+        printf( "Error loading private key\n" );
+        goto failed;
+    }
+    unsigned i;
+    for (i=0; i<skip; i++) {
+        if (!hss_generate_signature(w[0], NULL, priv_key[0],
+                             test_message, sizeof test_message,
+                             sig[0], len_sig, 0)) {
+            printf( "Error generating signature\n" );
+            goto failed;
+        }
+    }
+    memcpy( priv_key[1], priv_key[0], len_priv_key );
+
+    w[1] = allocate_working_key( levels, lm, ots, 0, 0 );
+    if (!w[1]) {
+        printf( "Error allocating working key\n" );
+        goto failed;
+    }
+
+    /* Start a step-wise load, and then abandon it; the key can't be used */
+    /* until we've done one that completes */
+    bool done = false;
+    if (!hss_generate_working_key_init( NULL, priv_key[1], NULL, 0,
+                                        w[1], 0 ) ||
+        !hss_generate_working_key_step( w[1], max_hashes, &done, 0 ) ||
+        done) {
+        printf( "Error starting step-wise load\n" );
+        goto failed;
+    }
+    hss_generate_working_key_cancel( w[1] );
+    if (hss_generate_signature(w[1], NULL, priv_key[1],
+                             test_message, sizeof test_message,
+                             sig[1], len_sig, 0)) {
+        printf( "Signed with a cancelled load\n" );
+        goto failed;
+    }
+
+    /* Now, do it for real */
+    if (!hss_generate_working_key_init( NULL, priv_key[1], NULL, 0,
+                                        w[1], 0 )) {
+        printf( "Error starting step-wise load\n" );
+        goto failed;
+    }
+    unsigned long long prev_done = 0, hashes_done, hashes_total;
+    unsigned steps = 0;
+    while (!done) {
+        if (!hss_generate_working_key_progress( w[1], &hashes_done,
+                                                 &hashes_total ) ||
+            (steps > 0 && hashes_done <= prev_done) ||
+            hashes_done >= hashes_total) {
+            printf( "Bad step-wise progress\n" );
+            goto failed;
+        }
+        prev_done = hashes_done;
+        if (!hss_generate_working_key_step( w[1], max_hashes, &done, 0 )) {
+            printf( "Error in step-wise load\n" );
+            goto failed;
+        }
+        steps++;
+    }
+    if (steps < 2) {
+        printf( "Step-wise load didn't step\n" );
+        goto failed;
+    }
+
+    /* The signatures should match */
+    for (i=0; i<40; i++) {
+        int j;
+        for (j=0; j<2; j++) {
+            if (!hss_generate_signature(w[j], NULL, priv_key[j],
+                             test_message, sizeof test_message,
+                             sig[j], len_sig, 0)) {
+                printf( "Error generating signature\n" );
+                goto failed;
+            }
+        }
+        if (0 != memcmp( sig[0], sig[1], len_sig )) {
+            printf( "Step-wise load signature mismatch\n" );
+            goto failed;
+        }
+    }
+
+    success = true;
+failed:
+    hss_free_working_key( w[0] );
+    hss_free_working_key( w[1] );
+    free(sig[0]);
+    free(sig[1]);
+    return success;
+}
+
 #define NUM_PARM_SETS 4
 
 static bool load_key( int *index, unsigned char priv_key[][HSS_MAX_PRIVATE_KEY_LEN], 
@@ -149,6 +273,22 @@ bool test_load(bool fast_flag, bool quiet_flag) {
         if (!test_aux( LMS_SHA256_N32_H20 )) return false;
     }
 
+    /*
+     * Check the step-wise load, both with slices much smaller than a node
+     * of the top subtree, and with large ones
+     */
+    {
+        param_set_t lm[2] = { LMS_SHA256_N32_H10, LMS_SHA256_N32_H5 };
+        param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W4 };
+        if (!test_stepwise( 2, lm, ots, 0, 5000 )) return false;
+        if (!test_stepwise( 2, lm, ots, 45, 200000 )) return false;
+    }
+    {
+        param_set_t lm[1] = { LMS_SHA256_N32_H10 };
+        param_set_t ots[1] = { LMOTS_SHA256_N32_W8 };
+        if (!test_stepwise( 1, lm, ots, 100, 1000000 )) return false;
+    }
+
     /*
      * Verify that we can't load a private key with the wrong parameter set
      * into an already allocated working set
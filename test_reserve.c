@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
 
 static int rand_seed;
 static int my_rand(void) {
@@ -74,6 +76,320 @@ static bool update_private_key(unsigned char *private_key,
     return true;
 }
 
+/*
+ * Here's the storage model for the asynchronous reservation test; the
+ * library asks us to start a write, and we decide when it completes (and
+ * whether it succeeds)
+ */
+enum async_mode { async_defer, async_now, async_fail_now, async_refuse,
+                  async_delayed };
+static enum async_mode async_mode;
+static const unsigned char *async_buffer;  /* The write in flight */
+static size_t async_len;
+static unsigned async_writes;  /* The number of writes started */
+static pthread_t async_thread; /* Completes an async_delayed write */
+static bool async_thread_started;
+
+static void *delayed_complete(void *arg);
+
+static bool async_write(const unsigned char *private_key,
+                        size_t len_private_key, void *context) {
+    struct hss_working_key *w = context;
+    async_writes++;
+    switch (async_mode) {
+    case async_now:
+        update_private_key( (unsigned char *)private_key, len_private_key, 0 );
+        hss_async_reserve_done( w, true );
+        break;
+    case async_fail_now:
+        hss_async_reserve_done( w, false );
+        break;
+    case async_refuse:
+        /* Claim success, and then say we couldn't start the write; */
+        /* the library must not believe the former */
+        hss_async_reserve_done( w, true );
+        return false;
+    case async_delayed:
+        async_buffer = private_key;
+        async_len = len_private_key;
+        async_thread_started = (0 == pthread_create( &async_thread, 0,
+                                                   delayed_complete, w ));
+        return async_thread_started;
+    default:
+        async_buffer = private_key;
+        async_len = len_private_key;
+        break;
+    }
+    return true;
+}
+
+/* Complete the write in flight */
+static void async_complete(struct hss_working_key *w, bool success) {
+    const unsigned char *buffer = async_buffer;
+    async_buffer = 0;
+    if (success) {
+        update_private_key( (unsigned char *)buffer, async_len, 0 );
+    }
+    hss_async_reserve_done( w, success );
+}
+
+/* This completes the write in flight after a delay (while the main */
+/* thread is waiting for it) */
+static void *delayed_complete(void *arg) {
+    usleep( 20000 );
+    async_complete( arg, true );
+    return 0;
+}
+
+static bool async_sign(struct hss_working_key *w, unsigned expected,
+                       struct hss_extra_info *info) {
+    unsigned char signature[ 16000 ];
+    if (!hss_generate_signature(w, update_private_key, NULL,
+                     "abc", 3, signature, sizeof signature, info )) {
+        return false;
+    }
+    unsigned long sig_index = (signature[4] << 24UL) +
+                              (signature[5] << 16UL) +
+                              (signature[6] <<  8UL) +
+                              (signature[7]      );
+    if (sig_index != expected) {
+        printf( "Error: unexpected signature index\n" );
+        return false;
+    }
+    /* Whatever happens, we must never sign with a sequence number that */
+    /* isn't covered by what's in storage (unless we're at the end) */
+    if (!hit_end && sig_index >= last_seqno) {
+        printf( "Error: signed past the stored reservation\n" );
+        return false;
+    }
+    return true;
+}
+
+#define WINDOW 16
+
+static bool test_async_reserve(void) {
+    rand_seed = 1000;
+    unsigned char pub_key[ 200 ];
+    param_set_t lm_type[1] = { LMS_SHA256_N32_H10 };
+    param_set_t ots_type[1] = { LMOTS_SHA256_N32_W2 };
+    if (!hss_generate_private_key( rand_1, 1, lm_type, ots_type,
+            update_private_key, NULL, pub_key, sizeof pub_key,
+            NULL, 0, NULL)) {
+        printf( "Error: unable to create private key\n" );
+        return false;
+    }
+    last_seqno = 0;
+    hit_end = false;
+
+    bool success = false;
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    struct hss_working_key *w = hss_load_private_key(
+                read_private_key, NULL, 0, NULL, 0, &info );
+    if (!w) {
+        printf( "Error: unable to load private key\n" );
+        return false;
+    }
+    if (!hss_set_async_reserve( w, async_write, w, WINDOW, &info )) {
+        printf( "Error: unable to set async reserve\n" );
+        goto failed;
+    }
+
+    /* The first signature has nothing reserved, and so waits for the */
+    /* write (which completes immediately) */
+    async_mode = async_now;
+    async_writes = 0;
+    if (!async_sign( w, 0, &info ) || async_writes != 1 ||
+                                      last_seqno != WINDOW) {
+        printf( "Error: first async reservation\n" );
+        goto failed;
+    }
+
+    /* Once half the window is used, we start the next write; signing */
+    /* continues while that's in flight */
+    async_mode = async_defer;
+    unsigned i;
+    for (i=1; i<WINDOW; i++) {
+        got_update = false;
+        if (!async_sign( w, i, &info )) goto failed;
+        if (got_update) {
+            printf( "Error: signature wrote the private key\n" );
+            goto failed;
+        }
+        bool expect_write = (i >= WINDOW/2 - 1);
+        if (expect_write != (async_buffer != 0) || async_writes > 2) {
+            printf( "Error: async write started at the wrong time\n" );
+            goto failed;
+        }
+    }
+    async_complete( w, true );
+    if (last_seqno != 2*WINDOW) {
+        printf( "Error: wrong next window\n" );
+        goto failed;
+    }
+
+    /* This time, we use up the window before the write completes; the */
+    /* signature must wait for it */
+    for (; i<3*WINDOW; i++) {
+        pthread_t thread;
+        bool started = false;
+        if (i == 2*WINDOW) {
+            if (!async_buffer || 0 != pthread_create( &thread, 0,
+                                             delayed_complete, w )) {
+                printf( "Error: can't start completion thread\n" );
+                goto failed;
+            }
+            started = true;
+        }
+        bool ok = async_sign( w, i, &info );
+        if (started) pthread_join( thread, 0 );
+        if (!ok) goto failed;
+    }
+    if (last_seqno != 3*WINDOW) {
+        printf( "Error: wrong window after waiting\n" );
+        goto failed;
+    }
+
+    /* A prefetch that fails is retried once we need it; if that fails, */
+    /* so does the signature (and then we can try again) */
+    async_complete( w, false );
+    async_mode = async_fail_now;
+    if (async_sign( w, i, &info ) ||
+         hss_extra_info_test_error_code( &info ) !=
+                                hss_error_private_key_write_failed) {
+        printf( "Error: failed async write not reported\n" );
+        goto failed;
+    }
+
+    /* Completions that don't belong to a write in flight (either from */
+    /* a write that never started, or just out of the blue) must not be */
+    /* taken as covering the next write */
+    async_mode = async_refuse;
+    if (async_sign( w, i, &info ) ||
+         hss_extra_info_test_error_code( &info ) !=
+                                hss_error_private_key_write_failed) {
+        printf( "Error: refused async write not reported\n" );
+        goto failed;
+    }
+    hss_async_reserve_done( w, true );
+    async_mode = async_delayed;
+    async_thread_started = false;
+    {
+        bool ok = async_sign( w, i, &info );
+        if (async_thread_started) pthread_join( async_thread, 0 );
+        if (!ok || !async_thread_started) {
+            printf( "Error: stale completion accepted\n" );
+            goto failed;
+        }
+        i++;
+    }
+    async_mode = async_now;
+    for (; i<1024; i++) {
+        if (!async_sign( w, i, &info )) {
+            printf( "Error: unable to sign after failed write\n" );
+            goto failed;
+        }
+        if (hss_extra_info_test_last_signature( &info )) break;
+    }
+    if (i != 1023 || !hit_end) {
+        printf( "Error: async reservation at end\n" );
+        goto failed;
+    }
+
+    success = true;
+failed:
+    hss_free_working_key( w );
+    return success;
+}
+
+/*
+ * This checks the adaptive autoreserve; we sign quickly (and so it should
+ * reserve up to the limit we give it), and then slowly (where it should
+ * write each time).  The write intervals are picked to be far from the
+ * actual signing times, so that this doesn't depend on how fast we run
+ * (the first phase wants a minute's worth of signatures, which hits the
+ * MAX_LOST ceiling unless a signature takes over a second)
+ */
+#define MAX_LOST 50
+
+static bool test_adaptive_reserve(void) {
+    rand_seed = 2000;
+    unsigned char pub_key[ 200 ];
+    unsigned char signature[ 16000 ];
+    param_set_t lm_type[1] = { LMS_SHA256_N32_H10 };
+    param_set_t ots_type[1] = { LMOTS_SHA256_N32_W2 };
+    if (!hss_generate_private_key( rand_1, 1, lm_type, ots_type,
+            update_private_key, NULL, pub_key, sizeof pub_key,
+            NULL, 0, NULL)) {
+        printf( "Error: unable to create private key\n" );
+        return false;
+    }
+    last_seqno = 0;
+
+    bool success = false;
+    struct hss_working_key *w = hss_load_private_key(
+                read_private_key, NULL, 0, NULL, 0, NULL );
+    if (!w) {
+        printf( "Error: unable to load private key\n" );
+        return false;
+    }
+    if (!hss_set_adaptive_reserve( w, 60000, MAX_LOST, NULL )) {
+        printf( "Error: unable to set adaptive reserve\n" );
+        goto failed;
+    }
+
+    unsigned i, writes = 0;
+    for (i=0; i<300; i++) {
+        got_update = false;
+        if (!hss_generate_signature(w, update_private_key, NULL,
+                     "abc", 3, signature, sizeof signature, NULL )) {
+            printf( "Error: unable to sign\n" );
+            goto failed;
+        }
+        if (got_update) writes++;
+        /* We must always have this signature reserved, and never more */
+        /* than MAX_LOST beyond it */
+        if (last_seqno <= i || last_seqno > i + 1 + MAX_LOST) {
+            printf( "Error: adaptive reservation out of range\n" );
+            goto failed;
+        }
+    }
+    /* Once it's seen how fast we're going (which takes two writes), it */
+    /* should reserve the most it can each time */
+    if (writes > 300 / (MAX_LOST+1) + 4) {
+        printf( "Error: adaptive reserve wrote %u times\n", writes );
+        goto failed;
+    }
+
+    /* Reload (dropping what we had reserved, as a crash would), and */
+    /* start measuring afresh; if we sign slower than the interval, there */
+    /* isn't anything to gain by reserving */
+    hss_free_working_key( w );
+    w = hss_load_private_key( read_private_key, NULL, 0, NULL, 0, NULL );
+    if (!w || !hss_set_adaptive_reserve( w, 1, MAX_LOST, NULL )) {
+        printf( "Error: unable to reload private key\n" );
+        goto failed;
+    }
+    unsigned long start = last_seqno;
+    for (i=0; i<5; i++) {
+        usleep( 20000 );
+        if (!hss_generate_signature(w, update_private_key, NULL,
+                     "abc", 3, signature, sizeof signature, NULL )) {
+            printf( "Error: unable to sign\n" );
+            goto failed;
+        }
+        if (last_seqno != start + i + 1) {
+            printf( "Error: slow signing reserved too much\n" );
+            goto failed;
+        }
+    }
+
+    success = true;
+failed:
+    hss_free_working_key( w );
+    return success;
+}
+
 bool test_reserve(bool fast_flag, bool quiet_flag) {
     int reserve, do_manual_res;
 
@@ -248,5 +564,5 @@ bool test_reserve(bool fast_flag, bool quiet_flag) {
         hss_free_working_key(w);
     } }
 
-    return true;
+    return test_async_reserve() && test_adaptive_reserve();
 }
@@ -0,0 +1,277 @@
+/*
+ * This tests out splitting a key into sub-keys; we make sure that each
+ * sub-key signs with only its own range of sequence numbers (and that,
+ * between them, they cover what was left of the original key)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hss.h"
+#include "test_hss.h"
+
+static bool rand_1(void *output, size_t len) {
+    unsigned char *p = output;
+    while (len--) *p++ = len + 3;
+    return true;
+}
+
+/* Where a private key (or sub-key) is kept */
+struct private_key_store {
+    unsigned char private_key[ HSS_MAX_PRIVATE_SUBKEY_LEN ];
+};
+
+static bool update_private_key(unsigned char *private_key,
+                               size_t len_private_key, void *context) {
+    struct private_key_store *store = context;
+    memcpy( store->private_key, private_key, len_private_key );
+    return true;
+}
+
+static bool read_private_key(unsigned char *private_key,
+                             size_t len_private_key, void *context) {
+    struct private_key_store *store = context;
+    memcpy( private_key, store->private_key, len_private_key );
+    return true;
+}
+
+static unsigned long get_int(const unsigned char *p) {
+    unsigned long result = 0;
+    int i;
+    for (i=0; i<4; i++) {
+        result <<= 8;
+        result += p[i];
+    }
+    return result;
+}
+
+#define NUM_SUBKEYS 3
+#define TOTAL_SIGS 1024     /* Two levels of H5 */
+#define SIGS_BEFORE 10      /* The ones we sign before we split */
+
+/* Pull the sequence number out of a two level H5/H5 signature */
+static unsigned long signature_count( const param_set_t *lm,
+                                      const param_set_t *ots,
+                                      const unsigned char *sig ) {
+    unsigned long top_q = get_int( sig + 4 );
+    size_t offset = hss_get_signature_len( 1, lm, ots ) + /* 4 + top sig */
+                    8 + 16 + 32;                          /* public key */
+    unsigned long bottom_q = get_int( sig + offset );
+    return (top_q << 5) + bottom_q;
+}
+
+/*
+ * This signs with a sub-key until it runs out (reloading it from storage
+ * partway through), and marks which sequence numbers it used
+ */
+static bool sign_with_subkey( struct private_key_store *store,
+                    const unsigned char *public_key,
+                    const param_set_t *lm, const param_set_t *ots,
+                    unsigned char *sig, size_t sig_len,
+                    unsigned char *used, unsigned long *first ) {
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    struct hss_working_key *w = hss_load_private_key( read_private_key,
+                                     store, 0, 0, 0, &info );
+    if (!w) {
+        printf( "  Load sub-key failed\n" );
+        return false;
+    }
+
+    bool success = false;
+    unsigned n;
+    for (n = 0; ; n++) {
+        if (n == 5) {
+            /* Make sure a reload picks up where we left off */
+            hss_free_working_key( w );
+            w = hss_load_private_key( read_private_key, store,
+                                      0, 0, 0, &info );
+            if (!w) {
+                printf( "  Reload sub-key failed\n" );
+                return false;
+            }
+        }
+        if (!hss_generate_signature( w, update_private_key, store,
+                                     "abc", 3, sig, sig_len, &info )) {
+            printf( "  Sub-key signature failed\n" );
+            goto failed;
+        }
+        if (!hss_validate_signature( public_key, "abc", 3,
+                                     sig, sig_len, 0 )) {
+            printf( "  Sub-key signature didn't validate\n" );
+            goto failed;
+        }
+        unsigned long count = signature_count( lm, ots, sig );
+        if (n == 0) *first = count;
+        if (count >= TOTAL_SIGS || used[count]) {
+            printf( "  Sequence number %lu used twice\n", count );
+            goto failed;
+        }
+        used[count] = 1;
+        if (hss_extra_info_test_last_signature( &info )) break;
+    }
+
+    /* It's used up; it must not sign again (even if we reload it) */
+    if (hss_generate_signature( w, update_private_key, store,
+                                "abc", 3, sig, sig_len, &info )) {
+        printf( "  Sub-key signed past its range\n" );
+        goto failed;
+    }
+    hss_free_working_key( w );
+    w = hss_load_private_key( read_private_key, store, 0, 0, 0, 0 );
+    if (w) {
+        printf( "  Used up sub-key loaded\n" );
+        goto failed;
+    }
+
+    success = true;
+failed:
+    hss_free_working_key( w );
+    return success;
+}
+
+bool test_split(bool fast_flag, bool quiet_flag) {
+    param_set_t lm[2] = { LMS_SHA256_N32_H5, LMS_SHA256_N32_H5 };
+    param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2 };
+    size_t sig_len = hss_get_signature_len( 2, lm, ots );
+    size_t subkey_len = hss_get_private_subkey_len( 2, lm, ots );
+    if (sig_len == 0 || subkey_len == 0 ||
+                                 subkey_len > HSS_MAX_PRIVATE_SUBKEY_LEN) {
+        printf( "  Bad parm set\n" );
+        return false;
+    }
+
+    struct private_key_store store;
+    unsigned char public_key[ HSS_MAX_PUBLIC_KEY_LEN ];
+    memset( &store, 0, sizeof store );
+    if (!hss_generate_private_key( rand_1, 2, lm, ots,
+                    update_private_key, &store,
+                    public_key, sizeof public_key, 0, 0, 0 )) {
+        printf( "  Private key gen failed\n" );
+        return false;
+    }
+
+    bool success_flag = false;
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    unsigned char *sig = malloc( sig_len );
+    unsigned char used[ TOTAL_SIGS ];
+    memset( used, 0, sizeof used );
+    struct private_key_store sub[ NUM_SUBKEYS + 2 ];
+    unsigned char *subkeys[ NUM_SUBKEYS + 2 ];
+    unsigned i;
+    for (i=0; i<NUM_SUBKEYS + 2; i++) {
+        subkeys[i] = sub[i].private_key;
+    }
+    struct hss_working_key *w = hss_load_private_key( read_private_key,
+                                     &store, 0, 0, 0, &info );
+    if (!w || !sig) goto failed;
+
+    for (i=0; i<SIGS_BEFORE; i++) {
+        if (!hss_generate_signature( w, update_private_key, &store,
+                                     "abc", 3, sig, sig_len, &info )) {
+            printf( "  Signature gen failed\n" );
+            goto failed;
+        }
+        used[ signature_count( lm, ots, sig ) ] = 1;
+    }
+
+    /* A buffer that's too short, or more sub-keys than signatures left, */
+    /* must fail without retiring the key */
+    if (hss_split_working_key( w, update_private_key, &store, NUM_SUBKEYS,
+                               subkeys, subkey_len - 1, &info ) ||
+        hss_extra_info_test_error_code( &info ) !=
+                                       hss_error_buffer_overflow) {
+        printf( "  Short sub-key buffer accepted\n" );
+        goto failed;
+    }
+    unsigned char *many[ TOTAL_SIGS ];
+    for (i=0; i<TOTAL_SIGS; i++) many[i] = sub[0].private_key;
+    if (hss_split_working_key( w, update_private_key, &store,
+                               TOTAL_SIGS - SIGS_BEFORE + 1,
+                               many, subkey_len, &info ) ||
+        hss_extra_info_test_error_code( &info ) !=
+                                 hss_error_not_that_many_sigs_left) {
+        printf( "  Too many sub-keys accepted\n" );
+        goto failed;
+    }
+    if (!hss_generate_signature( w, update_private_key, &store,
+                                 "abc", 3, sig, sig_len, &info )) {
+        printf( "  Failed split retired the key\n" );
+        goto failed;
+    }
+    used[ signature_count( lm, ots, sig ) ] = 1;
+
+    /* Now, split what's left */
+    if (!hss_split_working_key( w, update_private_key, &store, NUM_SUBKEYS,
+                               subkeys, subkey_len, &info )) {
+        printf( "  Split failed\n" );
+        goto failed;
+    }
+    if (hss_generate_signature( w, update_private_key, &store,
+                                 "abc", 3, sig, sig_len, &info )) {
+        printf( "  Split key still signs\n" );
+        goto failed;
+    }
+    hss_free_working_key( w );
+    w = hss_load_private_key( read_private_key, &store, 0, 0, 0, 0 );
+    if (w) {
+        printf( "  Split key still loads\n" );
+        goto failed;
+    }
+
+    /* A program that doesn't know about sub-keys (and so reads just the */
+    /* private key part) must not accept one */
+    if (hss_get_private_key_len( 2, lm, ots ) >= subkey_len) {
+        printf( "  Sub-key not longer than a private key\n" );
+        goto failed;
+    }
+
+    /* Split the last sub-key again (this time, with it in memory); */
+    /* that retires it */
+    unsigned last = NUM_SUBKEYS - 1;
+    w = hss_load_private_key( 0, sub[last].private_key, 0, 0, 0, &info );
+    if (!w) {
+        printf( "  Load sub-key failed\n" );
+        goto failed;
+    }
+    if (!hss_split_working_key( w, 0, sub[last].private_key,
+                               2, &subkeys[last+1], subkey_len, &info )) {
+        printf( "  Sub-key split failed\n" );
+        goto failed;
+    }
+    hss_free_working_key( w );
+    w = hss_load_private_key( 0, sub[last].private_key, 0, 0, 0, 0 );
+    if (w) {
+        printf( "  Split sub-key still loads\n" );
+        goto failed;
+    }
+
+    /* Each sub-key signs its own range; all but the first start at the */
+    /* beginning of a bottom tree */
+    unsigned long first;
+    for (i=0; i<NUM_SUBKEYS + 2; i++) {
+        if (i == last) continue;
+        if (!sign_with_subkey( &sub[i], public_key, lm, ots, sig, sig_len,
+                               used, &first )) {
+            goto failed;
+        }
+        if (i == 0 ? first != SIGS_BEFORE + 1 : (first & 31) != 0) {
+            printf( "  Sub-key %u starts at %lu\n", i, first );
+            goto failed;
+        }
+    }
+
+    /* And, between them, they used every signature */
+    for (i=0; i<TOTAL_SIGS; i++) {
+        if (!used[i]) {
+            printf( "  Sequence number %u not used\n", i );
+            goto failed;
+        }
+    }
+
+    success_flag = true;
+failed:
+    hss_free_working_key( w );
+    free( sig );
+    return success_flag;
+}
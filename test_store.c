@@ -0,0 +1,243 @@
+/*
+ * This tests out the file-backed private key store; we make sure that what
+ * we reserve survives closing and reopening the store (even with a torn
+ * journal write at the end), that the journal gets folded into the snapshot,
+ * and that several threads reserving at once (each with its own sub-key)
+ * don't step on each other
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "hss.h"
+#include "hss_store.h"
+#include "test_hss.h"
+
+#define NUM_SUBKEYS 3
+#define SIGS_PER_THREAD 60
+
+static bool rand_1(void *output, size_t len) {
+    unsigned char *p = output;
+    while (len--) *p++ = len + 5;
+    return true;
+}
+
+static unsigned long sig_index(const unsigned char *sig) {
+    return ((unsigned long)sig[4] << 24) + (sig[5] << 16) +
+                                           (sig[6] << 8) + sig[7];
+}
+
+static bool sign_one(struct hss_working_key *w, void *slot,
+                     unsigned char *sig, size_t sig_len,
+                     unsigned long *index) {
+    if (!hss_generate_signature( w, hss_store_update_private_key, slot,
+                                 "abc", 3, sig, sig_len, 0 )) {
+        return false;
+    }
+    *index = sig_index( sig );
+    return true;
+}
+
+struct thread_detail {
+    void *slot;
+    size_t sig_len;
+    unsigned long first, last;
+    bool success;
+};
+
+/* Each thread signs with its own sub-key (and so its own slot) */
+static void *sign_thread(void *arg) {
+    struct thread_detail *d = arg;
+    d->success = false;
+    unsigned char *sig = malloc( d->sig_len );
+    struct hss_working_key *w = hss_load_private_key(
+                  hss_store_read_private_key, d->slot, 0, 0, 0, 0 );
+    if (w && sig) {
+        unsigned i;
+        for (i=0; i<SIGS_PER_THREAD; i++) {
+            unsigned long index;
+            if (!sign_one( w, d->slot, sig, d->sig_len, &index )) break;
+            if (i == 0) {
+                d->first = index;
+            } else if (index != d->last + 1) {
+                break;
+            }
+            d->last = index;
+        }
+        d->success = (i == SIGS_PER_THREAD);
+    }
+    hss_free_working_key( w );
+    free( sig );
+    return 0;
+}
+
+bool test_store(bool fast_flag, bool quiet_flag) {
+    char name[100], log_name[110];
+    sprintf( name, "/tmp/hss_test_store_%ld", (long)getpid() );
+    sprintf( log_name, "%s.log", name );
+
+    param_set_t lm_type[1] = { LMS_SHA256_N32_H10 };
+    param_set_t ots_type[1] = { LMOTS_SHA256_N32_W2 };
+    size_t sig_len = hss_get_signature_len( 1, lm_type, ots_type );
+    size_t subkey_len = hss_get_private_subkey_len( 1, lm_type, ots_type );
+    unsigned char public_key[ HSS_MAX_PUBLIC_KEY_LEN ];
+    unsigned char *sig = malloc( sig_len );
+    unsigned char subkey[ NUM_SUBKEYS ][ HSS_MAX_PRIVATE_SUBKEY_LEN ];
+    unsigned char *subkeys[ NUM_SUBKEYS ];
+    struct thread_detail detail[ NUM_SUBKEYS ];
+    struct hss_working_key *w = 0;
+    bool success = false;
+    unsigned i;
+    unsigned long index;
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+
+    struct hss_store *store = hss_store_open( name, 1 + NUM_SUBKEYS, &info );
+    if (!store || !sig) {
+        printf( "  Unable to create store\n" );
+        goto failed;
+    }
+    if (hss_store_open( name, 0, &info ) ||
+          hss_extra_info_test_error_code( &info ) != hss_error_store_in_use) {
+        printf( "  Store opened twice\n" );
+        goto failed;
+    }
+    void *slot = hss_store_slot( store, 0 );
+    if (hss_store_slot( store, 1 + NUM_SUBKEYS ) ||
+        hss_load_private_key( hss_store_read_private_key, slot,
+                              0, 0, 0, 0 )) {
+        printf( "  Empty store has a key\n" );
+        goto failed;
+    }
+    if (!hss_generate_private_key( rand_1, 1, lm_type, ots_type,
+                    hss_store_update_private_key, slot,
+                    public_key, sizeof public_key, 0, 0, 0 )) {
+        printf( "  Key generation into store failed\n" );
+        goto failed;
+    }
+
+    /* Sign enough (with a reservation write each time) that the journal */
+    /* gets folded into the snapshot */
+    w = hss_load_private_key( hss_store_read_private_key, slot,
+                              0, 0, 0, 0 );
+    if (!w) {
+        printf( "  Load from store failed\n" );
+        goto failed;
+    }
+    for (i=0; i<300; i++) {
+        if (!sign_one( w, slot, sig, sig_len, &index ) || index != i) {
+            printf( "  Signature %u failed\n", i );
+            goto failed;
+        }
+    }
+    if (!hss_validate_signature( public_key, "abc", 3, sig, sig_len, 0 )) {
+        printf( "  Signature failed to validate\n" );
+        goto failed;
+    }
+    struct stat st;
+    if (0 != stat( log_name, &st ) || st.st_size >= 100 * 16) {
+        printf( "  Journal wasn't compacted\n" );
+        goto failed;
+    }
+
+    /* Reopen it, with a torn record at the end of the journal */
+    hss_free_working_key( w ); w = 0;
+    hss_store_close( store );
+    FILE *f = fopen( log_name, "ab" );
+    if (!f || 5 != fwrite( "\1\2\3\4\5", 1, 5, f )) {
+        printf( "  Can't append to journal\n" );
+        if (f) fclose( f );
+        store = 0;
+        goto failed;
+    }
+    fclose( f );
+    if (hss_store_open( name, 2, &info ) ||
+             hss_extra_info_test_error_code( &info ) !=
+                                          hss_error_bad_param_set) {
+        printf( "  Opened with the wrong number of slots\n" );
+        store = 0;
+        goto failed;
+    }
+    store = hss_store_open( name, 0, &info );
+    slot = hss_store_slot( store, 0 );
+    w = hss_load_private_key( hss_store_read_private_key, slot,
+                              0, 0, 0, 0 );
+    if (!w || !sign_one( w, slot, sig, sig_len, &index ) || index != 300) {
+        printf( "  Store lost the count on reopen\n" );
+        goto failed;
+    }
+
+    /* Split what's left between the other slots (which retires slot 0) */
+    for (i=0; i<NUM_SUBKEYS; i++) subkeys[i] = subkey[i];
+    if (!hss_split_working_key( w, hss_store_update_private_key, slot,
+                    NUM_SUBKEYS, subkeys, subkey_len, 0 )) {
+        printf( "  Split failed\n" );
+        goto failed;
+    }
+    hss_free_working_key( w ); w = 0;
+    for (i=0; i<NUM_SUBKEYS; i++) {
+        if (!hss_store_update_private_key( subkey[i], subkey_len,
+                                    hss_store_slot( store, i+1 ))) {
+            printf( "  Sub-key write failed\n" );
+            goto failed;
+        }
+    }
+
+    /* Have the sub-keys sign at once; their reservations share the */
+    /* journal (and hopefully the fsyncs) */
+    pthread_t thread[ NUM_SUBKEYS ];
+    for (i=0; i<NUM_SUBKEYS; i++) {
+        detail[i].slot = hss_store_slot( store, i+1 );
+        detail[i].sig_len = sig_len;
+        if (0 != pthread_create( &thread[i], 0, sign_thread, &detail[i] )) {
+            sign_thread( &detail[i] );
+            thread[i] = pthread_self();
+        }
+    }
+    for (i=0; i<NUM_SUBKEYS; i++) {
+        if (!pthread_equal( thread[i], pthread_self() )) {
+            pthread_join( thread[i], 0 );
+        }
+    }
+    for (i=0; i<NUM_SUBKEYS; i++) {
+        if (!detail[i].success) {
+            printf( "  Sub-key %u signing failed\n", i );
+            goto failed;
+        }
+    }
+    if (!quiet_flag) {
+        printf( "  %u reservations, %lu syncs\n",
+                NUM_SUBKEYS * SIGS_PER_THREAD, hss_store_sync_count( store ) );
+    }
+
+    /* Each sub-key picks up after that, and the split key is gone */
+    hss_store_close( store );
+    store = hss_store_open( name, 0, &info );
+    if (!store || hss_load_private_key( hss_store_read_private_key,
+                         hss_store_slot( store, 0 ), 0, 0, 0, 0 )) {
+        printf( "  Split key still loads\n" );
+        goto failed;
+    }
+    for (i=0; i<NUM_SUBKEYS; i++) {
+        slot = hss_store_slot( store, i+1 );
+        w = hss_load_private_key( hss_store_read_private_key, slot,
+                                  0, 0, 0, 0 );
+        if (!w || !sign_one( w, slot, sig, sig_len, &index ) ||
+                                      index != detail[i].last + 1) {
+            printf( "  Sub-key %u lost its count\n", i );
+            goto failed;
+        }
+        hss_free_working_key( w ); w = 0;
+    }
+
+    success = true;
+failed:
+    hss_free_working_key( w );
+    hss_store_close( store );
+    free( sig );
+    unlink( name );
+    unlink( log_name );
+    return success;
+}
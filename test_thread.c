@@ -5,9 +5,12 @@
 #include "test_hss.h"
 #include "hss.h"
 #include "hss_thread.h"
+#include "hss_sign_inc.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* This will do an initial check if threading is enabled */
 /* If it's not, there's no point in these tests */
@@ -31,13 +34,16 @@ static bool rand_1( void *output, size_t len) {
 
 #define MAX_THREAD 16
 
-bool run_test(unsigned L, const param_set_t *lm, const param_set_t *ots) {
+bool run_test(unsigned L, const param_set_t *lm, const param_set_t *ots,
+              struct hss_thread_pool *pool) {
     struct hss_extra_info info[MAX_THREAD];
     int i;
 
     for (i=0; i<MAX_THREAD; i++) {
         hss_init_extra_info( &info[i] );
         hss_extra_info_set_threads( &info[i], i+1 );
+        /* Have every other one use the persistent pool */
+        if (i & 1) hss_extra_info_set_thread_pool( &info[i], pool );
     }
 
     rand_val++;
@@ -166,27 +172,497 @@ failed:
     return success_flag;
 }
 
+/*
+ * This tests loading a working key in the background; the signatures we get
+ * (both before and after the background work completes) should be the same
+ * as the ones from a key we loaded the normal way
+ */
+static bool test_background(unsigned L, const param_set_t *lm,
+                            const param_set_t *ots, unsigned skip,
+                            unsigned num_sig,
+                            struct hss_thread_pool *pool) {
+    struct hss_extra_info info[2];
+    hss_init_extra_info( &info[0] );
+    hss_extra_info_set_threads( &info[0], 1 );
+    hss_init_extra_info( &info[1] );
+    hss_extra_info_set_threads( &info[1], 4 );
+    hss_extra_info_set_thread_pool( &info[1], pool );
+    hss_extra_info_set_background_load( &info[1], true );
+
+    rand_val++;
+
+    size_t private_len = hss_get_private_key_len(L, lm, ots);
+    size_t sig_len = hss_get_signature_len(L, lm, ots);
+    if (private_len == 0 || private_len > HSS_MAX_PRIVATE_KEY_LEN ||
+        sig_len == 0) {
+        printf( "  Bad parm set\n" );
+        return false;
+    }
+
+    unsigned char private[2][ HSS_MAX_PRIVATE_KEY_LEN ];
+    unsigned char public[ HSS_MAX_PUBLIC_KEY_LEN ];
+    if (!hss_generate_private_key( rand_1, L, lm, ots,
+                    0, private[0], public, sizeof public, 0, 0, 0 )) {
+        printf( "  Private key gen failed\n" );
+        return false;
+    }
+
+    bool success_flag = false;
+    struct hss_working_key *w[2] = { 0, 0 };
+    unsigned char *sig[2] = { 0, 0 };
+    const unsigned char test_message[] = "Hello spots fans";
+    sig[0] = malloc(sig_len);
+    sig[1] = malloc(sig_len);
+    if (!sig[0] || !sig[1]) goto failed;
+
+    /* Move partway into the key, so that the load starts in the middle of */
+    /* the subtrees */
+    w[0] = hss_load_private_key( 0, private[0], 0, 0, 0, &info[0] );
+    if (!w[0]) {
+        printf( "  Load private key failed\n" );
+        goto failed;
+    }
+    unsigned i, j;
+    for (i=0; i<skip; i++) {
+        if (!hss_generate_signature( w[0], 0, private[0],
+                     test_message, sizeof test_message,
+                     sig[0], sig_len, &info[0] )) {
+            printf( "  Signature gen failed\n" );
+            goto failed;
+        }
+    }
+    memcpy( private[1], private[0], private_len );
+
+    w[1] = hss_load_private_key( 0, private[1], 0, 0, 0, &info[1] );
+    if (!w[1]) {
+        printf( "  Background load private key failed\n" );
+        goto failed;
+    }
+
+    for (i=0; i<num_sig; i++) {
+        for (j=0; j<2; j++) {
+            if (!hss_generate_signature( w[j], 0, private[j],
+                         test_message, sizeof test_message,
+                         sig[j], sig_len, &info[j] )) {
+                printf( "  Signature gen failed\n" );
+                goto failed;
+            }
+        }
+        if (0 != memcmp( sig[0], sig[1], sig_len ) ||
+            0 != memcmp( private[0], private[1], private_len )) {
+            printf( "  Background load signature mismatch\n" );
+            goto failed;
+        }
+        if (!hss_validate_signature( public,
+                         test_message, sizeof test_message,
+                         sig[1], sig_len, 0 )) {
+            printf( "  Signature validate\n" );
+            goto failed;
+        }
+
+        /* Halfway through, check that we can wait for it explicitly */
+        if (i == num_sig/2 && !hss_finish_working_key( w[1], &info[1] )) {
+            printf( "  Finish working key failed\n" );
+            goto failed;
+        }
+    }
+
+    success_flag = true;
+failed:
+    hss_free_working_key( w[0] );
+    hss_free_working_key( w[1] );
+    free(sig[0]);
+    free(sig[1]);
+    return success_flag;
+}
+
+/*
+ * This checks that the updates that signing leaves running in the background
+ * don't get in the way of the next signature; we sign past a number of
+ * subtree (and bottom tree) boundaries, mixing in incremental signatures,
+ * and compare against what a single threaded working key gives
+ */
+static bool test_async_updates(unsigned L, const param_set_t *lm,
+                            const param_set_t *ots, unsigned num_sig,
+                            struct hss_thread_pool *pool) {
+    struct hss_extra_info info[2];
+    hss_init_extra_info( &info[0] );
+    hss_extra_info_set_threads( &info[0], 1 );
+    hss_init_extra_info( &info[1] );
+    hss_extra_info_set_threads( &info[1], 4 );
+    hss_extra_info_set_thread_pool( &info[1], pool );
+
+    rand_val++;
+
+    size_t private_len = hss_get_private_key_len(L, lm, ots);
+    size_t sig_len = hss_get_signature_len(L, lm, ots);
+    if (private_len == 0 || private_len > HSS_MAX_PRIVATE_KEY_LEN ||
+        sig_len == 0) {
+        printf( "  Bad parm set\n" );
+        return false;
+    }
+
+    unsigned char private[2][ HSS_MAX_PRIVATE_KEY_LEN ];
+    unsigned char public[ HSS_MAX_PUBLIC_KEY_LEN ];
+    if (!hss_generate_private_key( rand_1, L, lm, ots,
+                    0, private[0], public, sizeof public, 0, 0, 0 )) {
+        printf( "  Private key gen failed\n" );
+        return false;
+    }
+    memcpy( private[1], private[0], private_len );
+
+    bool success_flag = false;
+    struct hss_working_key *w[2] = { 0, 0 };
+    unsigned char *sig[2] = { 0, 0 };
+    const unsigned char test_message[] = "Hello spots fans";
+    sig[0] = malloc(sig_len);
+    sig[1] = malloc(sig_len);
+    if (!sig[0] || !sig[1]) goto failed;
+
+    unsigned i, j;
+    for (j=0; j<2; j++) {
+        w[j] = hss_load_private_key( 0, private[j], 0, 0, 0, &info[j] );
+        if (!w[j]) {
+            printf( "  Load private key failed\n" );
+            goto failed;
+        }
+    }
+
+    for (i=0; i<num_sig; i++) {
+        if (!hss_generate_signature( w[0], 0, private[0],
+                         test_message, sizeof test_message,
+                         sig[0], sig_len, &info[0] )) {
+            printf( "  Signature gen failed\n" );
+            goto failed;
+        }
+        if (i % 3 == 0) {
+            /* Sign incrementally (which looks at the bottom tree before */
+            /* the signature is started) */
+            struct hss_sign_inc ctx;
+            if (!hss_sign_init( &ctx, w[1], 0, private[1],
+                                sig[1], sig_len, &info[1] ) ||
+                !hss_sign_update( &ctx, test_message, sizeof test_message ) ||
+                !hss_sign_finalize( &ctx, w[1], sig[1], &info[1] )) {
+                printf( "  Incremental signature gen failed\n" );
+                goto failed;
+            }
+        } else {
+            if (!hss_generate_signature( w[1], 0, private[1],
+                         test_message, sizeof test_message,
+                         sig[1], sig_len, &info[1] )) {
+                printf( "  Signature gen failed\n" );
+                goto failed;
+            }
+        }
+        if (0 != memcmp( sig[0], sig[1], sig_len ) ||
+            0 != memcmp( private[0], private[1], private_len )) {
+            printf( "  Async update signature mismatch\n" );
+            goto failed;
+        }
+        if (!hss_validate_signature( public,
+                         test_message, sizeof test_message,
+                         sig[1], sig_len, 0 )) {
+            printf( "  Signature validate\n" );
+            goto failed;
+        }
+    }
+
+    /* Make sure we can wait for the last updates explicitly */
+    if (!hss_finish_working_key( w[1], &info[1] )) {
+        printf( "  Finish working key failed\n" );
+        goto failed;
+    }
+
+    success_flag = true;
+failed:
+    hss_free_working_key( w[0] );
+    hss_free_working_key( w[1] );
+    free(sig[0]);
+    free(sig[1]);
+    return success_flag;
+}
+
+/*
+ * This checks that work items can issue more work items themselves; each
+ * item at depth d issues NESTED_FANOUT items at depth d+1
+ */
+#define NESTED_FANOUT 4
+#define NESTED_DEPTH 3
+
+struct nested_detail {
+    atomic_uint *count;
+    unsigned depth;
+};
+
+static void do_nested(const void *detail, struct thread_collection *col) {
+    const struct nested_detail *d = detail;
+    atomic_fetch_add( d->count, 1 );
+    if (d->depth == NESTED_DEPTH) return;
+    struct nested_detail child = { d->count, d->depth + 1 };
+    unsigned i;
+    for (i=0; i<NESTED_FANOUT; i++) {
+        hss_thread_issue_work( col, do_nested, &child, sizeof child );
+    }
+}
+
+static bool test_nested(struct hss_thread_pool *pool) {
+    atomic_uint count;
+    atomic_init( &count, 0 );
+    struct thread_collection *col = hss_thread_init_pool( pool, 4 );
+    struct nested_detail top = { &count, 0 };
+    unsigned i, expected = 0, level = 1;
+    for (i=0; i<NESTED_FANOUT; i++) {
+        hss_thread_issue_work( col, do_nested, &top, sizeof top );
+    }
+    for (i=0; i<=NESTED_DEPTH; i++) {
+        level *= NESTED_FANOUT;
+        expected += level;
+    }
+    hss_thread_done( col );
+    if (atomic_load( &count ) != expected) {
+        printf( "  Nested work items: ran %u, expected %u\n",
+                              (unsigned)atomic_load( &count ), expected );
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Here, several application threads sign with the same working key at once
+ */
+#define NUM_SIGNERS 4
+#define SIGS_PER_SIGNER 40
+
+struct signer {
+    struct hss_working_key *w;
+    unsigned char *private_key;
+    struct hss_extra_info info;
+    size_t sig_len;
+    unsigned char *sig;         /* SIGS_PER_SIGNER signatures */
+    bool success;
+};
+
+static const unsigned char concurrent_message[] = "Sign me";
+
+static void *sign_thread(void *arg) {
+    struct signer *s = arg;
+    unsigned i;
+    for (i=0; i<SIGS_PER_SIGNER; i++) {
+        unsigned char *sig = s->sig + i * s->sig_len;
+        if (i % 4 == 3) {
+            /* Mix in some incremental signatures */
+            struct hss_sign_inc ctx;
+            if (!hss_sign_init( &ctx, s->w, 0, s->private_key,
+                                sig, s->sig_len, &s->info ) ||
+                !hss_sign_update( &ctx, concurrent_message,
+                                  sizeof concurrent_message ) ||
+                !hss_sign_finalize( &ctx, s->w, sig, &s->info )) {
+                return 0;
+            }
+        } else {
+            if (!hss_generate_signature( s->w, 0, s->private_key,
+                         concurrent_message, sizeof concurrent_message,
+                         sig, s->sig_len, &s->info )) {
+                return 0;
+            }
+        }
+    }
+    s->success = true;
+    return 0;
+}
+
+static unsigned long get_int(const unsigned char *p) {
+    unsigned long result = 0;
+    int i;
+    for (i=0; i<4; i++) {
+        result <<= 8;
+        result += p[i];
+    }
+    return result;
+}
+
+static bool test_concurrent(const param_set_t *ots, int threads,
+                            struct hss_thread_pool *pool) {
+    /* Two levels of H5; that way, the signers cross several bottom */
+    /* trees between them */
+    unsigned L = 2;
+    param_set_t lm[2] = { LMS_SHA256_N32_H5, LMS_SHA256_N32_H5 };
+    size_t sig_len = hss_get_signature_len(L, lm, ots);
+    size_t top_sig_len = hss_get_signature_len(1, lm, ots);
+    if (sig_len == 0) {
+        printf( "  Bad parm set\n" );
+        return false;
+    }
+
+    rand_val++;
+    unsigned char private[ HSS_MAX_PRIVATE_KEY_LEN ];
+    unsigned char public[ HSS_MAX_PUBLIC_KEY_LEN ];
+    if (!hss_generate_private_key( rand_1, L, lm, ots,
+                    0, private, public, sizeof public, 0, 0, 0 )) {
+        printf( "  Private key gen failed\n" );
+        return false;
+    }
+
+    bool success_flag = false;
+    struct signer signer[NUM_SIGNERS];
+    pthread_t thread_id[NUM_SIGNERS];
+    unsigned char *sig = malloc( NUM_SIGNERS * SIGS_PER_SIGNER * sig_len );
+    if (!sig) return false;
+    struct hss_extra_info info;
+    hss_init_extra_info( &info );
+    hss_extra_info_set_threads( &info, threads );
+    hss_extra_info_set_thread_pool( &info, pool );
+    struct hss_working_key *w = hss_load_private_key( 0, private,
+                                     0, 0, 0, &info );
+    if (!w) {
+        printf( "  Load private key failed\n" );
+        goto failed;
+    }
+
+    unsigned i, j;
+    for (i=0; i<NUM_SIGNERS; i++) {
+        signer[i].w = w;
+        signer[i].private_key = private;
+        signer[i].info = info;
+        signer[i].sig_len = sig_len;
+        signer[i].sig = sig + i * SIGS_PER_SIGNER * sig_len;
+        signer[i].success = false;
+    }
+    unsigned started;
+    for (started=0; started<NUM_SIGNERS; started++) {
+        if (0 != pthread_create( &thread_id[started], 0, sign_thread,
+                                 &signer[started] )) {
+            break;
+        }
+    }
+    for (i=0; i<started; i++) {
+        pthread_join( thread_id[i], 0 );
+    }
+    if (started < NUM_SIGNERS) {
+        printf( "  Unable to start signing threads\n" );
+        goto failed;
+    }
+    for (i=0; i<NUM_SIGNERS; i++) {
+        if (!signer[i].success) {
+            printf( "  Concurrent signature gen failed\n" );
+            goto failed;
+        }
+    }
+
+    /* Every signature must validate, and use a different leaf */
+    unsigned num_sig = NUM_SIGNERS * SIGS_PER_SIGNER;
+    unsigned char used[ 1 << 10 ];
+    memset( used, 0, sizeof used );
+    for (i=0; i<num_sig; i++) {
+        const unsigned char *s = sig + i * sig_len;
+        if (!hss_validate_signature( public, concurrent_message,
+                                     sizeof concurrent_message,
+                                     s, sig_len, 0 )) {
+            printf( "  Concurrent signature %u didn't validate\n", i );
+            goto failed;
+        }
+        /* The leaf is the q values of the top and bottom signatures */
+        unsigned long top_q = get_int( s + 4 );
+        unsigned long bottom_q = get_int( s + top_sig_len + 8 + 16 + 32 );
+        unsigned long count = (top_q << 5) + bottom_q;
+        if (count >= sizeof used || used[count]) {
+            printf( "  Leaf %lu used twice\n", count );
+            goto failed;
+        }
+        used[count] = 1;
+    }
+    /* And they should be the first ones (we didn't skip any) */
+    for (j=0; j<num_sig; j++) {
+        if (!used[j]) {
+            printf( "  Leaf %u skipped\n", j );
+            goto failed;
+        }
+    }
+
+    success_flag = true;
+failed:
+    hss_free_working_key( w );
+    free( sig );
+    return success_flag;
+}
+
 bool test_thread(bool fast_flag, bool quiet_flag) {
+    bool success = false;
+    /* Use more threads than we used to allow, to make sure that works */
+    struct hss_thread_pool *pool = hss_thread_pool_create( 32 );
+    if (!pool) {
+        printf( "  Unable to create thread pool\n" );
+        return false;
+    }
     {
         param_set_t lm[1] = { LMS_SHA256_N32_H5 };
         param_set_t ots[1] = { LMOTS_SHA256_N32_W8 };
-        if (!run_test(1, lm, ots)) return false;
+        if (!run_test(1, lm, ots, pool)) goto failed;
     }
     {
         param_set_t lm[1] = { LMS_SHA256_N32_H10 };
         param_set_t ots[1] = { LMOTS_SHA256_N32_W4 };
-        if (!run_test(1, lm, ots)) return false;
+        if (!run_test(1, lm, ots, pool)) goto failed;
     }
     {
         param_set_t lm[2] = { LMS_SHA256_N32_H10, LMS_SHA256_N32_H5 };
         param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W4 };
-        if (!run_test(2, lm, ots)) return false;
+        if (!run_test(2, lm, ots, pool)) goto failed;
     }
     if (!fast_flag) { /* This test exceeds our 15 second fast threshold */
         param_set_t lm[2] = { LMS_SHA256_N32_H15, LMS_SHA256_N32_H15 };
         param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2 };
-        if (!run_test(2, lm, ots)) return false;
+        if (!run_test(2, lm, ots, pool)) goto failed;
+    }
+    {
+        /* Load the key in the background (both with the pool, and with */
+        /* threads of its own), starting at a few different places */
+        param_set_t lm[2] = { LMS_SHA256_N32_H10, LMS_SHA256_N32_H5 };
+        param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2 };
+        if (!test_background(2, lm, ots, 0, 70, pool)) goto failed;
+        if (!test_background(2, lm, ots, 45, 40, pool)) goto failed;
+        if (!test_background(2, lm, ots, 31, 10, 0)) goto failed;
     }
+    {
+        /* Here, the NEXT bottom tree is well along, and so takes a while */
+        param_set_t lm[2] = { LMS_SHA256_N32_H10, LMS_SHA256_N32_H10 };
+        param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2 };
+        if (!test_background(2, lm, ots, 1000, 60, pool)) goto failed;
+    }
+    {
+        /* Sign across a number of bottom tree boundaries, while the updates */
+        /* from the previous signature are still running */
+        param_set_t lm[3] = { LMS_SHA256_N32_H5, LMS_SHA256_N32_H5,
+                              LMS_SHA256_N32_H5 };
+        param_set_t ots[3] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2,
+                               LMOTS_SHA256_N32_W2 };
+        if (!test_async_updates(3, lm, ots, 100, pool)) goto failed;
+    }
+    if (!fast_flag) {
+        /* Go far enough that the middle tree is switched as well (so the */
+        /* top tree signs that with its next leaf, and the middle tree */
+        /* signs the new bottom tree with its NEXT tree) */
+        param_set_t lm[3] = { LMS_SHA256_N32_H5, LMS_SHA256_N32_H5,
+                              LMS_SHA256_N32_H5 };
+        param_set_t ots[3] = { LMOTS_SHA256_N32_W4, LMOTS_SHA256_N32_W4,
+                               LMOTS_SHA256_N32_W4 };
+        if (!test_async_updates(3, lm, ots, 1100, pool)) goto failed;
+    }
+    {
+        /* Several threads signing with the same working key (both with */
+        /* and without splitting the OTS signatures) */
+        param_set_t ots[2] = { LMOTS_SHA256_N32_W2, LMOTS_SHA256_N32_W2 };
+        if (!test_concurrent(ots, 1, 0)) goto failed;
+        if (!test_concurrent(ots, 4, pool)) goto failed;
+        param_set_t ots8[2] = { LMOTS_SHA256_N32_W4, LMOTS_SHA256_N32_W8 };
+        if (!test_concurrent(ots8, 4, pool)) goto failed;
+    }
+    /* Work items issuing work items (both within the pool, and with */
+    /* threads of its own) */
+    if (!test_nested(pool) || !test_nested(0)) goto failed;
 /* MORE HERE */
-    return true;
+    success = true;
+failed:
+    hss_thread_pool_free( pool );
+    return success;
 }